@@ -0,0 +1,122 @@
+/* ======================================================================
+ * Batched D1 packet I/O on top of sendmmsg/recvmmsg.
+ * ====================================================================== */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "d1_udp.h"
+
+
+/**
+ * Sends complete D1 packets with as few kernel crossings as possible. Consecutive packets
+ * whose peers share a socket go out in one sendmmsg call, each to its own peer->addr.
+ * No ACKs are awaited, this is the job of the caller.
+ *
+ * @param packets The packets, peer, data and size must be set.
+ * @param count The number of packets.
+ * @return The number of packets sent, or -1 if not even the first could be sent.
+ */
+int d1_send_batch(D1Packet* packets, int count) {
+    struct mmsghdr msgs[D1_BATCH_MAX];
+    struct iovec   iovs[D1_BATCH_MAX];
+    int sent = 0;
+
+    while (sent < count) {
+        // Collect a run of packets that leave through the same socket
+        int sock = packets[sent].peer->socket;
+        int n = 0;
+        while (sent + n < count && n < D1_BATCH_MAX && packets[sent + n].peer->socket == sock) {
+            D1Packet* p = &packets[sent + n];
+            iovs[n].iov_base = p->data;
+            iovs[n].iov_len = p->size;
+            memset(&msgs[n], 0, sizeof(msgs[n]));
+            msgs[n].msg_hdr.msg_name = &p->peer->addr;
+            msgs[n].msg_hdr.msg_namelen = sizeof(p->peer->addr);
+            msgs[n].msg_hdr.msg_iov = &iovs[n];
+            msgs[n].msg_hdr.msg_iovlen = 1;
+            n++;
+        }
+
+        int wc = sendmmsg(sock, msgs, n, 0);
+        if (wc <= 0) {
+            check_error(-1, "sendmmsg d1_send_batch", __LINE__, __FILE__);
+            return sent > 0 ? sent : -1;
+        }
+        sent += wc;
+    }
+
+    print_line(__LINE__, __FILE__, "Sent batch (d1_send_batch)");
+    return sent;
+}
+
+/**
+ * Receives up to count packets from the peer's socket in one recvmmsg call. Every packet
+ * is checked like in d1_recv_data, and its header is converted to host byte order.
+ * Like recvfrom in d1_recv_data, the source of the last packet is stored in peer->addr.
+ *
+ * @param peer The D1Peer to receive from.
+ * @param packets The packets, data must point to PACKET_MAX bytes each. On return, size is
+ *                the size of the packet or 0 if it was corrupted, and addr its source.
+ * @param count The number of packets that fit.
+ * @param timeout_ms How long to wait for the first packet, -1 to block. A non-blocking socket
+ *                   never blocks, it returns 0 if there is nothing to receive.
+ * @return The number of packets received, 0 on timeout, or -1 on failure.
+ */
+int d1_recv_batch(D1Peer* peer, D1Packet* packets, int count, int timeout_ms) {
+    struct mmsghdr msgs[D1_BATCH_MAX];
+    struct iovec   iovs[D1_BATCH_MAX];
+    int flags = MSG_WAITFORONE;
+
+    if (count > D1_BATCH_MAX) {
+        count = D1_BATCH_MAX;
+    }
+
+    if (timeout_ms >= 0) {
+        struct pollfd pfd = { peer->socket, POLLIN, 0 };
+        int ready = poll(&pfd, 1, timeout_ms);
+        if (ready <= 0) {
+            check_error(ready, "poll d1_recv_batch", __LINE__, __FILE__);
+            return ready;
+        }
+        flags = MSG_DONTWAIT;
+    }
+
+    for (int i = 0; i < count; i++) {
+        iovs[i].iov_base = packets[i].data;
+        iovs[i].iov_len = PACKET_MAX;
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_name = &packets[i].addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(packets[i].addr);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int n = recvmmsg(peer->socket, msgs, count, flags, NULL);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0; // non-blocking socket, nothing there
+    }
+    if (n == -1) {
+        check_error(-1, "recvmmsg d1_recv_batch", __LINE__, __FILE__);
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        packets[i].peer = peer;
+        packets[i].size = d1_check_packet(packets[i].data, msgs[i].msg_len);
+    }
+    if (n > 0) {
+        peer->addr = packets[n - 1].addr;
+    }
+
+    print_line(__LINE__, __FILE__, "Received batch (d1_recv_batch)");
+    return n;
+}
@@ -0,0 +1,102 @@
+/* ======================================================================
+ * Packets per second of the batched send/receive path compared with one
+ * sendto/recvfrom per packet. Sender and receiver are two sockets in this
+ * process on the loopback interface.
+ * ====================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "d1_udp.h"
+
+#define PAYLOAD 100
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char* argv[]) {
+    int total = argc > 1 ? atoi(argv[1]) : 200000;
+    int batch = argc > 2 ? atoi(argv[2]) : 32;
+    if (batch > D1_BATCH_MAX) {
+        batch = D1_BATCH_MAX;
+    }
+
+    D1Peer* receiver = d1_create_client();
+    D1Peer* sender = d1_create_client();
+    if (!receiver || !sender) {
+        return 1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    bind(receiver->socket, (struct sockaddr*)&addr, sizeof(addr));
+    getsockname(receiver->socket, (struct sockaddr*)&addr, &len);
+    d1_get_peer_info(sender, "127.0.0.1", ntohs(addr.sin_port));
+
+    char payload[PAYLOAD];
+    memset(payload, 'x', sizeof(payload));
+    char storage[D1_BATCH_MAX][PACKET_MAX];
+    D1Packet packets[D1_BATCH_MAX];
+    for (int i = 0; i < D1_BATCH_MAX; i++) {
+        packets[i].peer = sender;
+        packets[i].data = storage[i];
+    }
+
+    // One system call per packet and direction
+    int received = 0;
+    double start = now_s();
+    for (int sent = 0; sent < total; sent += batch) {
+        for (int i = 0; i < batch; i++) {
+            d1_send_control(sender, FLAG_DATA, payload, sizeof(payload));
+        }
+        for (int i = 0; i < batch; i++) {
+            int n = recv(receiver->socket, storage[i], PACKET_MAX, 0);
+            received += d1_check_packet(storage[i], n) > 0;
+        }
+    }
+    double single = received / (now_s() - start);
+
+    // One system call per batch and direction
+    received = 0;
+    start = now_s();
+    for (int sent = 0; sent < total; sent += batch) {
+        for (int i = 0; i < batch; i++) {
+            packets[i].peer = sender;
+            packets[i].size = d1_build_packet(storage[i], FLAG_DATA, payload, sizeof(payload));
+        }
+        d1_send_batch(packets, batch);
+        int got = 0;
+        while (got < batch) {
+            int n = d1_recv_batch(receiver, packets + got, batch - got, -1);
+            if (n <= 0) {
+                break;
+            }
+            for (int i = 0; i < n; i++) {
+                received += packets[got + i].size > 0;
+            }
+            got += n;
+        }
+    }
+    double batched = received / (now_s() - start);
+
+    printf("%d packets of %d bytes, batches of %d\n", total, PAYLOAD, batch);
+    printf("%-24s %12.0f packets/s\n", "sendto/recvfrom", single);
+    printf("%-24s %12.0f packets/s\n", "sendmmsg/recvmmsg", batched);
+    printf("%-24s %12.1fx\n", "speedup", batched / single);
+
+    d1_delete(sender);
+    d1_delete(receiver);
+    return 0;
+}
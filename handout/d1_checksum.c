@@ -0,0 +1,240 @@
+/* ======================================================================
+ * D1 checksum kernels: scalar, SSE2 and AVX2, picked at runtime.
+ * ====================================================================== */
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define D1_CHECKSUM_X86 1
+#endif
+
+#include "d1_checksum.h"
+
+
+/*
+* START HELPER FUNCTIONS
+ */
+
+/**
+ * Folds a word of XORed bytes into the two lanes. Words are loaded at even offsets, so
+ * every other byte of the word belongs to the even lane.
+ *
+ * @param w The XOR of all words.
+ * @return The checksum, even lane in the high byte.
+ */
+static uint16_t fold64(uint64_t w) {
+    w ^= w >> 32;
+    w ^= w >> 16;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // The byte at the lowest address is the least significant one
+    return (uint16_t)(((w & 0xff) << 8) | ((w >> 8) & 0xff));
+#else
+    return (uint16_t)w;
+#endif
+}
+
+/**
+ * The bytes that don't fill a word, one at a time.
+ *
+ * @param data The bytes, starting at an even offset.
+ * @param len The number of bytes.
+ * @return The raw checksum of the bytes.
+ */
+static uint16_t tail_sum(const uint8_t* data, size_t len) {
+    uint8_t even = 0;
+    uint8_t odd = 0;
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        even ^= data[i];
+        odd ^= data[i + 1];
+    }
+    if (len % 2 == 1) {
+        even ^= data[len - 1];
+    }
+    return (uint16_t)((even << 8) | odd);
+}
+
+static uint16_t scalar_sum(const void* data, size_t len) {
+    const uint8_t* p = (const uint8_t*)data;
+    uint64_t acc = 0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8); // unaligned load
+        acc ^= w;
+    }
+    return fold64(acc) ^ tail_sum(p + i, len - i);
+}
+
+static uint16_t scalar_copy(void* dst, const void* src, size_t len) {
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* s = (const uint8_t*)src;
+    uint64_t acc = 0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, s + i, 8);
+        memcpy(d + i, &w, 8);
+        acc ^= w;
+    }
+    memcpy(d + i, s + i, len - i);
+    return fold64(acc) ^ tail_sum(s + i, len - i);
+}
+
+#ifdef D1_CHECKSUM_X86
+
+static uint64_t fold128(__m128i v) {
+    return (uint64_t)_mm_cvtsi128_si64(v) ^ (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(v, v));
+}
+
+__attribute__((target("sse2")))
+static uint16_t sse2_sum(const void* data, size_t len) {
+    const uint8_t* p = (const uint8_t*)data;
+    __m128i acc0 = _mm_setzero_si128();
+    __m128i acc1 = _mm_setzero_si128();
+    size_t i = 0;
+    // Two accumulators, so consecutive loads don't wait for each other
+    for (; i + 32 <= len; i += 32) {
+        acc0 = _mm_xor_si128(acc0, _mm_loadu_si128((const __m128i*)(p + i)));
+        acc1 = _mm_xor_si128(acc1, _mm_loadu_si128((const __m128i*)(p + i + 16)));
+    }
+    for (; i + 16 <= len; i += 16) {
+        acc0 = _mm_xor_si128(acc0, _mm_loadu_si128((const __m128i*)(p + i)));
+    }
+    return fold64(fold128(_mm_xor_si128(acc0, acc1))) ^ scalar_sum(p + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static uint16_t sse2_copy(void* dst, const void* src, size_t len) {
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* s = (const uint8_t*)src;
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+        _mm_storeu_si128((__m128i*)(d + i), v);
+        acc = _mm_xor_si128(acc, v);
+    }
+    return fold64(fold128(acc)) ^ scalar_copy(d + i, s + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static uint16_t avx2_sum(const void* data, size_t len) {
+    const uint8_t* p = (const uint8_t*)data;
+    __m256i acc0 = _mm256_setzero_si256();
+    __m256i acc1 = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        acc0 = _mm256_xor_si256(acc0, _mm256_loadu_si256((const __m256i*)(p + i)));
+        acc1 = _mm256_xor_si256(acc1, _mm256_loadu_si256((const __m256i*)(p + i + 32)));
+    }
+    for (; i + 32 <= len; i += 32) {
+        acc0 = _mm256_xor_si256(acc0, _mm256_loadu_si256((const __m256i*)(p + i)));
+    }
+    acc0 = _mm256_xor_si256(acc0, acc1);
+    __m128i half = _mm_xor_si128(_mm256_castsi256_si128(acc0), _mm256_extracti128_si256(acc0, 1));
+    if (i + 16 <= len) {
+        half = _mm_xor_si128(half, _mm_loadu_si128((const __m128i*)(p + i)));
+        i += 16;
+    }
+    uint64_t w = fold128(half);
+    // GCC does not always clear the upper halves before the call, and SSE code running
+    // with dirty upper halves is very slow on some CPUs
+    _mm256_zeroupper();
+    return fold64(w) ^ scalar_sum(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static uint16_t avx2_copy(void* dst, const void* src, size_t len) {
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* s = (const uint8_t*)src;
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(s + i));
+        _mm256_storeu_si256((__m256i*)(d + i), v);
+        acc = _mm256_xor_si256(acc, v);
+    }
+    __m128i half = _mm_xor_si128(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    if (i + 16 <= len) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+        _mm_storeu_si128((__m128i*)(d + i), v);
+        half = _mm_xor_si128(half, v);
+        i += 16;
+    }
+    uint64_t w = fold128(half);
+    _mm256_zeroupper();
+    return fold64(w) ^ scalar_copy(d + i, s + i, len - i);
+}
+
+#endif /* D1_CHECKSUM_X86 */
+
+static const D1ChecksumImpl impls[] = {
+    { "scalar", scalar_sum, scalar_copy },
+#ifdef D1_CHECKSUM_X86
+    { "sse2", sse2_sum, sse2_copy },
+    { "avx2", avx2_sum, avx2_copy },
+#endif
+};
+
+/* The implementation in use, atomic. Threads that race on the first call all store the
+ * same one. */
+static const D1ChecksumImpl* selected = NULL;
+
+static const D1ChecksumImpl* select_impl() {
+    const D1ChecksumImpl* impl = __atomic_load_n(&selected, __ATOMIC_ACQUIRE);
+    if (impl == NULL) {
+        const D1ChecksumImpl* list;
+        int n = d1_checksum_impls(&list);
+        impl = &list[n - 1];
+        __atomic_store_n(&selected, impl, __ATOMIC_RELEASE);
+    }
+    return impl;
+}
+
+/*
+* END HELPER FUNCTIONS
+ */
+
+/**
+ * Lists the implementations the CPU supports.
+ *
+ * @param list Set to the implementations, the fastest one last.
+ * @return The number of implementations.
+ */
+int d1_checksum_impls(const D1ChecksumImpl** list) {
+    *list = impls;
+#ifdef D1_CHECKSUM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return 3;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return 2;
+    }
+#endif
+    return 1;
+}
+
+/**
+ * Computes the raw checksum of a byte range with the fastest implementation.
+ *
+ * @param data The bytes, starting at an even offset of the packet.
+ * @param len The number of bytes.
+ * @return The checksum, even lane in the high byte.
+ */
+uint16_t d1_checksum(const void* data, size_t len) {
+    return select_impl()->sum(data, len);
+}
+
+/**
+ * Copies a byte range and computes its raw checksum in the same pass.
+ *
+ * @param dst Where the bytes are copied to.
+ * @param src The bytes, starting at an even offset of the packet.
+ * @param len The number of bytes.
+ * @return The checksum, even lane in the high byte.
+ */
+uint16_t d1_checksum_copy(void* dst, const void* src, size_t len) {
+    return select_impl()->copy(dst, src, len);
+}
@@ -0,0 +1,43 @@
+#ifndef D1_CHECKSUM_H
+#define D1_CHECKSUM_H
+
+#include <stddef.h>
+#include <inttypes.h>
+
+/* The D1 checksum is the XOR of all bytes at even offsets (high byte) and the XOR of all
+ * bytes at odd offsets (low byte). XOR does not care about order, so the bytes can be
+ * combined a whole machine word or vector register at a time, and only the two lanes are
+ * separated at the end.
+ *
+ * These functions compute the raw checksum of a byte range that starts at an even offset
+ * of the packet. They don't skip the checksum field, calculate_checksum does that. For a
+ * range that starts at an odd offset, swap the two bytes of the result.
+ *
+ * The implementation (scalar, SSE2 or AVX2) is picked at the first call, from what the CPU
+ * supports.
+ */
+
+/* Returns the raw checksum of len bytes in host byte order.
+ */
+uint16_t d1_checksum( const void* data, size_t len );
+
+/* Copies len bytes from src to dst, like memcpy, and returns the raw checksum of them.
+ * The buffers must not overlap.
+ */
+uint16_t d1_checksum_copy( void* dst, const void* src, size_t len );
+
+/* One implementation of both functions.
+ */
+typedef struct D1ChecksumImpl
+{
+    const char* name;
+    uint16_t (*sum)( const void* data, size_t len );
+    uint16_t (*copy)( void* dst, const void* src, size_t len );
+} D1ChecksumImpl;
+
+/* Lets impls point to the implementations this CPU supports, the fastest one last.
+ * Returns their number. Meant for tests and benchmarks.
+ */
+int d1_checksum_impls( const D1ChecksumImpl** impls );
+
+#endif /* D1_CHECKSUM_H */
@@ -0,0 +1,519 @@
+/* ======================================================================
+ * Event-loop driven, non-blocking D1 engine built around epoll.
+ * ====================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+
+#include "d1_engine.h"
+
+
+#define ENGINE_EVENTS  256  /* epoll events fetched per d1_engine_run */
+#define ENGINE_DRAIN   16   /* packets drained per peer and readiness event */
+
+/* A send that waits for its turn, or for its ACK.
+ */
+struct D1EngineSend
+{
+    struct D1EngineSend* next;
+    D1SendDone           done;
+    void*                arg;
+    int                  payload;   /* payload bytes, reported to done */
+    int                  size;      /* packet size, header included */
+    char                 packet[];  /* built when the send reaches the head of the queue */
+};
+
+/* The state machine of one peer. The peer is waiting for an ACK if head is not NULL.
+ */
+struct D1EnginePeer
+{
+    D1Peer*              peer;
+    D1RecvDone           on_recv;
+    void*                arg;
+    int                  socket_flags; /* restored by d1_engine_remove */
+
+    struct D1EngineSend* head;         /* the packet in flight */
+    struct D1EngineSend* tail;
+    long long            sent_at;      /* last (re)transmission of head */
+    long long            deadline;     /* retransmission deadline of head */
+    int                  timeouts;     /* timeouts in a row for head */
+    int                  resent;       /* copies of head sent after the first */
+    int                  heap_pos;     /* index in the timer heap, -1 if not in it */
+    int                  removed;      /* removed during d1_engine_run, freed at its end */
+    struct D1EnginePeer* prev;         /* all peers of the engine */
+    struct D1EnginePeer* next;         /* or the next removed peer */
+};
+
+struct D1Engine
+{
+    int                   epoll_fd;
+    struct D1EnginePeer*  peers;
+    struct D1EnginePeer** heap;        /* min-heap of peers waiting for an ACK, by deadline */
+    int                   heap_len;
+    int                   heap_cap;
+    int                   pending;     /* queued or unACKed sends */
+    int                   running;     /* d1_engine_run is calling callbacks */
+    struct D1EnginePeer*  removed;     /* peers removed by callbacks, not yet freed */
+};
+
+typedef struct D1EnginePeer D1EnginePeer;
+typedef struct D1EngineSend D1EngineSend;
+
+
+/*
+* START HELPER FUNCTIONS
+ */
+
+static void heap_swap(D1Engine* engine, int a, int b) {
+    D1EnginePeer* tmp = engine->heap[a];
+    engine->heap[a] = engine->heap[b];
+    engine->heap[b] = tmp;
+    engine->heap[a]->heap_pos = a;
+    engine->heap[b]->heap_pos = b;
+}
+
+/**
+ * Restores the heap property around position i after its deadline changed.
+ */
+static void heap_fix(D1Engine* engine, int i) {
+    while (i > 0 && engine->heap[(i - 1) / 2]->deadline > engine->heap[i]->deadline) {
+        heap_swap(engine, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    while (1) {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = 2 * i + 2;
+        if (left < engine->heap_len && engine->heap[left]->deadline < engine->heap[smallest]->deadline) {
+            smallest = left;
+        }
+        if (right < engine->heap_len && engine->heap[right]->deadline < engine->heap[smallest]->deadline) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        heap_swap(engine, i, smallest);
+        i = smallest;
+    }
+}
+
+static int heap_push(D1Engine* engine, D1EnginePeer* ep) {
+    if (engine->heap_len == engine->heap_cap) {
+        int cap = engine->heap_cap ? 2 * engine->heap_cap : 64;
+        D1EnginePeer** heap = realloc(engine->heap, cap * sizeof(D1EnginePeer*));
+        if (heap == NULL) {
+            check_error(-1, "Realloc timer heap", __LINE__, __FILE__);
+            return -1;
+        }
+        engine->heap = heap;
+        engine->heap_cap = cap;
+    }
+    ep->heap_pos = engine->heap_len++;
+    engine->heap[ep->heap_pos] = ep;
+    heap_fix(engine, ep->heap_pos);
+    return 1;
+}
+
+static void heap_remove(D1Engine* engine, D1EnginePeer* ep) {
+    int i = ep->heap_pos;
+    if (i < 0) {
+        return;
+    }
+    engine->heap_len--;
+    if (i != engine->heap_len) {
+        heap_swap(engine, i, engine->heap_len);
+        heap_fix(engine, i);
+    }
+    ep->heap_pos = -1;
+}
+
+/**
+ * Sends the packet at the head of the queue of the peer and arms its timer.
+ * A failed sendto is treated like a lost packet, the timer resends it.
+ */
+static void engine_transmit(D1Engine* engine, D1EnginePeer* ep) {
+    D1EngineSend* send = ep->head;
+    sendto(ep->peer->socket, send->packet, send->size, 0, (struct sockaddr*)&ep->peer->addr, sizeof(ep->peer->addr));
+
+    ep->sent_at = d1_now_us();
+    ep->deadline = ep->sent_at + ep->peer->rto_us;
+    if (ep->heap_pos < 0) {
+        heap_push(engine, ep);
+    } else {
+        heap_fix(engine, ep->heap_pos);
+    }
+}
+
+/**
+ * Builds the packet at the head of the queue with the current sequence number of the
+ * peer, and sends it.
+ */
+static void engine_start(D1Engine* engine, D1EnginePeer* ep) {
+    D1EngineSend* send = ep->head;
+    uint16_t flags = FLAG_DATA | (ep->peer->next_seqno ? SEQNO : 0);
+    d1_build_packet(send->packet, flags, NULL, send->payload);
+    ep->timeouts = 0;
+    ep->resent = 0;
+    engine_transmit(engine, ep);
+}
+
+/**
+ * Removes the head of the queue, reports its result and starts the next send.
+ */
+static void engine_complete(D1Engine* engine, D1EnginePeer* ep, int result) {
+    D1EngineSend* send = ep->head;
+    ep->head = send->next;
+    if (ep->head == NULL) {
+        ep->tail = NULL;
+        heap_remove(engine, ep);
+    }
+    engine->pending--;
+
+    D1SendDone done = send->done;
+    void* arg = send->arg;
+    int payload = send->payload;
+    free(send);
+
+    if (ep->head != NULL) {
+        engine_start(engine, ep);
+    }
+    if (done != NULL) {
+        done(ep->peer, result < 0 ? result : payload, arg);
+    }
+}
+
+/**
+ * Handles one received packet of the peer, like d1_recv_data and d1_wait_ack would.
+ */
+static void engine_packet(D1Engine* engine, D1EnginePeer* ep, char* packet, int size) {
+    D1Peer* peer = ep->peer;
+    D1Header* header = (D1Header*)packet;
+
+    if (size == 0) {
+        // Corrupted, the wrong ACK makes the sender retransmit
+        if ((header->flags & FLAG_DATA) && !(header->flags & FLAG_WND)) {
+            d1_send_ack(peer, header->flags & SEQNO);
+        }
+        return;
+    }
+    if (header->flags & FLAG_WND) {
+        return;
+    }
+
+    if (header->flags & FLAG_DATA) {
+        d1_send_ack(peer, !(header->flags & SEQNO));
+        if (ep->on_recv != NULL) {
+            ep->on_recv(peer, packet + sizeof(D1Header), size - sizeof(D1Header), ep->arg);
+        }
+        return;
+    }
+
+    if (!(header->flags & FLAG_ACK) || ep->head == NULL) {
+        return;
+    }
+
+    if ((header->flags & ACKNO) == peer->next_seqno) {
+        if (!ep->resent) {
+            d1_rtt_sample(peer, d1_now_us() - ep->sent_at);
+        }
+        peer->stale_acks = ep->resent;
+        peer->next_seqno = !peer->next_seqno;
+        engine_complete(engine, ep, 1);
+        return;
+    }
+
+    // Wrong ACK, see d1_wait_ack
+    if (peer->stale_acks > 0) {
+        peer->stale_acks--;
+        return;
+    }
+    peer->retransmits++;
+    ep->resent++;
+    engine_transmit(engine, ep);
+}
+
+/**
+ * Drains the socket of a peer that epoll reported as readable.
+ */
+static void engine_readable(D1Engine* engine, D1EnginePeer* ep) {
+    char storage[ENGINE_DRAIN][PACKET_MAX];
+    D1Packet packets[ENGINE_DRAIN];
+    for (int i = 0; i < ENGINE_DRAIN; i++) {
+        packets[i].data = storage[i];
+    }
+
+    int n;
+    do {
+        n = d1_recv_batch(ep->peer, packets, ENGINE_DRAIN, -1);
+        for (int i = 0; i < n; i++) {
+            engine_packet(engine, ep, packets[i].data, packets[i].size);
+            // A callback may have removed the peer
+            if (ep->removed) {
+                return;
+            }
+        }
+    } while (n == ENGINE_DRAIN);
+}
+
+/**
+ * Handles all retransmission deadlines that have passed.
+ *
+ * @return The number of peers that had a timeout.
+ */
+static int engine_timers(D1Engine* engine) {
+    int count = 0;
+    long long now = d1_now_us();
+
+    while (engine->heap_len > 0 && engine->heap[0]->deadline <= now) {
+        D1EnginePeer* ep = engine->heap[0];
+        count++;
+        if (++ep->timeouts > D1_MAX_RETRIES) {
+            check_error(-1, "timeout, ack not received, is server turned on?", __LINE__, __FILE__);
+            engine_complete(engine, ep, -1);
+            continue;
+        }
+        d1_rto_backoff(ep->peer);
+        ep->peer->stale_acks = 0;
+        ep->peer->retransmits++;
+        ep->resent++;
+        engine_transmit(engine, ep);
+    }
+    return count;
+}
+
+/*
+* END HELPER FUNCTIONS
+ */
+
+/**
+ * Creates an engine with its epoll instance.
+ *
+ * @return The engine, or NULL on failure.
+ */
+D1Engine* d1_engine_create() {
+    D1Engine* engine = (D1Engine*)calloc(1, sizeof(D1Engine));
+    if (engine == NULL) {
+        check_error(-1, "Calloc D1Engine", __LINE__, __FILE__);
+        return NULL;
+    }
+
+    engine->epoll_fd = epoll_create1(0);
+    if (engine->epoll_fd == -1) {
+        check_error(-1, "epoll_create1", __LINE__, __FILE__);
+        free(engine);
+        return NULL;
+    }
+    print_line(__LINE__, __FILE__, "Created engine (d1_engine_create)");
+    return engine;
+}
+
+/**
+ * Removes all peers from the engine and frees it. The peers themselves are not deleted.
+ *
+ * @param engine The engine, may be NULL.
+ * @return always NULL.
+ */
+D1Engine* d1_engine_delete(D1Engine* engine) {
+    if (engine != NULL) {
+        while (engine->peers != NULL) {
+            d1_engine_remove(engine, engine->peers->peer);
+        }
+        close(engine->epoll_fd);
+        free(engine->heap);
+        free(engine);
+    }
+    return NULL;
+}
+
+/**
+ * Registers the peer's socket with epoll and makes it non-blocking.
+ *
+ * @param engine The engine.
+ * @param peer The peer, d1_get_peer_info must have been called.
+ * @param on_recv Called for every data packet from the peer, may be NULL.
+ * @param arg Passed to on_recv.
+ * @return 1 on success, -1 on failure.
+ */
+int d1_engine_add(D1Engine* engine, D1Peer* peer, D1RecvDone on_recv, void* arg) {
+    if (peer->engine != NULL) {
+        check_error(-1, "Peer is already driven by an engine", __LINE__, __FILE__);
+        return -1;
+    }
+
+    D1EnginePeer* ep = (D1EnginePeer*)calloc(1, sizeof(D1EnginePeer));
+    if (ep == NULL) {
+        check_error(-1, "Calloc D1EnginePeer", __LINE__, __FILE__);
+        return -1;
+    }
+    ep->peer = peer;
+    ep->on_recv = on_recv;
+    ep->arg = arg;
+    ep->heap_pos = -1;
+
+    ep->socket_flags = fcntl(peer->socket, F_GETFL);
+    fcntl(peer->socket, F_SETFL, ep->socket_flags | O_NONBLOCK);
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = ep;
+    if (epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, peer->socket, &event) == -1) {
+        check_error(-1, "epoll_ctl add", __LINE__, __FILE__);
+        fcntl(peer->socket, F_SETFL, ep->socket_flags);
+        free(ep);
+        return -1;
+    }
+
+    ep->next = engine->peers;
+    if (engine->peers != NULL) {
+        engine->peers->prev = ep;
+    }
+    engine->peers = ep;
+    peer->engine = ep;
+    return 1;
+}
+
+/**
+ * Unregisters the peer, drops its queued sends and makes its socket blocking again.
+ * Called from a callback of d1_engine_run, the peer's state is only marked as removed
+ * and freed when d1_engine_run returns, later events may still point to it.
+ *
+ * @param engine The engine.
+ * @param peer The peer.
+ */
+void d1_engine_remove(D1Engine* engine, D1Peer* peer) {
+    D1EnginePeer* ep = peer->engine;
+    if (ep == NULL) {
+        return;
+    }
+
+    epoll_ctl(engine->epoll_fd, EPOLL_CTL_DEL, peer->socket, NULL);
+    heap_remove(engine, ep);
+    while (ep->head != NULL) {
+        D1EngineSend* send = ep->head;
+        ep->head = send->next;
+        engine->pending--;
+        free(send);
+    }
+    if (ep->prev != NULL) {
+        ep->prev->next = ep->next;
+    } else {
+        engine->peers = ep->next;
+    }
+    if (ep->next != NULL) {
+        ep->next->prev = ep->prev;
+    }
+    fcntl(peer->socket, F_SETFL, ep->socket_flags);
+    peer->engine = NULL;
+    if (engine->running) {
+        ep->removed = 1;
+        ep->next = engine->removed;
+        engine->removed = ep;
+        return;
+    }
+    free(ep);
+}
+
+/**
+ * Queues a data packet for the peer. The payload is copied into the packet right away.
+ *
+ * @param engine The engine.
+ * @param peer The peer, added with d1_engine_add.
+ * @param buffer The payload.
+ * @param sz The size of the payload.
+ * @param done Called with the result when the packet is ACKed or has failed, may be NULL.
+ * @param arg Passed to done.
+ * @return 1 on success, -1 on failure.
+ */
+int d1_engine_send(D1Engine* engine, D1Peer* peer, char* buffer, size_t sz, D1SendDone done, void* arg) {
+    D1EnginePeer* ep = peer->engine;
+    if (ep == NULL) {
+        check_error(-1, "Peer is not driven by an engine", __LINE__, __FILE__);
+        return -1;
+    }
+    if (sz + sizeof(D1Header) > PACKET_MAX) {
+        check_error(-1, "Data and header size exceeds 1024 bytes", __LINE__, __FILE__);
+        return -1;
+    }
+
+    D1EngineSend* send = (D1EngineSend*)malloc(sizeof(D1EngineSend) + sz + sizeof(D1Header));
+    if (send == NULL) {
+        check_error(-1, "Malloc D1EngineSend", __LINE__, __FILE__);
+        return -1;
+    }
+    send->next = NULL;
+    send->done = done;
+    send->arg = arg;
+    send->payload = sz;
+    send->size = sz + sizeof(D1Header);
+    memcpy(send->packet + sizeof(D1Header), buffer, sz);
+
+    engine->pending++;
+    if (ep->tail != NULL) {
+        ep->tail->next = send;
+        ep->tail = send;
+        return 1;
+    }
+    ep->head = ep->tail = send;
+    engine_start(engine, ep);
+    return 1;
+}
+
+/**
+ * Waits for readiness and timers, and runs the callbacks.
+ *
+ * @param engine The engine.
+ * @param timeout_ms The longest time to wait, -1 to wait for the next timer.
+ * @return The number of peers that had I/O or a timeout, or -1 on failure.
+ */
+int d1_engine_run(D1Engine* engine, int timeout_ms) {
+    if (engine->heap_len > 0) {
+        long long left = engine->heap[0]->deadline - d1_now_us();
+        int timer_ms = left > 0 ? (int)((left + 999) / 1000) : 0;
+        if (timeout_ms < 0 || timer_ms < timeout_ms) {
+            timeout_ms = timer_ms;
+        }
+    }
+
+    struct epoll_event events[ENGINE_EVENTS];
+    int n = epoll_wait(engine->epoll_fd, events, ENGINE_EVENTS, timeout_ms);
+    if (n == -1 && errno == EINTR) {
+        n = 0; // a signal, the timers may still be due
+    } else if (n == -1) {
+        check_error(-1, "epoll_wait", __LINE__, __FILE__);
+        return -1;
+    }
+
+    engine->running = 1;
+    for (int i = 0; i < n; i++) {
+        D1EnginePeer* ep = (D1EnginePeer*)events[i].data.ptr;
+        if (!ep->removed) {
+            engine_readable(engine, ep);
+        }
+    }
+    n += engine_timers(engine);
+    engine->running = 0;
+
+    while (engine->removed != NULL) {
+        D1EnginePeer* ep = engine->removed;
+        engine->removed = ep->next;
+        free(ep);
+    }
+    return n;
+}
+
+/**
+ * @param engine The engine.
+ * @return The number of sends that are queued or waiting for their ACK.
+ */
+int d1_engine_pending(D1Engine* engine) {
+    return engine->pending;
+}
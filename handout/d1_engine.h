@@ -0,0 +1,70 @@
+#ifndef D1_ENGINE_H
+#define D1_ENGINE_H
+
+#include "d1_udp.h"
+
+/* The D1Engine drives many D1Peers from one thread with epoll.
+ *
+ * The blocking functions in d1_udp.h make the caller wait for every ACK, so one
+ * slow peer holds up all others. The engine keeps a small state machine per peer
+ * instead: a peer is either idle or waits for the ACK of exactly one data packet
+ * (stop-and-wait is kept per peer), further sends are queued behind it.
+ * Retransmission deadlines of all peers live in one timer heap, and the RTO of every
+ * peer is used as in d1_wait_ack.
+ *
+ * Results are delivered through callbacks from d1_engine_run:
+ * - D1SendDone when the data packet has been ACKed (result is the number of bytes
+ *   sent) or has failed after D1_MAX_RETRIES timeouts (result is negative).
+ * - D1RecvDone for every data packet that arrives from the peer. It has been ACKed
+ *   already. The buffer is only valid during the callback.
+ *
+ * The engine speaks classic D1 only, peers must not negotiate the windowed mode.
+ */
+
+typedef struct D1Engine D1Engine;
+
+typedef void (*D1SendDone)( D1Peer* peer, int result, void* arg );
+typedef void (*D1RecvDone)( D1Peer* peer, char* buffer, int len, void* arg );
+
+/* Create an engine.
+ * Returns the pointer to a structure on the heap in case of success or NULL
+ * in case of failure.
+ */
+D1Engine* d1_engine_create( );
+
+/* Remove all peers from the engine (without calling their callbacks) and free it.
+ * The return value is always NULL.
+ */
+D1Engine* d1_engine_delete( D1Engine* engine );
+
+/* Let the engine drive the peer. d1_get_peer_info must have been called. The socket
+ * is made non-blocking until the peer is removed again. on_recv may be NULL if the
+ * peer is only used for sending.
+ * Returns 1 in case of success and a negative value in case of error.
+ */
+int d1_engine_add( D1Engine* engine, D1Peer* peer, D1RecvDone on_recv, void* arg );
+
+/* Stop driving the peer. Queued sends are dropped without callback. May be called
+ * from a callback, also for another peer.
+ */
+void d1_engine_remove( D1Engine* engine, D1Peer* peer );
+
+/* Queue the buffer for sending to the peer. The buffer is copied, so the caller can
+ * reuse it right away. If the peer is idle, the packet is sent immediately.
+ * Returns 1 in case of success and a negative value in case of error (then done is
+ * not called).
+ */
+int d1_engine_send( D1Engine* engine, D1Peer* peer, char* buffer, size_t sz, D1SendDone done, void* arg );
+
+/* Wait up to timeout_ms (-1 for the next timer) for packets and timers, and run the
+ * callbacks for everything that happened.
+ * Returns the number of peers that had I/O or a timeout, or a negative value in
+ * case of error.
+ */
+int d1_engine_run( D1Engine* engine, int timeout_ms );
+
+/* The number of sends that are queued or waiting for their ACK.
+ */
+int d1_engine_pending( D1Engine* engine );
+
+#endif /* D1_ENGINE_H */
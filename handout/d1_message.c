@@ -0,0 +1,208 @@
+/* ======================================================================
+ * D1 messages: fragmentation and reassembly of buffers of any size.
+ * ====================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "d1_message.h"
+
+
+#define MESSAGE_BATCH 256 /* fragments staged per d1_send_window call in the windowed mode */
+
+/*
+* START HELPER FUNCTIONS
+ */
+
+/**
+ * @brief Sends a message as a stream of windowed data packets. The fragments are built
+ * MESSAGE_BATCH at a time, each with its header, and handed to d1_send_window, which
+ * keeps a whole window of them in flight.
+ *
+ * @param peer The D1Peer to send to, in windowed mode.
+ * @param buffer The message.
+ * @param sz The size of the message.
+ * @return sz on success, or -1 on failure.
+ */
+static int send_message_window(D1Peer* peer, const char* buffer, size_t sz) {
+    size_t chunk = PACKET_MAX - sizeof(D1Header) - sizeof(D1WindowData) - sizeof(D1MessageHeader);
+    size_t count = sz == 0 ? 1 : (sz + chunk - 1) / chunk;
+    size_t batch = count < MESSAGE_BATCH ? count : MESSAGE_BATCH;
+
+    char* staging = malloc(batch * PACKET_MAX);
+    if (staging == NULL) {
+        check_error(-1, "malloc send_message_window", __LINE__, __FILE__);
+        return -1;
+    }
+    char*  buffers[MESSAGE_BATCH];
+    size_t sizes[MESSAGE_BATCH];
+
+    size_t offset = 0;
+    for (size_t first = 0; first < count; first += batch) {
+        int n = 0;
+        for (; n < (int)batch && first + n < count; n++) {
+            size_t bytes = sz - offset < chunk ? sz - offset : chunk;
+            D1MessageHeader header;
+            header.size = htonl(sz);
+            header.offset = htonl(offset);
+
+            buffers[n] = staging + n * PACKET_MAX;
+            memcpy(buffers[n], &header, sizeof(header));
+            memcpy(buffers[n] + sizeof(header), buffer + offset, bytes);
+            sizes[n] = sizeof(header) + bytes;
+            offset += bytes;
+        }
+        if (d1_send_window(peer, buffers, sizes, n) < 0) {
+            free(staging);
+            return -1;
+        }
+    }
+
+    free(staging);
+    return sz;
+}
+
+/*
+* END HELPER FUNCTIONS
+ */
+
+/**
+ * @brief Sends a buffer of any size as one message. In stop-and-wait mode every fragment
+ * is gathered by d1_send_datav from a header on the stack and the caller's buffer, so the
+ * message is never copied.
+ *
+ * @param peer The D1Peer to send to.
+ * @param buffer The message.
+ * @param sz The size of the message, at most D1_MESSAGE_MAX.
+ * @return sz on success, or a negative value on failure.
+ */
+int d1_send_message(D1Peer* peer, const char* buffer, size_t sz) {
+    if (sz > D1_MESSAGE_MAX) {
+        check_error(-1, "Message exceeds D1_MESSAGE_MAX", __LINE__, __FILE__);
+        return -1;
+    }
+    if (peer->window > 1) {
+        return send_message_window(peer, buffer, sz);
+    }
+
+    size_t chunk = PACKET_MAX - sizeof(D1Header) - sizeof(D1MessageHeader);
+    D1MessageHeader header;
+    header.size = htonl(sz);
+
+    size_t offset = 0;
+    do {
+        size_t bytes = sz - offset < chunk ? sz - offset : chunk;
+        header.offset = htonl(offset);
+
+        struct iovec iov[2];
+        iov[0].iov_base = &header;
+        iov[0].iov_len = sizeof(header);
+        iov[1].iov_base = (char*)buffer + offset;
+        iov[1].iov_len = bytes;
+        if (d1_send_datav(peer, iov, 2) < 0) {
+            return -1;
+        }
+        offset += bytes;
+    } while (offset < sz);
+
+    print_line(__LINE__, __FILE__, "Sent message (d1_send_message)");
+    return sz;
+}
+
+/**
+ * @brief Receives the fragments of one message and puts them together.
+ *
+ * The first fragment tells the size of the message; the buffer is allocated with room
+ * for one more packet behind the end. Every following fragment is then received straight
+ * into the message, with its header landing on the last bytes that have already arrived:
+ * those are saved before and put back after, so the payload needs no extra copy.
+ *
+ * In stop-and-wait mode d1_recv_data delivers a packet again when its ACK was lost and
+ * the sender retransmits it. Fragments that end at or before the bytes received so far
+ * are such copies and are skipped.
+ *
+ * @param peer The D1Peer to receive from.
+ * @param message Set to the message on the heap, to be freed by the caller.
+ * @return The size of the message, or -1 on failure.
+ */
+int d1_recv_message(D1Peer* peer, char** message) {
+    const size_t max_payload = PACKET_MAX - sizeof(D1Header);
+    char     first[PACKET_MAX];
+    char*    msg = NULL;
+    uint32_t size = 0;
+    uint32_t received = 0;
+
+    *message = NULL;
+    while (1) {
+        // Straight into the message once a whole header's worth of it has arrived
+        int direct = msg != NULL && received >= sizeof(D1MessageHeader);
+        char* dst = direct ? msg + received - sizeof(D1MessageHeader) : first;
+        char saved[sizeof(D1MessageHeader)];
+        if (direct) {
+            memcpy(saved, dst, sizeof(saved));
+        }
+
+        int len = d1_recv_data(peer, dst, max_payload);
+        D1MessageHeader header;
+        if (len >= (int)sizeof(header)) {
+            memcpy(&header, dst, sizeof(header));
+        }
+        if (direct) {
+            memcpy(dst, saved, sizeof(saved));
+        }
+        if (len < (int)sizeof(header)) {
+            check_error(-1, len < 0 ? "d1_recv_data" : "Fragment without header", __LINE__, __FILE__);
+            free(msg);
+            return -1;
+        }
+
+        uint32_t frag_size = ntohl(header.size);
+        uint32_t offset = ntohl(header.offset);
+        uint32_t bytes = len - sizeof(header);
+        char* payload = dst + sizeof(header);
+
+        if (msg != NULL ? frag_size == size && (uint64_t)offset + bytes <= received && bytes > 0 : offset != 0) {
+            // A copy of a fragment that has arrived already (its ACK was lost), or the rest of
+            // a message before this call. A direct receive only wrote behind the bytes that count.
+            continue;
+        }
+        if (offset == 0) {
+            // A new message, possibly after an incomplete one
+            if (frag_size > D1_MESSAGE_MAX || bytes > frag_size) {
+                check_error(-1, "Invalid message size", __LINE__, __FILE__);
+                free(msg);
+                return -1;
+            }
+            char* fresh = malloc(frag_size + PACKET_MAX);
+            if (fresh == NULL) {
+                check_error(-1, "malloc d1_recv_message", __LINE__, __FILE__);
+                free(msg);
+                return -1;
+            }
+            memcpy(fresh, payload, bytes);
+            free(msg);
+            msg = fresh;
+            size = frag_size;
+            received = bytes;
+        } else if (msg == NULL || offset != received || frag_size != size || bytes > size - received) {
+            check_error(-1, "Fragment does not continue the message", __LINE__, __FILE__);
+            free(msg);
+            return -1;
+        } else {
+            if (!direct) {
+                memcpy(msg + received, payload, bytes);
+            }
+            received += bytes;
+        }
+
+        if (received == size) {
+            break;
+        }
+    }
+
+    print_line(__LINE__, __FILE__, "Received message (d1_recv_message)");
+    *message = msg;
+    return size;
+}
@@ -0,0 +1,50 @@
+#ifndef D1_MESSAGE_H
+#define D1_MESSAGE_H
+
+#include "d1_udp.h"
+
+/* Messages of any size over D1.
+ *
+ * d1_send_message splits a buffer into fragments that each fill one D1 packet and sends
+ * them back-to-back: one d1_send_data after the other in stop-and-wait mode, or as one
+ * pipelined stream with d1_send_window once the windowed mode has been negotiated.
+ * d1_recv_message puts the fragments back together into one contiguous buffer.
+ *
+ * Every fragment starts with a D1MessageHeader, in network byte order, followed by
+ * the bytes [offset, offset + fragment size) of the message. D1 delivers the fragments
+ * in order, but in stop-and-wait mode a fragment arrives twice when its ACK was lost and
+ * the sender retransmitted it. The receiver skips fragments that end at or before the
+ * bytes it has already, and otherwise checks that each one continues where the previous
+ * one ended. A fragment with offset 0 starts a new message, also when the previous one
+ * is incomplete (the sender gave up on it), unless it is a copy of the first fragment of
+ * the current one. Fragments that arrive before any offset 0 belong to an earlier
+ * message and are skipped. A single-fragment message that is repeated after it has been
+ * returned cannot be told apart from a new one.
+ *
+ * Both peers must use the message functions for the whole association, plain
+ * d1_send_data/d1_recv_data payloads would be taken for fragments.
+ */
+
+#define D1_MESSAGE_MAX  (1u << 30)  /* largest message that is accepted */
+
+struct D1MessageHeader
+{
+    uint32_t size;      /* size of the whole message */
+    uint32_t offset;    /* position of this fragment in the message */
+};
+
+typedef struct D1MessageHeader D1MessageHeader;
+
+/* Send the sz bytes of buffer as one message (sz can be 0).
+ * Returns sz in case of success, and a negative value in case of error.
+ */
+int d1_send_message( D1Peer* peer, const char* buffer, size_t sz );
+
+/* Receive one message. *message is set to a buffer on the heap that holds the
+ * whole message, the caller must free it.
+ * Returns the size of the message in case of success, and a negative value (with
+ * *message set to NULL) in case of error.
+ */
+int d1_recv_message( D1Peer* peer, char** message );
+
+#endif /* D1_MESSAGE_H */
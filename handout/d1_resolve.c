@@ -0,0 +1,281 @@
+/* ======================================================================
+ * D1 name resolution: getaddrinfo behind a thread-safe cache.
+ * ====================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "d1_udp.h"
+#include "d1_resolve.h"
+
+
+#define RESOLVE_BUCKETS 256 /* a power of two */
+
+/* One cached name. ok == 0 caches a failure, then addr is unused.
+ */
+struct ResolveEntry
+{
+    struct ResolveEntry* next;        /* next entry in the same bucket */
+    struct in_addr       addr;
+    int                  ok;
+    int                  refreshing;  /* a background thread is resolving the name */
+    long long            refresh_us;  /* from then on, a refresh is started (async mode) */
+    long long            expires_us;
+    char                 name[];
+};
+
+static pthread_mutex_t      resolve_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ResolveEntry* buckets[RESOLVE_BUCKETS];
+static int                  entries = 0;
+static uint32_t             ttl_ms = D1_RESOLVE_TTL_MS;
+static uint32_t             negative_ttl_ms = D1_RESOLVE_NEGATIVE_TTL_MS;
+static int                  async_refresh = 0;
+
+/*
+* START HELPER FUNCTIONS
+ */
+
+/**
+ * @brief FNV-1a hash of a name, reduced to a bucket index.
+ *
+ * @param name The name.
+ * @return The bucket of the name.
+ */
+static uint32_t name_bucket(const char* name) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char* p = (const unsigned char*)name; *p; p++) {
+        h = (h ^ *p) * 16777619u;
+    }
+    return h & (RESOLVE_BUCKETS - 1);
+}
+
+/**
+ * @brief Finds the entry of a name. The lock must be held.
+ *
+ * @param name The name.
+ * @return The entry, or NULL.
+ */
+static struct ResolveEntry* find_entry(const char* name) {
+    for (struct ResolveEntry* e = buckets[name_bucket(name)]; e != NULL; e = e->next) {
+        if (strcmp(e->name, name) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Frees all entries. The lock must be held.
+ */
+static void flush_entries() {
+    for (int i = 0; i < RESOLVE_BUCKETS; i++) {
+        while (buckets[i] != NULL) {
+            struct ResolveEntry* next = buckets[i]->next;
+            free(buckets[i]);
+            buckets[i] = next;
+        }
+    }
+    entries = 0;
+}
+
+/**
+ * @brief Resolves a name with getaddrinfo, without the cache. Blocks until NSS answers.
+ *
+ * @param name The host name.
+ * @param addr Set to the first IPv4 address of the name.
+ * @return 1 on success, 0 if the name cannot be resolved.
+ */
+static int resolve_name(const char* name, struct in_addr* addr) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    struct addrinfo* result = NULL;
+    if (getaddrinfo(name, NULL, &hints, &result) != 0 || result == NULL) {
+        return 0;
+    }
+    *addr = ((struct sockaddr_in*)result->ai_addr)->sin_addr;
+    freeaddrinfo(result);
+    return 1;
+}
+
+/**
+ * @brief Stores the outcome of a resolution, creating the entry if needed. The lock
+ * must be held.
+ *
+ * @param name The name.
+ * @param ok 1 if the name was resolved, 0 if not.
+ * @param addr The address, if ok.
+ * @param now_us The time of the resolution.
+ */
+static void store_entry(const char* name, int ok, struct in_addr* addr, long long now_us) {
+    struct ResolveEntry* e = find_entry(name);
+    if (e == NULL) {
+        if (entries >= D1_RESOLVE_MAX) {
+            flush_entries();
+        }
+        size_t len = strlen(name) + 1;
+        e = calloc(1, sizeof(struct ResolveEntry) + len);
+        if (e == NULL) {
+            return; // only not cached
+        }
+        memcpy(e->name, name, len);
+        uint32_t b = name_bucket(name);
+        e->next = buckets[b];
+        buckets[b] = e;
+        entries++;
+    }
+
+    e->ok = ok;
+    e->refreshing = 0;
+    if (ok) {
+        e->addr = *addr;
+        e->refresh_us = now_us + ttl_ms * 750LL;
+        e->expires_us = now_us + ttl_ms * 1000LL;
+    } else {
+        e->expires_us = now_us + negative_ttl_ms * 1000LL;
+    }
+}
+
+/**
+ * @brief Background refresh of one name. If the name cannot be resolved any more, the
+ * cached address stays until it is too old, and the next refresh is tried after the
+ * negative TTL.
+ *
+ * @param arg The name, on the heap, freed here.
+ * @return NULL.
+ */
+static void* refresh_thread(void* arg) {
+    char* name = (char*)arg;
+    struct in_addr addr;
+    int ok = resolve_name(name, &addr);
+    long long now = d1_now_us();
+
+    pthread_mutex_lock(&resolve_lock);
+    if (ok) {
+        store_entry(name, 1, &addr, now);
+    } else {
+        struct ResolveEntry* e = find_entry(name);
+        if (e != NULL) {
+            e->refreshing = 0;
+            e->refresh_us = now + negative_ttl_ms * 1000LL;
+        }
+    }
+    pthread_mutex_unlock(&resolve_lock);
+
+    free(name);
+    return NULL;
+}
+
+/**
+ * @brief Starts the background refresh of a name whose entry is marked as refreshing.
+ * If no thread can be started, the mark is removed and a later call tries again.
+ *
+ * @param name The name.
+ */
+static void start_refresh(const char* name) {
+    char* copy = strdup(name);
+    pthread_attr_t attr;
+    pthread_t thread;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (copy == NULL || pthread_create(&thread, &attr, refresh_thread, copy) != 0) {
+        free(copy);
+        pthread_mutex_lock(&resolve_lock);
+        struct ResolveEntry* e = find_entry(name);
+        if (e != NULL) {
+            e->refreshing = 0;
+        }
+        pthread_mutex_unlock(&resolve_lock);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/*
+* END HELPER FUNCTIONS
+ */
+
+/**
+ * @brief Resolves a host name or dotted decimal address to an IPv4 address, through the
+ * cache. With the asynchronous refresh on, an expired address is still handed out for
+ * one more TTL while a background thread resolves the name again.
+ *
+ * @param name The host name or dotted decimal address.
+ * @param addr Set to the address on success.
+ * @return 1 on success, 0 if the name cannot be resolved.
+ */
+int d1_resolve(const char* name, struct in_addr* addr) {
+    if (inet_pton(AF_INET, name, addr) == 1) {
+        return 1;
+    }
+
+    long long now = d1_now_us();
+    int refresh = 0;
+
+    pthread_mutex_lock(&resolve_lock);
+    struct ResolveEntry* e = find_entry(name);
+    if (e != NULL && e->ok) {
+        long long usable_us = e->expires_us + (async_refresh ? ttl_ms * 1000LL : 0);
+        if (now < usable_us) {
+            *addr = e->addr;
+            if (async_refresh && now >= e->refresh_us && !e->refreshing) {
+                e->refreshing = 1;
+                refresh = 1;
+            }
+            pthread_mutex_unlock(&resolve_lock);
+            if (refresh) {
+                start_refresh(name);
+            }
+            return 1;
+        }
+    } else if (e != NULL && now < e->expires_us) {
+        pthread_mutex_unlock(&resolve_lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&resolve_lock);
+
+    // Not cached or expired: resolve without holding the lock
+    struct in_addr resolved;
+    int ok = resolve_name(name, &resolved);
+
+    pthread_mutex_lock(&resolve_lock);
+    store_entry(name, ok, &resolved, d1_now_us());
+    pthread_mutex_unlock(&resolve_lock);
+
+    if (ok) {
+        *addr = resolved;
+    }
+    print_line(__LINE__, __FILE__, ok ? "Resolved name (d1_resolve)" : "Could not resolve name (d1_resolve)");
+    return ok;
+}
+
+/**
+ * @brief Sets the lifetimes of cache entries and the asynchronous refresh.
+ *
+ * @param new_ttl_ms Lifetime of resolved addresses in milliseconds.
+ * @param new_negative_ttl_ms Lifetime of failures in milliseconds.
+ * @param async 1 to refresh names in the background, 0 to resolve them again when they expire.
+ */
+void d1_resolve_config(uint32_t new_ttl_ms, uint32_t new_negative_ttl_ms, int async) {
+    pthread_mutex_lock(&resolve_lock);
+    ttl_ms = new_ttl_ms;
+    negative_ttl_ms = new_negative_ttl_ms;
+    async_refresh = async;
+    pthread_mutex_unlock(&resolve_lock);
+}
+
+/**
+ * @brief Drops all cached names. Refreshes that are running store their result afterwards.
+ */
+void d1_resolve_flush() {
+    pthread_mutex_lock(&resolve_lock);
+    flush_entries();
+    pthread_mutex_unlock(&resolve_lock);
+}
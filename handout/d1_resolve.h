@@ -0,0 +1,42 @@
+#ifndef D1_RESOLVE_H
+#define D1_RESOLVE_H
+
+#include <netinet/in.h>
+
+/* Name resolution for d1_get_peer_info.
+ *
+ * Host names are resolved with getaddrinfo (IPv4 only, like the rest of D1) and the result
+ * is cached per name, so only the first lookup of a name goes through NSS. getaddrinfo does
+ * not tell the TTL of the DNS record, so a fixed TTL is used. Names that cannot be resolved
+ * are cached too, for a shorter time, so a bad name does not cost a DNS round trip on every
+ * call.
+ *
+ * With the asynchronous refresh on, a name whose entry is older than three quarters of the
+ * TTL is resolved again by a background thread, while callers keep getting the cached
+ * address, also after the entry has expired. Only the very first lookup of a name and
+ * lookups of names that failed wait for getaddrinfo.
+ *
+ * All functions can be called from any number of threads.
+ */
+
+#define D1_RESOLVE_TTL_MS           60000  /* default lifetime of a resolved address */
+#define D1_RESOLVE_NEGATIVE_TTL_MS   5000  /* default lifetime of a failure */
+#define D1_RESOLVE_MAX               1024  /* more cached names than this empty the cache */
+
+/* Resolve name to an IPv4 address. Dotted decimal addresses are converted without
+ * touching the cache.
+ * Returns 1 and sets *addr in case of success, 0 if the name cannot be resolved.
+ */
+int d1_resolve( const char* name, struct in_addr* addr );
+
+/* Set the lifetime of resolved addresses and of failures in milliseconds, and turn the
+ * asynchronous refresh on (1) or off (0, the default). Entries that are already cached
+ * keep their expiry time.
+ */
+void d1_resolve_config( uint32_t ttl_ms, uint32_t negative_ttl_ms, int async_refresh );
+
+/* Drop all cached names.
+ */
+void d1_resolve_flush( );
+
+#endif /* D1_RESOLVE_H */
@@ -0,0 +1,108 @@
+/* ======================================================================
+ * Cost of resolving a host name: gethostbyname (the old path of
+ * d1_get_peer_info), getaddrinfo without a cache, and d1_resolve with a
+ * warm cache, from one thread and from several at once. A name that does
+ * not exist shows the negative cache.
+ *
+ * Usage: d1_resolve_bench [name] [calls] [threads]
+ * ====================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+#include "d1_resolve.h"
+
+#define MISSING_NAME "d1-resolve-bench.invalid"
+
+static const char* name;
+static int calls;
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int with_gethostbyname(const char* n, struct in_addr* addr) {
+    struct hostent* host = gethostbyname(n);
+    if (host == NULL || host->h_addrtype != AF_INET) {
+        return 0;
+    }
+    memcpy(addr, host->h_addr_list[0], sizeof(*addr));
+    return 1;
+}
+
+static int with_getaddrinfo(const char* n, struct in_addr* addr) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    struct addrinfo* result;
+    if (getaddrinfo(n, NULL, &hints, &result) != 0) {
+        return 0;
+    }
+    *addr = ((struct sockaddr_in*)result->ai_addr)->sin_addr;
+    freeaddrinfo(result);
+    return 1;
+}
+
+/* Average nanoseconds per call of resolve for n, and whether the last call succeeded.
+ */
+static double measure(int (*resolve)(const char*, struct in_addr*), const char* n, int count, int* ok) {
+    struct in_addr addr;
+    double start = now_ns();
+    for (int i = 0; i < count; i++) {
+        *ok = resolve(n, &addr);
+    }
+    return (now_ns() - start) / count;
+}
+
+static void* run_thread(void* arg) {
+    int ok;
+    *(double*)arg = measure(d1_resolve, name, calls, &ok);
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    name = argc > 1 ? argv[1] : "localhost";
+    calls = argc > 2 ? atoi(argv[2]) : 20000;
+    int threads = argc > 3 ? atoi(argv[3]) : 4;
+    int slow_calls = calls / 100 > 0 ? calls / 100 : 1;
+    int ok;
+
+    printf("%-36s %12s\n", name, "ns per call");
+    printf("%-36s %12.0f\n", "gethostbyname", measure(with_gethostbyname, name, slow_calls, &ok));
+    printf("%-36s %12.0f\n", "getaddrinfo", measure(with_getaddrinfo, name, slow_calls, &ok));
+    measure(d1_resolve, name, 1, &ok);
+    if (!ok) {
+        printf("%s cannot be resolved\n", name);
+        return 1;
+    }
+    printf("%-36s %12.0f\n", "d1_resolve, warm", measure(d1_resolve, name, calls, &ok));
+
+    pthread_t* pool = malloc(threads * sizeof(pthread_t));
+    double* ns = malloc(threads * sizeof(double));
+    double start = now_ns();
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&pool[i], NULL, run_thread, &ns[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(pool[i], NULL);
+    }
+    char label[64];
+    snprintf(label, sizeof(label), "d1_resolve, warm, %d threads", threads);
+    printf("%-36s %12.0f  (wall time per call over all threads)\n", label, (now_ns() - start) / ((double)calls * threads));
+    free(pool);
+    free(ns);
+
+    printf("\n%-36s %12s\n", MISSING_NAME, "ns per call");
+    printf("%-36s %12.0f\n", "getaddrinfo", measure(with_getaddrinfo, MISSING_NAME, 3, &ok));
+    measure(d1_resolve, MISSING_NAME, 1, &ok);
+    printf("%-36s %12.0f\n", "d1_resolve, negative cache", measure(d1_resolve, MISSING_NAME, calls, &ok));
+    return 0;
+}
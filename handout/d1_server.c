@@ -0,0 +1,644 @@
+/* ======================================================================
+ * D1 server: one socket, per-peer state demultiplexed by source address.
+ * ====================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "d1_server.h"
+
+
+#define SERVER_BUCKETS 64 /* initial size of the hash table, a power of two */
+
+/* The state of one client. The D1Peer comes first, so the D1Peer* handed out to the
+ * caller can be cast back.
+ */
+struct D1ServerPeer
+{
+    D1Peer               peer;       /* socket of the server, addr of the client */
+    int                  rcv_seqno;  /* SEQNO flag of the next new data packet, -1 before the first */
+    long long            last_seen;  /* arrival of the last datagram, d1_now_us */
+    int                  held;       /* returned by d1_server_recv, freed by d1_server_forget */
+    int                  busy;       /* d1_server_send waits for its ACK */
+    int                  expired;    /* no longer in the table, see server_drop */
+    struct D1ServerPeer* next;       /* next peer in the same bucket */
+    struct D1ServerPeer* older;      /* all peers in the table, by last_seen, */
+    struct D1ServerPeer* newer;      /* or the expired list of the server */
+};
+
+/* Data that has been ACKed but not yet returned by d1_server_recv.
+ */
+struct D1ServerMessage
+{
+    struct D1ServerMessage* next;
+    struct D1ServerPeer*    from;
+    int                     size;
+    char                    data[];
+};
+
+struct D1Server
+{
+    int                     socket;
+    struct D1ServerPeer**   buckets;
+    int                     nbuckets;
+    int                     npeers;
+    int                     max_peers;
+    long long               idle_us;
+    struct D1ServerPeer*    oldest;  /* the peer that has been quiet the longest */
+    struct D1ServerPeer*    newest;
+    struct D1ServerPeer*    expired; /* dropped, but still held by the caller */
+    struct D1ServerMessage* head;    /* queued data, in arrival order */
+    struct D1ServerMessage* tail;
+};
+
+typedef struct D1ServerPeer D1ServerPeer;
+typedef struct D1ServerMessage D1ServerMessage;
+
+
+/*
+* START HELPER FUNCTIONS
+ */
+
+static unsigned server_hash(const struct sockaddr_in* addr, int nbuckets) {
+    uint32_t h = addr->sin_addr.s_addr * 2654435761u;
+    h ^= addr->sin_port * 40503u;
+    h ^= h >> 15;
+    return h & (nbuckets - 1);
+}
+
+/**
+ * Doubles the hash table when there are more peers than buckets.
+ */
+static void server_grow(D1Server* server) {
+    int nbuckets = server->nbuckets * 2;
+    D1ServerPeer** buckets = (D1ServerPeer**)calloc(nbuckets, sizeof(D1ServerPeer*));
+    if (buckets == NULL) {
+        return; // longer chains, but still correct
+    }
+    for (int i = 0; i < server->nbuckets; i++) {
+        D1ServerPeer* sp = server->buckets[i];
+        while (sp != NULL) {
+            D1ServerPeer* next = sp->next;
+            unsigned b = server_hash(&sp->peer.addr, nbuckets);
+            sp->next = buckets[b];
+            buckets[b] = sp;
+            sp = next;
+        }
+    }
+    free(server->buckets);
+    server->buckets = buckets;
+    server->nbuckets = nbuckets;
+}
+
+static void age_unlink(D1Server* server, D1ServerPeer* sp) {
+    if (sp->older != NULL) {
+        sp->older->newer = sp->newer;
+    } else {
+        server->oldest = sp->newer;
+    }
+    if (sp->newer != NULL) {
+        sp->newer->older = sp->older;
+    } else {
+        server->newest = sp->older;
+    }
+    sp->older = sp->newer = NULL;
+}
+
+static void age_append(D1Server* server, D1ServerPeer* sp) {
+    sp->older = server->newest;
+    sp->newer = NULL;
+    if (server->newest != NULL) {
+        server->newest->newer = sp;
+    } else {
+        server->oldest = sp;
+    }
+    server->newest = sp;
+}
+
+/**
+ * Drops the queued data of the peer.
+ */
+static void server_drop_messages(D1Server* server, D1ServerPeer* sp) {
+    D1ServerMessage** link = &server->head;
+    server->tail = NULL;
+    while (*link != NULL) {
+        D1ServerMessage* msg = *link;
+        if (msg->from == sp) {
+            *link = msg->next;
+            free(msg);
+        } else {
+            server->tail = msg;
+            link = &msg->next;
+        }
+    }
+}
+
+/**
+ * Takes the peer out of the table and drops its queued data. A peer the caller may still
+ * hold (held or busy) is only marked as expired, d1_server_forget frees it; the others
+ * are freed right away.
+ */
+static void server_drop(D1Server* server, D1ServerPeer* sp) {
+    server_drop_messages(server, sp);
+    D1ServerPeer** slot = &server->buckets[server_hash(&sp->peer.addr, server->nbuckets)];
+    while (*slot != NULL && *slot != sp) {
+        slot = &(*slot)->next;
+    }
+    if (*slot != NULL) {
+        *slot = sp->next;
+    }
+    age_unlink(server, sp);
+    server->npeers--;
+
+    if (sp->held || sp->busy) {
+        // Kept on the expired list until it is forgotten, or the server is deleted
+        sp->expired = 1;
+        sp->newer = server->expired;
+        if (server->expired != NULL) {
+            server->expired->older = sp;
+        }
+        server->expired = sp;
+        return;
+    }
+    free(sp->peer.wnd_rcv_buf);
+    free(sp);
+}
+
+/**
+ * Drops the peers that have not sent anything for idle_us.
+ */
+static void server_expire(D1Server* server) {
+    long long now = d1_now_us();
+    D1ServerPeer* sp = server->oldest;
+    while (sp != NULL && now - sp->last_seen > server->idle_us) {
+        D1ServerPeer* newer = sp->newer;
+        if (!sp->busy) {
+            print_line(__LINE__, __FILE__, "Idle peer expired (d1_server)");
+            server_drop(server, sp);
+        }
+        sp = newer;
+    }
+}
+
+/**
+ * Finds the state of the peer with the given address.
+ *
+ * @param server The server.
+ * @param addr The source address of a datagram.
+ * @param create If the peer is unknown, create its state.
+ * @return The state, or NULL if the peer is unknown and create is 0 (or calloc failed).
+ */
+static D1ServerPeer* server_peer(D1Server* server, const struct sockaddr_in* addr, int create) {
+    unsigned b = server_hash(addr, server->nbuckets);
+    for (D1ServerPeer* sp = server->buckets[b]; sp != NULL; sp = sp->next) {
+        if (sp->peer.addr.sin_addr.s_addr == addr->sin_addr.s_addr && sp->peer.addr.sin_port == addr->sin_port) {
+            sp->last_seen = d1_now_us();
+            age_unlink(server, sp);
+            age_append(server, sp);
+            return sp;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    if (server->npeers >= server->max_peers) {
+        // Make room: the idle peers first, else the one that has been quiet the longest
+        server_expire(server);
+        D1ServerPeer* victim = server->oldest;
+        while (server->npeers >= server->max_peers && victim != NULL) {
+            D1ServerPeer* newer = victim->newer;
+            if (!victim->busy) {
+                print_line(__LINE__, __FILE__, "Peer table full, oldest peer evicted (d1_server)");
+                server_drop(server, victim);
+            }
+            victim = newer;
+        }
+        if (server->npeers >= server->max_peers) {
+            return NULL;
+        }
+    }
+
+    D1ServerPeer* sp = (D1ServerPeer*)calloc(1, sizeof(D1ServerPeer));
+    if (sp == NULL) {
+        check_error(-1, "Calloc D1ServerPeer", __LINE__, __FILE__);
+        return NULL;
+    }
+    sp->peer.socket = server->socket;
+    sp->peer.addr = *addr;
+    sp->peer.rto_us = D1_RTO_INIT_US;
+    sp->peer.rto_min_us = D1_RTO_MIN_US;
+    sp->peer.rto_max_us = D1_RTO_MAX_US;
+    sp->rcv_seqno = -1;
+    sp->last_seen = d1_now_us();
+    sp->next = server->buckets[b];
+    server->buckets[b] = sp;
+    age_append(server, sp);
+
+    if (++server->npeers > server->nbuckets) {
+        server_grow(server);
+    }
+    print_line(__LINE__, __FILE__, "New peer (d1_server)");
+    return sp;
+}
+
+/**
+ * Waits for one datagram on the socket of the server.
+ *
+ * @param server The server.
+ * @param packet Receives the packet, PACKET_MAX bytes.
+ * @param addr Receives the source address.
+ * @param timeout_ms How long to wait, -1 blocks.
+ * @return The size as returned by d1_check_packet (0 if corrupted), -2 on timeout, -1 on failure.
+ */
+static int server_receive(D1Server* server, char* packet, struct sockaddr_in* addr, int timeout_ms) {
+    struct pollfd pfd = { server->socket, POLLIN, 0 };
+    int ready = poll(&pfd, 1, timeout_ms);
+    if (ready == -1) {
+        check_error(ready, "poll d1_server", __LINE__, __FILE__);
+        return -1;
+    }
+    if (ready == 0) {
+        return -2;
+    }
+
+    socklen_t fromlen = sizeof(*addr);
+    int bytes_received = recvfrom(server->socket, packet, PACKET_MAX, 0, (struct sockaddr*)addr, &fromlen);
+    if (bytes_received == -1) {
+        check_error(bytes_received, "recvfrom d1_server", __LINE__, __FILE__);
+        return -1;
+    }
+    return d1_check_packet(packet, bytes_received);
+}
+
+/**
+ * Handles a datagram that is not the ACK somebody waits for: data is ACKed and queued,
+ * corrupted data gets the wrong ACK, everything else is dropped.
+ *
+ * @param server The server.
+ * @param packet The packet, header in host byte order.
+ * @param size The size from d1_check_packet.
+ * @param addr The source address.
+ * @return The state of the peer it came from, NULL if unknown.
+ */
+static D1ServerPeer* server_dispatch(D1Server* server, char* packet, int size, struct sockaddr_in* addr) {
+    D1Header* header = (D1Header*)packet;
+    int is_data = (header->flags & FLAG_DATA) && !(header->flags & FLAG_WND);
+
+    // Only intact data makes a new peer
+    D1ServerPeer* sp = server_peer(server, addr, size > 0 && is_data);
+    if (sp == NULL || !is_data) {
+        return sp;
+    }
+
+    if (size == 0) {
+        // Corrupted, the wrong ACK makes the client retransmit
+        d1_send_ack(&sp->peer, header->flags & SEQNO);
+        return sp;
+    }
+
+    int seqno = (header->flags & SEQNO) ? 1 : 0;
+    d1_send_ack(&sp->peer, !seqno);
+    if (sp->rcv_seqno != -1 && seqno != sp->rcv_seqno) {
+        // Our ACK got lost and the client sent it again, it has been delivered already
+        print_line(__LINE__, __FILE__, "Duplicate data (d1_server)");
+        return sp;
+    }
+    sp->rcv_seqno = !seqno;
+
+    int payload = size - sizeof(D1Header);
+    D1ServerMessage* msg = (D1ServerMessage*)malloc(sizeof(D1ServerMessage) + payload);
+    if (msg == NULL) {
+        check_error(-1, "Malloc D1ServerMessage", __LINE__, __FILE__);
+        return sp;
+    }
+    msg->next = NULL;
+    msg->from = sp;
+    msg->size = payload;
+    memcpy(msg->data, packet + sizeof(D1Header), payload);
+    if (server->tail != NULL) {
+        server->tail->next = msg;
+    } else {
+        server->head = msg;
+    }
+    server->tail = msg;
+    return sp;
+}
+
+/**
+ * Creates the server socket and binds it to the port on all interfaces.
+ *
+ * @param port The port, 0 for any free one.
+ * @param reuseport Set SO_REUSEPORT before binding.
+ * @return The server, or NULL on failure.
+ */
+static D1Server* server_open(uint16_t port, int reuseport) {
+    D1Server* server = (D1Server*)calloc(1, sizeof(D1Server));
+    if (server == NULL) {
+        check_error(-1, "Calloc D1Server", __LINE__, __FILE__);
+        return NULL;
+    }
+    server->nbuckets = SERVER_BUCKETS;
+    server->max_peers = D1_SERVER_MAX_PEERS;
+    server->idle_us = (long long)D1_SERVER_IDLE_MS * 1000;
+    server->buckets = (D1ServerPeer**)calloc(server->nbuckets, sizeof(D1ServerPeer*));
+    server->socket = socket(AF_INET, SOCK_DGRAM, 0);
+    check_error(server->socket, "socket creation", __LINE__, __FILE__);
+    if (server->buckets == NULL || server->socket == -1) {
+        free(server->buckets);
+        free(server);
+        return NULL;
+    }
+
+    if (reuseport) {
+        int on = 1;
+        int rc = setsockopt(server->socket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+        if (rc == -1) {
+            check_error(rc, "setsockopt SO_REUSEPORT", __LINE__, __FILE__);
+            return d1_server_delete(server);
+        }
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    int rc = bind(server->socket, (struct sockaddr*)&addr, sizeof(addr));
+    if (rc == -1) {
+        check_error(rc, "bind d1_create_server", __LINE__, __FILE__);
+        return d1_server_delete(server);
+    }
+
+    print_line(__LINE__, __FILE__, "Created server (d1_create_server)");
+    return server;
+}
+
+/**
+ * Sends a data packet to one peer and waits for its ACK, see d1_server_send.
+ */
+static int server_send(D1Server* server, D1Peer* peer, char* buffer, size_t sz) {
+    char out[PACKET_MAX];
+    char packet[PACKET_MAX];
+    struct sockaddr_in addr;
+
+    int size = d1_build_packet(out, FLAG_DATA | (peer->next_seqno ? SEQNO : 0), buffer, sz);
+    if (size == -1) {
+        return -1;
+    }
+
+    int timeouts = 0;
+    int resent = 0; // number of copies sent after the first one
+    while (1) {
+        int wc = sendto(server->socket, out, size, 0, (struct sockaddr*)&peer->addr, sizeof(peer->addr));
+        if (wc == -1) {
+            check_error(wc, "sendto d1_server_send", __LINE__, __FILE__);
+            return -1;
+        }
+        long long sent_at = d1_now_us();
+
+        // Wait for the ACK of this peer, until the next resend
+        int resend = 0;
+        while (!resend) {
+            long long left = sent_at + peer->rto_us - d1_now_us();
+            int rc = left > 0 ? server_receive(server, packet, &addr, (int)((left + 999) / 1000)) : -2;
+            if (rc == -1) {
+                return -1;
+            }
+            if (rc == -2) {
+                if (++timeouts > D1_MAX_RETRIES) {
+                    check_error(-1, "timeout, ack not received, is the client still there?", __LINE__, __FILE__);
+                    return -1;
+                }
+                d1_rto_backoff(peer);
+                peer->stale_acks = 0;
+                resend = 1;
+                break;
+            }
+
+            D1Header* header = (D1Header*)packet;
+            if (server_dispatch(server, packet, rc, &addr) != (D1ServerPeer*)peer || rc == 0
+                || (header->flags & (FLAG_DATA | FLAG_WND)) || !(header->flags & FLAG_ACK)) {
+                continue;
+            }
+
+            if ((header->flags & ACKNO) == peer->next_seqno) {
+                // Karn's algorithm, see d1_wait_ack
+                if (!resent) {
+                    d1_rtt_sample(peer, d1_now_us() - sent_at);
+                }
+                peer->stale_acks = resent;
+                peer->next_seqno = !peer->next_seqno;
+                print_line(__LINE__, __FILE__, "Sent data (d1_server_send)");
+                return size;
+            }
+            if (peer->stale_acks > 0) {
+                peer->stale_acks--;
+                continue;
+            }
+            resend = 1;
+        }
+        peer->retransmits++;
+        resent++;
+    }
+}
+
+/*
+* END HELPER FUNCTIONS
+ */
+
+/**
+ * Creates the server socket and binds it to the port on all interfaces.
+ *
+ * @param port The port, 0 for any free one.
+ * @return The server, or NULL on failure.
+ */
+D1Server* d1_create_server(uint16_t port) {
+    return server_open(port, 0);
+}
+
+/**
+ * Like d1_create_server, but several servers can bind the same port.
+ *
+ * @param port The port.
+ * @return The server, or NULL on failure.
+ */
+D1Server* d1_create_server_reuseport(uint16_t port) {
+    return server_open(port, 1);
+}
+
+/**
+ * Closes the socket and frees the server, its peers (expired ones included) and queued data.
+ *
+ * @param server The server, may be NULL.
+ * @return always NULL.
+ */
+D1Server* d1_server_delete(D1Server* server) {
+    if (server != NULL) {
+        while (server->head != NULL) {
+            D1ServerMessage* msg = server->head;
+            server->head = msg->next;
+            free(msg);
+        }
+        for (int i = 0; i < server->nbuckets; i++) {
+            while (server->buckets[i] != NULL) {
+                D1ServerPeer* sp = server->buckets[i];
+                server->buckets[i] = sp->next;
+                free(sp->peer.wnd_rcv_buf);
+                free(sp);
+            }
+        }
+        while (server->expired != NULL) {
+            D1ServerPeer* sp = server->expired;
+            server->expired = sp->newer;
+            free(sp->peer.wnd_rcv_buf);
+            free(sp);
+        }
+        close(server->socket);
+        free(server->buckets);
+        free(server);
+    }
+    return NULL;
+}
+
+/**
+ * @param server The server.
+ * @return The port the server is bound to, in host byte order, or 0 on failure.
+ */
+uint16_t d1_server_port(D1Server* server) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(server->socket, (struct sockaddr*)&addr, &len) == -1) {
+        check_error(-1, "getsockname d1_server_port", __LINE__, __FILE__);
+        return 0;
+    }
+    return ntohs(addr.sin_port);
+}
+
+/**
+ * Sets the limits of the peer table.
+ *
+ * @param server The server.
+ * @param max_peers The most peers in the table, at least 1.
+ * @param idle_ms How long a peer may be quiet before it is dropped.
+ */
+void d1_server_set_limits(D1Server* server, int max_peers, int idle_ms) {
+    server->max_peers = max_peers > 0 ? max_peers : 1;
+    server->idle_us = (long long)idle_ms * 1000;
+    while (server->npeers > server->max_peers && server->oldest != NULL) {
+        server_drop(server, server->oldest);
+    }
+    server_expire(server);
+}
+
+/**
+ * Returns the next data packet from any peer, queued data first. Peers that have been
+ * idle too long are dropped first.
+ *
+ * @param server The server.
+ * @param peer Set to the peer that sent the data, NULL on timeout or failure.
+ * @param buffer The buffer for the payload.
+ * @param sz The size of the buffer, longer payloads are cut.
+ * @param timeout_ms How long to wait, -1 blocks.
+ * @return The number of payload bytes, 0 on timeout, or -1 on failure.
+ */
+int d1_server_recv(D1Server* server, D1Peer** peer, char* buffer, size_t sz, int timeout_ms) {
+    char packet[PACKET_MAX];
+    struct sockaddr_in addr;
+    long long deadline = d1_now_us() + (long long)timeout_ms * 1000;
+    *peer = NULL;
+
+    server_expire(server);
+    while (server->head == NULL) {
+        int wait_ms = -1;
+        if (timeout_ms >= 0) {
+            long long left = deadline - d1_now_us();
+            wait_ms = left > 0 ? (int)((left + 999) / 1000) : 0;
+        }
+        int size = server_receive(server, packet, &addr, wait_ms);
+        if (size == -2) {
+            return 0;
+        }
+        if (size == -1) {
+            return -1;
+        }
+        // ACKs here are late ACKs of resent packets, they are dropped
+        server_dispatch(server, packet, size, &addr);
+        server_expire(server);
+    }
+
+    D1ServerMessage* msg = server->head;
+    server->head = msg->next;
+    if (server->head == NULL) {
+        server->tail = NULL;
+    }
+    int payload = msg->size < (int)sz ? msg->size : (int)sz;
+    memcpy(buffer, msg->data, payload);
+    msg->from->held = 1;
+    *peer = &msg->from->peer;
+    free(msg);
+
+    print_line(__LINE__, __FILE__, "Received data (d1_server_recv)");
+    return payload;
+}
+
+/**
+ * Sends a data packet to one peer and waits for its ACK. Retransmissions work like in
+ * d1_wait_ack. Datagrams of other peers that arrive meanwhile are dispatched.
+ *
+ * @param server The server.
+ * @param peer A peer returned by d1_server_recv.
+ * @param buffer The payload.
+ * @param sz The size of the payload.
+ * @return The number of bytes sent, header included, or -1 on failure.
+ */
+int d1_server_send(D1Server* server, D1Peer* peer, char* buffer, size_t sz) {
+    D1ServerPeer* sp = (D1ServerPeer*)peer;
+    if (sp->expired) {
+        check_error(-1, "Peer has expired, d1_server_forget it", __LINE__, __FILE__);
+        return -1;
+    }
+    sp->busy = 1;
+    int rc = server_send(server, peer, buffer, sz);
+    sp->busy = 0;
+    return rc;
+}
+
+/**
+ * Removes the peer's state and its queued data, or frees a peer that has expired.
+ *
+ * @param server The server.
+ * @param peer A peer returned by d1_server_recv, invalid afterwards.
+ */
+void d1_server_forget(D1Server* server, D1Peer* peer) {
+    D1ServerPeer* sp = (D1ServerPeer*)peer;
+    if (!sp->expired) {
+        sp->held = 0;
+        server_drop(server, sp);
+        return;
+    }
+    if (sp->older != NULL) {
+        sp->older->newer = sp->newer;
+    } else {
+        server->expired = sp->newer;
+    }
+    if (sp->newer != NULL) {
+        sp->newer->older = sp->older;
+    }
+    free(sp->peer.wnd_rcv_buf);
+    free(sp);
+}
+
+/**
+ * @param server The server.
+ * @return The number of peers the server knows.
+ */
+int d1_server_peers(D1Server* server) {
+    return server->npeers;
+}
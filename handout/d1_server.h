@@ -0,0 +1,85 @@
+#ifndef D1_SERVER_H
+#define D1_SERVER_H
+
+#include "d1_udp.h"
+
+/* The server side of D1. A D1Server binds one UDP socket and serves any number of
+ * clients through it.
+ *
+ * A client D1Peer keeps only one addr, and recvfrom overwrites it with the source of
+ * every datagram. The server instead looks up the source address of every datagram in a
+ * hash table of per-peer states. Every client gets its own D1Peer there, with its own
+ * sequence numbers and RTO, so clients never see each other's ACKs or data. The D1Peers
+ * share the socket of the server and belong to it: don't pass them to d1_delete or to
+ * the blocking functions of d1_udp.h.
+ *
+ * The server ACKs data as soon as it arrives, also while d1_server_send waits for an ACK
+ * from another peer. Such data is queued and returned by later d1_server_recv calls, in
+ * arrival order. Data that a client resends because our ACK got lost is ACKed again but
+ * delivered only once.
+ *
+ * The windowed mode is not offered, clients that ask for it fall back to stop-and-wait.
+ *
+ * The table of peers is bounded, so that a port scan or spoofed source addresses cannot
+ * grow it without limit. A peer that has sent nothing for idle_ms is dropped, and when
+ * the table is full, a new peer evicts the one that has been quiet the longest (the peer
+ * d1_server_send is busy with excepted; if that is the only one, the datagram is ignored).
+ * A dropped peer loses its queued data. If d1_server_recv has returned it, the D1Peer
+ * stays valid: d1_server_send fails for it, and d1_server_forget frees it.
+ */
+
+#define D1_SERVER_MAX_PEERS 4096    /* default size limit of the table of peers */
+#define D1_SERVER_IDLE_MS   30000   /* default idle time after which a peer is dropped */
+
+typedef struct D1Server D1Server;
+
+/* Create a UDP socket bound to the given port on all interfaces (0 picks a free port,
+ * see d1_server_port).
+ * Returns the pointer to a structure on the heap in case of success or NULL
+ * in case of failure.
+ */
+D1Server* d1_create_server( uint16_t port );
+
+/* Like d1_create_server, but with SO_REUSEPORT, so that several servers (e.g. one per
+ * thread) can bind the same port. The kernel spreads the clients over them by their
+ * address, so all datagrams of one client go to the same server.
+ */
+D1Server* d1_create_server_reuseport( uint16_t port );
+
+/* Close the socket and free the server with all its peers.
+ * The return value is always NULL.
+ */
+D1Server* d1_server_delete( D1Server* server );
+
+/* The port the server is bound to, in host byte order.
+ */
+uint16_t d1_server_port( D1Server* server );
+
+/* Change the limits of the table of peers, see above. Peers beyond the new limits are
+ * dropped right away.
+ */
+void d1_server_set_limits( D1Server* server, int max_peers, int idle_ms );
+
+/* Wait up to timeout_ms (-1 blocks) for a data packet from any peer, and copy its payload
+ * into buffer. *peer is set to the peer that sent it, it can be passed to d1_server_send.
+ * Returns the number of payload bytes (can be 0), 0 with *peer set to NULL on timeout, or
+ * a negative value in case of error.
+ */
+int d1_server_recv( D1Server* server, D1Peer** peer, char* buffer, size_t sz, int timeout_ms );
+
+/* Send the buffer to the peer and wait for its ACK, like d1_send_data.
+ * Returns the number of bytes sent (header included) in case of success, and a negative
+ * value in case of error.
+ */
+int d1_server_send( D1Server* server, D1Peer* peer, char* buffer, size_t sz );
+
+/* Forget the peer, e.g. after it has disconnected. Its queued data is dropped. If it
+ * sends again, it is a new peer. Also frees a peer that has been dropped (see above).
+ */
+void d1_server_forget( D1Server* server, D1Peer* peer );
+
+/* The number of peers in the table of the server.
+ */
+int d1_server_peers( D1Server* server );
+
+#endif /* D1_SERVER_H */
@@ -9,13 +9,15 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
-#include <netdb.h>
+#include <time.h>
+#include <poll.h>
 
 #include "d1_udp.h" 
+#include "d1_checksum.h"
+#include "d1_resolve.h"
 
 
 
-#define PACKET_MAX 1024
 #define PRINT_DEBUG_INFO 0
 
 
@@ -50,41 +52,200 @@ void check_error(int res, char *msg, int line, char* file) {
  * @return The calculated checksum as a 16-bit unsigned integer.
  */
 uint16_t calculate_checksum(char* newBuffer, int size) {
-    // Calculate the checksum
+    // The XOR of the whole packet, a word at a time (see d1_checksum.c)
+    uint16_t checksum = d1_checksum(newBuffer, size);
 
-    uint8_t checksum_odd = 0;
-    uint8_t checksum_even = 0;
+    // We are not supposed to include the checksum field. XOR is its own inverse, so it is
+    // simply taken out again
+    if (size > 2) {
+        checksum ^= (uint8_t)newBuffer[2] << 8;
+    }
+    if (size > 3) {
+        checksum ^= (uint8_t)newBuffer[3];
+    }
+    return checksum;
+}
 
-    for (int i = 0; i < size; i++) {
-        if (i  == 2 || i == 3) {
-            // We are in the checksum field, so we skip it
-            continue;
-        }
-        if (i % 2 == 0) {
-            checksum_odd ^= newBuffer[i];
-        } else {
-            checksum_even ^= newBuffer[i];
+/**
+ * Calculates the same checksum as calculate_checksum over a packet that is scattered over
+ * several buffers. Bytes 2 and 3 of the packet, the checksum field, are skipped.
+ *
+ * @param iov The buffers, the first one starts with the header.
+ * @param iovcnt The number of buffers.
+ * @return The checksum in host byte order.
+ */
+uint16_t d1_checksum_iov(const struct iovec* iov, int iovcnt) {
+    uint16_t checksum = 0;
+    size_t offset = 0; // position of the first byte of the buffer in the whole packet
+
+    for (int v = 0; v < iovcnt; v++) {
+        const uint8_t* data = (const uint8_t*)iov[v].iov_base;
+        uint16_t part = d1_checksum(data, iov[v].iov_len);
+        // A buffer that starts at an odd offset has its lanes the other way round
+        checksum ^= offset % 2 ? (uint16_t)((part << 8) | (part >> 8)) : part;
+
+        // Take the checksum field out again
+        for (size_t i = offset; i < 4 && i < offset + iov[v].iov_len; i++) {
+            if (i >= 2) {
+                checksum ^= i == 2 ? data[i - offset] << 8 : data[i - offset];
+            }
         }
+        offset += iov[v].iov_len;
     }
-    if(size % 2 == 1) {
-        checksum_odd ^= 0;
-    };
+    return checksum;
+}
 
-    // This combines the two checksums, which are one byte each, into a two byte full one
-    uint16_t checksum = (checksum_odd << 8) | checksum_even;
+/**
+ * @return The current time of the monotonic clock in microseconds.
+ */
+long long d1_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-    return checksum;
+/**
+ * Clamps the retransmission timeout of the peer to its bounds.
+ *
+ * @param peer The D1Peer.
+ * @param rto_us The unclamped timeout.
+ */
+static void d1_set_rto(D1Peer* peer, long long rto_us) {
+    if (rto_us < peer->rto_min_us) {
+        rto_us = peer->rto_min_us;
+    }
+    if (rto_us > peer->rto_max_us) {
+        rto_us = peer->rto_max_us;
+    }
+    peer->rto_us = rto_us;
+}
+
+/**
+ * Updates the RTT estimate of the peer with a new sample and recomputes the retransmission
+ * timeout as described in RFC 6298.
+ *
+ * @param peer The D1Peer.
+ * @param rtt_us The measured round trip time of a packet that was sent only once.
+ */
+void d1_rtt_sample(D1Peer* peer, long long rtt_us) {
+    if (rtt_us < 1) {
+        rtt_us = 1;
+    }
+    if (peer->srtt_us == 0) {
+        peer->srtt_us = rtt_us;
+        peer->rttvar_us = rtt_us / 2;
+    } else {
+        long long delta = peer->srtt_us > rtt_us ? peer->srtt_us - rtt_us : rtt_us - peer->srtt_us;
+        peer->rttvar_us = (3 * (long long)peer->rttvar_us + delta) / 4;
+        peer->srtt_us = (7 * (long long)peer->srtt_us + rtt_us) / 8;
+    }
+    peer->last_rtt_us = rtt_us;
+
+    // On a very steady path rttvar goes towards 0, and the slightest jitter would trigger a
+    // spurious retransmission. The alternating bit can't tell the duplicate ACK that follows
+    // from a real one, so the margin never drops below a quarter of the RTT plus the 1 ms
+    // resolution of poll.
+    long long margin = 4 * (long long)peer->rttvar_us;
+    if (margin < peer->srtt_us / 4 + 1000) {
+        margin = peer->srtt_us / 4 + 1000;
+    }
+    d1_set_rto(peer, peer->srtt_us + margin);
+}
+
+/**
+ * Doubles the retransmission timeout of the peer after a timeout, up to its maximum.
+ *
+ * @param peer The D1Peer.
+ */
+void d1_rto_backoff(D1Peer* peer) {
+    d1_set_rto(peer, 2 * (long long)peer->rto_us);
+}
+
+/**
+ * Writes the D1Header with the given flags in front of the payload and sets the checksum.
+ *
+ * @param packet The packet buffer, PACKET_MAX bytes.
+ * @param flags The flags of the D1Header in host byte order.
+ * @param payload The payload, copied behind the header. If NULL, the payload is expected to
+ *                be in place behind the header already.
+ * @param sz The size of the payload.
+ * @return The size of the packet, or -1 if it exceeds PACKET_MAX.
+ */
+int d1_build_packet(char* packet, uint16_t flags, char* payload, size_t sz) {
+    int size = sz + sizeof(D1Header);
+    if (size > PACKET_MAX) {
+        check_error(-1, "Data and header size exceeds 1024 bytes", __LINE__, __FILE__);
+        return -1;
+    }
+
+    D1Header header;
+    header.flags = htons(flags);
+    header.checksum = 0;
+    header.size = htonl(size);
+    memcpy(packet, &header, sizeof(D1Header));
+
+    // The checksum field is still 0, and the payload is checksummed while it is copied
+    uint16_t checksum = d1_checksum(packet, sizeof(D1Header));
+    if (payload != NULL) {
+        checksum ^= d1_checksum_copy(packet + sizeof(D1Header), payload, sz);
+    } else {
+        checksum ^= d1_checksum(packet + sizeof(D1Header), sz);
+    }
+
+    header.checksum = htons(checksum);
+    memcpy(packet + 2, &header.checksum, 2);
+    return size;
+}
+
+/**
+ * Checks size and checksum of a received packet, and converts the header fields to host
+ * byte order in place.
+ *
+ * @param packet The received packet, in a buffer of PACKET_MAX bytes.
+ * @param size The number of bytes received.
+ * @return size if the packet is intact, 0 if it is too short or corrupted.
+ */
+int d1_check_packet(char* packet, int size) {
+    if (size < (int)sizeof(D1Header)) {
+        // Callers look at the flags of corrupted packets, don't let them see garbage
+        ((D1Header*)packet)->flags = 0;
+        return 0;
+    }
+
+    // Before the ntoh(s/l) operations, like in d1_recv_data
+    uint16_t checksum = calculate_checksum(packet, size);
+
+    D1Header* header = (D1Header*)packet;
+    header->flags = ntohs(header->flags);
+    header->checksum = ntohs(header->checksum);
+    header->size = ntohl(header->size);
+
+    if (checksum != header->checksum || size != (int)header->size) {
+        return 0;
+    }
+    return size;
 }
 
 /**
- * Resets the socket options for the given D1Peer.
- * Used to reset socket after wait_ack, which sets the timeout to 1 second. 
+ * Sends a single packet with the given flags and payload to the peer, without waiting
+ * for an ACK. Used for the packets of the windowed mode, which do their own bookkeeping.
  *
- * @param peer The D1Peer for which to reset the socket options.
+ * @param peer The D1Peer to send the packet to.
+ * @param flags The flags of the D1Header in host byte order.
+ * @param payload The payload that follows the header, may be NULL if sz is 0.
+ * @param sz The size of the payload.
+ * @return The number of bytes sent, or -1 on failure.
  */
-void reset_socket_options(D1Peer* peer) {
-    // Reset the socket options to standard values
-    setsockopt(peer->socket, SOL_SOCKET, SO_RCVTIMEO, NULL, 0);
+int d1_send_control(D1Peer* peer, uint16_t flags, char* payload, size_t sz) {
+    char packet[PACKET_MAX];
+    int size = d1_build_packet(packet, flags, payload, sz);
+    if (size == -1) {
+        return -1;
+    }
+
+    int wc = sendto(peer->socket, packet, size, 0, (struct sockaddr*)&(peer->addr), sizeof(peer->addr));
+    check_error(wc, "sendto d1_send_control", __LINE__, __FILE__);
+    return wc;
 }
 
 /* 
@@ -114,6 +275,9 @@ D1Peer* d1_create_client() {
         return NULL;
     }
     peer->socket = sockfd;
+    peer->rto_us = D1_RTO_INIT_US;
+    peer->rto_min_us = D1_RTO_MIN_US;
+    peer->rto_max_us = D1_RTO_MAX_US;
 
     print_line(__LINE__, __FILE__, "Created client (d1_create_client)");
     return peer;
@@ -129,12 +293,31 @@ D1Peer* d1_create_client() {
 D1Peer* d1_delete( D1Peer* peer ) {
     // delete the peer and close the socketfd
     if (peer != NULL) {
+        d1_uring_delete(peer);
         close(peer->socket);
+        free(peer->wnd_rcv_buf);
         free(peer);
     }
     return NULL;
 }
 
+/**
+ * Sets the bounds of the retransmission timeout of the peer. The current timeout is clamped
+ * to the new bounds.
+ *
+ * @param peer The D1Peer.
+ * @param rto_min_us The smallest timeout in microseconds.
+ * @param rto_max_us The largest timeout in microseconds.
+ */
+void d1_set_rto_bounds(D1Peer* peer, uint32_t rto_min_us, uint32_t rto_max_us) {
+    if (rto_min_us > rto_max_us) {
+        rto_min_us = rto_max_us;
+    }
+    peer->rto_min_us = rto_min_us;
+    peer->rto_max_us = rto_max_us;
+    d1_set_rto(peer, peer->rto_us);
+}
+
 /** Determine the socket address structure that belongs to the server's name
  *  and port. The server's name may be given as a hostname, or it may be given
  *  in dotted decimal format.
@@ -151,16 +334,12 @@ int d1_get_peer_info( struct D1Peer* peer, const char* peername, uint16_t server
     dest_addr.sin_family = AF_INET;
     dest_addr.sin_port = htons(server_port);
 
-    //changed from earlier, to cover "erver's name may be given as a hostname, or it may be givenin dotted decimal format."
-    // inet_pton is only for dotted decimal, and if hosname is given, we need to use gethostbyname
-    if (inet_pton(AF_INET, peername, &dest_addr.sin_addr) <= 0) {
-        struct hostent* host = gethostbyname(peername);
-        if (host == NULL || host->h_addrtype != AF_INET) {
-            check_error(-1, "gethostbyname", __LINE__, __FILE__);
-            d1_delete(peer); // Im told to terminate the client, but the test file also does this on return=0; but im doing it:)
-            return 0;
-        }
-        memcpy(&dest_addr.sin_addr, host->h_addr_list[0], host->h_length);
+    // The name may be a hostname or dotted decimal. d1_resolve handles both, with getaddrinfo
+    // and a cache instead of gethostbyname, which is not thread-safe.
+    if (!d1_resolve(peername, &dest_addr.sin_addr)) {
+        check_error(-1, "d1_resolve", __LINE__, __FILE__);
+        d1_delete(peer); // Im told to terminate the client, but the test file also does this on return=0; but im doing it:)
+        return 0;
     }
     peer->addr = dest_addr;
     print_line(__LINE__, __FILE__, "Got peer info (d1_get_peer_info)");
@@ -170,6 +349,7 @@ int d1_get_peer_info( struct D1Peer* peer, const char* peername, uint16_t server
 /**
  * @brief Call this to wait for a single packet from the peer. The function checks if the
  *  size indicated in the header is correct and if the checksum is correct.
+ *  The payload is received directly into buffer with recvmsg, without a staging copy.
  * 
  * @param peer The D1Peer structure representing the peer connection.
  * @param buffer The buffer to store the received data.
@@ -178,167 +358,272 @@ int d1_get_peer_info( struct D1Peer* peer, const char* peername, uint16_t server
  */
 int d1_recv_data(struct D1Peer* peer, char* buffer, size_t sz) {
 
-    char packet[sizeof(D1Header) + sz];
-    ssize_t bytes_received = 0;
-    D1Header* header;
-    
-    // Using recvfrom, since we are using Udp, so source adress is more critical.
-    socklen_t fromlen = sizeof(peer->addr);
-    bytes_received = recvfrom(peer->socket, packet, sz + sizeof(D1Header), 0, (struct sockaddr*)&(peer->addr), &fromlen); 
-    /* bytes_received = recv(peer->socket, packet, sz + sizeof(D1Header), 0); */
-    if (bytes_received < 0 || bytes_received > (ssize_t)(sz + sizeof(D1Header))) {
+    // Once the windowed mode is negotiated, it has its own receive path with a reorder buffer
+    if (peer->window > 1) {
+        return d1_window_recv(peer, buffer, sz);
+    }
+
+#ifdef D1_USE_URING
+    if (d1_uring_ready(peer)) {
+        return d1_uring_recv_data(peer, buffer, sz);
+    }
+#endif
+
+    // The header goes into a local struct and the payload straight into the caller's buffer.
+    // The spill area makes room for a window hello, even if the caller expects a smaller payload.
+    D1Header header;
+    char spill[sizeof(D1WindowHello)];
+    memset(&header, 0, sizeof(header));
+    struct iovec iov[3] = {
+        { &header, sizeof(D1Header) },
+        { buffer, sz },
+        { spill, sizeof(spill) }
+    };
+
+    // Using recvmsg with the source address, since we are using Udp, so source adress is more critical.
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &peer->addr;
+    msg.msg_namelen = sizeof(peer->addr);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 3;
+    ssize_t bytes_received = recvmsg(peer->socket, &msg, 0);
+    if (bytes_received < 0) {
         check_error(bytes_received, "error with bytes received(d1_recv_data)", __LINE__, __FILE__);
         return -1;
-    } 
+    }
+
+    // Only the bytes that arrived are checked, so the cost follows the size of the datagram
+    size_t left = bytes_received;
+    for (int i = 0; i < 3; i++) {
+        if (iov[i].iov_len > left) {
+            iov[i].iov_len = left;
+        }
+        left -= iov[i].iov_len;
+    }
 
     // Calculate the checksum, does not calculate over the checksum field
     // VERY VERY IMPORTANT, before the ntoh(s/l) operations. 
-    uint16_t checksum = calculate_checksum(packet, bytes_received);
-
-    header = (D1Header*)packet;
-    header->flags = ntohs(header->flags);
-    header->checksum = ntohs(header->checksum);
-    header->size = ntohl(header->size);
-
-    
+    uint16_t checksum = d1_checksum_iov(iov, 3);
+
+    header.flags = ntohs(header.flags);
+    header.checksum = ntohs(header.checksum);
+    header.size = ntohl(header.size);
+
+    // The peer asks for the windowed mode. Answer it, and wait for the data the caller expects.
+    if (header.flags & FLAG_WND) {
+        char packet[sizeof(D1Header) + sizeof(D1WindowHello)];
+        if ((header.flags & FLAG_WND_HELLO) && checksum == header.checksum && bytes_received == header.size
+            && bytes_received <= (ssize_t)sizeof(packet)) {
+            // Rare, so the hello is simply put back together
+            memcpy(packet, &header, sizeof(D1Header));
+            memcpy(packet + sizeof(D1Header), iov[1].iov_base, iov[1].iov_len);
+            memcpy(packet + sizeof(D1Header) + iov[1].iov_len, spill, iov[2].iov_len);
+            d1_window_accept(peer, packet, bytes_received);
+        }
+        return d1_recv_data(peer, buffer, sz);
+    }
 
-    
-    // check if checksum and size is correct with actual values.
+    // check if checksum and size is correct with actual values. A packet that did not fit
+    // into the caller's buffer counts as corrupted, like before.
     // send ack with correct seqno if correct, else send ack with wrong seqno, this should trigger server to retransmit
-    if ((checksum != header->checksum) | (bytes_received != header->size)) {
-        d1_send_ack(peer, header->flags & SEQNO);
-    } else if (header->flags & FLAG_DATA) {
-        d1_send_ack(peer, !(header->flags & SEQNO));
+    if ((checksum != header.checksum) | (bytes_received != header.size) | (iov[2].iov_len > 0)) {
+        d1_send_ack(peer, header.flags & SEQNO);
+    } else if (header.flags & FLAG_DATA) {
+        d1_send_ack(peer, !(header.flags & SEQNO));
     }
-  
-    memcpy(buffer, packet + sizeof(D1Header), sz);
+
+    // The payload is already in place, never more than the caller's buffer holds
+    int payload = iov[1].iov_len;
    
     print_line(__LINE__, __FILE__, "Received data (d1_recv_data)");
     
-    return bytes_received - sizeof(D1Header);
+    return payload;
 }
 
 /**
  * @brief Waits for an acknowledgment pack from a D1Peer.
  * 
  * Function must always block after sending a data packet or connect packet until it has received the
- * correct ACK. If it receives the wrong ACK or does not receive an ACK within 1 second, it
- * must return -1
+ * correct ACK. If it receives the wrong ACK, the packet is resent right away. If no ACK arrives within
+ * the retransmission timeout of the peer, the packet is resent and the timeout is doubled, and after
+ * D1_MAX_RETRIES timeouts in a row it returns -1.
+ * The round trip time of packets that did not have to be resent updates the RTT estimate of the peer.
  *
  * @param peer The D1Peer to wait for acknowledgment from.
- * @param buffer The buffer to store the received acknowledgment.
- * @param sz The size of the buffer.
+ * @param msg The complete packet, as it was sent by d1_send_datav, for retransmissions.
  * @return Returns 1 if the ack was received and successful, -1 if there is an error or timeout
  */
-int d1_wait_ack(D1Peer* peer, char* buffer, size_t sz) {
+static int d1_wait_ackv(D1Peer* peer, struct msghdr* msg) {
 
     int real_seqno = peer->next_seqno;
-    int pack_received = -1; // -1 means not received
-    //Looks quirky, but it just sets the timeout to 1 second. 
-    setsockopt(peer->socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&(struct timeval){1, 0}, sizeof(struct timeval));
+    int timeouts = 0;
+    int resent = 0; // number of copies sent after the first one
+    long long sent_at = d1_now_us();
+    char received_packet[PACKET_MAX];
     // Helper variable for recvfrom
     socklen_t fromlen = sizeof(peer->addr);
 
-
-    while (pack_received == -1) {
-        char received_packet[sz];
-        ssize_t bytes_received = recvfrom(peer->socket, received_packet, sz + sizeof(D1Header), 0, (struct sockaddr*)&(peer->addr), &fromlen);
-        if(bytes_received == -1) {
-            reset_socket_options(peer);
-            check_error(bytes_received, "timeout, ack not received, is server turned on?", __LINE__, __FILE__);
+    while (1) {
+        // poll instead of SO_RCVTIMEO, so the socket options never have to be touched
+        long long left = sent_at + peer->rto_us - d1_now_us();
+        struct pollfd pfd = { peer->socket, POLLIN, 0 };
+        int ready = left > 0 ? poll(&pfd, 1, (int)((left + 999) / 1000)) : 0;
+        if (ready == -1) {
+            check_error(ready, "poll d1_wait_ack", __LINE__, __FILE__);
             return -1;
         }
 
-        if (bytes_received > 0 ) {
-            pack_received = 1;
-            // ACK received if 8th bit equal to 1 
-            int received_seqno = ((ntohs(received_packet[1]) & (1<<8)) >> 8); 
+        if (ready == 0) {
+            if (++timeouts > D1_MAX_RETRIES) {
+                check_error(-1, "timeout, ack not received, is server turned on?", __LINE__, __FILE__);
+                return -1;
+            }
+            d1_rto_backoff(peer);
+            peer->stale_acks = 0;
+        } else {
+            ssize_t bytes_received = recvfrom(peer->socket, received_packet, PACKET_MAX, 0, (struct sockaddr*)&(peer->addr), &fromlen);
+            if (bytes_received == -1) {
+                check_error(bytes_received, "recvfrom d1_wait_ack", __LINE__, __FILE__);
+                return -1;
+            }
 
-            if (received_seqno != real_seqno) {
-                // If the received ack is not the same as the one we sent, resend the packet. The answer will be read at the first recvfrom in this functiona agin. 
-                int wc = sendto(peer->socket, buffer, sz, 0, (struct sockaddr *)&peer->addr, sizeof(struct sockaddr_in));
-                check_error(-1, "Received ack is not the same as the one we sent", __LINE__, __FILE__);
-                pack_received = -1;
+            // Corrupted packets and anything that is not an ACK are ignored
+            int size = d1_check_packet(received_packet, bytes_received);
+            D1Header* header = (D1Header*)received_packet;
+            if (size == 0 || header->flags & FLAG_WND || !(header->flags & FLAG_ACK)) {
+                continue;
+            }
 
-                if(wc == -1) {
-                    return -1;
+            int received_seqno = header->flags & ACKNO;
+            if (received_seqno == real_seqno) {
+                // Karn's algorithm, a resent packet does not tell which copy was ACKed
+                if (!resent) {
+                    d1_rtt_sample(peer, d1_now_us() - sent_at);
                 }
-            } else {
+                peer->stale_acks = resent;
                 peer->next_seqno = !peer->next_seqno;
-                reset_socket_options(peer);
                 print_line(__LINE__, __FILE__, "Received ack (d1_wait_ack)");
                 return 1; // Return a positive value in case of success
             }
+
+            // The peer ACKs every copy of the previous packet that we resent, and these late ACKs
+            // look like wrong ACKs now. Resending on them would duplicate every following packet.
+            if (peer->stale_acks > 0) {
+                peer->stale_acks--;
+                continue;
+            }
+            // If the received ack is not the same as the one we sent, resend the packet immediately
+            check_error(-1, "Received ack is not the same as the one we sent", __LINE__, __FILE__);
+        }
+
+        int wc = sendmsg(peer->socket, msg, 0);
+        if(wc == -1) {
+            check_error(wc, "sendmsg d1_wait_ack", __LINE__, __FILE__);
+            return -1;
         }
+        peer->retransmits++;
+        resent++;
+        sent_at = d1_now_us();
     }
-    return -1;
 }
 
 /**
- * @brief If the buffer does not exceed the packet size, the function adds the D1 header and sends
- *  it to the peer.
+ * Waits for the ACK of a packet that is in one buffer, see d1_wait_ackv.
  *
- * @param peer    The D1Peer to send the data to.
- * @param buffer  The buffer containing the data to send.
- * @param sz      The size of the data to send.
- * @return        Returns bytes sent on success, or a negative value on failure.
+ * @param peer The D1Peer to wait for acknowledgment from.
+ * @param buffer The complete packet, as it was sent, for retransmissions.
+ * @param sz The size of the packet.
+ * @return Returns 1 if the ack was received and successful, -1 if there is an error or timeout
  */
+int d1_wait_ack(D1Peer* peer, char* buffer, size_t sz) {
+    struct iovec iov = { buffer, sz };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &peer->addr;
+    msg.msg_namelen = sizeof(peer->addr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    return d1_wait_ackv(peer, &msg);
+}
 
-int d1_send_data(D1Peer* peer, char* buffer, size_t sz) {
-    int wc = 0;
-    // TODO: Check if the buffer size exceeds the packet size
-    int size = sz + sizeof(D1Header);
+/**
+ * Sends a data packet whose payload is gathered from several buffers, and waits for its ACK.
+ * The header lives on the stack and sendmsg reads the payload straight from the caller's
+ * buffers, so nothing is allocated or copied.
+ *
+ * @param peer The D1Peer to send the data to.
+ * @param iov The buffers with the payload.
+ * @param iovcnt The number of buffers, at most D1_IOV_MAX.
+ * @return The number of bytes sent, header included, or -1 on failure.
+ */
+int d1_send_datav(D1Peer* peer, const struct iovec* iov, int iovcnt) {
+    if (iovcnt < 0 || iovcnt > D1_IOV_MAX) {
+        check_error(-1, "Too many buffers for d1_send_datav", __LINE__, __FILE__);
+        return -1;
+    }
+
+#ifdef D1_USE_URING
+    if (peer->window <= 1 && d1_uring_ready(peer)) {
+        return d1_uring_send_datav(peer, iov, iovcnt);
+    }
+#endif
+
+    size_t size = sizeof(D1Header);
+    for (int i = 0; i < iovcnt; i++) {
+        size += iov[i].iov_len;
+    }
     if (size > PACKET_MAX) {
         // data and header size exceeds 1024 bytes
         check_error(-1, "Data and header size exceeds 1024 bytes", __LINE__, __FILE__);
         return -1;
     }
 
-    // Create the D1 header
-    D1Header* header = (D1Header*)malloc(sizeof(D1Header));
-    if(header == NULL) {
-        check_error(-1, "Malloc header d1_send_data", __LINE__, __FILE__);
-        return -1;
-    }
-    
-    // Keep it simple, could use bitwise and with peer->next_seqno, but this is way readable. 
-    if(peer->next_seqno) {
-        header->flags = htons(FLAG_DATA |  SEQNO); // Set the data packet flag and seqno if it is one
-    } else {
-        header->flags = htons(FLAG_DATA); // Set the data packet flag
-    }
-    
-    header->size = htonl(size);       // Set the length of the data in network long byte order
-    char newBuffer[size];
+    D1Header header;
+    header.flags = htons(peer->next_seqno ? FLAG_DATA | SEQNO : FLAG_DATA);
+    header.checksum = 0;
+    header.size = htonl(size);
 
-    // Place the header in the "packet", step by step
-    // Else, only the flags will be put in memory, as header is a pointer and only will add flags
-    memcpy(newBuffer, &(header->flags), 2);
-    memcpy(newBuffer + 2, &(header->checksum), 2);
-    memcpy(newBuffer + 4, &(header->size), 4);
+    struct iovec packet[D1_IOV_MAX + 1];
+    packet[0].iov_base = &header;
+    packet[0].iov_len = sizeof(D1Header);
+    memcpy(packet + 1, iov, iovcnt * sizeof(struct iovec));
+    header.checksum = htons(d1_checksum_iov(packet, iovcnt + 1));
 
-    // Place the data in the packet, at place sizeof(header), which means right after the header
-    memcpy(newBuffer + sizeof(header), buffer, sz);
-    
-    // Set the checksum
-    header->checksum= htons(calculate_checksum(newBuffer, size));
-    memcpy(newBuffer + 2, &(header->checksum), 2);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &peer->addr;
+    msg.msg_namelen = sizeof(peer->addr);
+    msg.msg_iov = packet;
+    msg.msg_iovlen = iovcnt + 1;
 
     // SEND THE PACKET
-    int bytes_sent = sendto(peer->socket, newBuffer, size, 0, (struct sockaddr*)&(peer->addr), sizeof(peer->addr));
-    check_error(wc, "sendto", __LINE__, __FILE__);    
+    int bytes_sent = sendmsg(peer->socket, &msg, 0);
+    check_error(bytes_sent, "sendmsg d1_send_datav", __LINE__, __FILE__);
 
-    // Wait for the ack, this goes on forever if there is no ack arriving, but this is what the handout says. 
-    wc = d1_wait_ack(peer, buffer, sz);
-    if(wc == -1) {
-        check_error(wc, "d1_wait_ack", __LINE__, __FILE__);
-        free(header);
+    // Wait for the ack, a lost packet is retransmitted from the same buffers
+    if (d1_wait_ackv(peer, &msg) == -1) {
+        check_error(-1, "d1_wait_ack", __LINE__, __FILE__);
         return -1;
     }
-    
-    print_line(__LINE__, __FILE__, "Sent data (d1_send_data)");
-    free(header);
-    return bytes_sent;
+
+    print_line(__LINE__, __FILE__, "Sent data (d1_send_datav)");
+    return size;
+}
+
+/**
+ * @brief If the buffer does not exceed the packet size, the function adds the D1 header and sends
+ *  it to the peer.
+ *
+ * @param peer    The D1Peer to send the data to.
+ * @param buffer  The buffer containing the data to send.
+ * @param sz      The size of the data to send.
+ * @return        Returns bytes sent on success, or a negative value on failure.
+ */
+
+int d1_send_data(D1Peer* peer, char* buffer, size_t sz) {
+    struct iovec iov = { buffer, sz };
+    return d1_send_datav(peer, &iov, 1);
 }
 
 /**
@@ -349,43 +634,18 @@ int d1_send_data(D1Peer* peer, char* buffer, size_t sz) {
  */
 void d1_send_ack( struct D1Peer* peer, int seqno )
 {
-    
-    int wc = 0;
-    int size = 8;
-
-    // Create the D1 header
-    D1Header* header = (D1Header*)malloc(sizeof(D1Header));
-    if(header == NULL) {
-        check_error(-1, "Malloc header d1_send_ack", __LINE__, __FILE__);
-        return;
-    }
-
     // Keep it simple, could use bitwise and with peer->next_seqno, but this is way readable. 
     // Since the only value seqno can have is 0 or 1, this works:). Dont know why i had to reverse seqno, but it works. 
-    if(!seqno) {
-        header->flags = htons(FLAG_ACK |  ACKNO); // Set the data packet flag and seqno
-    } else {
-        header->flags = htons(FLAG_ACK); // Set the data packet flag
-    }
-
-    header->size = htonl(size);       // Set the length of the data
-    char newBuffer[size];
+    uint16_t flags = seqno ? FLAG_ACK : FLAG_ACK | ACKNO;
 
-    // Place the header in the packet, step by step
-    // Else, only the flags will be put in memory, as header is a pointer and only will add flags
-    memcpy(newBuffer, &(header->flags), 2);
-    memcpy(newBuffer + 2, &(header->checksum), 2);
-    memcpy(newBuffer + 4, &(header->size), 4);
-    // Place the data in the packet, at place sizeof(header), which means right after the header
-    header->checksum= htons(calculate_checksum(newBuffer, size));
-    memcpy(newBuffer + 2, &(header->checksum), 2);
+    // An ACK is just the 8 byte header, built on the stack
+    char packet[sizeof(D1Header)];
+    int size = d1_build_packet(packet, flags, NULL, 0);
 
-    wc = sendto(peer->socket, newBuffer, size, 0, (struct sockaddr*)&(peer->addr), sizeof(peer->addr));
+    int wc = sendto(peer->socket, packet, size, 0, (struct sockaddr*)&(peer->addr), sizeof(peer->addr));
     if(wc == -1) {
         check_error(wc, "sending ack d1_send_ack", __LINE__, __FILE__);
-        free(header); // No stated reason to recursively call send_ack. 
     }
-    free(header);
     print_line(__LINE__, __FILE__, "Sent ack (d1_send_ack)");
 }
 
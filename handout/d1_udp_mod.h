@@ -8,6 +8,73 @@
 #include <inttypes.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <sys/uio.h>
+
+/* The maximum packet size, including the D1Header.
+ */
+#define PACKET_MAX 1024
+
+/* Windowed transfer mode.
+ *
+ * This is an opt-in extension of D1 that uses flag bits that d1_udp.h leaves at 0.
+ * A classic D1 entity ignores packets with these bits, which is what makes the
+ * fallback work: if the peer does not answer the hello, the association stays in
+ * stop-and-wait mode.
+ *
+ * - hello:        flags FLAG_WND | FLAG_WND_HELLO, payload D1WindowHello.
+ * - hello reply:  flags FLAG_WND | FLAG_WND_HELLO | FLAG_ACK, payload D1WindowHello
+ *                 with the window the responder agrees to.
+ * - data:         flags FLAG_WND | FLAG_DATA, a D1WindowData follows the D1Header,
+ *                 then the payload.
+ * - ACK:          flags FLAG_WND | FLAG_ACK, payload D1WindowAck.
+ *
+ * All fields are in network byte order and covered by the regular D1 checksum.
+ */
+#define FLAG_WND        (1 << 14)
+#define FLAG_WND_HELLO  (1 << 13)
+
+/* Upper bound of the window, limited by the 32 bit selective ACK bitmap.
+ */
+#define D1_WINDOW_MAX   32
+
+struct D1WindowHello
+{
+    uint32_t window;    /* number of packets that may be in flight */
+};
+
+struct D1WindowData
+{
+    uint32_t seqno;     /* sequence number of this data packet */
+};
+
+/* cum_ack is the first sequence number the receiver is missing, everything before
+ * it has been received. If bit i of sack is set, the packet cum_ack + i has been
+ * received out of order and is buffered by the receiver.
+ */
+struct D1WindowAck
+{
+    uint32_t cum_ack;
+    uint32_t sack;
+};
+
+typedef struct D1WindowHello D1WindowHello;
+typedef struct D1WindowData  D1WindowData;
+typedef struct D1WindowAck   D1WindowAck;
+
+/* Retransmission timeout.
+ *
+ * Every D1Peer estimates the round trip time from the ACKs of packets that were not
+ * retransmitted (Karn's algorithm) and derives its retransmission timeout (RTO) like
+ * TCP does (RFC 6298): rto = srtt + 4 * rttvar, clamped to [rto_min_us, rto_max_us].
+ * The 4 * rttvar term is never smaller than srtt / 4 + 1 ms, see d1_rtt_sample.
+ * Every timeout doubles the RTO up to rto_max_us, the next RTT sample resets it.
+ * Until the first sample arrives, the RTO is the 1 second of classic D1.
+ * All times are in microseconds.
+ */
+#define D1_RTO_INIT_US  1000000
+#define D1_RTO_MIN_US   20000
+#define D1_RTO_MAX_US   8000000
+#define D1_MAX_RETRIES  6       /* timeouts in a row before a send fails */
 
 /* This structure keeps all information about this client's association
  * with the server in one place.
@@ -19,9 +86,139 @@ struct D1Peer
     int32_t            socket;      /* the peer's UDP socket */
     struct sockaddr_in addr;        /* addr of my peer, initialized to zero */
     int                next_seqno;  /* either 0 or 1, initialized to zero */
+
+    /* RTT estimation, readable for statistics */
+    uint32_t           last_rtt_us;  /* most recent RTT sample, 0 before the first one */
+    uint32_t           srtt_us;      /* smoothed RTT */
+    uint32_t           rttvar_us;    /* RTT variation */
+    uint32_t           rto_us;       /* current retransmission timeout, including backoff */
+    uint32_t           rto_min_us;   /* bounds of rto_us, see d1_set_rto_bounds */
+    uint32_t           rto_max_us;
+    uint32_t           retransmits;  /* number of retransmitted packets */
+    int                stale_acks;   /* ACKs still expected for resent copies of the last packet */
+
+    struct D1EnginePeer* engine;     /* state in the D1Engine that drives this peer, or NULL */
+    struct D1Uring*      uring;      /* io_uring backend, created on first use, see below */
+    int                  uring_off;  /* the io_uring backend could not be set up for this peer */
+
+    /* windowed mode, only used when window > 1 */
+    int                window;       /* negotiated window, 0 or 1 means stop-and-wait */
+    uint32_t           wnd_snd_next; /* sequence number of the next new data packet */
+    uint32_t           wnd_rcv_next; /* next sequence number that is delivered */
+    uint32_t           wnd_rcv_mask; /* bit i set: wnd_rcv_next + i is buffered */
+    uint16_t           wnd_rcv_len[D1_WINDOW_MAX]; /* payload length of buffered packets */
+    char*              wnd_rcv_buf;  /* D1_WINDOW_MAX reorder slots of PACKET_MAX bytes */
 };
 
 typedef struct D1Peer D1Peer;
 
+/* Set the bounds of the retransmission timeout of the peer, in microseconds.
+ * The defaults are D1_RTO_MIN_US and D1_RTO_MAX_US.
+ */
+void d1_set_rto_bounds( D1Peer* peer, uint32_t rto_min_us, uint32_t rto_max_us );
+
+/* Negotiate the windowed mode with the peer. This must be called after
+ * d1_get_peer_info and before any data is exchanged. window is the number of
+ * packets that this side wants to have in flight (at most D1_WINDOW_MAX).
+ * Returns the agreed window, 1 if the peer does not support the windowed mode
+ * (the association continues in stop-and-wait mode), and a negative value in
+ * case of error.
+ */
+int d1_negotiate_window( D1Peer* peer, int window );
+
+/* Send count buffers to the peer as a pipelined stream of data packets, keeping
+ * up to peer->window of them in flight. Only packets that have not been
+ * selectively acknowledged are retransmitted.
+ * Falls back to one d1_send_data per buffer if the windowed mode is not active.
+ * Returns the number of payload bytes sent in case of success, and a negative
+ * value in case of error.
+ */
+int d1_send_window( D1Peer* peer, char** buffers, size_t* sizes, int count );
+
+/* Batched I/O.
+ *
+ * A D1Packet is one complete D1 packet, header included, that is sent to or has been
+ * received from peer. The batch functions move up to D1_BATCH_MAX of them per system
+ * call with sendmmsg/recvmmsg. They do not wait for ACKs, they are the building block
+ * for the windowed mode and for servers that answer many peers at once.
+ */
+#define D1_BATCH_MAX    64
+
+struct D1Packet
+{
+    D1Peer*            peer;   /* destination, or the peer whose socket received it */
+    struct sockaddr_in addr;   /* source address of a received packet */
+    char*              data;   /* the packet, at most PACKET_MAX bytes */
+    int                size;   /* number of bytes in data, 0 if a received packet is corrupted */
+};
+
+typedef struct D1Packet D1Packet;
+
+/* Send count packets. Consecutive packets of peers that share a socket go out in one
+ * sendmmsg call.
+ * Returns the number of packets sent, or a negative value in case of error.
+ */
+int d1_send_batch( D1Packet* packets, int count );
+
+/* Receive up to count packets from the peer's socket with one recvmmsg call, waiting up
+ * to timeout_ms for the first one (-1 blocks, unless the socket is non-blocking). Sizes and checksums are checked, and the
+ * headers are converted to host byte order.
+ * Returns the number of packets received, 0 on timeout, or a negative value in case of
+ * error.
+ */
+int d1_recv_batch( D1Peer* peer, D1Packet* packets, int count, int timeout_ms );
+
+/* Vectored send.
+ * d1_send_datav works like d1_send_data, but the payload is gathered from iovcnt buffers
+ * (at most D1_IOV_MAX). The header is built on the stack, the checksum is computed over
+ * the buffers in place and sendmsg hands them to the kernel, so the payload is never
+ * copied. d1_send_data is a wrapper with a single buffer.
+ * Returns the number of bytes sent, header included, and a negative value in case of
+ * error.
+ */
+#define D1_IOV_MAX 16
+
+int d1_send_datav( D1Peer* peer, const struct iovec* iov, int iovcnt );
+
+/* io_uring backend.
+ * Built with "make D1_BACKEND=uring", d1_send_data/d1_send_datav and d1_recv_data of
+ * stop-and-wait peers go through an io_uring per peer instead of sendto/poll/recvfrom.
+ * Packets are built in registered buffers from a small fixed pool (WRITE_FIXED and
+ * READ_FIXED), and the ACK wait is a read linked to a timeout of rto_us, so sending a packet
+ * and waiting for its ACK is a single io_uring_enter. The ring connects the socket to
+ * peer->addr. If io_uring is not available, the socket code is used.
+ * The functions are always compiled, d1_uring_bench compares both paths.
+ */
+int d1_uring_send_datav( D1Peer* peer, const struct iovec* iov, int iovcnt );
+int d1_uring_recv_data( D1Peer* peer, char* buffer, size_t sz );
+
+/* Set up the ring of the peer if that has not happened yet.
+ * Returns 1 if the peer can use the backend, 0 if not.
+ */
+int d1_uring_ready( D1Peer* peer );
+
+/* Release the ring, called by d1_delete.
+ */
+void d1_uring_delete( D1Peer* peer );
+
+/* The number of io_uring_enter calls made by this process, for benchmarks.
+ */
+long d1_uring_syscalls( );
+
+/* Helpers shared by the D1 sources.
+ */
+void      check_error( int res, char* msg, int line, char* file );
+void      print_line( int line, const char* file, const char* message );
+uint16_t  calculate_checksum( char* newBuffer, int size );
+uint16_t  d1_checksum_iov( const struct iovec* iov, int iovcnt );
+long long d1_now_us( );
+void      d1_rtt_sample( D1Peer* peer, long long rtt_us );
+void      d1_rto_backoff( D1Peer* peer );
+int       d1_build_packet( char* packet, uint16_t flags, char* payload, size_t sz );
+int       d1_check_packet( char* packet, int size );
+int       d1_send_control( D1Peer* peer, uint16_t flags, char* payload, size_t sz );
+int       d1_window_accept( D1Peer* peer, char* packet, int size );
+int       d1_window_recv( D1Peer* peer, char* buffer, size_t sz );
+
 #endif /* D1_UDP_MOD_H */
 
@@ -0,0 +1,435 @@
+/* ======================================================================
+ * io_uring backend of the D1 transport, on the raw system calls (no
+ * liburing): registered buffers, and a read linked to a timeout for the
+ * ACK wait.
+ * ====================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+
+#include "d1_udp.h"
+#include "d1_checksum.h"
+
+
+#define URING_ENTRIES 8
+
+/* The registered buffers, one packet each */
+enum { BUF_TX, BUF_RX, BUF_ACK, URING_BUFS };
+
+/* user_data of the requests */
+enum { TAG_WRITE = 1, TAG_READ, TAG_TIMEOUT, TAG_ACK };
+
+struct D1Uring
+{
+    int                  fd;
+    void*                sq_ptr;
+    size_t               sq_len;
+    void*                cq_ptr;
+    size_t               cq_len;
+    struct io_uring_sqe* sqes;
+    size_t               sqes_len;
+
+    unsigned*            sq_head;
+    unsigned*            sq_tail;
+    unsigned*            sq_mask;
+    unsigned*            sq_array;
+    unsigned*            cq_head;
+    unsigned*            cq_tail;
+    unsigned*            cq_mask;
+    struct io_uring_cqe* cqes;
+
+    unsigned             queued;     /* SQEs not submitted yet */
+    unsigned             inflight;   /* submitted requests without CQE */
+    int                  read_res;   /* result of the last read */
+
+    struct __kernel_timespec timeout;
+    char*                pool;       /* URING_BUFS * PACKET_MAX, registered */
+};
+
+static long syscalls = 0; /* all rings of the process, atomic */
+
+
+/*
+* START HELPER FUNCTIONS
+ */
+
+static int uring_enter(struct D1Uring* ring, unsigned submit, unsigned wait) {
+    __atomic_fetch_add(&syscalls, 1, __ATOMIC_RELAXED);
+    int rc = syscall(__NR_io_uring_enter, ring->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (rc >= 0) {
+        ring->queued -= rc;
+        ring->inflight += rc;
+    }
+    return rc;
+}
+
+/**
+ * Takes the next free SQE and clears it. The ring is never full, every operation waits
+ * for its requests.
+ */
+static struct io_uring_sqe* uring_sqe(struct D1Uring* ring, uint8_t opcode, uint64_t tag) {
+    unsigned tail = *ring->sq_tail + ring->queued;
+    unsigned idx = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->user_data = tag;
+    ring->sq_array[idx] = idx;
+    ring->queued++;
+    return sqe;
+}
+
+/**
+ * Makes the queued SQEs visible to the kernel.
+ */
+static void uring_publish(struct D1Uring* ring) {
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->queued, __ATOMIC_RELEASE);
+}
+
+static void uring_prep_fixed(struct D1Uring* ring, uint8_t opcode, uint64_t tag, int fd, int buf, int len) {
+    struct io_uring_sqe* sqe = uring_sqe(ring, opcode, tag);
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)(ring->pool + buf * PACKET_MAX);
+    sqe->len = len;
+    sqe->buf_index = buf;
+}
+
+/**
+ * Consumes all CQEs that are there. Only the result of the read is of interest, failed
+ * writes show up as missing ACKs.
+ */
+static void uring_reap(struct D1Uring* ring) {
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+        if (cqe->user_data == TAG_READ) {
+            ring->read_res = cqe->res;
+        }
+        ring->inflight--;
+        head++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * Submits the queued requests and waits until every request has completed.
+ *
+ * @return 0 on success, -1 if io_uring_enter failed.
+ */
+static int uring_run(struct D1Uring* ring) {
+    uring_publish(ring);
+    unsigned submit = ring->queued;
+    while (submit > 0 || ring->inflight > 0) {
+        int rc = uring_enter(ring, submit, submit + ring->inflight);
+        if (rc == -1 && errno != EINTR) {
+            check_error(-1, "io_uring_enter", __LINE__, __FILE__);
+            return -1;
+        }
+        submit = ring->queued;
+        uring_reap(ring);
+    }
+    return 0;
+}
+
+/**
+ * Queues a read of the next datagram into BUF_RX, linked to a timeout.
+ *
+ * @param timeout_us The timeout, 0 for none.
+ */
+static void uring_prep_read(D1Peer* peer, long long timeout_us) {
+    struct D1Uring* ring = peer->uring;
+    uring_prep_fixed(ring, IORING_OP_READ_FIXED, TAG_READ, peer->socket, BUF_RX, PACKET_MAX);
+    if (timeout_us > 0) {
+        ring->sqes[(*ring->sq_tail + ring->queued - 1) & *ring->sq_mask].flags |= IOSQE_IO_LINK;
+        ring->timeout.tv_sec = timeout_us / 1000000;
+        ring->timeout.tv_nsec = (timeout_us % 1000000) * 1000;
+        struct io_uring_sqe* sqe = uring_sqe(ring, IORING_OP_LINK_TIMEOUT, TAG_TIMEOUT);
+        sqe->addr = (uint64_t)(uintptr_t)&ring->timeout;
+        sqe->len = 1;
+    }
+}
+
+static struct D1Uring* uring_create(D1Peer* peer) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct D1Uring* ring = (struct D1Uring*)calloc(1, sizeof(struct D1Uring));
+    if (ring == NULL) {
+        close(fd);
+        return NULL;
+    }
+    ring->fd = fd;
+    ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_len = ring->cq_len = ring->sq_len > ring->cq_len ? ring->sq_len : ring->cq_len;
+    }
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cq_ptr = (params.features & IORING_FEAT_SINGLE_MMAP) ? ring->sq_ptr
+        : mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    ring->pool = aligned_alloc(4096, URING_BUFS * PACKET_MAX);
+    if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED || ring->pool == NULL) {
+        check_error(-1, "mmap io_uring", __LINE__, __FILE__);
+        peer->uring = ring;
+        d1_uring_delete(peer);
+        return NULL;
+    }
+
+    char* sq = (char*)ring->sq_ptr;
+    char* cq = (char*)ring->cq_ptr;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    // The fixed buffer pool
+    struct iovec iov[URING_BUFS];
+    for (int i = 0; i < URING_BUFS; i++) {
+        iov[i].iov_base = ring->pool + i * PACKET_MAX;
+        iov[i].iov_len = PACKET_MAX;
+    }
+    // READ_FIXED/WRITE_FIXED carry no address, so the socket talks to the peer only
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov, URING_BUFS) == -1
+        || connect(peer->socket, (struct sockaddr*)&peer->addr, sizeof(peer->addr)) == -1) {
+        check_error(-1, "io_uring_register/connect", __LINE__, __FILE__);
+        peer->uring = ring;
+        d1_uring_delete(peer);
+        return NULL;
+    }
+    return ring;
+}
+
+/**
+ * Builds an ACK in BUF_ACK and queues it, like d1_send_ack.
+ */
+static void uring_prep_ack(D1Peer* peer, int seqno) {
+    char* ack = peer->uring->pool + BUF_ACK * PACKET_MAX;
+    // Same reversed meaning as in d1_send_ack
+    int size = d1_build_packet(ack, seqno ? FLAG_ACK : FLAG_ACK | ACKNO, NULL, 0);
+    uring_prep_fixed(peer->uring, IORING_OP_WRITE_FIXED, TAG_ACK, peer->socket, BUF_ACK, size);
+}
+
+/*
+* END HELPER FUNCTIONS
+ */
+
+/**
+ * Creates the ring of the peer on first use. A failure is remembered, the peer then stays
+ * with the socket code.
+ *
+ * @param peer The peer, d1_get_peer_info must have been called.
+ * @return 1 if the peer has a ring, 0 if not.
+ */
+int d1_uring_ready(D1Peer* peer) {
+    if (peer->uring == NULL && !peer->uring_off) {
+        peer->uring = uring_create(peer);
+        peer->uring_off = peer->uring == NULL;
+    }
+    return peer->uring != NULL;
+}
+
+/**
+ * Releases the ring and its buffer pool.
+ *
+ * @param peer The peer, may have no ring.
+ */
+void d1_uring_delete(D1Peer* peer) {
+    struct D1Uring* ring = peer->uring;
+    if (ring == NULL) {
+        return;
+    }
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_len);
+    }
+    if (ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED) {
+        munmap(ring->sq_ptr, ring->sq_len);
+    }
+    close(ring->fd);
+    free(ring->pool);
+    free(ring);
+    peer->uring = NULL;
+}
+
+/**
+ * @return The number of io_uring_enter calls so far.
+ */
+long d1_uring_syscalls() {
+    return __atomic_load_n(&syscalls, __ATOMIC_RELAXED);
+}
+
+/**
+ * d1_send_datav on the ring. The packet is gathered into the registered send buffer while
+ * its checksum is computed. The write, the read of the answer and its timeout are
+ * submitted together, and one io_uring_enter waits for all three.
+ *
+ * @param peer The D1Peer to send the data to.
+ * @param iov The buffers with the payload.
+ * @param iovcnt The number of buffers.
+ * @return The number of bytes sent, header included, or -1 on failure.
+ */
+int d1_uring_send_datav(D1Peer* peer, const struct iovec* iov, int iovcnt) {
+    if (!d1_uring_ready(peer)) {
+        return -1;
+    }
+    struct D1Uring* ring = peer->uring;
+    char* packet = ring->pool + BUF_TX * PACKET_MAX;
+    char* received = ring->pool + BUF_RX * PACKET_MAX;
+
+    size_t size = sizeof(D1Header);
+    for (int i = 0; i < iovcnt; i++) {
+        size += iov[i].iov_len;
+    }
+    if (size > PACKET_MAX) {
+        check_error(-1, "Data and header size exceeds 1024 bytes", __LINE__, __FILE__);
+        return -1;
+    }
+
+    // Header first, then every buffer is copied and checksummed in one pass
+    D1Header header;
+    header.flags = htons(peer->next_seqno ? FLAG_DATA | SEQNO : FLAG_DATA);
+    header.checksum = 0;
+    header.size = htonl(size);
+    memcpy(packet, &header, sizeof(D1Header));
+    uint16_t checksum = d1_checksum(packet, sizeof(D1Header));
+    size_t offset = sizeof(D1Header);
+    for (int i = 0; i < iovcnt; i++) {
+        uint16_t part = d1_checksum_copy(packet + offset, iov[i].iov_base, iov[i].iov_len);
+        checksum ^= offset % 2 ? (uint16_t)((part << 8) | (part >> 8)) : part;
+        offset += iov[i].iov_len;
+    }
+    ((D1Header*)packet)->checksum = htons(checksum);
+
+    int timeouts = 0;
+    int resent = 0;
+    int send = 1;
+    long long sent_at = 0;
+    while (1) {
+        if (send) {
+            uring_prep_fixed(ring, IORING_OP_WRITE_FIXED, TAG_WRITE, peer->socket, BUF_TX, size);
+            sent_at = d1_now_us();
+            send = 0;
+        }
+        long long left = sent_at + peer->rto_us - d1_now_us();
+        uring_prep_read(peer, left > 0 ? left : 1);
+        if (uring_run(ring) == -1) {
+            return -1;
+        }
+
+        if (ring->read_res == -ECANCELED || ring->read_res == -EINTR) {
+            // The linked timeout fired
+            if (++timeouts > D1_MAX_RETRIES) {
+                check_error(-1, "timeout, ack not received, is server turned on?", __LINE__, __FILE__);
+                return -1;
+            }
+            d1_rto_backoff(peer);
+            peer->stale_acks = 0;
+        } else {
+            // Corrupted packets and anything that is not an ACK are ignored
+            int len = ring->read_res > 0 ? d1_check_packet(received, ring->read_res) : 0;
+            D1Header* header = (D1Header*)received;
+            if (len == 0 || header->flags & FLAG_WND || !(header->flags & FLAG_ACK)) {
+                continue;
+            }
+            if ((header->flags & ACKNO) == peer->next_seqno) {
+                if (!resent) {
+                    d1_rtt_sample(peer, d1_now_us() - sent_at);
+                }
+                peer->stale_acks = resent;
+                peer->next_seqno = !peer->next_seqno;
+                print_line(__LINE__, __FILE__, "Sent data (d1_uring_send_datav)");
+                return size;
+            }
+            if (peer->stale_acks > 0) {
+                peer->stale_acks--;
+                continue;
+            }
+        }
+        peer->retransmits++;
+        resent++;
+        send = 1;
+    }
+}
+
+/**
+ * d1_recv_data on the ring: the datagram is read into the registered receive buffer, and
+ * the ACK is submitted without waiting; its completion is collected by the next call.
+ *
+ * @param peer The D1Peer to receive from.
+ * @param buffer The buffer for the payload.
+ * @param sz The size of the buffer.
+ * @return The number of payload bytes, or -1 on failure.
+ */
+int d1_uring_recv_data(D1Peer* peer, char* buffer, size_t sz) {
+    if (!d1_uring_ready(peer)) {
+        return -1;
+    }
+    struct D1Uring* ring = peer->uring;
+    char* packet = ring->pool + BUF_RX * PACKET_MAX;
+
+    uring_prep_read(peer, 0);
+    if (uring_run(ring) == -1) {
+        return -1;
+    }
+    if (ring->read_res < 0) {
+        check_error(-1, "read d1_uring_recv_data", __LINE__, __FILE__);
+        return -1;
+    }
+
+    int size = d1_check_packet(packet, ring->read_res);
+    D1Header* header = (D1Header*)packet;
+    if (header->flags & FLAG_WND) {
+        if (size > 0 && (header->flags & FLAG_WND_HELLO)) {
+            d1_window_accept(peer, packet, size);
+        }
+        // Once the windowed mode is on, d1_recv_data takes the windowed path
+        return d1_recv_data(peer, buffer, sz);
+    }
+
+    // A packet that does not fit into the caller's buffer counts as corrupted, as in d1_recv_data
+    if (size == 0 || ring->read_res - (int)sizeof(D1Header) > (int)sz) {
+        uring_prep_ack(peer, header->flags & SEQNO);
+    } else if (header->flags & FLAG_DATA) {
+        uring_prep_ack(peer, !(header->flags & SEQNO));
+    }
+    if (ring->queued > 0) {
+        uring_publish(ring);
+        if (uring_enter(ring, ring->queued, 0) == -1) {
+            check_error(-1, "io_uring_enter", __LINE__, __FILE__);
+            return -1;
+        }
+    }
+
+    // Same as d1_recv_data: whatever arrived is returned, never more than fits
+    int payload = ring->read_res - (int)sizeof(D1Header);
+    if (payload > (int)sz) {
+        payload = sz;
+    }
+    if (payload > 0) {
+        memcpy(buffer, packet + sizeof(D1Header), payload);
+    }
+    print_line(__LINE__, __FILE__, "Received data (d1_uring_recv_data)");
+    return payload < 0 ? 0 : payload;
+}
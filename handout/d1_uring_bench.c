@@ -0,0 +1,148 @@
+/* ======================================================================
+ * System calls and CPU time per packet of the io_uring backend compared
+ * with the socket code, for sending (with the ACK wait) and receiving
+ * (with the ACK) stop-and-wait packets on the loopback interface.
+ *
+ * A forked process is the other end. The socket functions the D1 code
+ * calls are wrapped below to count them; the io_uring backend counts its
+ * io_uring_enter calls itself.
+ *
+ * Usage: d1_uring_bench [packets]
+ * ====================================================================== */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+#include "d1_udp.h"
+
+#define OTHER_PORT 23411
+#define PAYLOAD    100
+
+static long socket_calls = 0;
+
+/* Counting wrappers. libhe.a is linked statically, so its calls end up here. */
+#define WRAP(ret, name, params, args)                          \
+    ret name params {                                          \
+        static ret (*real) params = NULL;                      \
+        if (real == NULL) {                                    \
+            real = (ret (*) params)dlsym(RTLD_NEXT, #name);    \
+        }                                                      \
+        socket_calls++;                                        \
+        return real args;                                      \
+    }
+
+WRAP(ssize_t, sendto, (int fd, const void* buf, size_t len, int flags, const struct sockaddr* addr, socklen_t addrlen), (fd, buf, len, flags, addr, addrlen))
+WRAP(ssize_t, recvfrom, (int fd, void* buf, size_t len, int flags, struct sockaddr* addr, socklen_t* addrlen), (fd, buf, len, flags, addr, addrlen))
+WRAP(ssize_t, sendmsg, (int fd, const struct msghdr* msg, int flags), (fd, msg, flags))
+WRAP(ssize_t, recvmsg, (int fd, struct msghdr* msg, int flags), (fd, msg, flags))
+WRAP(int, poll, (struct pollfd* fds, nfds_t nfds, int timeout), (fds, nfds, timeout))
+
+static D1Peer* bound_peer(uint16_t port) {
+    D1Peer* peer = d1_create_client();
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (peer == NULL || bind(peer->socket, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        perror("bind");
+        exit(1);
+    }
+    return peer;
+}
+
+static double cpu_us() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e6 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/* The other end: for both backends, receive the packets and send them back. */
+static void run_other(int packets) {
+    D1Peer* peer = bound_peer(OTHER_PORT);
+    peer->uring_off = 1;
+    char buffer[PACKET_MAX];
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < packets; i++) {
+            d1_recv_data(peer, buffer, sizeof(buffer));
+        }
+        for (int i = 0; i < packets; i++) {
+            d1_send_data(peer, buffer, PAYLOAD);
+        }
+    }
+    d1_delete(peer);
+    exit(0);
+}
+
+static void measure(const char* name, D1Peer* peer, int packets, int uring) {
+    char payload[PAYLOAD];
+    char buffer[PACKET_MAX];
+    memset(payload, 'x', sizeof(payload));
+    struct iovec iov = { payload, sizeof(payload) };
+
+    long calls = socket_calls + d1_uring_syscalls();
+    double cpu = cpu_us();
+    for (int i = 0; i < packets; i++) {
+        if ((uring ? d1_uring_send_datav(peer, &iov, 1) : d1_send_data(peer, payload, sizeof(payload))) < 0) {
+            printf("send failed\n");
+            return;
+        }
+    }
+    double send_calls = (double)(socket_calls + d1_uring_syscalls() - calls) / packets;
+    double send_cpu = (cpu_us() - cpu) / packets;
+
+    calls = socket_calls + d1_uring_syscalls();
+    cpu = cpu_us();
+    for (int i = 0; i < packets; i++) {
+        if ((uring ? d1_uring_recv_data(peer, buffer, sizeof(buffer)) : d1_recv_data(peer, buffer, sizeof(buffer))) < 0) {
+            printf("receive failed\n");
+            return;
+        }
+    }
+    double recv_calls = (double)(socket_calls + d1_uring_syscalls() - calls) / packets;
+    double recv_cpu = (cpu_us() - cpu) / packets;
+
+    printf("%-8s %14.2f %14.2f %14.2f %14.2f\n", name, send_calls, send_cpu, recv_calls, recv_cpu);
+}
+
+int main(int argc, char* argv[]) {
+    int packets = argc > 1 ? atoi(argv[1]) : 20000;
+
+    pid_t child = fork();
+    if (child == 0) {
+        run_other(packets);
+    }
+    usleep(100000);
+
+    D1Peer* sockets = bound_peer(0);
+    sockets->uring_off = 1; // the socket code, also in a D1_BACKEND=uring build
+    d1_get_peer_info(sockets, "127.0.0.1", OTHER_PORT);
+
+    D1Peer* uring = bound_peer(0);
+    d1_get_peer_info(uring, "127.0.0.1", OTHER_PORT);
+    if (!d1_uring_ready(uring)) {
+        printf("io_uring is not available\n");
+        kill(child, SIGKILL);
+        return 1;
+    }
+
+    printf("%d packets of %d bytes each way\n", packets, PAYLOAD);
+    printf("%-8s %14s %14s %14s %14s\n", "", "send syscalls", "send CPU us", "recv syscalls", "recv CPU us");
+    measure("sockets", sockets, packets, 0);
+    measure("io_uring", uring, packets, 1);
+
+    waitpid(child, NULL, 0);
+    d1_delete(sockets);
+    d1_delete(uring);
+    return 0;
+}
@@ -0,0 +1,484 @@
+/* ======================================================================
+ * Windowed (pipelined) transfer mode for D1. See d1_udp_mod.h for the
+ * packet formats.
+ * ====================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "d1_udp.h"
+
+
+#define D1_HELLO_TIMEOUT_US 200000 /* old peers never answer the hello, don't wait too long */
+#define D1_HELLO_TRIES      3
+#define D1_RECV_BATCH       16   /* packets drained per recvmmsg */
+
+
+/*
+* START HELPER FUNCTIONS
+ */
+
+/**
+ * Sends the cumulative and selective ACK that describes the receive state of the peer.
+ *
+ * @param peer The D1Peer whose receive state is acknowledged.
+ */
+static void d1_window_send_ack(D1Peer* peer) {
+    // Packets that are buffered in order, but not delivered yet, count as received
+    uint32_t mask = peer->wnd_rcv_mask;
+    int in_order = (~mask == 0) ? 32 : __builtin_ctz(~mask);
+
+    D1WindowAck ack;
+    ack.cum_ack = htonl(peer->wnd_rcv_next + in_order);
+    ack.sack = htonl(in_order == 32 ? 0 : mask >> in_order);
+    d1_send_control(peer, FLAG_WND | FLAG_ACK, (char*)&ack, sizeof(ack));
+}
+
+/**
+ * Builds the data packet with the given sequence number.
+ *
+ * @param packet The packet buffer, PACKET_MAX bytes.
+ * @param seqno The sequence number of the packet.
+ * @param buffer The payload.
+ * @param sz The size of the payload.
+ * @return The size of the packet, or -1 if it is too big.
+ */
+static int d1_window_build_packet(char* packet, uint32_t seqno, char* buffer, size_t sz) {
+    if (sz + sizeof(D1Header) + sizeof(D1WindowData) > PACKET_MAX) {
+        check_error(-1, "Data and header size exceeds 1024 bytes", __LINE__, __FILE__);
+        return -1;
+    }
+    D1WindowData data;
+    data.seqno = htonl(seqno);
+    memcpy(packet + sizeof(D1Header), &data, sizeof(data));
+    memcpy(packet + sizeof(D1Header) + sizeof(data), buffer, sz);
+    return d1_build_packet(packet, FLAG_WND | FLAG_DATA, NULL, sz + sizeof(data));
+}
+
+/**
+ * Stores a windowed data packet in the reorder buffer, unless it is a duplicate or outside
+ * the window.
+ *
+ * @param peer The D1Peer that received the packet.
+ * @param packet The packet, header in host byte order.
+ * @param size The size of the packet.
+ */
+static void d1_window_store(D1Peer* peer, char* packet, int size) {
+    if (size < (int)(sizeof(D1Header) + sizeof(D1WindowData))) {
+        return;
+    }
+
+    D1WindowData data;
+    memcpy(&data, packet + sizeof(D1Header), sizeof(data));
+    uint32_t seqno = ntohl(data.seqno);
+    uint32_t offset = seqno - peer->wnd_rcv_next;
+
+    if (offset < (uint32_t)peer->window && !(peer->wnd_rcv_mask & (1u << offset))) {
+        int slot = seqno % D1_WINDOW_MAX;
+        int len = size - sizeof(D1Header) - sizeof(D1WindowData);
+        memcpy(peer->wnd_rcv_buf + slot * PACKET_MAX, packet + sizeof(D1Header) + sizeof(D1WindowData), len);
+        peer->wnd_rcv_len[slot] = len;
+        peer->wnd_rcv_mask |= 1u << offset;
+    }
+}
+
+/**
+ * Switches the peer to the windowed mode and allocates the reorder buffer.
+ *
+ * @param peer The D1Peer.
+ * @param window The agreed window.
+ * @return 1 on success, -1 if the memory could not be allocated.
+ */
+static int d1_window_enable(D1Peer* peer, int window) {
+    if (peer->wnd_rcv_buf == NULL) {
+        peer->wnd_rcv_buf = (char*)malloc(D1_WINDOW_MAX * PACKET_MAX);
+        if (peer->wnd_rcv_buf == NULL) {
+            check_error(-1, "Malloc reorder buffer d1_window_enable", __LINE__, __FILE__);
+            return -1;
+        }
+    }
+    peer->window = window;
+    peer->wnd_snd_next = 0;
+    peer->wnd_rcv_next = 0;
+    peer->wnd_rcv_mask = 0;
+    return 1;
+}
+
+/*
+* END HELPER FUNCTIONS
+ */
+
+/**
+ * Sends a hello to the peer and waits for the reply. Old peers ignore the hello, so after
+ * D1_HELLO_TRIES unanswered attempts the association stays in stop-and-wait mode.
+ *
+ * @param peer The D1Peer, d1_get_peer_info must have been called.
+ * @param window The number of packets this side wants in flight.
+ * @return The agreed window, 1 for stop-and-wait, or -1 on failure.
+ */
+int d1_negotiate_window(D1Peer* peer, int window) {
+    if (window > D1_WINDOW_MAX) {
+        window = D1_WINDOW_MAX;
+    }
+    if (window <= 1) {
+        peer->window = 1;
+        return 1;
+    }
+
+    D1WindowHello hello;
+    hello.window = htonl(window);
+    char packet[PACKET_MAX];
+    D1Packet reply_packet = { .data = packet };
+
+    for (int tries = 0; tries < D1_HELLO_TRIES; tries++) {
+        if (d1_send_control(peer, FLAG_WND | FLAG_WND_HELLO, (char*)&hello, sizeof(hello)) == -1) {
+            return -1;
+        }
+
+        long long sent_at = d1_now_us();
+        long long left;
+        while ((left = sent_at + D1_HELLO_TIMEOUT_US - d1_now_us()) > 0) {
+            int n = d1_recv_batch(peer, &reply_packet, 1, (int)((left + 999) / 1000));
+            if (n == -1) {
+                return -1;
+            }
+            if (n == 0) {
+                break;
+            }
+            int size = reply_packet.size;
+
+            D1Header* header = (D1Header*)packet;
+            uint16_t reply = FLAG_WND | FLAG_WND_HELLO | FLAG_ACK;
+            if (size == sizeof(D1Header) + sizeof(D1WindowHello) && header->flags == reply) {
+                if (tries == 0) {
+                    d1_rtt_sample(peer, d1_now_us() - sent_at);
+                }
+                D1WindowHello agreed;
+                memcpy(&agreed, packet + sizeof(D1Header), sizeof(agreed));
+                int agreed_window = ntohl(agreed.window);
+                if (agreed_window < window) {
+                    window = agreed_window;
+                }
+                if (window <= 1) {
+                    peer->window = 1;
+                    return 1;
+                }
+                if (d1_window_enable(peer, window) == -1) {
+                    return -1;
+                }
+                print_line(__LINE__, __FILE__, "Negotiated window (d1_negotiate_window)");
+                return window;
+            }
+        }
+    }
+
+    // No answer, the peer only speaks classic D1
+    peer->window = 1;
+    print_line(__LINE__, __FILE__, "Peer has no windowed mode (d1_negotiate_window)");
+    return 1;
+}
+
+/**
+ * Answers a hello that has arrived from the peer. Called by d1_recv_data.
+ * A repeated hello (our reply got lost) is answered again without resetting the state.
+ *
+ * @param peer The D1Peer that received the hello.
+ * @param packet The packet, header already in host byte order.
+ * @param size The size of the packet.
+ * @return The agreed window, or -1 on failure.
+ */
+int d1_window_accept(D1Peer* peer, char* packet, int size) {
+    if (size < (int)(sizeof(D1Header) + sizeof(D1WindowHello))) {
+        return -1;
+    }
+
+    D1WindowHello hello;
+    memcpy(&hello, packet + sizeof(D1Header), sizeof(hello));
+    int window = ntohl(hello.window);
+    if (window > D1_WINDOW_MAX) {
+        window = D1_WINDOW_MAX;
+    }
+
+    if (peer->window <= 1 && window > 1) {
+        if (d1_window_enable(peer, window) == -1) {
+            window = 1;
+        }
+    } else if (peer->window > 1) {
+        window = peer->window;
+    }
+
+    hello.window = htonl(window);
+    d1_send_control(peer, FLAG_WND | FLAG_WND_HELLO | FLAG_ACK, (char*)&hello, sizeof(hello));
+    print_line(__LINE__, __FILE__, "Accepted window (d1_window_accept)");
+    return window;
+}
+
+/**
+ * The receive path of d1_recv_data in windowed mode. Packets are drained from the socket in
+ * batches, kept in the reorder buffer and handed to the caller in order. One ACK per batch
+ * tells the sender what has arrived. Classic data packets are still accepted, so that the
+ * peer can mix d1_send_data and d1_send_window.
+ *
+ * Only when nothing can be delivered from the reorder buffer does this function receive,
+ * so the sender can never get more than one window ahead of the buffer.
+ *
+ * @param peer The D1Peer to receive from.
+ * @param buffer The buffer to store the payload in.
+ * @param sz The size of the buffer.
+ * @return The number of payload bytes, or -1 on failure.
+ */
+int d1_window_recv(D1Peer* peer, char* buffer, size_t sz) {
+    char storage[D1_RECV_BATCH][PACKET_MAX];
+    D1Packet packets[D1_RECV_BATCH];
+    for (int i = 0; i < D1_RECV_BATCH; i++) {
+        packets[i].data = storage[i];
+    }
+
+    while (1) {
+        // The next packet may already be waiting in the reorder buffer
+        if (peer->wnd_rcv_mask & 1) {
+            int slot = peer->wnd_rcv_next % D1_WINDOW_MAX;
+            int len = peer->wnd_rcv_len[slot];
+            if (len > (int)sz) {
+                len = sz;
+            }
+            memcpy(buffer, peer->wnd_rcv_buf + slot * PACKET_MAX, len);
+            peer->wnd_rcv_next++;
+            peer->wnd_rcv_mask >>= 1;
+            print_line(__LINE__, __FILE__, "Received windowed data (d1_window_recv)");
+            return len;
+        }
+
+        int n = d1_recv_batch(peer, packets, D1_RECV_BATCH, -1);
+        if (n == -1) {
+            return -1;
+        }
+
+        int need_ack = 0;
+        int classic_len = -1;
+        for (int i = 0; i < n; i++) {
+            char* packet = packets[i].data;
+            int size = packets[i].size;
+            D1Header* header = (D1Header*)packet;
+
+            if (size == 0) {
+                // Corrupted. A classic sender needs the wrong ACK, a windowed one only our state.
+                if (header->flags & FLAG_WND) {
+                    need_ack = 1;
+                } else if (header->flags & FLAG_DATA) {
+                    d1_send_ack(peer, header->flags & SEQNO);
+                }
+            } else if ((header->flags & FLAG_WND) && (header->flags & FLAG_WND_HELLO)) {
+                if (!(header->flags & FLAG_ACK)) {
+                    d1_window_accept(peer, packet, size);
+                }
+            } else if (!(header->flags & FLAG_DATA)) {
+                continue;
+            } else if (!(header->flags & FLAG_WND)) {
+                // Classic data packet, handled like d1_recv_data does
+                d1_send_ack(peer, !(header->flags & SEQNO));
+                if (classic_len == -1) {
+                    classic_len = size - sizeof(D1Header);
+                    if (classic_len > (int)sz) {
+                        classic_len = sz;
+                    }
+                    memcpy(buffer, packet + sizeof(D1Header), classic_len);
+                }
+            } else {
+                d1_window_store(peer, packet, size);
+                need_ack = 1;
+            }
+        }
+
+        if (need_ack) {
+            d1_window_send_ack(peer);
+        }
+        if (classic_len >= 0) {
+            return classic_len;
+        }
+    }
+}
+
+/**
+ * Sends the buffers as a stream of windowed data packets. New packets and retransmissions go
+ * out in batches, and all ACKs that have arrived are drained at once. Every packet has its
+ * own retransmission deadline that follows the RTO of the peer, and only the packets that
+ * the peer has neither cumulatively nor selectively ACKed are sent again when their deadline
+ * passes. A hole below a selectively ACKed packet is resent right away, once.
+ *
+ * @param peer The D1Peer to send to.
+ * @param buffers The payloads.
+ * @param sizes The sizes of the payloads.
+ * @param count The number of buffers.
+ * @return The number of payload bytes sent, or -1 on failure.
+ */
+int d1_send_window(D1Peer* peer, char** buffers, size_t* sizes, int count) {
+    int total = 0;
+
+    if (peer->window <= 1) {
+        for (int i = 0; i < count; i++) {
+            if (d1_send_data(peer, buffers[i], sizes[i]) < 0) {
+                return -1;
+            }
+            total += sizes[i];
+        }
+        return total;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (sizes[i] + sizeof(D1Header) + sizeof(D1WindowData) > PACKET_MAX) {
+            check_error(-1, "Data and header size exceeds 1024 bytes", __LINE__, __FILE__);
+            return -1;
+        }
+    }
+
+    // Per in-flight packet state, indexed by buffer index modulo D1_WINDOW_MAX.
+    // The built packets are kept for retransmission.
+    char      built[D1_WINDOW_MAX][PACKET_MAX];
+    int       built_size[D1_WINDOW_MAX];
+    long long sent_at[D1_WINDOW_MAX];
+    int       tries[D1_WINDOW_MAX];
+    int       sacked[D1_WINDOW_MAX];
+    int       fast_resent[D1_WINDOW_MAX];
+
+    D1Packet  out[D1_WINDOW_MAX];
+    char      ack_storage[D1_RECV_BATCH][PACKET_MAX];
+    D1Packet  acks[D1_RECV_BATCH];
+    for (int i = 0; i < D1_RECV_BATCH; i++) {
+        acks[i].data = ack_storage[i];
+    }
+
+    uint32_t base = peer->wnd_snd_next;
+    int acked = 0;  // every buffer before this index is ACKed
+    int next = 0;   // the next buffer that has not been sent yet
+
+    while (acked < count) {
+        // Fill the window with one batch
+        int n_out = 0;
+        long long now = d1_now_us();
+        while (next < count && next - acked < peer->window) {
+            int slot = next % D1_WINDOW_MAX;
+            built_size[slot] = d1_window_build_packet(built[slot], base + next, buffers[next], sizes[next]);
+            sent_at[slot] = now;
+            tries[slot] = 0;
+            sacked[slot] = 0;
+            fast_resent[slot] = 0;
+            out[n_out].peer = peer;
+            out[n_out].data = built[slot];
+            out[n_out].size = built_size[slot];
+            n_out++;
+            next++;
+        }
+        if (n_out > 0 && d1_send_batch(out, n_out) == -1) {
+            return -1;
+        }
+
+        long long earliest = now + peer->rto_us;
+        for (int i = acked; i < next; i++) {
+            int slot = i % D1_WINDOW_MAX;
+            if (!sacked[slot] && sent_at[slot] + peer->rto_us < earliest) {
+                earliest = sent_at[slot] + peer->rto_us;
+            }
+        }
+
+        now = d1_now_us();
+        int n = d1_recv_batch(peer, acks, D1_RECV_BATCH, earliest > now ? (int)((earliest - now + 999) / 1000) : 0);
+        if (n == -1) {
+            return -1;
+        }
+
+        n_out = 0;
+        for (int k = 0; k < n; k++) {
+            char* packet = acks[k].data;
+            int size = acks[k].size;
+            D1Header* header = (D1Header*)packet;
+            if (size == (int)(sizeof(D1Header) + sizeof(D1WindowAck)) && header->flags == (FLAG_WND | FLAG_ACK)) {
+                D1WindowAck ack;
+                memcpy(&ack, packet + sizeof(D1Header), sizeof(ack));
+                uint32_t cum = ntohl(ack.cum_ack) - base;
+                uint32_t sack = ntohl(ack.sack);
+                if (cum > (uint32_t)next) {
+                    continue; // stale or bogus
+                }
+                if ((int)cum > acked) {
+                    // Karn's algorithm, only packets that were sent once give an RTT sample
+                    int slot = (cum - 1) % D1_WINDOW_MAX;
+                    if (tries[slot] == 0) {
+                        d1_rtt_sample(peer, d1_now_us() - sent_at[slot]);
+                    }
+                    acked = cum;
+                }
+                int highest = 0;
+                for (int i = 1; i < 32 && (int)cum + i < next; i++) {
+                    if (sack & (1u << i)) {
+                        sacked[(cum + i) % D1_WINDOW_MAX] = 1;
+                        highest = cum + i;
+                    }
+                }
+                // Packets below the highest selectively ACKed one are most likely lost
+                for (int i = acked; i < highest; i++) {
+                    int slot = i % D1_WINDOW_MAX;
+                    if (!sacked[slot] && !fast_resent[slot] && n_out < D1_WINDOW_MAX) {
+                        fast_resent[slot] = 1;
+                        tries[slot]++;
+                        sent_at[slot] = d1_now_us();
+                        out[n_out].peer = peer;
+                        out[n_out].data = built[slot];
+                        out[n_out].size = built_size[slot];
+                        n_out++;
+                    }
+                }
+            } else if (size > 0 && (header->flags & FLAG_WND_HELLO) && !(header->flags & FLAG_ACK)) {
+                d1_window_accept(peer, packet, size);
+            }
+        }
+        if (n > 0) {
+            if (n_out > 0) {
+                if (d1_send_batch(out, n_out) == -1) {
+                    return -1;
+                }
+                peer->retransmits += n_out;
+            }
+            continue;
+        }
+
+        // Timeout, back off and retransmit what is still missing
+        d1_rto_backoff(peer);
+        now = d1_now_us();
+        for (int i = acked; i < next; i++) {
+            int slot = i % D1_WINDOW_MAX;
+            if (sacked[slot] || sent_at[slot] + peer->rto_us / 2 > now) {
+                continue;
+            }
+            if (++tries[slot] > D1_MAX_RETRIES) {
+                check_error(-1, "timeout, ack not received, is server turned on?", __LINE__, __FILE__);
+                peer->wnd_snd_next = base + acked;
+                return -1;
+            }
+            sent_at[slot] = now;
+            out[n_out].peer = peer;
+            out[n_out].data = built[slot];
+            out[n_out].size = built_size[slot];
+            n_out++;
+        }
+        if (n_out > 0) {
+            if (d1_send_batch(out, n_out) == -1) {
+                return -1;
+            }
+            peer->retransmits += n_out;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        total += sizes[i];
+    }
+    peer->wnd_snd_next = base + count;
+    print_line(__LINE__, __FILE__, "Sent windowed data (d1_send_window)");
+    return total;
+}
@@ -0,0 +1,194 @@
+/* ======================================================================
+ * Goodput of the windowed mode compared with stop-and-wait, for a range
+ * of round trip times.
+ *
+ * The program forks a receiver, and puts a relay thread between sender and
+ * receiver that delays every packet by half the round trip time in each
+ * direction, and optionally drops a percentage of them. Everything runs on the
+ * loopback interface.
+ *
+ * Usage: d1_window_bench [messages] [window] [loss percent]
+ * ====================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+#include "d1_udp.h"
+
+#define RECEIVER_PORT 23401
+#define RELAY_PORT    23402
+#define PAYLOAD       1000
+#define RELAY_QUEUE   1024
+
+struct RelayPacket
+{
+    long long due_us;
+    int       to_receiver;
+    int       len;
+    char      data[PACKET_MAX];
+};
+
+static struct RelayPacket queue[RELAY_QUEUE];
+static volatile int relay_delay_us;
+static int relay_loss_percent;
+
+static long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int bind_socket(uint16_t port) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (sock == -1 || bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        perror("bind");
+        exit(1);
+    }
+    return sock;
+}
+
+/* Forwards packets between the sender (talking to RELAY_PORT) and the receiver,
+ * holding each of them back for half the round trip time.
+ */
+static void* relay(void* arg) {
+    (void)arg;
+    int front = bind_socket(RELAY_PORT);
+    int back = bind_socket(0);
+    struct sockaddr_in sender;
+    struct sockaddr_in receiver;
+    memset(&sender, 0, sizeof(sender));
+    memset(&receiver, 0, sizeof(receiver));
+    receiver.sin_family = AF_INET;
+    receiver.sin_port = htons(RECEIVER_PORT);
+    receiver.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int head = 0;
+    int tail = 0;
+    while (1) {
+        int timeout = -1;
+        if (head != tail) {
+            long long left = queue[head].due_us - now_us();
+            timeout = left > 0 ? (int)((left + 999) / 1000) : 0;
+        }
+
+        struct pollfd pfd[2] = { { front, POLLIN, 0 }, { back, POLLIN, 0 } };
+        poll(pfd, 2, timeout);
+        for (int i = 0; i < 2; i++) {
+            if (!(pfd[i].revents & POLLIN) || (tail + 1) % RELAY_QUEUE == head) {
+                continue;
+            }
+            struct RelayPacket* p = &queue[tail];
+            socklen_t fromlen = sizeof(sender);
+            if (i == 0) {
+                p->len = recvfrom(front, p->data, PACKET_MAX, 0, (struct sockaddr*)&sender, &fromlen);
+            } else {
+                p->len = recv(back, p->data, PACKET_MAX, 0);
+            }
+            if (rand() % 100 < relay_loss_percent) {
+                continue;
+            }
+            p->to_receiver = (i == 0);
+            p->due_us = now_us() + relay_delay_us / 2;
+            tail = (tail + 1) % RELAY_QUEUE;
+        }
+
+        while (head != tail && queue[head].due_us <= now_us()) {
+            struct RelayPacket* p = &queue[head];
+            if (p->to_receiver) {
+                sendto(back, p->data, p->len, 0, (struct sockaddr*)&receiver, sizeof(receiver));
+            } else {
+                sendto(front, p->data, p->len, 0, (struct sockaddr*)&sender, sizeof(sender));
+            }
+            head = (head + 1) % RELAY_QUEUE;
+        }
+    }
+    return NULL;
+}
+
+/* Receives forever, the parent kills this process when it is done.
+ */
+static void run_receiver() {
+    D1Peer* peer = d1_create_client();
+    close(peer->socket);
+    peer->socket = bind_socket(RECEIVER_PORT);
+    char buffer[PACKET_MAX];
+    while (d1_recv_data(peer, buffer, sizeof(buffer)) >= 0) {
+    }
+    d1_delete(peer);
+    exit(0);
+}
+
+int main(int argc, char* argv[]) {
+    int messages = argc > 1 ? atoi(argv[1]) : 200;
+    int window = argc > 2 ? atoi(argv[2]) : D1_WINDOW_MAX;
+    relay_loss_percent = argc > 3 ? atoi(argv[3]) : 0;
+    int rtts_ms[] = { 0, 1, 5, 10, 20 };
+
+    pid_t child = fork();
+    if (child == 0) {
+        run_receiver();
+    }
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, relay, NULL);
+    usleep(100000);
+
+    D1Peer* peer = d1_create_client();
+    if (!peer || !d1_get_peer_info(peer, "127.0.0.1", RELAY_PORT)) {
+        kill(child, SIGKILL);
+        return 1;
+    }
+    int agreed = d1_negotiate_window(peer, window);
+
+    char payload[PAYLOAD];
+    memset(payload, 'x', sizeof(payload));
+    char** buffers = malloc(messages * sizeof(char*));
+    size_t* sizes = malloc(messages * sizeof(size_t));
+    for (int i = 0; i < messages; i++) {
+        buffers[i] = payload;
+        sizes[i] = sizeof(payload);
+    }
+
+    printf("%d messages of %d bytes, window %d, loss %d%%\n", messages, PAYLOAD, agreed, relay_loss_percent);
+    printf("%8s %20s %20s %8s\n", "rtt ms", "stop-and-wait KB/s", "windowed KB/s", "speedup");
+    for (size_t r = 0; r < sizeof(rtts_ms) / sizeof(rtts_ms[0]); r++) {
+        relay_delay_us = rtts_ms[r] * 1000;
+
+        long long start = now_us();
+        for (int i = 0; i < messages; i++) {
+            if (d1_send_data(peer, payload, sizeof(payload)) < 0) {
+                break;
+            }
+        }
+        double saw = (double)messages * PAYLOAD / 1024 / ((now_us() - start) / 1e6);
+
+        start = now_us();
+        d1_send_window(peer, buffers, sizes, messages);
+        double wnd = (double)messages * PAYLOAD / 1024 / ((now_us() - start) / 1e6);
+
+        printf("%8d %20.0f %20.0f %7.1fx   srtt %u us, rto %u us, %u retransmits\n", rtts_ms[r], saw, wnd, wnd / saw,
+               peer->srtt_us, peer->rto_us, peer->retransmits);
+    }
+
+    free(buffers);
+    free(sizes);
+    d1_delete(peer);
+    kill(child, SIGKILL);
+    waitpid(child, NULL, 0);
+    return 0;
+}
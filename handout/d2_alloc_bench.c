@@ -0,0 +1,187 @@
+/* ======================================================================
+ * Counts the heap allocations per lookup once a client is warmed up, and
+ * fails if a lookup with an arena (d2_arena.h) allocates at all.
+ *
+ * malloc, calloc, realloc and free are wrapped below and counted while a
+ * measurement runs. The lookups cycle through a fixed set of ids that the
+ * warm-up has already looked up, so an arena has reached its size.
+ *
+ * Usage: d2_alloc_bench <server> <port> [lookups]
+ *   The server must answer several requests per association, e.g.
+ *   d2_shard_server.
+ * ====================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "d2_lookup.h"
+#include "d2_mux.h"
+#include "d2_arena.h"
+
+#define IDS   200
+#define BATCH 64
+
+static long mallocs = 0;   /* malloc, calloc and realloc */
+static long frees = 0;
+static int  counting = 0;
+
+/* Counting wrappers. libhe.a is linked statically, so its calls end up here; glibc's own
+ * functions do the work.
+ */
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* p, size_t size);
+extern void  __libc_free(void* p);
+
+void* malloc(size_t size) {
+    mallocs += counting;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) {
+    mallocs += counting;
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* p, size_t size) {
+    mallocs += counting;
+    return __libc_realloc(p, size);
+}
+
+void free(void* p) {
+    frees += counting && p != NULL;
+    __libc_free(p);
+}
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static uint32_t id_of(int i) {
+    return 1001 + (uint32_t)(i % IDS) * 7919 % 100000;
+}
+
+/* One lookup with the functions of d2_lookup.h, like d2_test_client. The tree comes from
+ * the arena if there is one.
+ */
+static int classic_lookup(D2Client* client, D2Arena* arena, uint32_t id) {
+    if (d2_send_request(client, id) <= 0) {
+        return -1;
+    }
+    int size = d2_recv_response_size(client);
+    if (size <= 0) {
+        return size;
+    }
+    LocalTreeStore* tree = arena ? d2_arena_tree(arena, size) : d2_alloc_local_tree(size);
+    char buffer[PACKET_MAX];
+    int node_idx = 0;
+    for (;;) {
+        int len = d2_recv_response(client, buffer, PACKET_MAX);
+        if (len <= 0 || tree == NULL) {
+            return -1;
+        }
+        node_idx = d2_add_to_local_tree(tree, node_idx, buffer + sizeof(PacketResponse), len - sizeof(PacketResponse));
+        if (ntohs(((PacketHeader*)buffer)->type) == TYPE_LAST_RESPONSE) {
+            break;
+        }
+    }
+    int ok = tree->filled == size;
+    if (arena) {
+        d2_arena_reset(arena);
+    } else {
+        d2_free_local_tree(tree);
+    }
+    return ok ? 0 : -1;
+}
+
+/* n lookups with d2_lookup_tagged, batch ids per call. */
+static int tagged_lookups(D2Client* client, D2Arena* arena, int first, int n, int batch) {
+    LocalTreeStore* trees[BATCH];
+    uint32_t ids[BATCH];
+    client->arena = arena;
+    for (int i = first; i < first + n; i += batch) {
+        for (int k = 0; k < batch; k++) {
+            ids[k] = id_of(i + k);
+        }
+        if (d2_lookup_tagged(client, ids, batch, trees) != batch) {
+            return -1;
+        }
+        if (arena) {
+            d2_arena_reset(arena);
+        } else {
+            for (int k = 0; k < batch; k++) {
+                d2_free_local_tree(trees[k]);
+            }
+        }
+    }
+    client->arena = NULL;
+    return 0;
+}
+
+/* Runs a scenario: a warm-up over all ids, then n counted lookups.
+ * Returns the mallocs per lookup, or -1 if a lookup failed.
+ */
+static double measure(const char* label, D2Client* client, D2Arena* arena, int mode, int n) {
+    int batch = mode == 2 ? BATCH : 1;
+    for (int round = 0; round < 2; round++) {
+        int count = round == 0 ? IDS : n;
+        mallocs = 0;
+        frees = 0;
+        counting = round;
+        double start = now_us();
+        int res = 0;
+        if (mode == 0) {
+            for (int i = 0; i < count && res == 0; i++) {
+                res = classic_lookup(client, arena, id_of(i));
+            }
+        } else {
+            res = tagged_lookups(client, arena, 0, count, batch);
+        }
+        double took = now_us() - start;
+        counting = 0;
+        if (res != 0) {
+            printf("%s: a lookup failed\n", label);
+            return -1;
+        }
+        if (round == 1) {
+            printf("%-40s %10.2f %10.2f %10.1f\n", label, (double)mallocs / n, (double)frees / n, took / n);
+        }
+    }
+    return (double)mallocs / n;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <server> <port> [lookups]\n", argv[0]);
+        return 1;
+    }
+    int n = argc > 3 ? atoi(argv[3]) : 2000;
+    n = (n + BATCH - 1) / BATCH * BATCH;
+
+    D2Client* client = d2_client_create(argv[1], atoi(argv[2]));
+    D2Arena* arena = d2_arena_create(64 << 10);
+    if (client == NULL || arena == NULL) {
+        return 1;
+    }
+    printf("%d lookups, per lookup                     %10s %10s %10s\n", n, "mallocs", "frees", "us");
+    double heap = measure("d2_lookup.h, d2_alloc_local_tree", client, NULL, 0, n);
+    double arena_classic = measure("d2_lookup.h, d2_arena_tree", client, arena, 0, n);
+    double tagged = measure("d2_lookup_tagged, 1 id, heap trees", client, NULL, 1, n);
+    double arena_tagged = measure("d2_lookup_tagged, 1 id, arena", client, arena, 1, n);
+    double arena_batch = measure("d2_lookup_tagged, 64 ids, arena", client, arena, 2, n);
+    printf("arena: %zu bytes\n", d2_arena_bytes(arena));
+
+    d2_arena_delete(arena);
+    d2_client_delete(client);
+    if (heap < 0 || tagged < 0 || arena_classic != 0 || arena_tagged != 0 || arena_batch != 0) {
+        printf("FAILED: lookups with an arena must not allocate\n");
+        return 1;
+    }
+    printf("lookups with an arena do not allocate\n");
+    return 0;
+}
@@ -0,0 +1,173 @@
+/* ======================================================================
+ * D2 arena: bump allocation of lookup trees, released in one shot.
+ * ====================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "d2_arena.h"
+
+
+#define ARENA_ALIGN 16
+
+struct ArenaChunk
+{
+    struct ArenaChunk* next;      /* the chunk filled before this one */
+    size_t             size;      /* bytes in data */
+    size_t             used;
+    char               data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+struct D2Arena
+{
+    struct ArenaChunk* chunks;    /* the current chunk, the older ones follow */
+    size_t             bytes;     /* of all chunks */
+};
+
+/*
+* START HELPER FUNCTIONS
+ */
+
+/**
+ * @brief Allocates an empty chunk and makes it the current one.
+ *
+ * @return 0 on success, or -1 if there is no memory.
+ */
+static int arena_grow(D2Arena* arena, size_t size) {
+    struct ArenaChunk* chunk = malloc(sizeof(struct ArenaChunk) + size);
+    if (chunk == NULL) {
+        return -1;
+    }
+    chunk->next = arena->chunks;
+    chunk->size = size;
+    chunk->used = 0;
+    arena->chunks = chunk;
+    arena->bytes += size;
+    return 0;
+}
+
+static void free_chunks(struct ArenaChunk* chunk) {
+    while (chunk != NULL) {
+        struct ArenaChunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+}
+
+/*
+* END HELPER FUNCTIONS
+ */
+
+/**
+ * @brief Creates an arena with one chunk.
+ *
+ * @param chunk_bytes The size of the first chunk.
+ * @return The arena, or NULL on failure.
+ */
+D2Arena* d2_arena_create(size_t chunk_bytes) {
+    D2Arena* arena = calloc(1, sizeof(D2Arena));
+    if (arena == NULL || arena_grow(arena, chunk_bytes > 0 ? chunk_bytes : ARENA_ALIGN) == -1) {
+        free(arena);
+        check_error_d2(-1, "Failed to allocate memory for D2Arena", __LINE__, __FILE__);
+        return NULL;
+    }
+    return arena;
+}
+
+/**
+ * @brief Frees the arena with all its chunks.
+ *
+ * @param arena The arena, can be NULL.
+ * @return Always NULL.
+ */
+D2Arena* d2_arena_delete(D2Arena* arena) {
+    if (arena != NULL) {
+        free_chunks(arena->chunks);
+        free(arena);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Takes zeroed bytes from the current chunk, or from a new one that is at least
+ * twice as large.
+ *
+ * @param arena The arena.
+ * @param len The number of bytes.
+ * @return The bytes, or NULL if there is no memory.
+ */
+void* d2_arena_alloc(D2Arena* arena, size_t len) {
+    len = (len + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    struct ArenaChunk* chunk = arena->chunks;
+    if (chunk->size - chunk->used < len) {
+        size_t size = chunk->size * 2 > len ? chunk->size * 2 : len;
+        if (arena_grow(arena, size) == -1) {
+            check_error_d2(-1, "Failed to allocate memory for D2Arena", __LINE__, __FILE__);
+            return NULL;
+        }
+        chunk = arena->chunks;
+    }
+    void* p = chunk->data + chunk->used;
+    chunk->used += len;
+    memset(p, 0, len);
+    return p;
+}
+
+/**
+ * @brief Allocates a tree and its arrays in one piece, laid out like the block of
+ * d2_alloc_local_tree.
+ *
+ * @param arena The arena.
+ * @param num_nodes The number of nodes.
+ * @return The tree, or NULL on failure.
+ */
+LocalTreeStore* d2_arena_tree(D2Arena* arena, int num_nodes) {
+    if (num_nodes < 0) {
+        fprintf(stderr, "Invalid input parameters.\n");
+        return NULL;
+    }
+    size_t len = sizeof(LocalTreeStore) + (size_t)num_nodes * (2 * sizeof(uint32_t) + sizeof(uint8_t));
+    LocalTreeStore* tree = d2_arena_alloc(arena, len);
+    if (tree == NULL) {
+        return NULL;
+    }
+    tree->number_of_nodes = num_nodes;
+    tree->arena = 1;
+    tree->value = (uint32_t*)(tree + 1);
+    tree->subtree_end = tree->value + num_nodes;
+    tree->num_children = (uint8_t*)(tree->subtree_end + num_nodes);
+    return tree;
+}
+
+/**
+ * @brief Releases all allocations. If the arena had to grow since the last reset, its
+ * chunks are replaced by one chunk of their total size.
+ *
+ * @param arena The arena.
+ */
+void d2_arena_reset(D2Arena* arena) {
+    if (arena->chunks->next != NULL) {
+        size_t bytes = arena->bytes;
+        struct ArenaChunk* old = arena->chunks;
+        arena->chunks = NULL;
+        arena->bytes = 0;
+        if (arena_grow(arena, bytes) == 0) {
+            free_chunks(old);
+        } else {
+            arena->chunks = old; // keep the chunks, the current one is the largest
+            arena->bytes = bytes;
+        }
+    }
+    arena->chunks->used = 0;
+}
+
+/**
+ * @brief The memory the arena holds.
+ *
+ * @param arena The arena.
+ * @return The bytes of all chunks.
+ */
+size_t d2_arena_bytes(const D2Arena* arena) {
+    return arena->bytes;
+}
@@ -0,0 +1,50 @@
+#ifndef D2_ARENA_H
+#define D2_ARENA_H
+
+#include "d2_lookup.h"
+
+/* An arena for the trees of lookups, so that a stream of lookups does not allocate.
+ *
+ * d2_arena_tree carves a tree (the LocalTreeStore and its arrays) out of the arena's
+ * memory with a bump pointer. d2_arena_reset releases all trees of the arena in one
+ * shot and keeps the memory for the next ones. When a chunk runs out, a new one is
+ * allocated; the next reset replaces all chunks by one that is as large as all of them
+ * together, so after a few lookups of a similar size the arena never allocates again.
+ *
+ * A D2Client with client->arena set takes the trees of d2_lookup_tagged (d2_mux.h) from
+ * the arena. Trees of an arena have tree->arena set; d2_free_local_tree leaves them
+ * alone, and they must not go to d2_cache_put. They stay valid until the next reset.
+ *
+ * An arena is used by one thread at a time.
+ */
+
+typedef struct D2Arena D2Arena;
+
+/* Create an arena whose first chunk has chunk_bytes.
+ * Returns NULL in case of failure.
+ */
+D2Arena* d2_arena_create( size_t chunk_bytes );
+
+/* Free the arena and all trees in it.
+ * Returns always NULL.
+ */
+D2Arena* d2_arena_delete( D2Arena* arena );
+
+/* Returns len zeroed bytes, aligned to 16, or NULL if there is no memory.
+ */
+void* d2_arena_alloc( D2Arena* arena, size_t len );
+
+/* Allocate an empty tree of num_nodes nodes, like d2_alloc_local_tree.
+ * Returns NULL in case of failure.
+ */
+LocalTreeStore* d2_arena_tree( D2Arena* arena, int num_nodes );
+
+/* Release everything allocated from the arena.
+ */
+void d2_arena_reset( D2Arena* arena );
+
+/* Returns the memory the arena holds, in bytes.
+ */
+size_t d2_arena_bytes( const D2Arena* arena );
+
+#endif /* D2_ARENA_H */
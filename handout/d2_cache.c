@@ -0,0 +1,377 @@
+/* ======================================================================
+ * D2 tree cache: sharded, reference counted, CLOCK eviction, TTL.
+ * ====================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "d2_cache.h"
+#include "d2_mux.h"
+
+
+#define SHARD_BUCKETS 64 /* initial size of a shard's hash table, a power of two */
+
+/* A cached tree. The LocalTreeStore comes first, so the references handed out can be
+ * cast back.
+ */
+struct D2CacheEntry
+{
+    LocalTreeStore       tree;
+    LocalTreeStore*      block;       /* the tree from d2_alloc_local_tree, one block with the nodes */
+    int                  refs;        /* the cache's and the callers' references, atomic */
+    uint32_t             id;
+    int                  referenced;  /* CLOCK bit, set by hits */
+    int                  slot;        /* position in the shard's clock ring */
+    long long            expires_us;  /* 0: never */
+    size_t               bytes;
+    struct D2CacheEntry* next;        /* next entry in the same bucket */
+};
+
+struct CacheShard
+{
+    pthread_mutex_t       lock;
+    struct D2CacheEntry** buckets;
+    int                   nbuckets;
+    struct D2CacheEntry** ring;       /* all entries of the shard, swept by the hand */
+    int                   nring;
+    int                   ring_cap;
+    int                   hand;
+    size_t                bytes;
+    size_t                budget;
+    long                  hits;
+    long                  misses;
+    long                  evictions;
+    long                  expirations;
+} __attribute__((aligned(64)));       /* no false sharing between the locks */
+
+struct D2Cache
+{
+    uint32_t          ttl_ms;
+    struct CacheShard shards[D2_CACHE_SHARDS];
+};
+
+/*
+* START HELPER FUNCTIONS
+ */
+
+static uint32_t hash_id(uint32_t id) {
+    return id * 2654435761u;
+}
+
+/**
+ * @brief The shard of an id, from the top bits of its hash (the buckets use the low ones).
+ */
+static struct CacheShard* shard_of(D2Cache* cache, uint32_t id) {
+    return &cache->shards[hash_id(id) >> 28 & (D2_CACHE_SHARDS - 1)];
+}
+
+/**
+ * @brief Drops one reference to an entry and frees it with the last one.
+ */
+static void entry_unref(struct D2CacheEntry* e) {
+    if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(e->block); // and with it the nodes, see d2_free_local_tree
+        free(e);
+    }
+}
+
+/**
+ * @brief Finds the entry of an id in a shard. The shard must be locked.
+ *
+ * @param shard The shard.
+ * @param id The id.
+ * @param link Set to the link that points to the entry (or to the end of its bucket).
+ * @return The entry, or NULL.
+ */
+static struct D2CacheEntry* shard_find(struct CacheShard* shard, uint32_t id, struct D2CacheEntry*** link) {
+    *link = &shard->buckets[hash_id(id) & (shard->nbuckets - 1)];
+    while (**link != NULL && (**link)->id != id) {
+        *link = &(**link)->next;
+    }
+    return **link;
+}
+
+/**
+ * @brief Takes an entry out of the shard and drops the cache's reference. The shard must
+ * be locked.
+ */
+static void shard_remove(struct CacheShard* shard, struct D2CacheEntry* e) {
+    struct D2CacheEntry** link;
+    shard_find(shard, e->id, &link);
+    *link = e->next;
+
+    // The last entry of the ring takes the place of the removed one
+    struct D2CacheEntry* last = shard->ring[--shard->nring];
+    shard->ring[e->slot] = last;
+    last->slot = e->slot;
+
+    shard->bytes -= e->bytes;
+    entry_unref(e);
+}
+
+/**
+ * @brief Doubles the hash table of a shard. The shard must be locked.
+ *
+ * @return 0 on success, or -1 if there is no memory, then the table stays as it is.
+ */
+static int shard_grow(struct CacheShard* shard) {
+    int nbuckets = shard->nbuckets * 2;
+    struct D2CacheEntry** buckets = calloc(nbuckets, sizeof(struct D2CacheEntry*));
+    if (buckets == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < shard->nring; i++) {
+        struct D2CacheEntry* e = shard->ring[i];
+        uint32_t b = hash_id(e->id) & (nbuckets - 1);
+        e->next = buckets[b];
+        buckets[b] = e;
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->nbuckets = nbuckets;
+    return 0;
+}
+
+/**
+ * @brief Runs the CLOCK hand until the shard is within its budget. The shard must be
+ * locked.
+ */
+static void shard_evict(struct CacheShard* shard) {
+    while (shard->bytes > shard->budget && shard->nring > 0) {
+        if (shard->hand >= shard->nring) {
+            shard->hand = 0;
+        }
+        struct D2CacheEntry* e = shard->ring[shard->hand];
+        if (e->referenced) {
+            e->referenced = 0; // a second chance
+            shard->hand++;
+        } else {
+            shard_remove(shard, e); // the hand now points at the entry moved into the slot
+            shard->evictions++;
+        }
+    }
+}
+
+/**
+ * @brief Adds a new entry to a shard, replacing an entry of the same id. The shard must
+ * be locked.
+ *
+ * @return 0 on success, or -1 if there is no memory.
+ */
+static int shard_insert(struct CacheShard* shard, struct D2CacheEntry* e) {
+    struct D2CacheEntry** link;
+    struct D2CacheEntry* old = shard_find(shard, e->id, &link);
+    if (old != NULL) {
+        shard_remove(shard, old);
+    }
+    if (shard->nring == shard->ring_cap) {
+        int cap = shard->ring_cap ? shard->ring_cap * 2 : SHARD_BUCKETS;
+        struct D2CacheEntry** ring = realloc(shard->ring, cap * sizeof(struct D2CacheEntry*));
+        if (ring == NULL) {
+            return -1;
+        }
+        shard->ring = ring;
+        shard->ring_cap = cap;
+    }
+    if (shard->nring >= shard->nbuckets) {
+        shard_grow(shard); // only slower chains if it fails
+    }
+
+    shard_find(shard, e->id, &link);
+    e->next = NULL;
+    *link = e;
+    e->slot = shard->nring;
+    shard->ring[shard->nring++] = e;
+    shard->bytes += e->bytes;
+    shard_evict(shard);
+    return 0;
+}
+
+/*
+* END HELPER FUNCTIONS
+ */
+
+/**
+ * @brief Creates an empty cache.
+ *
+ * @param budget_bytes The memory budget, split evenly over the shards.
+ * @param ttl_ms The lifetime of entries in milliseconds, 0 for no expiry.
+ * @return The cache, or NULL on failure.
+ */
+D2Cache* d2_cache_create(size_t budget_bytes, uint32_t ttl_ms) {
+    D2Cache* cache = aligned_alloc(64, sizeof(D2Cache));
+    if (cache == NULL) {
+        check_error_d2(-1, "Failed to allocate memory for D2Cache", __LINE__, __FILE__);
+        return NULL;
+    }
+    memset(cache, 0, sizeof(D2Cache));
+    cache->ttl_ms = ttl_ms;
+
+    for (int i = 0; i < D2_CACHE_SHARDS; i++) {
+        struct CacheShard* shard = &cache->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->budget = budget_bytes / D2_CACHE_SHARDS;
+        shard->nbuckets = SHARD_BUCKETS;
+        shard->buckets = calloc(SHARD_BUCKETS, sizeof(struct D2CacheEntry*));
+        if (shard->buckets == NULL) {
+            check_error_d2(-1, "Failed to allocate memory for D2Cache", __LINE__, __FILE__);
+            return d2_cache_delete(cache);
+        }
+    }
+    return cache;
+}
+
+/**
+ * @brief Drops the cache's references and frees the cache.
+ *
+ * @param cache The cache, can be NULL.
+ * @return Always NULL.
+ */
+D2Cache* d2_cache_delete(D2Cache* cache) {
+    if (cache == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < D2_CACHE_SHARDS; i++) {
+        struct CacheShard* shard = &cache->shards[i];
+        for (int j = 0; j < shard->nring; j++) {
+            entry_unref(shard->ring[j]);
+        }
+        free(shard->ring);
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(cache);
+    return NULL;
+}
+
+/**
+ * @brief Looks up an id. A hit sets the entry's CLOCK bit and takes a reference; an
+ * expired entry is dropped and counts as a miss.
+ *
+ * @param cache The cache.
+ * @param id The id.
+ * @return A reference to the tree, or NULL.
+ */
+const LocalTreeStore* d2_cache_get(D2Cache* cache, uint32_t id) {
+    struct CacheShard* shard = shard_of(cache, id);
+    struct D2CacheEntry** link;
+
+    pthread_mutex_lock(&shard->lock);
+    struct D2CacheEntry* e = shard_find(shard, id, &link);
+    if (e != NULL && e->expires_us != 0 && d1_now_us() >= e->expires_us) {
+        shard_remove(shard, e);
+        shard->expirations++;
+        e = NULL;
+    }
+    if (e == NULL) {
+        shard->misses++;
+        pthread_mutex_unlock(&shard->lock);
+        return NULL;
+    }
+    e->referenced = 1;
+    __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+    shard->hits++;
+    pthread_mutex_unlock(&shard->lock);
+    return &e->tree;
+}
+
+/**
+ * @brief Takes over a tree and caches it.
+ *
+ * @param cache The cache.
+ * @param id The id of the tree.
+ * @param tree The tree from d2_alloc_local_tree, owned by the cache afterwards.
+ * @return A reference to the tree, or NULL on failure.
+ */
+const LocalTreeStore* d2_cache_put(D2Cache* cache, uint32_t id, LocalTreeStore* tree) {
+    if (tree == NULL || tree->arena) {
+        return NULL;
+    }
+    struct D2CacheEntry* e = malloc(sizeof(struct D2CacheEntry));
+    if (e == NULL) {
+        check_error_d2(-1, "Failed to allocate memory for a cache entry", __LINE__, __FILE__);
+        d2_free_local_tree(tree);
+        return NULL;
+    }
+    e->tree = *tree;
+    e->block = tree; // the nodes are in its block, it belongs to the entry now
+    e->id = id;
+    e->referenced = 1;
+    e->bytes = sizeof(struct D2CacheEntry) - sizeof(LocalTreeStore) + d2_tree_bytes(&e->tree);
+    e->expires_us = cache->ttl_ms ? d1_now_us() + cache->ttl_ms * 1000LL : 0;
+
+    struct CacheShard* shard = shard_of(cache, id);
+    e->refs = 1; // the caller's
+    if (e->bytes > shard->budget) {
+        return &e->tree; // too large, only the caller holds it
+    }
+
+    e->refs = 2;
+    pthread_mutex_lock(&shard->lock);
+    if (shard_insert(shard, e) == -1) {
+        e->refs = 1;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return &e->tree;
+}
+
+/**
+ * @brief Gives back a reference.
+ *
+ * @param tree The tree, can be NULL.
+ */
+void d2_cache_release(const LocalTreeStore* tree) {
+    if (tree != NULL) {
+        entry_unref((struct D2CacheEntry*)tree);
+    }
+}
+
+/**
+ * @brief Gets a tree from the cache, or looks it up on a pooled session and caches it.
+ *
+ * @param cache The cache.
+ * @param pool The pool to take a session from on a miss.
+ * @param server_name The name of the server.
+ * @param server_port The port of the server.
+ * @param id The id.
+ * @return A reference to the tree, or NULL if it could not be looked up.
+ */
+const LocalTreeStore* d2_cache_fetch(D2Cache* cache, D2Pool* pool, const char* server_name,
+                                     uint16_t server_port, uint32_t id) {
+    const LocalTreeStore* cached = d2_cache_get(cache, id);
+    if (cached != NULL) {
+        return cached;
+    }
+
+    D2Client* client = d2_pool_checkout(pool, server_name, server_port);
+    if (client == NULL) {
+        return NULL;
+    }
+    LocalTreeStore* tree = NULL;
+    d2_lookup_tagged(client, &id, 1, &tree);
+    d2_pool_return(pool, client);
+    return d2_cache_put(cache, id, tree);
+}
+
+/**
+ * @brief Sums the counters of all shards.
+ *
+ * @param cache The cache.
+ * @param stats Where to store the sums.
+ */
+void d2_cache_stats(D2Cache* cache, D2CacheStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < D2_CACHE_SHARDS; i++) {
+        struct CacheShard* shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->expirations += shard->expirations;
+        stats->entries += shard->nring;
+        stats->bytes += shard->bytes;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
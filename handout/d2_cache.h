@@ -0,0 +1,80 @@
+#ifndef D2_CACHE_H
+#define D2_CACHE_H
+
+#include "d2_pool.h"
+
+/* A client-side cache of decoded trees, keyed by lookup id.
+ *
+ * Cached trees are immutable and reference counted. d2_cache_get and d2_cache_put hand
+ * out a reference, which the caller gives back with d2_cache_release (never with
+ * d2_free_local_tree). A tree stays valid as long as someone holds a reference, also
+ * after the cache has evicted or replaced it.
+ *
+ * The cache holds at most budget_bytes of trees, counting the nodes and the bookkeeping.
+ * It is split into D2_CACHE_SHARDS shards by id, each with its own lock, its own share of
+ * the budget and its own CLOCK hand: a hit only sets the entry's referenced bit, and when
+ * a shard is over budget, the hand sweeps its entries, clears the referenced bits and
+ * evicts the first entry whose bit was already clear (the ones not hit since the last
+ * sweep). Entries older than the TTL are dropped when they are found.
+ *
+ * All functions can be called from any number of threads.
+ */
+
+#define D2_CACHE_SHARDS 16
+
+typedef struct D2Cache D2Cache;
+
+struct D2CacheStats
+{
+    long   hits;
+    long   misses;       /* including lookups of expired entries */
+    long   evictions;    /* entries dropped to stay within the budget */
+    long   expirations;  /* entries dropped because they were older than the TTL */
+    long   entries;
+    size_t bytes;
+};
+
+typedef struct D2CacheStats D2CacheStats;
+
+/* Create a cache for up to budget_bytes of trees. Entries expire ttl_ms after they were
+ * put, 0 means never.
+ * Returns NULL in case of failure.
+ */
+D2Cache* d2_cache_create( size_t budget_bytes, uint32_t ttl_ms );
+
+/* Drop the cache's references to all trees and free the cache. Trees that callers still
+ * hold stay valid until they are released.
+ * Returns always NULL.
+ */
+D2Cache* d2_cache_delete( D2Cache* cache );
+
+/* Get a reference to the tree of id.
+ * Returns NULL if the id is not cached or has expired.
+ */
+const LocalTreeStore* d2_cache_get( D2Cache* cache, uint32_t id );
+
+/* Put the tree of id into the cache, replacing an older one. The cache takes over the
+ * tree, which must come from d2_alloc_local_tree and must not be used or freed by the
+ * caller afterwards. A tree larger than a shard's budget is not cached. A tree of a
+ * D2Arena is refused, NULL is returned and it stays in its arena.
+ * Returns a reference to the tree as it is stored now, or NULL in case of failure (then
+ * the tree has been freed).
+ */
+const LocalTreeStore* d2_cache_put( D2Cache* cache, uint32_t id, LocalTreeStore* tree );
+
+/* Give back a reference from d2_cache_get, d2_cache_put or d2_cache_fetch. NULL is
+ * ignored.
+ */
+void d2_cache_release( const LocalTreeStore* tree );
+
+/* Get the tree of id from the cache, or look it up with a session from pool and cache it.
+ * Returns a reference to the tree, or NULL if the lookup failed.
+ */
+const LocalTreeStore* d2_cache_fetch( D2Cache* cache, D2Pool* pool, const char* server_name,
+                                      uint16_t server_port, uint32_t id );
+
+/* Copy the counters of all shards into stats.
+ */
+void d2_cache_stats( D2Cache* cache, D2CacheStats* stats );
+
+#endif /* D2_CACHE_H */
@@ -0,0 +1,106 @@
+/* ======================================================================
+ * Cost of a d2_cache hit (get and release) from one and from several
+ * threads, and, with a server, of a miss that goes over the network.
+ *
+ * Usage: d2_cache_bench [threads] [server port]
+ *   The server must answer several requests per association, e.g.
+ *   d2_shard_server.
+ * ====================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "d2_cache.h"
+
+#define HOT_IDS   1000
+#define GETS      2000000
+
+static D2Cache* cache;
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void* run_gets(void* arg) {
+    unsigned seed = (unsigned)(long)arg;
+    long found = 0;
+    for (int i = 0; i < GETS; i++) {
+        const LocalTreeStore* tree = d2_cache_get(cache, 1001 + rand_r(&seed) % HOT_IDS);
+        found += tree != NULL;
+        d2_cache_release(tree);
+    }
+    return (void*)found;
+}
+
+/* Wall time per get of all threads together.
+ */
+static double measure_gets(int threads) {
+    pthread_t pool[64];
+    double start = now_ns();
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&pool[i], NULL, run_gets, (void*)(long)(i + 1));
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(pool[i], NULL);
+    }
+    return (now_ns() - start) / ((double)GETS * threads);
+}
+
+int main(int argc, char* argv[]) {
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    if (threads < 1 || threads > 64) {
+        threads = 4;
+    }
+
+    // Trees of 50 nodes, the whole hot set fits into the budget
+    cache = d2_cache_create(64 << 20, 0);
+    for (uint32_t id = 1001; id < 1001 + HOT_IDS; id++) {
+        d2_cache_release(d2_cache_put(cache, id, d2_alloc_local_tree(50)));
+    }
+
+    printf("%-32s %10s\n", "", "ns per get");
+    printf("%-32s %10.1f\n", "hit, 1 thread", measure_gets(1));
+    char label[64];
+    snprintf(label, sizeof(label), "hit, %d threads", threads);
+    printf("%-32s %10.1f\n", label, measure_gets(threads));
+
+    if (argc > 3) {
+        D2Pool* pool = d2_pool_create(4);
+        int misses = 200;
+        double start = now_ns();
+        for (int i = 0; i < misses; i++) {
+            d2_cache_release(d2_cache_fetch(cache, pool, argv[2], atoi(argv[3]), 200001 + i));
+        }
+        printf("%-32s %10.1f\n", "miss, looked up at the server", (now_ns() - start) / misses);
+        start = now_ns();
+        for (int i = 0; i < misses; i++) {
+            d2_cache_release(d2_cache_fetch(cache, pool, argv[2], atoi(argv[3]), 200001 + i));
+        }
+        printf("%-32s %10.1f\n", "d2_cache_fetch, hit", (now_ns() - start) / misses);
+        d2_pool_delete(pool);
+    }
+
+    // A budget for a tenth of the hot set makes the CLOCK hand work
+    D2Cache* all = cache;
+    cache = d2_cache_create(HOT_IDS / 10 * (50 * 9 + 128), 0);
+    for (int i = 0; i < 100000; i++) {
+        uint32_t id = 1001 + rand() % HOT_IDS;
+        const LocalTreeStore* tree = d2_cache_get(cache, id);
+        if (tree == NULL) {
+            tree = d2_cache_put(cache, id, d2_alloc_local_tree(50));
+        }
+        d2_cache_release(tree);
+    }
+
+    D2CacheStats stats;
+    d2_cache_stats(cache, &stats);
+    printf("\nsmall budget: %ld hits, %ld misses, %ld evictions, %ld entries, %zu bytes\n",
+           stats.hits, stats.misses, stats.evictions, stats.entries, stats.bytes);
+    d2_cache_delete(cache);
+    d2_cache_delete(all);
+    return 0;
+}
@@ -0,0 +1,228 @@
+/* ======================================================================
+ * NetNode decoding kernels: scalar, SSSE3 and AVX2, picked at runtime.
+ * ====================================================================== */
+
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define D2_DECODE_X86 1
+#endif
+
+#include "d2_decode.h"
+
+/* id, value and num_children */
+#define NODE_BASE_SIZE (3 * (int)sizeof(uint32_t))
+
+
+/*
+* START HELPER FUNCTIONS
+ */
+
+static uint32_t load_be32(const char* p) {
+    uint32_t w;
+    memcpy(&w, p, sizeof(w)); // unaligned load
+    return ntohl(w);
+}
+
+/**
+ * Decodes one node with all checks, and says what is wrong if one fails.
+ *
+ * @param store The LocalTreeStore.
+ * @param node_idx The index the node goes to.
+ * @param buffer The node, in network byte order.
+ * @param left The bytes left in the buffer, at least NODE_BASE_SIZE.
+ * @return The size of the node in bytes, or -1 if it is malformed.
+ */
+static int scalar_node(LocalTreeStore* store, int node_idx, const char* buffer, int left) {
+    uint32_t id = load_be32(buffer);
+    uint32_t value = load_be32(buffer + 4);
+    uint32_t num_children = load_be32(buffer + 8);
+
+    if ((uint64_t)num_children * sizeof(uint32_t) > (uint64_t)(left - NODE_BASE_SIZE)) {
+        fprintf(stderr, "Not enough data for children IDs.\n");
+        return -1;
+    }
+    if (node_idx >= store->number_of_nodes) {
+        fprintf(stderr, "More nodes than the response size announced.\n");
+        return -1;
+    }
+    // The layout relies on ids in depth first order, with the first child right after its parent
+    if (id != (uint32_t)node_idx || num_children > 5 || (num_children > 0 && load_be32(buffer + 12) != id + 1)) {
+        fprintf(stderr, "Node ids are not in depth first order.\n");
+        return -1;
+    }
+    store->value[node_idx] = value;
+    store->num_children[node_idx] = num_children;
+    return NODE_BASE_SIZE + num_children * sizeof(uint32_t);
+}
+
+static int scalar_decode(LocalTreeStore* store, int node_idx, const char* buffer, int buflen) {
+    int pos = 0;
+    while (buflen - pos >= NODE_BASE_SIZE) {
+        int size = scalar_node(store, node_idx, buffer + pos, buflen - pos);
+        if (size == -1) {
+            return -1;
+        }
+        pos += size;
+        node_idx++;
+    }
+    return node_idx;
+}
+
+#ifdef D2_DECODE_X86
+
+/* One case of the switch in fast_node: a node with nc children is 3 + nc words, so its
+ * size is a constant here, and its first child has to follow it. */
+#define NODE_CASE(nc)                                                               \
+    case nc:                                                                        \
+        if (NODE_BASE_SIZE + 4 * nc > left || (nc > 0 && w[3] != w[0] + 1)) {      \
+            return 0;                                                               \
+        }                                                                           \
+        store->value[node_idx] = w[1];                                              \
+        store->num_children[node_idx] = nc;                                         \
+        return NODE_BASE_SIZE + 4 * nc;
+
+/**
+ * The fast path for one node whose first four words are already byte-swapped.
+ *
+ * @param store The LocalTreeStore.
+ * @param node_idx The index the node goes to.
+ * @param w id, value, num_children and the first child id (or the next node's id).
+ * @param left The bytes left in the buffer.
+ * @return The size of the node, or 0 if it has to go through scalar_node.
+ */
+static inline int fast_node(LocalTreeStore* store, int node_idx, const uint32_t* w, int left) {
+    if (node_idx >= store->number_of_nodes || w[0] != (uint32_t)node_idx) {
+        return 0;
+    }
+    switch (w[2]) {
+        NODE_CASE(0)
+        NODE_CASE(1)
+        NODE_CASE(2)
+        NODE_CASE(3)
+        NODE_CASE(4)
+        NODE_CASE(5)
+    }
+    return 0;
+}
+
+#undef NODE_CASE
+
+__attribute__((target("ssse3")))
+static int ssse3_decode(LocalTreeStore* store, int node_idx, const char* buffer, int buflen) {
+    const __m128i swap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    int pos = 0;
+    // A leaf is 12 bytes, the load takes 16, so the last node is always left to the scalar code
+    while (buflen - pos >= 16) {
+        uint32_t w[4];
+        _mm_storeu_si128((__m128i*)w, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(buffer + pos)), swap));
+        int size = fast_node(store, node_idx, w, buflen - pos);
+        if (size == 0 && (size = scalar_node(store, node_idx, buffer + pos, buflen - pos)) == -1) {
+            return -1;
+        }
+        pos += size;
+        node_idx++;
+    }
+    return scalar_decode(store, node_idx, buffer + pos, buflen - pos);
+}
+
+__attribute__((target("avx2")))
+static int avx2_decode(LocalTreeStore* store, int node_idx, const char* buffer, int buflen) {
+    // vpshufb shuffles within each 128 bit half, so both halves take the same pattern
+    const __m256i swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                          3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    int pos = 0;
+    while (buflen - pos >= 32) {
+        uint32_t w[8];
+        _mm256_storeu_si256((__m256i*)w, _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(buffer + pos)), swap));
+        int size = fast_node(store, node_idx, w, buflen - pos);
+        if (size == 0) {
+            if ((size = scalar_node(store, node_idx, buffer + pos, buflen - pos)) == -1) {
+                _mm256_zeroupper();
+                return -1;
+            }
+            pos += size;
+            node_idx++;
+            continue;
+        }
+        pos += size;
+        node_idx++;
+        // After a node of 12 or 16 bytes, the first four words of the next one are swapped too
+        if (size <= 16) {
+            int next = fast_node(store, node_idx, w + size / 4, buflen - pos);
+            if (next > 0) {
+                pos += next;
+                node_idx++;
+            }
+        }
+    }
+    _mm256_zeroupper();
+    return ssse3_decode(store, node_idx, buffer + pos, buflen - pos);
+}
+
+#endif /* D2_DECODE_X86 */
+
+static const D2DecodeImpl impls[] = {
+    { "scalar", scalar_decode },
+#ifdef D2_DECODE_X86
+    { "ssse3", ssse3_decode },
+    { "avx2", avx2_decode },
+#endif
+};
+
+/* The implementation in use, atomic. Threads that race on the first call all store the
+ * same one. */
+static const D2DecodeImpl* selected = NULL;
+
+static const D2DecodeImpl* select_impl() {
+    const D2DecodeImpl* impl = __atomic_load_n(&selected, __ATOMIC_ACQUIRE);
+    if (impl == NULL) {
+        const D2DecodeImpl* list;
+        int n = d2_decode_impls(&list);
+        // AVX2 measured no faster than SSSE3 (d2_decode_bench): a payload holds at most five
+        // nodes, so the wider load rarely gets to decode a second one
+        impl = &list[n > 1 ? 1 : 0];
+        __atomic_store_n(&selected, impl, __ATOMIC_RELEASE);
+    }
+    return impl;
+}
+
+/*
+* END HELPER FUNCTIONS
+ */
+
+/**
+ * Lists the implementations the CPU supports.
+ *
+ * @param list Set to the implementations, the widest vectors last.
+ * @return The number of implementations.
+ */
+int d2_decode_impls(const D2DecodeImpl** list) {
+    *list = impls;
+#ifdef D2_DECODE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return 3;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        return 2;
+    }
+#endif
+    return 1;
+}
+
+/**
+ * Decodes the abbreviated NetNodes of a response with the fastest implementation.
+ *
+ * @param store The LocalTreeStore the nodes go to.
+ * @param node_idx The index of the first node in the buffer.
+ * @param buffer The nodes, in network byte order.
+ * @param buflen The size of the buffer.
+ * @return The index of the next node, or -1 on a malformed node.
+ */
+int d2_decode_nodes(LocalTreeStore* store, int node_idx, const char* buffer, int buflen) {
+    return select_impl()->decode(store, node_idx, buffer, buflen);
+}
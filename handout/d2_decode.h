@@ -0,0 +1,42 @@
+#ifndef D2_DECODE_H
+#define D2_DECODE_H
+
+#include "d2_lookup.h"
+
+/* Decoding of the abbreviated NetNodes of a PacketResponse into a LocalTreeStore.
+ *
+ * A node is 3 + num_children big-endian 32 bit words: id, value, num_children and the
+ * child ids. The store keeps only value and num_children (see d2_lookup_mod.h), and the
+ * checks need id and the first child id, so the first four words of a node are all that
+ * is read. The vector kernels byte-swap 16 (SSSE3) or 32 (AVX2) bytes with one shuffle,
+ * which covers a node's first four words, or with AVX2 those of two nodes when the
+ * first one has at most one child. Every num_children from 0 to 5 has its own case with
+ * a constant node size. Whatever a kernel can't take on the fast path (the last bytes
+ * of the buffer, or a node that fails a check) goes through the scalar code, which also
+ * prints what is wrong.
+ *
+ * The implementation is picked at the first call, from what the CPU supports: SSSE3 if
+ * it is there, as the AVX2 kernel is not faster on payloads of five nodes.
+ */
+
+/* Decodes the nodes in buffer into store, from node_idx on, and returns the index of
+ * the next node, or -1 if a node is malformed or there are more than number_of_nodes.
+ * Trailing bytes that are too few for a node are ignored. Does not fill in
+ * subtree_end, d2_add_to_local_tree does that.
+ */
+int d2_decode_nodes( LocalTreeStore* store, int node_idx, const char* buffer, int buflen );
+
+/* One implementation of d2_decode_nodes.
+ */
+typedef struct D2DecodeImpl
+{
+    const char* name;
+    int (*decode)( LocalTreeStore* store, int node_idx, const char* buffer, int buflen );
+} D2DecodeImpl;
+
+/* Lets impls point to the implementations this CPU supports, the widest vectors last.
+ * Returns their number. Meant for tests and benchmarks.
+ */
+int d2_decode_impls( const D2DecodeImpl** impls );
+
+#endif /* D2_DECODE_H */
@@ -0,0 +1,256 @@
+/* ======================================================================
+ * Checks every NetNode decoder against a plain decode of the same nodes,
+ * and measures how many nodes per second each one decodes.
+ *
+ * The input is synthetic: trees in depth first order with random shapes,
+ * packed into PacketResponse payloads of five abbreviated nodes like the
+ * servers send them. The check also covers every split of a payload into
+ * two buffers, and malformed nodes, which every decoder has to reject.
+ * The program exits with 1 on the first mismatch, before any timing.
+ *
+ * Usage: d2_decode_bench [rounds]
+ * ====================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "d2_lookup.h"
+#include "d2_decode.h"
+
+#define TREE_NODES       (1 << 16)
+#define NODES_PER_PACKET 5
+
+/* The wire format of a whole tree: the payloads one after another. */
+struct Response
+{
+    char* data;
+    int   packets;
+    int*  offset;        /* packets + 1 entries, the payload p is [offset[p], offset[p + 1]) */
+};
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* A random tree in depth first order, like d2_shard_server makes them. max_children
+ * limits the shape: 1 gives a path, 5 any tree. */
+static void make_tree(NetNode* nodes, int count, int max_children, unsigned seed) {
+    int* path = malloc(count * sizeof(int));
+    int depth = 1;
+    path[0] = 0;
+    for (int i = 0; i < count; i++) {
+        nodes[i].id = i;
+        nodes[i].value = rand_r(&seed);
+        nodes[i].num_children = 0;
+        if (i == 0) {
+            continue;
+        }
+        int up = depth - 1 - rand_r(&seed) % depth;
+        while (nodes[path[up]].num_children == (uint32_t)max_children) {
+            up++;
+        }
+        NetNode* parent = &nodes[path[up]];
+        parent->child_id[parent->num_children++] = i;
+        depth = up + 1;
+        path[depth++] = i;
+    }
+    free(path);
+}
+
+static void pack(NetNode* nodes, int count, struct Response* r) {
+    r->data = malloc(count * sizeof(NetNode));
+    r->packets = (count + NODES_PER_PACKET - 1) / NODES_PER_PACKET;
+    r->offset = malloc((r->packets + 1) * sizeof(int));
+    int len = 0;
+    for (int i = 0; i < count; i++) {
+        if (i % NODES_PER_PACKET == 0) {
+            r->offset[i / NODES_PER_PACKET] = len;
+        }
+        uint32_t fields[3 + NODES_PER_PACKET];
+        fields[0] = htonl(nodes[i].id);
+        fields[1] = htonl(nodes[i].value);
+        fields[2] = htonl(nodes[i].num_children);
+        for (uint32_t c = 0; c < nodes[i].num_children; c++) {
+            fields[3 + c] = htonl(nodes[i].child_id[c]);
+        }
+        memcpy(r->data + len, fields, (3 + nodes[i].num_children) * sizeof(uint32_t));
+        len += (3 + nodes[i].num_children) * sizeof(uint32_t);
+    }
+    r->offset[r->packets] = len;
+}
+
+/* The decode loop as it was before d2_decode.c, a memcpy and ntohl per field. */
+static int per_field_decode(LocalTreeStore* store, int node_idx, const char* buffer, int buflen) {
+    int base = 3 * sizeof(uint32_t);
+    while (buflen >= base) {
+        NetNode node;
+        memcpy(&node, buffer, base);
+        node.id = ntohl(node.id);
+        node.value = ntohl(node.value);
+        node.num_children = ntohl(node.num_children);
+        buffer += base;
+        buflen -= base;
+        if (buflen < (int)(sizeof(uint32_t) * node.num_children) || node.num_children > 5) {
+            return -1;
+        }
+        for (uint32_t i = 0; i < node.num_children; ++i) {
+            memcpy(&node.child_id[i], buffer, sizeof(uint32_t));
+            node.child_id[i] = ntohl(node.child_id[i]);
+            buffer += sizeof(uint32_t);
+            buflen -= sizeof(uint32_t);
+        }
+        if (node_idx >= store->number_of_nodes || node.id != (uint32_t)node_idx ||
+            (node.num_children > 0 && node.child_id[0] != node.id + 1)) {
+            return -1;
+        }
+        store->value[node_idx] = node.value;
+        store->num_children[node_idx] = node.num_children;
+        node_idx++;
+    }
+    return node_idx;
+}
+
+static int decode_all(int (*decode)(LocalTreeStore*, int, const char*, int), LocalTreeStore* store, struct Response* r) {
+    int idx = 0;
+    for (int p = 0; p < r->packets && idx >= 0; p++) {
+        idx = decode(store, idx, r->data + r->offset[p], r->offset[p + 1] - r->offset[p]);
+    }
+    return idx;
+}
+
+static int same(LocalTreeStore* store, NetNode* nodes, int count) {
+    for (int i = 0; i < count; i++) {
+        if (store->value[i] != nodes[i].value || store->num_children[i] != nodes[i].num_children) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static uint32_t load(const char* p) {
+    uint32_t w;
+    memcpy(&w, p, 4);
+    return ntohl(w);
+}
+
+static int fail(const char* what, const char* impl) {
+    printf("MISMATCH: %s, %s\n", what, impl);
+    return 1;
+}
+
+static int verify(const D2DecodeImpl* impls, int n, NetNode* nodes, struct Response* r) {
+    LocalTreeStore* store = d2_alloc_local_tree(TREE_NODES);
+    for (int k = 0; k < n; k++) {
+        memset(store->value, 0, TREE_NODES * sizeof(uint32_t));
+        if (decode_all(impls[k].decode, store, r) != TREE_NODES || !same(store, nodes, TREE_NODES)) {
+            return fail("whole tree", impls[k].name);
+        }
+
+        // The first 200 nodes in two buffers, split at every node start and up to 11 bytes
+        // after it, so each node is also seen at the end of a buffer. Less than a node's
+        // header at the end is ignored.
+        int len = r->offset[40];
+        for (int first = 0, start = 0; first < 200; start += 12 + 4 * nodes[first++].num_children) {
+            for (int extra = 0; extra < 12 && start + extra <= len; extra++) {
+                memset(store->value, 0, TREE_NODES * sizeof(uint32_t));
+                if (impls[k].decode(store, 0, r->data, start + extra) != first ||
+                    impls[k].decode(store, first, r->data + start, len - start) != 200 || !same(store, nodes, 200)) {
+                    return fail("split buffer", impls[k].name);
+                }
+            }
+        }
+
+        // Malformed nodes: a wrong id, a wrong first child, too many children, children cut
+        // short, more nodes than the store has room for
+        int parent = 10;
+        while (nodes[parent].num_children == 0) {
+            parent++;
+        }
+        int at = r->offset[0];
+        for (int i = 0; i < parent; i++) {
+            at += 12 + 4 * nodes[i].num_children;
+        }
+        char bad[200 * sizeof(NetNode)];
+        int bad_len = r->offset[40];
+        for (int what = 0; what < 5; what++) {
+            memcpy(bad, r->data, bad_len);
+            int cut = bad_len;
+            int field = what == 0 ? 0 : what == 1 ? 12 : 8;
+            uint32_t word = what == 2 ? htonl(6) : htonl(load(bad + at + field) + 1);
+            if (what < 3) {
+                memcpy(bad + at + field, &word, 4);
+            } else if (what == 3) {
+                cut = at + 12 + 2;
+            }
+            LocalTreeStore* small = d2_alloc_local_tree(what == 4 ? 150 : TREE_NODES);
+            int res = impls[k].decode(small, 0, bad, cut);
+            d2_free_local_tree(small);
+            if (res != -1) {
+                return fail("malformed node accepted", impls[k].name);
+            }
+        }
+    }
+    d2_free_local_tree(store);
+    return 0;
+}
+
+static double nodes_per_s(int (*decode)(LocalTreeStore*, int, const char*, int), LocalTreeStore* store, struct Response* r, int rounds) {
+    double start = now_s();
+    for (int i = 0; i < rounds; i++) {
+        if (decode_all(decode, store, r) != TREE_NODES) {
+            return 0;
+        }
+    }
+    return (double)TREE_NODES * rounds / (now_s() - start) / 1e6;
+}
+
+int main(int argc, char* argv[]) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 200;
+
+    const char* shapes[] = { "random", "path", "max 2" };
+    int max_children[] = { 5, 1, 2 };
+    NetNode* nodes = malloc(TREE_NODES * sizeof(NetNode));
+    struct Response r[3];
+    for (int s = 0; s < 3; s++) {
+        make_tree(nodes, TREE_NODES, max_children[s], s + 1);
+        pack(nodes, TREE_NODES, &r[s]);
+    }
+
+    const D2DecodeImpl* impls;
+    int n = d2_decode_impls(&impls);
+    make_tree(nodes, TREE_NODES, 5, 1);
+    if (verify(impls, n, nodes, &r[0])) {
+        return 1;
+    }
+    printf("all %d decoders match the nodes and reject malformed ones\n\n", n);
+
+    LocalTreeStore* store = d2_alloc_local_tree(TREE_NODES);
+    printf("%-22s", "Mnodes/s");
+    for (int s = 0; s < 3; s++) {
+        printf(" %12s", shapes[s]);
+    }
+    printf("\n%-22s", "per-field ntohl");
+    for (int s = 0; s < 3; s++) {
+        printf(" %12.1f", nodes_per_s(per_field_decode, store, &r[s], rounds));
+    }
+    for (int k = 0; k < n; k++) {
+        printf("\n%-22s", impls[k].name);
+        for (int s = 0; s < 3; s++) {
+            printf(" %12.1f", nodes_per_s(impls[k].decode, store, &r[s], rounds));
+        }
+    }
+    printf("\n");
+
+    d2_free_local_tree(store);
+    for (int s = 0; s < 3; s++) {
+        free(r[s].data);
+        free(r[s].offset);
+    }
+    free(nodes);
+    return 0;
+}
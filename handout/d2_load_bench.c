@@ -0,0 +1,137 @@
+/* ======================================================================
+ * Load generator for D2 servers: client threads that look up trees as
+ * fast as they can, each lookup on a new association like d2_test_client.
+ * Prints the completed lookups per second.
+ *
+ * Usage: d2_load_bench <server> <port> [threads] [seconds] [-s]
+ *   -s  take the clients from a D2Pool, reusing sessions across lookups
+ *       (needs a server that answers several requests per association)
+ * ====================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "d2_pool.h"
+
+struct Client
+{
+    pthread_t   thread;
+    const char* server;
+    uint16_t    port;
+    D2Pool*     pool;        /* NULL: a new client per lookup */
+    unsigned    seed;
+    double      until;
+    long        lookups;
+    long        failures;
+};
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* One lookup, returns the number of nodes received or -1.
+ */
+static int lookup(struct Client* c, uint32_t id) {
+    D2Client* client = c->pool ? d2_pool_checkout(c->pool, c->server, c->port)
+                               : d2_client_create(c->server, c->port);
+    if (client == NULL) {
+        return -1;
+    }
+    if (d2_send_request(client, id) <= 0) {
+        if (c->pool) {
+            d2_pool_return(c->pool, client);
+        }
+        return -1; // a client without a pool has been deleted
+    }
+
+    int nodes = d2_recv_response_size(client);
+    int received = 0;
+    char buffer[1024];
+    while (nodes > 0) {
+        int len = d2_recv_response(client, buffer, sizeof(buffer));
+        if (len <= 0) {
+            received = -1;
+            break;
+        }
+        received++;
+        if (ntohs(((PacketResponse*)buffer)->type) == TYPE_LAST_RESPONSE) {
+            break;
+        }
+    }
+    if (c->pool) {
+        d2_pool_return(c->pool, client);
+    } else {
+        d2_client_delete(client);
+    }
+    return nodes > 0 && received > 0 ? nodes : -1;
+}
+
+static void* run_client(void* arg) {
+    struct Client* c = (struct Client*)arg;
+    while (now_s() < c->until) {
+        uint32_t id = 1001 + rand_r(&c->seed) % 100000;
+        if (lookup(c, id) > 0) {
+            c->lookups++;
+        } else {
+            c->failures++;
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <server> <port> [threads] [seconds] [-s]\n", argv[0]);
+        return 1;
+    }
+    int threads = 8;
+    double seconds = 5;
+    D2Pool* pool = NULL;
+    for (int i = 3, pos = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0) {
+            pool = pool ? pool : d2_pool_create(64);
+        } else if (pos++ == 0) {
+            threads = atoi(argv[i]);
+        } else {
+            seconds = atof(argv[i]);
+        }
+    }
+
+    struct Client* clients = calloc(threads, sizeof(struct Client));
+    double start = now_s();
+    for (int i = 0; i < threads; i++) {
+        clients[i].server = argv[1];
+        clients[i].port = atoi(argv[2]);
+        clients[i].pool = pool;
+        clients[i].seed = i + 1;
+        clients[i].until = start + seconds;
+        pthread_create(&clients[i].thread, NULL, run_client, &clients[i]);
+    }
+
+    long lookups = 0;
+    long failures = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(clients[i].thread, NULL);
+        lookups += clients[i].lookups;
+        failures += clients[i].failures;
+    }
+    double elapsed = now_s() - start;
+
+    printf("%d client threads, %.1f s: %ld lookups, %ld failed, %.0f lookups/s\n",
+           threads, elapsed, lookups, failures, lookups / elapsed);
+    if (pool) {
+        D2PoolStats stats;
+        d2_pool_stats(pool, &stats);
+        printf("pool: %ld clients created, %ld checkouts reused a client, %ld recycled\n",
+               stats.created, stats.reused, stats.recycled);
+        d2_pool_delete(pool);
+    }
+    free(clients);
+    return 0;
+}
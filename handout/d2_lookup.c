@@ -6,8 +6,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 
 #include "d2_lookup.h"
+#include "d2_decode.h"
 
 
 #define PRINT_DEBUG_INFO 0
@@ -37,28 +39,119 @@ void check_error_d2(int res, char *msg, int line, char* file) {
 };
 
 
+/* The output buffer of d2_print_tree_fd. */
+struct TreeWriter {
+    int  fd;
+    int  failed;
+    int  len;
+    char buf[1 << 16];
+};
+
 /**
- * Displays the node at the specified index in the LocalTreeStore.
+ * Writes the buffered output to the file descriptor, all of it.
  *
- * @param store The LocalTreeStore containing the node.
- * @param index The index of the node to display.
- * @param level The level of the node in the tree.
+ * @param w The TreeWriter.
  */
-void display_node(LocalTreeStore *store, int index, int level) {
-    // Function implementation goes here
-    for (int j = 0; j < level; j++) {
+static void writer_flush(struct TreeWriter *w) {
+    int done = 0;
+    while (!w->failed && done < w->len) {
+        ssize_t n = write(w->fd, w->buf + done, w->len - done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            w->failed = 1;
+            break;
+        }
+        done += n;
+    }
+    w->len = 0;
+}
 
-        printf("--"); // Indent based on the level of depth
+/**
+ * Appends a run of the same character, flushing as often as the buffer fills up, so the
+ * indent of a node can be longer than the buffer.
+ *
+ * @param w The TreeWriter.
+ * @param c The character.
+ * @param count How many of them.
+ */
+static void writer_repeat(struct TreeWriter *w, char c, long count) {
+    while (count > 0) {
+        if (w->len == (int)sizeof(w->buf)) {
+            writer_flush(w);
+        }
+        int n = (int)sizeof(w->buf) - w->len < count ? (int)sizeof(w->buf) - w->len : (int)count;
+        memset(w->buf + w->len, c, n);
+        w->len += n;
+        count -= n;
     }
+}
 
-    //Print the Node inside the tree
-    NetNode *current = &store->root[index];
-    printf("id: %d, value: %d, children: %d\n", current->id, current->value, current->num_children);
+/**
+ * Appends the text of a node: "id <id> value <value> children <n>\n". Integers are
+ * formatted two digits at a time from a table, backwards from the end of a scratch buffer.
+ *
+ * @param w The TreeWriter, with room for at least 64 bytes.
+ * @param id The id.
+ * @param value The value.
+ * @param children The number of children.
+ */
+static void writer_node(struct TreeWriter *w, uint32_t id, uint32_t value, uint32_t children) {
+    static const char pairs[201] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    static const char* labels[3] = { "id ", " value ", " children " };
+    uint32_t numbers[3] = { id, value, children };
+
+    char* out = w->buf + w->len;
+    for (int k = 0; k < 3; k++) {
+        size_t label_len = strlen(labels[k]);
+        memcpy(out, labels[k], label_len);
+        out += label_len;
+
+        char digits[10];
+        char* d = digits + sizeof(digits);
+        uint32_t x = numbers[k];
+        while (x >= 100) {
+            d -= 2;
+            memcpy(d, pairs + 2 * (x % 100), 2);
+            x /= 100;
+        }
+        if (x >= 10) {
+            d -= 2;
+            memcpy(d, pairs + 2 * x, 2);
+        } else {
+            *--d = '0' + x;
+        }
+        memcpy(out, d, digits + sizeof(digits) - d);
+        out += digits + sizeof(digits) - d;
+    }
+    *out++ = '\n';
+    w->len = out - w->buf;
+}
 
-    // Gotta love recursion, do the same for children
-    for (uint32_t i = 0; i < current->num_children; i++) {
-        display_node(store, current->child_id[i], level + 1);
+/**
+ * Fills in subtree_end once all nodes are there. Going backwards, the subtree ends of all
+ * children of a node are known when the node is reached: they follow each other from
+ * index + 1 on, and the subtree of the node ends where its last child's subtree ends.
+ *
+ * @param store The LocalTreeStore with all nodes added.
+ * @return 0 on success, or -1 if the children run past the end of the tree.
+ */
+static int finish_local_tree(LocalTreeStore *store) {
+    for (int i = store->number_of_nodes - 1; i >= 0; i--) {
+        uint32_t end = i + 1;
+        for (int k = 0; k < store->num_children[i]; k++) {
+            if (end >= (uint32_t)store->number_of_nodes) {
+                return -1;
+            }
+            end = store->subtree_end[end];
+        }
+        store->subtree_end[i] = end;
     }
+    return 0;
 }
 
 /* 
@@ -93,11 +186,17 @@ D2Client* d2_client_create( const char* server_name, uint16_t server_port )
 
     int wc = d1_get_peer_info(peer, server_name, server_port);
     if (wc == 0) {
+        d1_delete(peer);
         free(client);
         check_error_d2(-1, "Failed to get peer info", __LINE__, __FILE__);
         return NULL;
     }
     client->peer=peer;
+    client->pool = NULL;
+    client->failed = 0;
+    client->pending = 0;
+    client->tagged = 0;
+    client->arena = NULL;
     print_line_d2(__LINE__, __FILE__, "Created D2 client");
     return client;
 }
@@ -113,6 +212,8 @@ D2Client* d2_client_delete( D2Client* client ) {
 
 /**
  * Send a PacketRequest with the given id to the server identified by client.
+ * If sending fails, the client is deleted, unless it belongs to a D2Pool: then it is
+ * marked as failed and the pool recycles it when it is returned.
  * @param client The D2Client object representing the client connection.
  * @param id The ID of the request to be sent. In host byte order.
  * @return Returns a positive value if the request was sent successfully, otherwise 0. 
@@ -124,26 +225,24 @@ int d2_send_request( D2Client* client, uint32_t id ) {
         return 0;
     }
 
-    // Use calloc to initialise value.
-    PacketRequest* pack = (PacketRequest*)calloc(1, sizeof(PacketRequest));
-    if( !pack ) {
-        check_error_d2(-1, "Failed to allocate memory for PacketRequest", __LINE__, __FILE__);
-        return 0;
-    }
-
-
-    pack->id = htonl(id);
-    pack->type = htons(TYPE_REQUEST);
+    // On the stack, d1_send_datav sends it from there
+    PacketRequest pack;
+    memset(&pack, 0, sizeof(pack));
+    pack.id = htonl(id);
+    pack.type = htons(TYPE_REQUEST);
 
-    int wc = d1_send_data(client->peer, (char*)pack, sizeof(PacketRequest));
+    int wc = d1_send_data(client->peer, (char*)&pack, sizeof(PacketRequest));
     if( wc <= 0 ) {
-        free(pack);
-        d2_client_delete(client);
         check_error_d2(-1, "Failed to send data", __LINE__, __FILE__);
+        if( client->pool ) {
+            client->failed = 1;
+        } else {
+            d2_client_delete(client);
+        }
         return 0;
     }
 
-    free(pack);
+    client->pending = 1;
     print_line_d2(__LINE__, __FILE__, "Sent request to server");
     return wc;
 }
@@ -160,6 +259,7 @@ int d2_recv_response_size( D2Client* client ) {
 
     if( wc <= 0 ) {
         check_error_d2(-1, "Failed to receive size data", __LINE__, __FILE__);
+        client->failed = 1;
         return -1;
     }
 
@@ -167,11 +267,15 @@ int d2_recv_response_size( D2Client* client ) {
     PacketHeader* packCheck = (PacketHeader*)buffer;
     if( ntohs(packCheck->type) != TYPE_RESPONSE_SIZE ) {
         check_error_d2(-1, "Received wrong packet type", __LINE__, __FILE__);
+        client->failed = 1;
         return -1;
     }
 
     PacketResponseSize* pack = (PacketResponseSize*)buffer;
     int num_netNodes = ntohs(pack->size);
+    if( num_netNodes == 0 ) {
+        client->pending = 0; // no PacketResponse follows
+    }
 
     print_line_d2(__LINE__, __FILE__, "Received response size from server (d2_recv_response_size)");
     return num_netNodes;
@@ -192,6 +296,7 @@ int d2_recv_response( D2Client* client, char* buffer, size_t sz ) {
     int wc = d1_recv_data(client->peer, buffer, sz - sizeof(D1Header));
     if( wc <= 0 ) {
         check_error_d2(-1, "Failed to receive data", __LINE__, __FILE__);
+        client->failed = 1;
         return -1;
     }
 
@@ -200,8 +305,12 @@ int d2_recv_response( D2Client* client, char* buffer, size_t sz ) {
 
     if( ntohs(packCheck->type) != TYPE_RESPONSE && ntohs(packCheck->type) != TYPE_LAST_RESPONSE ){
         check_error_d2(-1, "Received wrong packet type", __LINE__, __FILE__);
+        client->failed = 1;
         return -1;
     }
+    if( ntohs(packCheck->type) == TYPE_LAST_RESPONSE ) {
+        client->pending = 0;
+    }
 
     print_line_d2(__LINE__, __FILE__, "Received response from server (d2_recv_response)");
     return wc;
@@ -215,21 +324,22 @@ int d2_recv_response( D2Client* client, char* buffer, size_t sz ) {
  */
 LocalTreeStore* d2_alloc_local_tree( int num_nodes ) {
 
-    // Again using calloc to initialize value at adress -> avoid warnings. 
-    LocalTreeStore* nodes = (LocalTreeStore*)calloc(1, sizeof(LocalTreeStore));
-    if( !nodes ) {
+    if( num_nodes < 0 ) {
         check_error_d2(-1, "Failed to allocate memory for LocalTreeStore", __LINE__, __FILE__);
         return NULL;
     }
 
-    nodes->number_of_nodes = num_nodes;
-    nodes->root = calloc(num_nodes, sizeof(NetNode));
-
-    if( !nodes->root ) {
-        free(nodes);
-        check_error_d2(-1, "Failed to allocate memory for NetNode", __LINE__, __FILE__);
+    // Again using calloc to initialize value at adress -> avoid warnings.
+    // One block for the struct and the three arrays, the 4 byte arrays first so they stay aligned
+    LocalTreeStore* nodes = (LocalTreeStore*)calloc(1, sizeof(LocalTreeStore) + num_nodes * (2 * sizeof(uint32_t) + sizeof(uint8_t)) + 1);
+    if( !nodes ) {
+        check_error_d2(-1, "Failed to allocate memory for LocalTreeStore", __LINE__, __FILE__);
         return NULL;
     }
+    nodes->number_of_nodes = num_nodes;
+    nodes->value = (uint32_t*)(nodes + 1);
+    nodes->subtree_end = nodes->value + num_nodes;
+    nodes->num_children = (uint8_t*)(nodes->subtree_end + num_nodes);
 
     return nodes;
 }
@@ -240,11 +350,8 @@ LocalTreeStore* d2_alloc_local_tree( int num_nodes ) {
  * @param nodes A pointer to the LocalTreeStore structure representing the local tree.
  */
 void  d2_free_local_tree( LocalTreeStore* nodes ) {
-    if( nodes ) {
-        if(nodes->root) {
-            free(nodes->root);
-        }
-        free(nodes);
+    if( nodes && !nodes->arena ) {
+        free(nodes); // the arrays too, they are in the same block
         print_line_d2(__LINE__, __FILE__, "Freed local tree");
     }
 }
@@ -271,51 +378,164 @@ int d2_add_to_local_tree(LocalTreeStore* nodes_out, int node_idx, char* buffer,
         return -1;
     }
 
-    // Removing exactly 5 times 4 bytes, because "unused children fields are not sent over thenetwork"
-    int net_node_base_size = sizeof(NetNode) - sizeof(uint32_t) * 5;
-
-    
-    while (buflen >= net_node_base_size) {
-
-        NetNode node;
-        memcpy(&node, buffer, net_node_base_size); 
+    // The nodes go straight into the arrays, with the fastest decoder the CPU has, see d2_decode.h
+    int next_idx = d2_decode_nodes(nodes_out, node_idx, buffer, buflen);
+    if (next_idx == -1) {
+        return -1;
+    }
+    nodes_out->filled += next_idx - node_idx;
 
-        node.id = ntohl(node.id);
-        node.value = ntohl(node.value);
-        node.num_children = ntohl(node.num_children);
+    if (nodes_out->filled == nodes_out->number_of_nodes && finish_local_tree(nodes_out) == -1) {
+        fprintf(stderr, "Children run past the end of the tree.\n");
+        return -1;
+    }
+    return next_idx; 
+}
 
-        buffer += net_node_base_size;
-        buflen -= net_node_base_size;
+/**
+ * Prints the contents of the tree stored in the given LocalTreeStore, in the style given in the header file. 
+ *
+ * @param store A pointer to the LocalTreeStore containing the tree to be printed.
+ */
+void d2_print_tree(LocalTreeStore *store) {
+    // Whatever stdio still holds for stdout goes first, d2_print_tree_fd bypasses it
+    fflush(stdout);
+    d2_print_tree_fd(store, STDOUT_FILENO);
+}
 
-        if (buflen < (int)(sizeof(uint32_t) * node.num_children)) {
-            fprintf(stderr, "Not enough data for children IDs.\n");
+/**
+ * Writes the tree to a file descriptor, in the format of d2_print_tree. The ids are in
+ * depth first order, so the nodes are printed in the order they are stored, without
+ * recursion. A stack of the subtree ends of the ancestors gives the depth: the ancestors
+ * of node i are those whose subtree ends after i.
+ *
+ * @param store A pointer to the LocalTreeStore containing the tree to be printed.
+ * @param fd The file descriptor to write to.
+ * @return 0 on success, or -1 if a write failed.
+ */
+int d2_print_tree_fd(LocalTreeStore *store, int fd) {
+    struct TreeWriter *w = malloc(sizeof(struct TreeWriter));
+    if (w == NULL) {
+        check_error_d2(-1, "Failed to allocate the output buffer", __LINE__, __FILE__);
+        return -1;
+    }
+    w->fd = fd;
+    w->failed = 0;
+    w->len = 0;
+
+    if (store == NULL || store->number_of_nodes <= 0 || store->filled != store->number_of_nodes) {
+        const char *empty = "Empty or uninitialized tree.\n";
+        memcpy(w->buf, empty, strlen(empty));
+        w->len = strlen(empty);
+    } else {
+        uint32_t *ends = malloc(store->number_of_nodes * sizeof(uint32_t));
+        if (ends == NULL) {
+            free(w);
+            check_error_d2(-1, "Failed to allocate the ancestor stack", __LINE__, __FILE__);
             return -1;
         }
-
-        //this handles the children, after the "header" of NetNode is set above. 
-        for (uint32_t i = 0; i < node.num_children; ++i) {
-            memcpy(&node.child_id[i], buffer, sizeof(uint32_t));
-            node.child_id[i] = ntohl(node.child_id[i]);
-
-            // unit32_t is the size of children id given in slides, so for each slize ad 8 bytes to buffer adress.
-            buffer += sizeof(uint32_t);
-            buflen -= sizeof(uint32_t);
+        int depth = 0;
+        for (int i = 0; i < store->number_of_nodes && !w->failed; i++) {
+            while (depth > 0 && ends[depth - 1] <= (uint32_t)i) {
+                depth--;
+            }
+            // The indent may be longer than the buffer, the node text is short
+            if (depth > 0) {
+                writer_repeat(w, '-', 2L * depth);
+                writer_repeat(w, ' ', 1);
+            }
+            if (sizeof(w->buf) - w->len < 64) {
+                writer_flush(w);
+            }
+            writer_node(w, i, store->value[i], store->num_children[i]);
+            ends[depth++] = store->subtree_end[i];
         }
-        nodes_out->root[node_idx++] = node; // Store the node
+        free(ends);
     }
 
-    return node_idx; 
+    writer_flush(w);
+    int res = w->failed ? -1 : 0;
+    free(w);
+    return res;
 }
 
 /**
- * Prints the contents of the tree stored in the given LocalTreeStore, in the style given in the header file. 
+ * The value of a node.
  *
- * @param store A pointer to the LocalTreeStore containing the tree to be printed.
+ * @param store The LocalTreeStore.
+ * @param id The id of the node.
+ * @return The value.
  */
-void d2_print_tree(LocalTreeStore *store) {
-    if (store != NULL && store->root != NULL) {
-        display_node(store, 0, 0); // Start from the root with depth 0
-    } else {
-        printf("Empty or uninitialized tree.\n");
+uint32_t d2_tree_value(const LocalTreeStore* store, int id) {
+    return store->value[id];
+}
+
+/**
+ * The number of children of a node.
+ *
+ * @param store The LocalTreeStore.
+ * @param id The id of the node.
+ * @return The number of children.
+ */
+int d2_tree_num_children(const LocalTreeStore* store, int id) {
+    return store->num_children[id];
+}
+
+/**
+ * The end of the subtree of a node: its descendants are the ids between id and the end.
+ *
+ * @param store A complete LocalTreeStore.
+ * @param id The id of the node.
+ * @return One past the last id in the subtree.
+ */
+int d2_tree_subtree_end(const LocalTreeStore* store, int id) {
+    return store->subtree_end[id];
+}
+
+/**
+ * Finds the k-th child of a node by skipping the subtrees of the children before it.
+ *
+ * @param store A complete LocalTreeStore.
+ * @param id The id of the node.
+ * @param k The index of the child, from 0.
+ * @return The id of the child, or -1 if the node has no k-th child.
+ */
+int d2_tree_child(const LocalTreeStore* store, int id, int k) {
+    if (k < 0 || k >= store->num_children[id]) {
+        return -1;
+    }
+    int child = id + 1;
+    while (k-- > 0) {
+        child = store->subtree_end[child];
     }
+    return child;
+}
+
+/**
+ * Rebuilds the NetNode of a node, in host byte order.
+ *
+ * @param store A complete LocalTreeStore.
+ * @param id The id of the node.
+ * @param node Set to the node; unused child_id slots are 0.
+ */
+void d2_tree_get_node(const LocalTreeStore* store, int id, NetNode* node) {
+    memset(node, 0, sizeof(*node));
+    node->id = id;
+    node->value = store->value[id];
+    node->num_children = store->num_children[id];
+    int child = id + 1;
+    for (uint32_t k = 0; k < node->num_children; k++) {
+        node->child_id[k] = child;
+        child = store->subtree_end[child];
+    }
+}
+
+/**
+ * The memory a tree takes, the LocalTreeStore included.
+ *
+ * @param store The LocalTreeStore.
+ * @return The number of bytes.
+ */
+size_t d2_tree_bytes(const LocalTreeStore* store) {
+    return sizeof(LocalTreeStore) + store->number_of_nodes * (2 * sizeof(uint32_t) + sizeof(uint8_t));
 }
@@ -9,18 +9,105 @@
 
 struct D2Client
 {
-    D1Peer* peer;
+    D1Peer*        peer;
+    struct D2Pool* pool;     /* the D2Pool the client belongs to, or NULL, see d2_pool.h */
+    int            failed;   /* a request or response failed, the D1 state may be out of step */
+    int            pending;  /* a request has been sent and its last response not yet received */
+    int            tagged;   /* the server answers tagged requests: 1 yes, -1 no, 0 not known yet */
+    struct D2Arena* arena;   /* if set, d2_lookup_tagged allocates the trees here, see d2_arena.h */
 };
 
 typedef struct D2Client D2Client;
 
+/* A tree in struct-of-arrays form. The ids of a tree are assigned in depth first order,
+ * so node i is stored at index i, its first child (if it has any) is i + 1, and the
+ * subtree of i is the range [i, subtree_end[i]). The next sibling of a child c is
+ * subtree_end[c]. That makes the child_id arrays unnecessary: a node takes 9 bytes
+ * instead of a 32 byte NetNode, and walking a subtree is a sequential scan.
+ *
+ * d2_alloc_local_tree makes the LocalTreeStore and its three arrays one allocation; the
+ * arrays follow the struct, starting at value. subtree_end is filled in when the last
+ * node has been added; before that, filled < number_of_nodes.
+ */
 struct LocalTreeStore
 {
-    int number_of_nodes;
-    struct NetNode* root;
+    int       number_of_nodes;
+    int       filled;         /* nodes added so far */
+    int       arena;          /* 1: the tree belongs to a D2Arena, d2_free_local_tree skips it */
+    uint32_t* value;          /* value of node i */
+    uint32_t* subtree_end;    /* one past the last id in the subtree of node i */
+    uint8_t*  num_children;   /* at most 5 */
 };
 
 typedef struct LocalTreeStore LocalTreeStore;
 
+struct NetNode;
+
+/* Accessors for complete trees, id is the node's id (= its index).
+ * d2_tree_child returns the id of the k-th child, or -1 if there is none.
+ * d2_tree_get_node rebuilds the full NetNode, child ids included.
+ * d2_tree_bytes is the memory the tree takes.
+ */
+uint32_t d2_tree_value( const LocalTreeStore* store, int id );
+int      d2_tree_num_children( const LocalTreeStore* store, int id );
+int      d2_tree_subtree_end( const LocalTreeStore* store, int id );
+int      d2_tree_child( const LocalTreeStore* store, int id, int k );
+void     d2_tree_get_node( const LocalTreeStore* store, int id, struct NetNode* node );
+size_t   d2_tree_bytes( const LocalTreeStore* store );
+
+/* Writes the tree to fd in the format of d2_print_tree, through a large buffer and
+ * without recursion, so trees of any depth can be printed. Returns 0, or -1 if a write
+ * failed. d2_print_tree writes to STDOUT_FILENO with it, after flushing stdout.
+ */
+int d2_print_tree_fd( LocalTreeStore* store, int fd );
+
+/* Tagged lookups, an extension of the protocol in d2_lookup.h that lets a client have
+ * many lookups in flight on one association.
+ *
+ * A tagged request is a PacketRequest that carries a tag != 0 in its two padding bytes,
+ * see PacketTaggedRequest. A classic server does not look at these bytes and answers as
+ * usual. A server that knows tags answers with the tagged packets below, which have
+ * TYPE_TAGGED set in their type, and so tells the client that it supports them. From
+ * then on, the client may send up to D2_TAGGED_MAX PacketTaggedRequests back-to-back in
+ * one D1 packet, with distinct tags. The server answers all of them with interleaved
+ * response streams; each packet carries the tag of the request it belongs to.
+ *
+ * All fields are in network byte order. The abbreviated NetNodes of a
+ * PacketTaggedResponse follow its header like those of a PacketResponse, and payload_size
+ * is the size of the whole packet, header included.
+ */
+#define TYPE_TAGGED   (1 << 7)
+#define D2_TAGGED_MAX 64
+
+struct PacketTaggedRequest
+{
+    uint16_t type;          /* TYPE_REQUEST */
+    uint16_t tag;
+    uint32_t id;
+};
+
+struct PacketTaggedResponseSize
+{
+    uint16_t type;          /* TYPE_TAGGED | TYPE_RESPONSE_SIZE */
+    uint16_t tag;
+    uint16_t size;
+};
+
+struct PacketTaggedResponse
+{
+    uint16_t type;          /* TYPE_TAGGED | TYPE_RESPONSE or TYPE_TAGGED | TYPE_LAST_RESPONSE */
+    uint16_t tag;
+    uint16_t payload_size;
+};
+
+typedef struct PacketTaggedRequest      PacketTaggedRequest;
+typedef struct PacketTaggedResponseSize PacketTaggedResponseSize;
+typedef struct PacketTaggedResponse     PacketTaggedResponse;
+
+/* Helpers shared by the D2 sources.
+ */
+void check_error_d2( int res, char* msg, int line, char* file );
+void print_line_d2( int line, const char* file, const char* message );
+
 #endif /* D2_LOOKUP_MOD_H */
 
@@ -0,0 +1,172 @@
+/* ======================================================================
+ * D2 bulk lookups: a pool of worker threads with their own sessions.
+ * ====================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "d2_many.h"
+#include "d2_mux.h"
+
+
+/* What all workers of one d2_lookup_many call share.
+ */
+struct ManyJob
+{
+    D2Pool*          pool;
+    const char*      server_name;
+    uint16_t         server_port;
+    const uint32_t*  ids;
+    LocalTreeStore** trees;
+    int              n;
+    int              chunk;     /* ids claimed at once */
+    int              next;      /* first id that has not been claimed, taken atomically */
+    int              received;  /* trees received, added atomically */
+};
+
+/*
+* START HELPER FUNCTIONS
+ */
+
+/**
+ * @brief Looks up one chunk of ids on the worker's session. A session that fails is
+ * returned to the pool, which deletes it, and the ids without a tree are tried once more
+ * on a new session.
+ *
+ * @param job The job.
+ * @param client The worker's session, replaced if it fails; NULL if none could be created.
+ * @param first The index of the first id of the chunk.
+ * @param count The number of ids in the chunk.
+ * @return The number of trees received.
+ */
+static int lookup_chunk(struct ManyJob* job, D2Client** client, int first, int count) {
+    int received = 0;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (*client == NULL) {
+            *client = d2_pool_checkout(job->pool, job->server_name, job->server_port);
+            if (*client == NULL) {
+                return received;
+            }
+        }
+
+        // Only the ids that have no tree yet
+        uint32_t        ids[D2_TAGGED_MAX];
+        int             index[D2_TAGGED_MAX];
+        LocalTreeStore* trees[D2_TAGGED_MAX];
+        int missing = 0;
+        for (int i = first; i < first + count; i++) {
+            if (job->trees[i] == NULL) {
+                index[missing] = i;
+                ids[missing++] = job->ids[i];
+            }
+        }
+        if (missing == 0) {
+            break;
+        }
+
+        received += d2_lookup_tagged(*client, ids, missing, trees);
+        for (int k = 0; k < missing; k++) {
+            job->trees[index[k]] = trees[k];
+        }
+        if (!(*client)->failed) {
+            break;
+        }
+        d2_pool_return(job->pool, *client);
+        *client = NULL;
+    }
+    return received;
+}
+
+static void* run_many_worker(void* arg) {
+    struct ManyJob* job = (struct ManyJob*)arg;
+    D2Client* client = NULL;
+    int received = 0;
+
+    while (1) {
+        int first = __atomic_fetch_add(&job->next, job->chunk, __ATOMIC_RELAXED);
+        if (first >= job->n) {
+            break;
+        }
+        int count = job->n - first < job->chunk ? job->n - first : job->chunk;
+        received += lookup_chunk(job, &client, first, count);
+    }
+
+    d2_pool_return(job->pool, client);
+    __atomic_fetch_add(&job->received, received, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/*
+* END HELPER FUNCTIONS
+ */
+
+/**
+ * @brief Looks up many ids in parallel, see d2_many.h.
+ *
+ * @param pool The pool to take the sessions from, or NULL for a pool of this call.
+ * @param server_name The name of the server.
+ * @param server_port The port of the server.
+ * @param ids The ids, in host byte order.
+ * @param n The number of ids.
+ * @param max_workers The largest number of threads.
+ * @param trees Set to the trees, NULL for the lookups that failed.
+ * @return The number of trees received, or -1 on failure.
+ */
+int d2_lookup_many(D2Pool* pool, const char* server_name, uint16_t server_port,
+                   const uint32_t* ids, int n, int max_workers, LocalTreeStore** trees) {
+    for (int i = 0; i < n; i++) {
+        trees[i] = NULL;
+    }
+    if (n <= 0) {
+        return 0;
+    }
+
+    struct ManyJob job;
+    memset(&job, 0, sizeof(job));
+    job.pool = pool ? pool : d2_pool_create(max_workers);
+    job.server_name = server_name;
+    job.server_port = server_port;
+    job.ids = ids;
+    job.trees = trees;
+    job.n = n;
+    if (job.pool == NULL) {
+        return -1;
+    }
+
+    // Chunks of a full tagged batch, unless that would leave workers idle
+    int workers = max_workers < 1 ? 1 : max_workers;
+    job.chunk = (n + workers - 1) / workers;
+    if (job.chunk > D2_TAGGED_MAX) {
+        job.chunk = D2_TAGGED_MAX;
+    }
+    int chunks = (n + job.chunk - 1) / job.chunk;
+    if (workers > chunks) {
+        workers = chunks;
+    }
+
+    pthread_t* threads = malloc(workers * sizeof(pthread_t));
+    int started = 0;
+    if (threads != NULL) {
+        for (; started < workers; started++) {
+            if (pthread_create(&threads[started], NULL, run_many_worker, &job) != 0) {
+                break;
+            }
+        }
+    }
+    if (started == 0) {
+        // Without any thread, this one does the work
+        run_many_worker(&job);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    if (pool == NULL) {
+        d2_pool_delete(job.pool);
+    }
+    print_line_d2(__LINE__, __FILE__, "Finished bulk lookup (d2_lookup_many)");
+    return job.received;
+}
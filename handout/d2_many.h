@@ -0,0 +1,27 @@
+#ifndef D2_MANY_H
+#define D2_MANY_H
+
+#include "d2_pool.h"
+
+/* Bulk lookups.
+ *
+ * d2_lookup_many spreads the ids over up to max_workers threads. Every worker takes a
+ * D2Client from the pool for its own session and claims chunks of at most D2_TAGGED_MAX
+ * ids from a shared counter, which it looks up with d2_lookup_tagged, so a chunk is one
+ * batch of tagged requests on a server that supports them. The ids of a chunk whose
+ * session failed are tried once more on a fresh session.
+ *
+ * The sessions go back to the pool afterwards, so a pool that is passed in keeps them for
+ * the next call.
+ */
+
+/* Look up the n ids at the server. trees[i] is set to the tree of ids[i], or to NULL if
+ * that lookup failed; free the trees with d2_free_local_tree. pool can be NULL, then a
+ * pool is created for the call. At most max_workers threads run at once, and never more
+ * than there are chunks.
+ * Returns the number of trees received, or -1 in case of error (then all trees are NULL).
+ */
+int d2_lookup_many( D2Pool* pool, const char* server_name, uint16_t server_port,
+                    const uint32_t* ids, int n, int max_workers, LocalTreeStore** trees );
+
+#endif /* D2_MANY_H */
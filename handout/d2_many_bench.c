@@ -0,0 +1,52 @@
+/* ======================================================================
+ * Lookups per second of d2_lookup_many as the number of workers grows.
+ *
+ * Usage: d2_many_bench <server> <port> [ids] [max workers]
+ *   The server must answer several requests per association, e.g.
+ *   d2_shard_server.
+ * ====================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "d2_many.h"
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <server> <port> [ids] [max workers]\n", argv[0]);
+        return 1;
+    }
+    int n = argc > 3 ? atoi(argv[3]) : 2000;
+    int max_workers = argc > 4 ? atoi(argv[4]) : 8;
+
+    uint32_t* ids = malloc(n * sizeof(uint32_t));
+    LocalTreeStore** trees = malloc(n * sizeof(LocalTreeStore*));
+    if (ids == NULL || trees == NULL) {
+        return 1;
+    }
+    for (int i = 0; i < n; i++) {
+        ids[i] = 1001 + (uint32_t)i * 7919 % 100000;
+    }
+
+    printf("%d ids\n%8s %12s %8s\n", n, "workers", "lookups/s", "failed");
+    for (int workers = 1; workers <= max_workers; workers *= 2) {
+        double start = now_s();
+        int received = d2_lookup_many(NULL, argv[1], atoi(argv[2]), ids, n, workers, trees);
+        double elapsed = now_s() - start;
+        printf("%8d %12.0f %8d\n", workers, received / elapsed, n - received);
+        for (int i = 0; i < n; i++) {
+            d2_free_local_tree(trees[i]);
+        }
+    }
+
+    free(ids);
+    free(trees);
+    return 0;
+}
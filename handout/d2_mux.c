@@ -0,0 +1,249 @@
+/* ======================================================================
+ * D2 multiplexed lookups: tagged requests, interleaved responses.
+ * ====================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "d2_mux.h"
+#include "d2_arena.h"
+
+
+/* The state of one lookup of a batch, found by its tag (index + 1).
+ */
+struct TaggedLookup
+{
+    LocalTreeStore* tree;      /* allocated when the size arrives */
+    int             node_idx;  /* nodes received so far */
+    int             done;      /* the last response (or a size of 0) has arrived */
+};
+
+/*
+* START HELPER FUNCTIONS
+ */
+
+/**
+ * @brief Allocates a tree for a lookup, from the client's arena if it has one.
+ */
+static LocalTreeStore* alloc_tree(D2Client* client, int size) {
+    return client->arena != NULL ? d2_arena_tree(client->arena, size) : d2_alloc_local_tree(size);
+}
+
+/**
+ * @brief Sends count tagged requests in one D1 packet, tagged 1 to count.
+ *
+ * @param client The D2Client.
+ * @param ids The ids to look up.
+ * @param count The number of ids, at most D2_TAGGED_MAX.
+ * @return A positive value on success, or <= 0 on failure.
+ */
+static int send_tagged(D2Client* client, const uint32_t* ids, int count) {
+    PacketTaggedRequest requests[D2_TAGGED_MAX];
+    memset(requests, 0, sizeof(requests));
+    for (int k = 0; k < count; k++) {
+        requests[k].type = htons(TYPE_REQUEST);
+        requests[k].tag = htons(k + 1);
+        requests[k].id = htonl(ids[k]);
+    }
+    return d1_send_data(client->peer, (char*)requests, count * sizeof(PacketTaggedRequest));
+}
+
+/**
+ * @brief Receives the PacketResponses of a classic lookup, whose PacketResponseSize has
+ * already arrived.
+ *
+ * @param client The D2Client.
+ * @param packet The PacketResponseSize.
+ * @param len The length of the packet.
+ * @return The tree, or NULL on failure (and client->failed is set).
+ */
+static LocalTreeStore* recv_classic_tree(D2Client* client, char* packet, int len) {
+    if (len < (int)sizeof(PacketResponseSize) || ntohs(((PacketHeader*)packet)->type) != TYPE_RESPONSE_SIZE) {
+        check_error_d2(-1, "Received wrong packet type", __LINE__, __FILE__);
+        client->failed = 1;
+        return NULL;
+    }
+    int size = ntohs(((PacketResponseSize*)packet)->size);
+    if (size == 0) {
+        return NULL; // nothing follows
+    }
+    LocalTreeStore* tree = alloc_tree(client, size);
+    int node_idx = 0;
+    char buffer[PACKET_MAX];
+
+    while (tree != NULL) {
+        len = d1_recv_data(client->peer, buffer, PACKET_MAX - sizeof(D1Header));
+        int type = len >= (int)sizeof(PacketResponse) ? ntohs(((PacketHeader*)buffer)->type) : 0;
+        if (type != TYPE_RESPONSE && type != TYPE_LAST_RESPONSE) {
+            check_error_d2(-1, "Failed to receive a response", __LINE__, __FILE__);
+            break;
+        }
+        node_idx = d2_add_to_local_tree(tree, node_idx, buffer + sizeof(PacketResponse), len - sizeof(PacketResponse));
+        if (node_idx < 0) {
+            break;
+        }
+        if (type == TYPE_LAST_RESPONSE) {
+            return tree;
+        }
+    }
+    d2_free_local_tree(tree);
+    client->failed = 1;
+    return NULL;
+}
+
+/**
+ * @brief Looks up one id with a classic request, for servers without tags.
+ *
+ * @param client The D2Client.
+ * @param id The id.
+ * @return The tree, or NULL on failure.
+ */
+static LocalTreeStore* lookup_classic(D2Client* client, uint32_t id) {
+    // d1_send_data directly: d2_send_request would delete a client without a pool on failure
+    PacketRequest request;
+    memset(&request, 0, sizeof(request));
+    request.type = htons(TYPE_REQUEST);
+    request.id = htonl(id);
+    if (d1_send_data(client->peer, (char*)&request, sizeof(request)) <= 0) {
+        client->failed = 1;
+        return NULL;
+    }
+    char buffer[PACKET_MAX];
+    int len = d1_recv_data(client->peer, buffer, PACKET_MAX - sizeof(D1Header));
+    return recv_classic_tree(client, buffer, len);
+}
+
+/**
+ * @brief Handles one tagged packet of a batch.
+ *
+ * @param client The D2Client.
+ * @param lookups The lookups of the batch.
+ * @param count The number of lookups.
+ * @param packet The packet.
+ * @param len Its length.
+ * @return 1 if a lookup has completed with it, 0 if not, -1 on a protocol error.
+ */
+static int handle_tagged(D2Client* client, struct TaggedLookup* lookups, int count, char* packet, int len) {
+    if (len < (int)sizeof(PacketTaggedResponse)) {
+        return -1;
+    }
+    PacketTaggedResponse header;
+    memcpy(&header, packet, sizeof(header));
+    int type = ntohs(header.type) & ~TYPE_TAGGED;
+    int k = ntohs(header.tag) - 1;
+    if (k < 0 || k >= count || lookups[k].done) {
+        return -1;
+    }
+    struct TaggedLookup* lookup = &lookups[k];
+
+    if (type == TYPE_RESPONSE_SIZE) {
+        int size = ntohs(((PacketTaggedResponseSize*)packet)->size);
+        if (lookup->tree != NULL) {
+            return -1;
+        }
+        if (size == 0) {
+            lookup->done = 1;
+            return 1;
+        }
+        lookup->tree = alloc_tree(client, size);
+        return lookup->tree != NULL ? 0 : -1;
+    }
+    if ((type != TYPE_RESPONSE && type != TYPE_LAST_RESPONSE) || lookup->tree == NULL) {
+        return -1;
+    }
+    lookup->node_idx = d2_add_to_local_tree(lookup->tree, lookup->node_idx, packet + sizeof(header), len - sizeof(header));
+    if (lookup->node_idx < 0) {
+        return -1;
+    }
+    if (type == TYPE_LAST_RESPONSE) {
+        lookup->done = 1;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+* END HELPER FUNCTIONS
+ */
+
+/**
+ * @brief Looks up many ids on one association. Against a server that knows tags, up to
+ * D2_TAGGED_MAX lookups are in flight at once and their interleaved responses are
+ * demultiplexed by tag; otherwise the ids are looked up one after the other.
+ *
+ * @param client The D2Client.
+ * @param ids The ids to look up, in host byte order.
+ * @param n The number of ids.
+ * @param trees Set to the trees, NULL for the lookups that failed.
+ * @return The number of trees received.
+ */
+int d2_lookup_tagged(D2Client* client, const uint32_t* ids, int n, LocalTreeStore** trees) {
+    int received = 0;
+    int next = 0;
+    for (int i = 0; i < n; i++) {
+        trees[i] = NULL;
+    }
+    client->pending = 1;
+
+    while (next < n && !client->failed) {
+        if (client->tagged < 0) {
+            trees[next] = lookup_classic(client, ids[next]);
+            received += trees[next++] != NULL;
+            continue;
+        }
+
+        // Until the server has shown that it knows tags, one request at a time
+        int count = client->tagged > 0 ? n - next : 1;
+        if (count > D2_TAGGED_MAX) {
+            count = D2_TAGGED_MAX;
+        }
+        if (send_tagged(client, ids + next, count) <= 0) {
+            check_error_d2(-1, "Failed to send tagged requests", __LINE__, __FILE__);
+            client->failed = 1;
+            break;
+        }
+
+        struct TaggedLookup lookups[D2_TAGGED_MAX];
+        memset(lookups, 0, sizeof(lookups));
+        int open = count;
+        char buffer[PACKET_MAX];
+        while (open > 0) {
+            int len = d1_recv_data(client->peer, buffer, PACKET_MAX - sizeof(D1Header));
+            int type = len >= (int)sizeof(PacketHeader) ? ntohs(((PacketHeader*)buffer)->type) : 0;
+
+            if (client->tagged == 0 && type == TYPE_RESPONSE_SIZE) {
+                // A classic server, it has ignored the tag
+                client->tagged = -1;
+                lookups[0].tree = recv_classic_tree(client, buffer, len);
+                lookups[0].done = lookups[0].tree != NULL;
+                break;
+            }
+            int res = (type & TYPE_TAGGED) ? handle_tagged(client, lookups, count, buffer, len) : -1;
+            if (res < 0) {
+                check_error_d2(-1, "Failed to receive a tagged response", __LINE__, __FILE__);
+                client->failed = 1;
+                break;
+            }
+            client->tagged = 1;
+            open -= res;
+        }
+
+        for (int k = 0; k < count; k++) {
+            if (lookups[k].done && lookups[k].tree != NULL) {
+                trees[next + k] = lookups[k].tree;
+                received++;
+            } else {
+                d2_free_local_tree(lookups[k].tree);
+            }
+        }
+        next += count;
+    }
+
+    if (!client->failed) {
+        client->pending = 0;
+    }
+    print_line_d2(__LINE__, __FILE__, "Finished tagged lookups (d2_lookup_tagged)");
+    return received;
+}
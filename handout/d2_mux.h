@@ -0,0 +1,28 @@
+#ifndef D2_MUX_H
+#define D2_MUX_H
+
+#include "d2_lookup.h"
+
+/* Multiplexed lookups: many lookups in flight on one association, with the tagged
+ * requests described in d2_lookup_mod.h.
+ *
+ * The first request on a client is sent alone, as a tagged request. If the server answers
+ * with tagged packets, the remaining ids go out up to D2_TAGGED_MAX per D1 packet and
+ * their responses, which the server interleaves, are sorted out by tag. If it answers
+ * classically, the client remembers that (client->tagged) and looks the ids up one after
+ * the other on the same association, which needs a server that takes several requests
+ * per association.
+ *
+ * The client sends a batch only after all responses to the previous one have arrived:
+ * a stop-and-wait D1 client ignores data while it waits for an ACK, so a request sent into
+ * a running response stream would cost the server a retransmission timeout.
+ */
+
+/* Look up the n ids on the client's association. trees[i] is set to the tree of ids[i],
+ * or to NULL if that lookup failed; free the trees with d2_free_local_tree.
+ * Returns the number of trees received. If the association failed, client->failed is
+ * set and the trees of the remaining ids are NULL.
+ */
+int d2_lookup_tagged( D2Client* client, const uint32_t* ids, int n, LocalTreeStore** trees );
+
+#endif /* D2_MUX_H */
@@ -0,0 +1,277 @@
+/* ======================================================================
+ * D2 session pool: long-lived D2Clients reused across lookups.
+ * ====================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "d2_pool.h"
+#include "d1_resolve.h"
+
+
+/* One server, with its resolved address and its idle clients.
+ */
+struct D2PoolEndpoint
+{
+    char*                  name;
+    uint16_t               port;
+    struct sockaddr_in     addr;   /* the address of the last d1_resolve */
+    D2Client**             idle;   /* max_idle slots, the last returned client on top */
+    int                    nidle;
+    struct D2PoolEndpoint* next;
+};
+
+struct D2Pool
+{
+    pthread_mutex_t        lock;
+    int                    max_idle;
+    struct D2PoolEndpoint* endpoints;
+    D2PoolStats            stats;
+};
+
+/*
+* START HELPER FUNCTIONS
+ */
+
+/**
+ * @brief Finds the endpoint of the server. The pool must be locked.
+ *
+ * @param pool The pool.
+ * @param server_name The name as given to d2_pool_checkout.
+ * @param server_port The port.
+ * @return The endpoint, or NULL if the pool has none for the server yet.
+ */
+static struct D2PoolEndpoint* find_endpoint(D2Pool* pool, const char* server_name, uint16_t server_port) {
+    for (struct D2PoolEndpoint* ep = pool->endpoints; ep != NULL; ep = ep->next) {
+        if (ep->port == server_port && strcmp(ep->name, server_name) == 0) {
+            return ep;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Finds the endpoint a client talks to, by the address of its peer. The pool must
+ * be locked.
+ *
+ * @param pool The pool.
+ * @param client The client.
+ * @return The endpoint, or NULL.
+ */
+static struct D2PoolEndpoint* find_endpoint_of(D2Pool* pool, D2Client* client) {
+    for (struct D2PoolEndpoint* ep = pool->endpoints; ep != NULL; ep = ep->next) {
+        if (ep->addr.sin_port == client->peer->addr.sin_port &&
+            ep->addr.sin_addr.s_addr == client->peer->addr.sin_addr.s_addr) {
+            return ep;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Adds an endpoint for the server. The pool must be locked.
+ *
+ * @param pool The pool.
+ * @param server_name The name of the server.
+ * @param server_port The port.
+ * @param addr The resolved address.
+ * @return The endpoint, or NULL on failure.
+ */
+static struct D2PoolEndpoint* add_endpoint(D2Pool* pool, const char* server_name, uint16_t server_port,
+                                           struct sockaddr_in* addr) {
+    struct D2PoolEndpoint* ep = calloc(1, sizeof(struct D2PoolEndpoint));
+    if (ep == NULL) {
+        return NULL;
+    }
+    ep->name = strdup(server_name);
+    ep->idle = calloc(pool->max_idle, sizeof(D2Client*));
+    if (ep->name == NULL || ep->idle == NULL) {
+        free(ep->name);
+        free(ep->idle);
+        free(ep);
+        return NULL;
+    }
+    ep->port = server_port;
+    ep->addr = *addr;
+    ep->next = pool->endpoints;
+    pool->endpoints = ep;
+    return ep;
+}
+
+/**
+ * @brief Moves the endpoint to a new address. Its idle clients still talk to the old one,
+ * they are deleted. The pool must be locked.
+ *
+ * @param ep The endpoint.
+ * @param addr The address just resolved.
+ */
+static void move_endpoint(struct D2PoolEndpoint* ep, struct sockaddr_in* addr) {
+    ep->addr = *addr;
+    while (ep->nidle > 0) {
+        d2_client_delete(ep->idle[--ep->nidle]);
+    }
+}
+
+/**
+ * @brief Creates a client for an address that has already been resolved: only a new
+ * socket.
+ *
+ * @param addr The address of the server.
+ * @return The client, or NULL on failure.
+ */
+static D2Client* create_client_for(struct sockaddr_in* addr) {
+    D2Client* client = calloc(1, sizeof(D2Client));
+    if (client == NULL) {
+        return NULL;
+    }
+    client->peer = d1_create_client();
+    if (client->peer == NULL) {
+        free(client);
+        return NULL;
+    }
+    client->peer->addr = *addr;
+    return client;
+}
+
+/*
+* END HELPER FUNCTIONS
+ */
+
+/**
+ * @brief Creates an empty pool.
+ *
+ * @param max_idle The number of idle clients kept per server, at least 1.
+ * @return The pool, or NULL on failure.
+ */
+D2Pool* d2_pool_create(int max_idle) {
+    D2Pool* pool = calloc(1, sizeof(D2Pool));
+    if (pool == NULL) {
+        check_error_d2(-1, "Failed to allocate memory for D2Pool", __LINE__, __FILE__);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->max_idle = max_idle < 1 ? 1 : max_idle;
+    return pool;
+}
+
+/**
+ * @brief Deletes the idle clients, the endpoints and the pool.
+ *
+ * @param pool The pool, can be NULL.
+ * @return Always NULL.
+ */
+D2Pool* d2_pool_delete(D2Pool* pool) {
+    if (pool == NULL) {
+        return NULL;
+    }
+    struct D2PoolEndpoint* ep = pool->endpoints;
+    while (ep != NULL) {
+        struct D2PoolEndpoint* next = ep->next;
+        for (int i = 0; i < ep->nidle; i++) {
+            d2_client_delete(ep->idle[i]);
+        }
+        free(ep->idle);
+        free(ep->name);
+        free(ep);
+        ep = next;
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+    return NULL;
+}
+
+/**
+ * @brief Hands out an idle client of the server, or creates a new one. The name is
+ * resolved for every checkout with d1_resolve, which serves it from its cache until the
+ * TTL runs out. When the address has changed, the idle clients of the old address are
+ * deleted.
+ *
+ * @param pool The pool.
+ * @param server_name The name of the server (e.g., "localhost" or "127.0.0.1").
+ * @param server_port The port of the server.
+ * @return The client, or NULL on failure.
+ */
+D2Client* d2_pool_checkout(D2Pool* pool, const char* server_name, uint16_t server_port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(server_port);
+    if (!d1_resolve(server_name, &addr.sin_addr)) {
+        check_error_d2(-1, "Failed to resolve the server of the pool", __LINE__, __FILE__);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    struct D2PoolEndpoint* ep = find_endpoint(pool, server_name, server_port);
+    if (ep == NULL && add_endpoint(pool, server_name, server_port, &addr) == NULL) {
+        check_error_d2(-1, "Failed to allocate memory for a pool endpoint", __LINE__, __FILE__);
+    }
+    if (ep != NULL && ep->addr.sin_addr.s_addr != addr.sin_addr.s_addr) {
+        move_endpoint(ep, &addr);
+    }
+    if (ep != NULL && ep->nidle > 0) {
+        D2Client* client = ep->idle[--ep->nidle];
+        pool->stats.reused++;
+        pthread_mutex_unlock(&pool->lock);
+        return client;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    // Sockets are created without holding the lock
+    D2Client* client = create_client_for(&addr);
+    if (client == NULL) {
+        check_error_d2(-1, "Failed to create pooled D2 client", __LINE__, __FILE__);
+        return NULL;
+    }
+    client->pool = pool;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stats.created++;
+    pthread_mutex_unlock(&pool->lock);
+
+    print_line_d2(__LINE__, __FILE__, "Created pooled D2 client");
+    return client;
+}
+
+/**
+ * @brief Takes a client back. A client whose last lookup failed or was not read to the
+ * end is deleted, as is one that does not fit into the idle slots of its server.
+ *
+ * @param pool The pool the client was checked out from.
+ * @param client The client, can be NULL.
+ */
+void d2_pool_return(D2Pool* pool, D2Client* client) {
+    if (client == NULL) {
+        return;
+    }
+
+    client->arena = NULL; // the arena was the borrower's
+    pthread_mutex_lock(&pool->lock);
+    if (client->failed || client->pending) {
+        pool->stats.recycled++;
+    } else {
+        struct D2PoolEndpoint* ep = find_endpoint_of(pool, client);
+        if (ep != NULL && ep->nidle < pool->max_idle) {
+            ep->idle[ep->nidle++] = client;
+            client = NULL;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    d2_client_delete(client);
+}
+
+/**
+ * @brief Copies the counters of the pool.
+ *
+ * @param pool The pool.
+ * @param stats Where to copy them to.
+ */
+void d2_pool_stats(D2Pool* pool, D2PoolStats* stats) {
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+}
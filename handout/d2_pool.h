@@ -0,0 +1,62 @@
+#ifndef D2_POOL_H
+#define D2_POOL_H
+
+#include "d2_lookup.h"
+
+/* A pool of long-lived D2Clients, so that a stream of lookups does not create a socket
+ * and resolve the server name for every request.
+ *
+ * d2_pool_checkout hands out an idle client of the server, or creates one. Every checkout
+ * resolves the name with d1_resolve, which answers from its cache and so honours its TTL;
+ * when the address changes, the idle clients of the old address are dropped, and clients
+ * of it that come back are deleted. After the lookup the client goes back with
+ * d2_pool_return and keeps its socket and D1 sequence numbers for the next lookup.
+ *
+ * A client is reused only when its last lookup is complete: the request was sent and
+ * the response size and the TYPE_LAST_RESPONSE packet have been received without error.
+ * Otherwise the D1 state or stray packets from the server could spoil the next lookup,
+ * so the client is deleted when it is returned and replaced by a new one later. For this,
+ * d2_send_request does not delete a pooled client when sending fails.
+ *
+ * The pool is thread-safe. Every client is used by one thread at a time.
+ *
+ * The server must answer several requests on one association. d2_shard_server does;
+ * the prebuilt d2_server ends after the first request.
+ */
+
+typedef struct D2Pool D2Pool;
+
+struct D2PoolStats
+{
+    long created;    /* clients created */
+    long reused;     /* checkouts served by an idle client */
+    long recycled;   /* clients deleted on return because their lookup failed or is incomplete */
+};
+
+typedef struct D2PoolStats D2PoolStats;
+
+/* Create a pool that keeps up to max_idle idle clients per server.
+ * Returns NULL in case of failure.
+ */
+D2Pool* d2_pool_create( int max_idle );
+
+/* Delete the idle clients and the pool. All checked out clients must have been returned.
+ * Returns always NULL.
+ */
+D2Pool* d2_pool_delete( D2Pool* pool );
+
+/* Get a client for the server, an idle one if there is one.
+ * Returns NULL in case of failure.
+ */
+D2Client* d2_pool_checkout( D2Pool* pool, const char* server_name, uint16_t server_port );
+
+/* Give a client back after a lookup. It is kept for reuse if the lookup completed and
+ * there is room, otherwise deleted.
+ */
+void d2_pool_return( D2Pool* pool, D2Client* client );
+
+/* Copy the counters of the pool into stats.
+ */
+void d2_pool_stats( D2Pool* pool, D2PoolStats* stats );
+
+#endif /* D2_POOL_H */
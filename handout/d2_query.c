@@ -0,0 +1,218 @@
+/* ======================================================================
+ * D2 tree queries: subtree aggregates, ancestors and depths from an index
+ * over the depth first id order.
+ * ====================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "d2_query.h"
+
+struct D2TreeIndex
+{
+    const LocalTreeStore* tree;
+    int                   n;
+    int*                  parent;   /* -1 for the root */
+    int*                  depth;
+    uint64_t*             prefix;   /* n + 1 entries, prefix[i] is the sum of value[0..i) */
+    uint32_t*             min;      /* segment trees of 2n entries, leaf i at n + i */
+    uint32_t*             max;
+};
+
+
+/*
+* START HELPER FUNCTIONS
+ */
+
+/**
+ * Checks that an id is in the tree.
+ *
+ * @param index The D2TreeIndex.
+ * @param id The id.
+ * @return 1 if it is, 0 if not.
+ */
+static int valid(const D2TreeIndex* index, int id) {
+    return index != NULL && id >= 0 && id < index->n;
+}
+
+/**
+ * The minimum and maximum of the values of the ids [l, r), from the segment trees: a
+ * node at position p covers the ranges of 2p and 2p + 1, so walking up from both ends
+ * takes the nodes that cover the range between them.
+ *
+ * @param index The D2TreeIndex.
+ * @param l The first id.
+ * @param r One past the last id, r > l.
+ * @param min Set to the minimum.
+ * @param max Set to the maximum.
+ */
+static void range_min_max(const D2TreeIndex* index, int l, int r, uint32_t* min, uint32_t* max) {
+    uint32_t lo = UINT32_MAX;
+    uint32_t hi = 0;
+    for (l += index->n, r += index->n; l < r; l /= 2, r /= 2) {
+        if (l & 1) {
+            lo = index->min[l] < lo ? index->min[l] : lo;
+            hi = index->max[l] > hi ? index->max[l] : hi;
+            l++;
+        }
+        if (r & 1) {
+            r--;
+            lo = index->min[r] < lo ? index->min[r] : lo;
+            hi = index->max[r] > hi ? index->max[r] : hi;
+        }
+    }
+    *min = lo;
+    *max = hi;
+}
+
+/*
+* END HELPER FUNCTIONS
+ */
+
+/**
+ * Builds the index of a tree in one pass over its nodes. A stack holds the ancestors of
+ * the current node: those whose subtree has not ended yet. The top of the stack is the
+ * parent, its size the depth.
+ *
+ * @param tree A complete LocalTreeStore.
+ * @return The index, or NULL on failure.
+ */
+D2TreeIndex* d2_query_create(const LocalTreeStore* tree) {
+    if (tree == NULL || tree->number_of_nodes <= 0 || tree->filled != tree->number_of_nodes) {
+        fprintf(stderr, "The tree is empty or not complete.\n");
+        return NULL;
+    }
+    int n = tree->number_of_nodes;
+
+    D2TreeIndex* index = calloc(1, sizeof(D2TreeIndex));
+    // One block: prefix first for its alignment, then the 4 byte arrays
+    char* block = malloc((n + 1) * sizeof(uint64_t) + 2 * n * sizeof(int) + 4 * n * sizeof(uint32_t));
+    int* stack = malloc(n * sizeof(int));
+    if (index == NULL || block == NULL || stack == NULL) {
+        free(index);
+        free(block);
+        free(stack);
+        check_error_d2(-1, "Failed to allocate the tree index", __LINE__, __FILE__);
+        return NULL;
+    }
+    index->tree = tree;
+    index->n = n;
+    index->prefix = (uint64_t*)block;
+    index->parent = (int*)(index->prefix + n + 1);
+    index->depth = index->parent + n;
+    index->min = (uint32_t*)(index->depth + n);
+    index->max = index->min + 2 * n;
+
+    int top = 0;
+    index->prefix[0] = 0;
+    for (int i = 0; i < n; i++) {
+        while (top > 0 && tree->subtree_end[stack[top - 1]] <= (uint32_t)i) {
+            top--;
+        }
+        index->parent[i] = top > 0 ? stack[top - 1] : -1;
+        index->depth[i] = top;
+        stack[top++] = i;
+
+        index->prefix[i + 1] = index->prefix[i] + tree->value[i];
+        index->min[n + i] = tree->value[i];
+        index->max[n + i] = tree->value[i];
+    }
+    for (int p = n - 1; p > 0; p--) {
+        index->min[p] = index->min[2 * p] < index->min[2 * p + 1] ? index->min[2 * p] : index->min[2 * p + 1];
+        index->max[p] = index->max[2 * p] > index->max[2 * p + 1] ? index->max[2 * p] : index->max[2 * p + 1];
+    }
+    free(stack);
+    return index;
+}
+
+/**
+ * Frees an index.
+ *
+ * @param index The D2TreeIndex, may be NULL.
+ * @return Always NULL.
+ */
+D2TreeIndex* d2_query_delete(D2TreeIndex* index) {
+    if (index) {
+        free(index->prefix); // the start of the block
+        free(index);
+    }
+    return NULL;
+}
+
+/**
+ * Aggregates the values of a subtree.
+ *
+ * @param index The D2TreeIndex.
+ * @param id The root of the subtree.
+ * @param stats Set to the count, sum, minimum and maximum.
+ * @return 0 on success, or -1 if id is not in the tree.
+ */
+int d2_query_subtree(const D2TreeIndex* index, int id, D2SubtreeStats* stats) {
+    if (!valid(index, id) || stats == NULL) {
+        return -1;
+    }
+    int end = index->tree->subtree_end[id];
+    stats->count = end - id;
+    stats->sum = index->prefix[end] - index->prefix[id];
+    range_min_max(index, id, end, &stats->min, &stats->max);
+    return 0;
+}
+
+/**
+ * Tells if a node is in the subtree of another, from the id ranges.
+ *
+ * @param index The D2TreeIndex.
+ * @param a The possible ancestor.
+ * @param b The possible descendant.
+ * @return 1 if a is b or an ancestor of b, 0 if not, -1 if an id is not in the tree.
+ */
+int d2_query_is_ancestor(const D2TreeIndex* index, int a, int b) {
+    if (!valid(index, a) || !valid(index, b)) {
+        return -1;
+    }
+    return a <= b && (uint32_t)b < index->tree->subtree_end[a];
+}
+
+/**
+ * The depth of a node.
+ *
+ * @param index The D2TreeIndex.
+ * @param id The node.
+ * @return The depth, 0 for the root, or -1 if id is not in the tree.
+ */
+int d2_query_depth(const D2TreeIndex* index, int id) {
+    return valid(index, id) ? index->depth[id] : -1;
+}
+
+/**
+ * The parent of a node.
+ *
+ * @param index The D2TreeIndex.
+ * @param id The node.
+ * @return The parent, or -1 for the root or if id is not in the tree.
+ */
+int d2_query_parent(const D2TreeIndex* index, int id) {
+    return valid(index, id) ? index->parent[id] : -1;
+}
+
+/**
+ * The path from a node up to the root.
+ *
+ * @param index The D2TreeIndex.
+ * @param id The node.
+ * @param path Filled with id, its parent, and so on up to the root.
+ * @param max The size of path.
+ * @return The length of the whole path, or -1 if id is not in the tree.
+ */
+int d2_query_path(const D2TreeIndex* index, int id, int* path, int max) {
+    if (!valid(index, id)) {
+        return -1;
+    }
+    int len = index->depth[id] + 1;
+    for (int k = 0; k < len && k < max; k++) {
+        path[k] = id;
+        id = index->parent[id];
+    }
+    return len;
+}
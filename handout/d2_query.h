@@ -0,0 +1,70 @@
+#ifndef D2_QUERY_H
+#define D2_QUERY_H
+
+#include "d2_lookup.h"
+
+/* Queries on a complete tree without walking it.
+ *
+ * The ids of a tree are in depth first order, so the subtree of a node is the id range
+ * [id, subtree_end[id]) of the LocalTreeStore. d2_query_create builds, in one pass over
+ * the nodes, the parent and depth of every node, prefix sums over value and a segment
+ * tree with the minimum and maximum of every aligned id range. Then:
+ *
+ *   subtree count, sum     O(1)
+ *   subtree min, max       O(log n)
+ *   ancestor test, depth   O(1)
+ *   parent                 O(1)
+ *   path to the root       O(depth), the length of the answer
+ *
+ * The index takes 32 bytes per node and refers to the tree, which has to outlive
+ * it and must not change. Queries only read the index, so any number of threads can
+ * run them at the same time.
+ */
+
+typedef struct D2TreeIndex D2TreeIndex;
+
+struct D2SubtreeStats
+{
+    int      count;    /* nodes in the subtree, the node included */
+    uint64_t sum;      /* of their values */
+    uint32_t min;
+    uint32_t max;
+};
+
+typedef struct D2SubtreeStats D2SubtreeStats;
+
+/* Build the index of a complete tree (all nodes added with d2_add_to_local_tree).
+ * Returns NULL in case of failure.
+ */
+D2TreeIndex* d2_query_create( const LocalTreeStore* tree );
+
+/* Free the index, not the tree.
+ * Returns always NULL.
+ */
+D2TreeIndex* d2_query_delete( D2TreeIndex* index );
+
+/* Count, sum, minimum and maximum of the values in the subtree of id.
+ * Returns 0, or -1 if id is not in the tree.
+ */
+int d2_query_subtree( const D2TreeIndex* index, int id, D2SubtreeStats* stats );
+
+/* Returns 1 if a is b or an ancestor of b, 0 if not, and -1 if one of them is not in the
+ * tree.
+ */
+int d2_query_is_ancestor( const D2TreeIndex* index, int a, int b );
+
+/* Returns the depth of id (0 for the root), or -1 if id is not in the tree.
+ */
+int d2_query_depth( const D2TreeIndex* index, int id );
+
+/* Returns the parent of id, -1 for the root or if id is not in the tree.
+ */
+int d2_query_parent( const D2TreeIndex* index, int id );
+
+/* Write the ids from id up to the root into path, at most max of them.
+ * Returns the length of the whole path (depth + 1), which may be more than max, or -1 if
+ * id is not in the tree.
+ */
+int d2_query_path( const D2TreeIndex* index, int id, int* path, int max );
+
+#endif /* D2_QUERY_H */
@@ -0,0 +1,215 @@
+/* ======================================================================
+ * Checks the answers of the tree index (d2_query.h) against recursive
+ * walks of the tree, and compares the time per query.
+ *
+ * The trees are synthetic, with random shapes in depth first order, loaded
+ * through d2_add_to_local_tree five nodes at a time like a response. The
+ * walks are what a client does without the index: visit the subtree for
+ * its aggregates, and search from the root for a node's depth and path.
+ * The program exits with 1 on the first wrong answer, before any timing.
+ *
+ * Usage: d2_query_bench [queries]
+ * ====================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "d2_lookup.h"
+#include "d2_query.h"
+
+#define NODES_PER_PACKET 5
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* A random tree in depth first order, loaded into a LocalTreeStore like a response.
+ * max_children limits the shape: 1 gives a path, 5 any tree. */
+static LocalTreeStore* make_tree(int count, int max_children, unsigned seed) {
+    NetNode* nodes = malloc(count * sizeof(NetNode));
+    int* path = malloc(count * sizeof(int));
+    int depth = 1;
+    path[0] = 0;
+    for (int i = 0; i < count; i++) {
+        nodes[i].id = i;
+        nodes[i].value = rand_r(&seed) % 100000;
+        nodes[i].num_children = 0;
+        if (i == 0) {
+            continue;
+        }
+        int up = depth - 1 - rand_r(&seed) % depth;
+        while (nodes[path[up]].num_children == (uint32_t)max_children) {
+            up++;
+        }
+        NetNode* parent = &nodes[path[up]];
+        parent->child_id[parent->num_children++] = i;
+        depth = up + 1;
+        path[depth++] = i;
+    }
+
+    LocalTreeStore* tree = d2_alloc_local_tree(count);
+    char payload[NODES_PER_PACKET * sizeof(NetNode)];
+    for (int first = 0; first < count; first += NODES_PER_PACKET) {
+        int len = 0;
+        for (int i = first; i < count && i < first + NODES_PER_PACKET; i++) {
+            uint32_t fields[3 + NODES_PER_PACKET];
+            fields[0] = htonl(nodes[i].id);
+            fields[1] = htonl(nodes[i].value);
+            fields[2] = htonl(nodes[i].num_children);
+            for (uint32_t c = 0; c < nodes[i].num_children; c++) {
+                fields[3 + c] = htonl(nodes[i].child_id[c]);
+            }
+            memcpy(payload + len, fields, (3 + nodes[i].num_children) * sizeof(uint32_t));
+            len += (3 + nodes[i].num_children) * sizeof(uint32_t);
+        }
+        d2_add_to_local_tree(tree, first, payload, len);
+    }
+    free(path);
+    free(nodes);
+    return tree;
+}
+
+/* The recursive walks. */
+
+static void walk_subtree(const LocalTreeStore* tree, int id, D2SubtreeStats* stats) {
+    stats->count++;
+    stats->sum += tree->value[id];
+    stats->min = tree->value[id] < stats->min ? tree->value[id] : stats->min;
+    stats->max = tree->value[id] > stats->max ? tree->value[id] : stats->max;
+    for (int k = 0; k < d2_tree_num_children(tree, id); k++) {
+        walk_subtree(tree, d2_tree_child(tree, id, k), stats);
+    }
+}
+
+/* Searches target below id; on the way back, fills in the path from target up. Returns
+ * the depth of target below id, or -1 if it is not there. */
+static int walk_find(const LocalTreeStore* tree, int id, int target, int* path, int depth) {
+    if (id == target) {
+        path[0] = id;
+        return 0;
+    }
+    for (int k = 0; k < d2_tree_num_children(tree, id); k++) {
+        int below = walk_find(tree, d2_tree_child(tree, id, k), target, path, depth + 1);
+        if (below >= 0) {
+            path[below + 1] = id;
+            return below + 1;
+        }
+    }
+    return -1;
+}
+
+static int check(const LocalTreeStore* tree, const D2TreeIndex* index, int* ids, int queries, int* path, int* path2) {
+    for (int q = 0; q < queries; q++) {
+        int id = ids[q];
+        int other = ids[(q + 1) % queries];
+        D2SubtreeStats a = { 0, 0, UINT32_MAX, 0 };
+        D2SubtreeStats b;
+        walk_subtree(tree, id, &a);
+        int depth = walk_find(tree, 0, id, path, 0);
+        int below = walk_find(tree, id, other, path2, 0);
+        if (d2_query_subtree(index, id, &b) != 0 || a.count != b.count || a.sum != b.sum || a.min != b.min || a.max != b.max) {
+            printf("WRONG: subtree of %d\n", id);
+            return 1;
+        }
+        if (d2_query_depth(index, id) != depth || d2_query_parent(index, id) != (depth > 0 ? path[1] : -1) ||
+            d2_query_is_ancestor(index, id, other) != (below >= 0)) {
+            printf("WRONG: depth, parent or ancestor of %d\n", id);
+            return 1;
+        }
+        if (d2_query_path(index, id, path2, tree->number_of_nodes) != depth + 1 ||
+            memcmp(path, path2, (depth + 1) * sizeof(int)) != 0) {
+            printf("WRONG: path of %d\n", id);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void measure(const char* shape, const LocalTreeStore* tree, int queries) {
+    int n = tree->number_of_nodes;
+    int* ids = malloc(queries * sizeof(int));
+    int* path = malloc(n * sizeof(int));
+    int* path2 = malloc(n * sizeof(int));
+    unsigned seed = 7;
+    for (int q = 0; q < queries; q++) {
+        ids[q] = rand_r(&seed) % n;
+    }
+
+    double start = now_s();
+    D2TreeIndex* index = d2_query_create(tree);
+    double build_ms = (now_s() - start) * 1e3;
+    if (index == NULL || check(tree, index, ids, queries < 1000 ? queries : 1000, path, path2)) {
+        exit(1);
+    }
+
+    // The walks are slow, a few of the queries are enough for them
+    int walks = queries < 1000 ? queries : 1000;
+    volatile uint64_t sink = 0;
+    double t[2][3];
+
+    start = now_s();
+    for (int q = 0; q < walks; q++) {
+        D2SubtreeStats s = { 0, 0, UINT32_MAX, 0 };
+        walk_subtree(tree, ids[q], &s);
+        sink += s.sum + s.min;
+    }
+    t[0][0] = (now_s() - start) / walks * 1e9;
+    start = now_s();
+    for (int q = 0; q < walks; q++) {
+        sink += walk_find(tree, 0, ids[q], path, 0);
+    }
+    t[0][1] = (now_s() - start) / walks * 1e9;
+    start = now_s();
+    for (int q = 0; q < walks; q++) {
+        sink += walk_find(tree, ids[q], ids[(q + 1) % queries], path, 0) >= 0;
+    }
+    t[0][2] = (now_s() - start) / walks * 1e9;
+
+    start = now_s();
+    for (int q = 0; q < queries; q++) {
+        D2SubtreeStats s;
+        d2_query_subtree(index, ids[q], &s);
+        sink += s.sum + s.min;
+    }
+    t[1][0] = (now_s() - start) / queries * 1e9;
+    start = now_s();
+    for (int q = 0; q < queries; q++) {
+        sink += d2_query_path(index, ids[q], path, n);
+    }
+    t[1][1] = (now_s() - start) / queries * 1e9;
+    start = now_s();
+    for (int q = 0; q < queries; q++) {
+        sink += d2_query_is_ancestor(index, ids[q], ids[(q + 1) % queries]);
+    }
+    t[1][2] = (now_s() - start) / queries * 1e9;
+    (void)sink;
+
+    printf("%s tree, %d nodes, index built in %.2f ms\n", shape, n, build_ms);
+    printf("  %-16s %18s %18s %18s\n", "ns per query", "subtree stats", "depth and path", "ancestor test");
+    printf("  %-16s %18.0f %18.0f %18.0f\n", "recursive walk", t[0][0], t[0][1], t[0][2]);
+    printf("  %-16s %18.0f %18.0f %18.0f\n", "index", t[1][0], t[1][1], t[1][2]);
+
+    d2_query_delete(index);
+    free(ids);
+    free(path);
+    free(path2);
+}
+
+int main(int argc, char* argv[]) {
+    int queries = argc > 1 ? atoi(argv[1]) : 20000;
+
+    LocalTreeStore* random = make_tree(1 << 16, 5, 1);
+    LocalTreeStore* deep = make_tree(1 << 13, 1, 2);
+    measure("random", random, queries);
+    measure("path", deep, queries);
+    printf("all answers match the recursive walks\n");
+
+    d2_free_local_tree(random);
+    d2_free_local_tree(deep);
+    return 0;
+}
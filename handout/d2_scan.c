@@ -0,0 +1,708 @@
+/* ======================================================================
+ * D2 value scans: range filters, min/max/sum and top-k over the value
+ * column of trees. Scalar, SSE4.1 and AVX2 kernels, picked at runtime,
+ * and worker threads across trees.
+ * ====================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define D2_SCAN_X86 1
+#endif
+
+#include "d2_scan.h"
+
+
+#define BITMAP_WORDS(n) (((n) + 63) / 64)
+
+enum ScanOp { SCAN_FILTER, SCAN_STATS, SCAN_TOP_K };
+
+/* The k best hits so far, a heap with the worst of them on top. */
+struct TopK
+{
+    D2ScanHit* heap;
+    int        size;
+    int        k;
+};
+
+/* A scan over many trees, shared by its workers. */
+struct ScanJob
+{
+    enum ScanOp                  op;
+    const LocalTreeStore* const* trees;
+    int                          ntrees;
+    const struct D2ScanImpl*     impl;
+    uint32_t                     lo;
+    uint32_t                     span;       /* hi - lo */
+    uint64_t**                   bitmaps;    /* may be NULL */
+    long*                        counts;     /* may be NULL */
+    D2ScanStats*                 per_tree;   /* may be NULL */
+    int                          k;
+    int                          next;       /* first tree that has not been claimed, taken atomically */
+    pthread_mutex_t              lock;       /* for the results below */
+    long                         matches;
+    D2ScanStats                  total;
+    struct TopK                  top;
+    int                          failed;
+};
+
+
+/*
+* START HELPER FUNCTIONS
+ */
+
+static void stats_init(D2ScanStats* stats) {
+    stats->count = 0;
+    stats->sum = 0;
+    stats->min = UINT32_MAX;
+    stats->max = 0;
+}
+
+static void stats_merge(D2ScanStats* into, const D2ScanStats* from) {
+    into->count += from->count;
+    into->sum += from->sum;
+    into->min = from->min < into->min ? from->min : into->min;
+    into->max = from->max > into->max ? from->max : into->max;
+}
+
+/**
+ * The scalar filter from an index on, for the values the vector kernels leave over.
+ * The bits are ORed in, so the bitmap has to be cleared already.
+ *
+ * @param values The values.
+ * @param start The first index.
+ * @param n The number of values.
+ * @param lo The lower end of the range.
+ * @param span The width of the range, hi - lo.
+ * @param bitmap The selection bitmap.
+ * @return The number of matches from start on.
+ */
+static long scalar_filter_from(const uint32_t* values, int start, int n, uint32_t lo, uint32_t span, uint64_t* bitmap) {
+    long count = 0;
+    for (int i = start; i < n; i++) {
+        // Below lo wraps around to a large number, so one comparison covers both ends
+        if (values[i] - lo <= span) {
+            bitmap[i / 64] |= 1ull << (i % 64);
+            count++;
+        }
+    }
+    return count;
+}
+
+static void scalar_stats_from(const uint32_t* values, int start, int n, D2ScanStats* stats) {
+    for (int i = start; i < n; i++) {
+        stats->sum += values[i];
+        stats->min = values[i] < stats->min ? values[i] : stats->min;
+        stats->max = values[i] > stats->max ? values[i] : stats->max;
+    }
+    stats->count += n > start ? n - start : 0;
+}
+
+static long scalar_filter(const uint32_t* values, int n, uint32_t lo, uint32_t span, uint64_t* bitmap) {
+    memset(bitmap, 0, BITMAP_WORDS(n) * sizeof(uint64_t));
+    return scalar_filter_from(values, 0, n, lo, span, bitmap);
+}
+
+static void scalar_stats(const uint32_t* values, int n, D2ScanStats* stats) {
+    stats_init(stats);
+    scalar_stats_from(values, 0, n, stats);
+}
+
+static int scalar_next_above(const uint32_t* values, int start, int n, uint32_t threshold) {
+    for (int i = start; i < n; i++) {
+        if (values[i] > threshold) {
+            return i;
+        }
+    }
+    return n;
+}
+
+#ifdef D2_SCAN_X86
+
+/* The bitmap is written a byte (8 values) at a time: on x86, byte j of the words holds
+ * the bits 8j to 8j + 7. A value is in the range if min(value - lo, span) is value - lo,
+ * as there is no unsigned compare. */
+
+__attribute__((target("sse4.1")))
+static long sse41_filter(const uint32_t* values, int n, uint32_t lo, uint32_t span, uint64_t* bitmap) {
+    memset(bitmap, 0, BITMAP_WORDS(n) * sizeof(uint64_t));
+    uint8_t* bytes = (uint8_t*)bitmap;
+    const __m128i vlo = _mm_set1_epi32(lo);
+    const __m128i vspan = _mm_set1_epi32(span);
+    long count = 0;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i d0 = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)(values + i)), vlo);
+        __m128i d1 = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)(values + i + 4)), vlo);
+        int m0 = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_min_epu32(d0, vspan), d0)));
+        int m1 = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_min_epu32(d1, vspan), d1)));
+        int mask = m0 | (m1 << 4);
+        bytes[i / 8] = mask;
+        count += __builtin_popcount(mask);
+    }
+    return count + scalar_filter_from(values, i, n, lo, span, bitmap);
+}
+
+__attribute__((target("sse4.1")))
+static void sse41_stats(const uint32_t* values, int n, D2ScanStats* stats) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i vmin = _mm_set1_epi32(-1);
+    __m128i vmax = zero;
+    __m128i sum0 = zero;
+    __m128i sum1 = zero;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(values + i));
+        vmin = _mm_min_epu32(vmin, v);
+        vmax = _mm_max_epu32(vmax, v);
+        // Widened to 64 bit lanes, so the sum can't overflow
+        sum0 = _mm_add_epi64(sum0, _mm_unpacklo_epi32(v, zero));
+        sum1 = _mm_add_epi64(sum1, _mm_unpackhi_epi32(v, zero));
+    }
+    uint32_t mins[4];
+    uint32_t maxs[4];
+    uint64_t sums[2];
+    _mm_storeu_si128((__m128i*)mins, vmin);
+    _mm_storeu_si128((__m128i*)maxs, vmax);
+    _mm_storeu_si128((__m128i*)sums, _mm_add_epi64(sum0, sum1));
+
+    stats_init(stats);
+    stats->count = i;
+    stats->sum = sums[0] + sums[1];
+    for (int k = 0; k < 4 && i > 0; k++) {
+        stats->min = mins[k] < stats->min ? mins[k] : stats->min;
+        stats->max = maxs[k] > stats->max ? maxs[k] : stats->max;
+    }
+    scalar_stats_from(values, i, n, stats);
+}
+
+__attribute__((target("sse4.1")))
+static int sse41_next_above(const uint32_t* values, int start, int n, uint32_t threshold) {
+    if (threshold == UINT32_MAX) {
+        return n;
+    }
+    // Above the threshold is at least threshold + 1: max(value, threshold + 1) is value
+    const __m128i above = _mm_set1_epi32(threshold + 1);
+    int i = start;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(values + i));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_max_epu32(v, above), v)));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return scalar_next_above(values, i, n, threshold);
+}
+
+__attribute__((target("avx2")))
+static long avx2_filter(const uint32_t* values, int n, uint32_t lo, uint32_t span, uint64_t* bitmap) {
+    memset(bitmap, 0, BITMAP_WORDS(n) * sizeof(uint64_t));
+    uint8_t* bytes = (uint8_t*)bitmap;
+    const __m256i vlo = _mm256_set1_epi32(lo);
+    const __m256i vspan = _mm256_set1_epi32(span);
+    long count = 0;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i d = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(values + i)), vlo);
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_min_epu32(d, vspan), d)));
+        bytes[i / 8] = mask;
+        count += __builtin_popcount(mask);
+    }
+    // GCC does not always clear the upper halves before the call, see d1_checksum.c
+    _mm256_zeroupper();
+    return count + scalar_filter_from(values, i, n, lo, span, bitmap);
+}
+
+__attribute__((target("avx2")))
+static void avx2_stats(const uint32_t* values, int n, D2ScanStats* stats) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i vmin = _mm256_set1_epi32(-1);
+    __m256i vmax = zero;
+    __m256i sum0 = zero;
+    __m256i sum1 = zero;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(values + i));
+        vmin = _mm256_min_epu32(vmin, v);
+        vmax = _mm256_max_epu32(vmax, v);
+        sum0 = _mm256_add_epi64(sum0, _mm256_unpacklo_epi32(v, zero));
+        sum1 = _mm256_add_epi64(sum1, _mm256_unpackhi_epi32(v, zero));
+    }
+    uint32_t mins[8];
+    uint32_t maxs[8];
+    uint64_t sums[4];
+    _mm256_storeu_si256((__m256i*)mins, vmin);
+    _mm256_storeu_si256((__m256i*)maxs, vmax);
+    _mm256_storeu_si256((__m256i*)sums, _mm256_add_epi64(sum0, sum1));
+    _mm256_zeroupper();
+
+    stats_init(stats);
+    stats->count = i;
+    stats->sum = sums[0] + sums[1] + sums[2] + sums[3];
+    for (int k = 0; k < 8 && i > 0; k++) {
+        stats->min = mins[k] < stats->min ? mins[k] : stats->min;
+        stats->max = maxs[k] > stats->max ? maxs[k] : stats->max;
+    }
+    scalar_stats_from(values, i, n, stats);
+}
+
+__attribute__((target("avx2")))
+static int avx2_next_above(const uint32_t* values, int start, int n, uint32_t threshold) {
+    if (threshold == UINT32_MAX) {
+        return n;
+    }
+    const __m256i above = _mm256_set1_epi32(threshold + 1);
+    int i = start;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(values + i));
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_max_epu32(v, above), v)));
+        if (mask) {
+            _mm256_zeroupper();
+            return i + __builtin_ctz(mask);
+        }
+    }
+    _mm256_zeroupper();
+    return scalar_next_above(values, i, n, threshold);
+}
+
+#endif /* D2_SCAN_X86 */
+
+static const D2ScanImpl impls[] = {
+    { "scalar", scalar_filter, scalar_stats, scalar_next_above },
+#ifdef D2_SCAN_X86
+    { "sse4.1", sse41_filter, sse41_stats, sse41_next_above },
+    { "avx2", avx2_filter, avx2_stats, avx2_next_above },
+#endif
+};
+
+/* The implementation in use, atomic. Threads that race on the first call all store the
+ * same one. */
+static const D2ScanImpl* selected = NULL;
+
+static const D2ScanImpl* select_impl() {
+    const D2ScanImpl* impl = __atomic_load_n(&selected, __ATOMIC_ACQUIRE);
+    if (impl == NULL) {
+        const D2ScanImpl* list;
+        int n = d2_scan_impls(&list);
+        impl = &list[n - 1];
+        __atomic_store_n(&selected, impl, __ATOMIC_RELEASE);
+    }
+    return impl;
+}
+
+/**
+ * The order of top-k: a larger value first, then the lower tree, then the lower id.
+ *
+ * @param a A hit.
+ * @param b Another hit.
+ * @return 1 if a comes before b, 0 if not.
+ */
+static int better(const D2ScanHit* a, const D2ScanHit* b) {
+    if (a->value != b->value) {
+        return a->value > b->value;
+    }
+    return a->tree != b->tree ? a->tree < b->tree : a->id < b->id;
+}
+
+static int compare_hits(const void* a, const void* b) {
+    return better((const D2ScanHit*)a, (const D2ScanHit*)b) ? -1 : better((const D2ScanHit*)b, (const D2ScanHit*)a);
+}
+
+/**
+ * Offers a hit to the k best so far. The heap keeps the worst of them on top, which a
+ * new hit has to beat once the heap is full.
+ *
+ * @param top The TopK.
+ * @param hit The hit.
+ */
+static void topk_offer(struct TopK* top, D2ScanHit hit) {
+    D2ScanHit* heap = top->heap;
+    if (top->size < top->k) {
+        int i = top->size++;
+        while (i > 0 && better(&heap[(i - 1) / 2], &hit)) {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        heap[i] = hit;
+        return;
+    }
+    if (top->k == 0 || !better(&hit, &heap[0])) {
+        return;
+    }
+    int i = 0;
+    while (1) {
+        int worst = 2 * i + 1;
+        if (worst >= top->size) {
+            break;
+        }
+        if (worst + 1 < top->size && better(&heap[worst], &heap[worst + 1])) {
+            worst++;
+        }
+        if (!better(&hit, &heap[worst])) {
+            break;
+        }
+        heap[i] = heap[worst];
+        i = worst;
+    }
+    heap[i] = hit;
+}
+
+/**
+ * Offers the nodes of a tree to the k best. Once the heap is full, only values above
+ * the worst of them can get in, and next_above skips the others a vector at a time.
+ * The trees of one TopK are scanned in order, so an equal value comes from a later
+ * node and can't get in either.
+ *
+ * @param top The TopK.
+ * @param impl The kernels.
+ * @param t The index of the tree.
+ * @param tree The tree.
+ */
+static void topk_scan(struct TopK* top, const D2ScanImpl* impl, int t, const LocalTreeStore* tree) {
+    const uint32_t* values = tree->value;
+    int n = tree->number_of_nodes;
+    int i = 0;
+    for (; i < n && top->size < top->k; i++) {
+        D2ScanHit hit = { t, i, values[i] };
+        topk_offer(top, hit);
+    }
+    while (top->k > 0 && i < n) {
+        i = impl->next_above(values, i, n, top->heap[0].value);
+        if (i < n) {
+            D2ScanHit hit = { t, i, values[i] };
+            topk_offer(top, hit);
+            i++;
+        }
+    }
+}
+
+/**
+ * Sorts the k best into the hits, the best first.
+ *
+ * @param top The TopK.
+ * @param hits The hits.
+ * @return The number of hits.
+ */
+static int topk_finish(struct TopK* top, D2ScanHit* hits) {
+    memcpy(hits, top->heap, top->size * sizeof(D2ScanHit));
+    qsort(hits, top->size, sizeof(D2ScanHit), compare_hits);
+    return top->size;
+}
+
+static void* run_scan_worker(void* arg) {
+    struct ScanJob* job = (struct ScanJob*)arg;
+    long matches = 0;
+    D2ScanStats total;
+    stats_init(&total);
+    struct TopK top = { NULL, 0, job->k };
+    uint64_t* scratch = NULL;   // the bitmap when only counting
+    int scratch_words = 0;
+    int failed = 0;
+
+    if (job->op == SCAN_TOP_K && (top.heap = malloc((job->k > 0 ? job->k : 1) * sizeof(D2ScanHit))) == NULL) {
+        failed = 1;
+    }
+
+    while (!failed) {
+        int t = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (t >= job->ntrees) {
+            break;
+        }
+        const LocalTreeStore* tree = job->trees[t];
+        int n = tree ? tree->number_of_nodes : 0;
+
+        if (job->op == SCAN_FILTER) {
+            uint64_t* bitmap = job->bitmaps ? job->bitmaps[t] : NULL;
+            if (bitmap == NULL && n > 0) {
+                if (scratch_words < BITMAP_WORDS(n)) {
+                    free(scratch);
+                    scratch_words = BITMAP_WORDS(n);
+                    if ((scratch = malloc(scratch_words * sizeof(uint64_t))) == NULL) {
+                        failed = 1;
+                        break;
+                    }
+                }
+                bitmap = scratch;
+            }
+            long count = n > 0 ? job->impl->filter(tree->value, n, job->lo, job->span, bitmap) : 0;
+            matches += count;
+            if (job->counts) {
+                job->counts[t] = count;
+            }
+        } else if (job->op == SCAN_STATS) {
+            D2ScanStats stats;
+            stats_init(&stats);
+            if (n > 0) {
+                job->impl->stats(tree->value, n, &stats);
+            }
+            stats_merge(&total, &stats);
+            if (job->per_tree) {
+                job->per_tree[t] = stats;
+            }
+        } else if (n > 0) {
+            topk_scan(&top, job->impl, t, tree);
+        }
+    }
+
+    pthread_mutex_lock(&job->lock);
+    job->failed |= failed;
+    job->matches += matches;
+    stats_merge(&job->total, &total);
+    for (int i = 0; i < top.size; i++) {
+        topk_offer(&job->top, top.heap[i]);
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    free(top.heap);
+    free(scratch);
+    return NULL;
+}
+
+/**
+ * Runs a scan over many trees on up to max_workers threads, like d2_lookup_many: the
+ * trees are claimed one at a time from a shared counter, and every worker merges its
+ * results into the job at the end.
+ *
+ * @param job The ScanJob, with op and its parameters set.
+ * @param max_workers The largest number of threads.
+ * @return 0 on success, or -1 on failure.
+ */
+static int run_scan(struct ScanJob* job, int max_workers) {
+    job->impl = select_impl();
+    job->next = 0;
+    job->matches = 0;
+    job->failed = 0;
+    stats_init(&job->total);
+    job->top.size = 0;
+    job->top.k = job->k;
+    job->top.heap = NULL;
+    if (job->op == SCAN_TOP_K && (job->top.heap = malloc((job->k > 0 ? job->k : 1) * sizeof(D2ScanHit))) == NULL) {
+        check_error_d2(-1, "Failed to allocate the top-k heap", __LINE__, __FILE__);
+        return -1;
+    }
+    pthread_mutex_init(&job->lock, NULL);
+
+    int workers = max_workers < 1 ? 1 : max_workers;
+    if (workers > job->ntrees) {
+        workers = job->ntrees > 0 ? job->ntrees : 1;
+    }
+    pthread_t* threads = malloc(workers * sizeof(pthread_t));
+    int started = 0;
+    if (threads != NULL && workers > 1) {
+        for (; started < workers; started++) {
+            if (pthread_create(&threads[started], NULL, run_scan_worker, job) != 0) {
+                break;
+            }
+        }
+    }
+    if (started == 0) {
+        // One worker, or no thread could be started: this one does the work
+        run_scan_worker(job);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&job->lock);
+
+    if (job->failed) {
+        check_error_d2(-1, "A scan worker ran out of memory", __LINE__, __FILE__);
+        free(job->top.heap);
+        job->top.heap = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+* END HELPER FUNCTIONS
+ */
+
+/**
+ * Lists the implementations the CPU supports.
+ *
+ * @param list Set to the implementations, the fastest one last.
+ * @return The number of implementations.
+ */
+int d2_scan_impls(const D2ScanImpl** list) {
+    *list = impls;
+#ifdef D2_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return 3;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return 2;
+    }
+#endif
+    return 1;
+}
+
+/**
+ * Filters the values of a tree by a range.
+ *
+ * @param tree The LocalTreeStore.
+ * @param lo The lowest value that matches.
+ * @param hi The highest value that matches.
+ * @param bitmap Set to the selection bitmap, (number_of_nodes + 63) / 64 words.
+ * @return The number of matches, or -1 if tree or bitmap is NULL.
+ */
+long d2_scan_filter(const LocalTreeStore* tree, uint32_t lo, uint32_t hi, uint64_t* bitmap) {
+    if (tree == NULL || bitmap == NULL) {
+        return -1;
+    }
+    if (lo > hi) {
+        memset(bitmap, 0, BITMAP_WORDS(tree->number_of_nodes) * sizeof(uint64_t));
+        return 0;
+    }
+    return select_impl()->filter(tree->value, tree->number_of_nodes, lo, hi - lo, bitmap);
+}
+
+/**
+ * Lists the ids whose bits are set, a word at a time.
+ *
+ * @param bitmap The selection bitmap.
+ * @param n The number of nodes of the tree.
+ * @param ids Set to the ids, in increasing order.
+ * @return The number of ids.
+ */
+int d2_scan_ids(const uint64_t* bitmap, int n, uint32_t* ids) {
+    int count = 0;
+    for (int w = 0; w < BITMAP_WORDS(n); w++) {
+        for (uint64_t bits = bitmap[w]; bits != 0; bits &= bits - 1) {
+            ids[count++] = w * 64 + __builtin_ctzll(bits);
+        }
+    }
+    return count;
+}
+
+/**
+ * Computes the stats of the values of a tree.
+ *
+ * @param tree The LocalTreeStore, may be NULL (no nodes).
+ * @param stats Set to the count, sum, minimum and maximum.
+ */
+void d2_scan_stats(const LocalTreeStore* tree, D2ScanStats* stats) {
+    stats_init(stats);
+    if (tree != NULL && tree->number_of_nodes > 0) {
+        select_impl()->stats(tree->value, tree->number_of_nodes, stats);
+    }
+}
+
+/**
+ * Finds the nodes of a tree with the largest values.
+ *
+ * @param tree The LocalTreeStore.
+ * @param k The number of nodes to find.
+ * @param hits Set to the hits, the best first.
+ * @return The number of hits, or -1 on failure.
+ */
+int d2_scan_top_k(const LocalTreeStore* tree, int k, D2ScanHit* hits) {
+    return d2_scan_trees_top_k(&tree, 1, k, 1, hits);
+}
+
+/**
+ * Filters the values of many trees by a range, in parallel.
+ *
+ * @param trees The trees, NULL entries are skipped.
+ * @param ntrees The number of trees.
+ * @param lo The lowest value that matches.
+ * @param hi The highest value that matches.
+ * @param max_workers The largest number of threads.
+ * @param bitmaps Set to the bitmap of every tree, or NULL.
+ * @param counts Set to the matches in every tree, or NULL.
+ * @return The number of matches, or -1 on failure.
+ */
+long d2_scan_trees_filter(const LocalTreeStore* const* trees, int ntrees, uint32_t lo, uint32_t hi,
+                          int max_workers, uint64_t** bitmaps, long* counts) {
+    if (trees == NULL || ntrees < 0) {
+        return -1;
+    }
+    struct ScanJob job;
+    memset(&job, 0, sizeof(job));
+    job.op = SCAN_FILTER;
+    job.trees = trees;
+    job.ntrees = ntrees;
+    // hi - lo would wrap around for an empty range
+    if (lo > hi) {
+        for (int t = 0; t < ntrees; t++) {
+            if (bitmaps && trees[t]) {
+                memset(bitmaps[t], 0, BITMAP_WORDS(trees[t]->number_of_nodes) * sizeof(uint64_t));
+            }
+            if (counts) {
+                counts[t] = 0;
+            }
+        }
+        return 0;
+    }
+    job.lo = lo;
+    job.span = hi - lo;
+    job.bitmaps = bitmaps;
+    job.counts = counts;
+    if (run_scan(&job, max_workers) == -1) {
+        return -1;
+    }
+    return job.matches;
+}
+
+/**
+ * Computes the stats of many trees, in parallel.
+ *
+ * @param trees The trees, NULL entries are skipped.
+ * @param ntrees The number of trees.
+ * @param max_workers The largest number of threads.
+ * @param per_tree Set to the stats of every tree, or NULL.
+ * @param total Set to the stats of all trees together.
+ * @return 0 on success, or -1 on failure.
+ */
+int d2_scan_trees_stats(const LocalTreeStore* const* trees, int ntrees, int max_workers,
+                        D2ScanStats* per_tree, D2ScanStats* total) {
+    if (trees == NULL || ntrees < 0 || total == NULL) {
+        return -1;
+    }
+    struct ScanJob job;
+    memset(&job, 0, sizeof(job));
+    job.op = SCAN_STATS;
+    job.trees = trees;
+    job.ntrees = ntrees;
+    job.per_tree = per_tree;
+    if (run_scan(&job, max_workers) == -1) {
+        return -1;
+    }
+    *total = job.total;
+    return 0;
+}
+
+/**
+ * Finds the nodes with the largest values in many trees, in parallel. Every worker
+ * keeps its own k best, and they are merged at the end.
+ *
+ * @param trees The trees, NULL entries are skipped.
+ * @param ntrees The number of trees.
+ * @param k The number of nodes to find.
+ * @param max_workers The largest number of threads.
+ * @param hits Set to the hits, the best first.
+ * @return The number of hits, or -1 on failure.
+ */
+int d2_scan_trees_top_k(const LocalTreeStore* const* trees, int ntrees, int k, int max_workers,
+                        D2ScanHit* hits) {
+    if (trees == NULL || ntrees < 0 || k < 0 || (k > 0 && hits == NULL)) {
+        return -1;
+    }
+    struct ScanJob job;
+    memset(&job, 0, sizeof(job));
+    job.op = SCAN_TOP_K;
+    job.trees = trees;
+    job.ntrees = ntrees;
+    job.k = k;
+    if (run_scan(&job, max_workers) == -1) {
+        return -1;
+    }
+    int count = topk_finish(&job.top, hits);
+    free(job.top.heap);
+    return count;
+}
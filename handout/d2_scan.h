@@ -0,0 +1,102 @@
+#ifndef D2_SCAN_H
+#define D2_SCAN_H
+
+#include "d2_lookup.h"
+
+/* Scans over the value column of trees: range filters, min/max/sum and top-k.
+ *
+ * The values of a LocalTreeStore are one contiguous array (see d2_lookup_mod.h), so the
+ * kernels go through them 4 (SSE4.1) or 8 (AVX2) at a time, with a scalar version for
+ * other CPUs and for the last values. The kernel is picked at the first call, from what
+ * the CPU supports.
+ *
+ * A range [lo, hi] includes both ends. A filter produces a selection bitmap: bit i of
+ * word i / 64 is set if node i matches. The bitmap of a tree has (number_of_nodes + 63)
+ * / 64 words. d2_scan_ids turns it into a list of ids.
+ *
+ * The d2_scan_trees_* functions scan many trees at once, on up to max_workers threads
+ * that claim the trees one after another from a shared counter, like d2_lookup_many.
+ * NULL trees (failed lookups) are skipped. The trees are only read, so trees from a
+ * D2Cache can be scanned while other threads use them.
+ */
+
+struct D2ScanStats
+{
+    long     count;  /* nodes scanned */
+    uint64_t sum;
+    uint32_t min;    /* UINT32_MAX if count is 0 */
+    uint32_t max;    /* 0 if count is 0 */
+};
+
+/* A node found by top-k. tree is the index in the array of trees, 0 for one tree.
+ */
+struct D2ScanHit
+{
+    int      tree;
+    int      id;
+    uint32_t value;
+};
+
+typedef struct D2ScanStats D2ScanStats;
+typedef struct D2ScanHit   D2ScanHit;
+
+/* Set the bitmap of the nodes of tree whose value is in [lo, hi].
+ * Returns the number of matches.
+ */
+long d2_scan_filter( const LocalTreeStore* tree, uint32_t lo, uint32_t hi, uint64_t* bitmap );
+
+/* Write the ids of the bits set in the bitmap of a tree of n nodes into ids, in order.
+ * Returns their number.
+ */
+int d2_scan_ids( const uint64_t* bitmap, int n, uint32_t* ids );
+
+/* Count, sum, minimum and maximum of the values of tree.
+ */
+void d2_scan_stats( const LocalTreeStore* tree, D2ScanStats* stats );
+
+/* Find the k nodes of tree with the largest values, the lowest id first among equal
+ * values. hits is sorted, the largest value first.
+ * Returns the number of hits, less than k if the tree has fewer nodes, or -1 in case of
+ * failure.
+ */
+int d2_scan_top_k( const LocalTreeStore* tree, int k, D2ScanHit* hits );
+
+/* The range filter over many trees. bitmaps[t] is the bitmap of trees[t], or bitmaps is
+ * NULL to count only. counts[t] is set to the matches in trees[t], or counts is NULL.
+ * Returns the number of matches in all trees, or -1 in case of failure.
+ */
+long d2_scan_trees_filter( const LocalTreeStore* const* trees, int ntrees, uint32_t lo, uint32_t hi,
+                           int max_workers, uint64_t** bitmaps, long* counts );
+
+/* The stats of each tree into per_tree (may be NULL), and of all of them into total.
+ * Returns 0, or -1 in case of failure.
+ */
+int d2_scan_trees_stats( const LocalTreeStore* const* trees, int ntrees, int max_workers,
+                         D2ScanStats* per_tree, D2ScanStats* total );
+
+/* The k nodes with the largest values in all trees, ties broken by the lowest tree and
+ * then the lowest id, like d2_scan_top_k.
+ * Returns the number of hits, or -1 in case of failure.
+ */
+int d2_scan_trees_top_k( const LocalTreeStore* const* trees, int ntrees, int k, int max_workers,
+                         D2ScanHit* hits );
+
+/* One implementation of the kernels, over n values.
+ * filter sets the bits of the values in [lo, lo + span] and returns their number; the
+ * bitmap is cleared first. next_above returns the first index from start on whose value
+ * is above threshold, or n.
+ */
+typedef struct D2ScanImpl
+{
+    const char* name;
+    long (*filter)( const uint32_t* values, int n, uint32_t lo, uint32_t span, uint64_t* bitmap );
+    void (*stats)( const uint32_t* values, int n, D2ScanStats* stats );
+    int  (*next_above)( const uint32_t* values, int start, int n, uint32_t threshold );
+} D2ScanImpl;
+
+/* Lets impls point to the implementations this CPU supports, the fastest one last.
+ * Returns their number. Meant for tests and benchmarks.
+ */
+int d2_scan_impls( const D2ScanImpl** impls );
+
+#endif /* D2_SCAN_H */
@@ -0,0 +1,270 @@
+/* ======================================================================
+ * Checks the value scan kernels (d2_scan.h) against plain loops, and
+ * measures their throughput over many trees.
+ *
+ * The check covers every kernel with all lengths up to 200 values, random
+ * and extreme ranges, and top-k over many trees against a sort of all
+ * nodes. The program exits with 1 on the first mismatch, before any timing.
+ * The timing compares the kernels with the same scans over an array of
+ * NetNodes, as the trees were stored before, and runs the d2_scan_trees_*
+ * functions on 1, 2 and 4 worker threads.
+ *
+ * Usage: d2_scan_bench [trees] [nodes]
+ * ====================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "d2_lookup.h"
+#include "d2_scan.h"
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int fail(const char* what, const char* impl, int n) {
+    printf("MISMATCH: %s, %s, %d values\n", what, impl, n);
+    return 1;
+}
+
+/* Random values, or with extremes mixed in. */
+static uint32_t random_value(unsigned* seed) {
+    switch (rand_r(seed) % 8) {
+    case 0:
+        return 0;
+    case 1:
+        return UINT32_MAX;
+    default:
+        return ((uint32_t)rand_r(seed) << 16) ^ rand_r(seed);
+    }
+}
+
+static int verify_kernels(const D2ScanImpl* impls, int count) {
+    unsigned seed = 1;
+    uint32_t values[200] = { 0 };
+    uint64_t bitmap[4];
+    for (int n = 0; n <= 200; n++) {
+        for (int round = 0; round < 20; round++) {
+            for (int i = 0; i < n; i++) {
+                values[i] = round % 2 ? random_value(&seed) : (uint32_t)(rand_r(&seed) % 100);
+            }
+            uint32_t lo = round % 2 ? random_value(&seed) : (uint32_t)(rand_r(&seed) % 100);
+            uint32_t hi = round % 2 ? random_value(&seed) : lo + (uint32_t)(rand_r(&seed) % 50);
+            if (lo > hi) {
+                uint32_t swap = lo;
+                lo = hi;
+                hi = swap;
+            }
+            uint32_t threshold = values[n > 0 ? rand_r(&seed) % n : 0];
+            int start = n > 0 ? rand_r(&seed) % n : 0;
+
+            for (int k = 0; k < count; k++) {
+                memset(bitmap, 0xff, sizeof(bitmap));
+                long matches = impls[k].filter(values, n, lo, hi - lo, bitmap);
+                long expect = 0;
+                for (int i = 0; i < n; i++) {
+                    int in = values[i] >= lo && values[i] <= hi;
+                    expect += in;
+                    if (((bitmap[i / 64] >> (i % 64)) & 1) != (uint64_t)in) {
+                        return fail("filter bitmap", impls[k].name, n);
+                    }
+                }
+                for (int i = n; i < (n + 63) / 64 * 64; i++) {
+                    if ((bitmap[i / 64] >> (i % 64)) & 1) {
+                        return fail("filter bitmap past the end", impls[k].name, n);
+                    }
+                }
+                if (matches != expect) {
+                    return fail("filter count", impls[k].name, n);
+                }
+
+                D2ScanStats stats;
+                impls[k].stats(values, n, &stats);
+                uint64_t sum = 0;
+                uint32_t min = UINT32_MAX;
+                uint32_t max = 0;
+                for (int i = 0; i < n; i++) {
+                    sum += values[i];
+                    min = values[i] < min ? values[i] : min;
+                    max = values[i] > max ? values[i] : max;
+                }
+                if (stats.count != n || stats.sum != sum || stats.min != min || stats.max != max) {
+                    return fail("stats", impls[k].name, n);
+                }
+
+                int next = start;
+                while (next < n && values[next] <= threshold) {
+                    next++;
+                }
+                if (impls[k].next_above(values, start, n, threshold) != (n > 0 ? next : 0)) {
+                    return fail("next_above", impls[k].name, n);
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+static int compare_desc(const void* a, const void* b) {
+    const D2ScanHit* x = a;
+    const D2ScanHit* y = b;
+    if (x->value != y->value) {
+        return x->value > y->value ? -1 : 1;
+    }
+    if (x->tree != y->tree) {
+        return x->tree < y->tree ? -1 : 1;
+    }
+    return x->id < y->id ? -1 : x->id > y->id;
+}
+
+static int verify_trees(LocalTreeStore** trees, int ntrees) {
+    long total = 0;
+    for (int t = 0; t < ntrees; t++) {
+        total += trees[t] ? trees[t]->number_of_nodes : 0;
+    }
+    D2ScanHit* all = malloc(total * sizeof(D2ScanHit));
+    long n = 0;
+    for (int t = 0; t < ntrees; t++) {
+        for (int i = 0; trees[t] && i < trees[t]->number_of_nodes; i++) {
+            D2ScanHit hit = { t, i, trees[t]->value[i] };
+            all[n++] = hit;
+        }
+    }
+    qsort(all, n, sizeof(D2ScanHit), compare_desc);
+
+    int ks[] = { 0, 1, 10, 1000 };
+    D2ScanHit hits[1000];
+    for (int w = 1; w <= 4; w *= 2) {
+        for (int q = 0; q < 4; q++) {
+            int got = d2_scan_trees_top_k((const LocalTreeStore* const*)trees, ntrees, ks[q], w, hits);
+            if (got != ks[q] || memcmp(hits, all, got * sizeof(D2ScanHit)) != 0) {
+                free(all);
+                return fail("top-k over trees", "dispatched", ks[q]);
+            }
+        }
+        long counts[64];
+        long matches = d2_scan_trees_filter((const LocalTreeStore* const*)trees, ntrees, 100, 199, w, NULL, counts);
+        long expect = 0;
+        for (long i = 0; i < n; i++) {
+            expect += all[i].value >= 100 && all[i].value <= 199;
+        }
+        D2ScanStats total_stats;
+        if (matches != expect || d2_scan_trees_stats((const LocalTreeStore* const*)trees, ntrees, w, NULL, &total_stats) != 0 ||
+            total_stats.count != n || total_stats.max != all[0].value || total_stats.min != all[n - 1].value) {
+            free(all);
+            return fail("filter or stats over trees", "dispatched", w);
+        }
+    }
+    free(all);
+    return 0;
+}
+
+static LocalTreeStore* make_tree(int n, uint32_t modulo, unsigned seed) {
+    LocalTreeStore* tree = d2_alloc_local_tree(n);
+    for (int i = 0; i < n; i++) {
+        tree->value[i] = rand_r(&seed) % modulo;
+    }
+    tree->filled = n;
+    return tree;
+}
+
+int main(int argc, char* argv[]) {
+    int ntrees = argc > 1 ? atoi(argv[1]) : 1000;
+    int nodes = argc > 2 ? atoi(argv[2]) : 4096;
+
+    const D2ScanImpl* impls;
+    int count = d2_scan_impls(&impls);
+    if (verify_kernels(impls, count)) {
+        return 1;
+    }
+    // Trees of all sizes with many equal values, for the order among them, and some NULL
+    LocalTreeStore* small[64];
+    for (int t = 0; t < 64; t++) {
+        small[t] = t % 9 == 4 ? NULL : make_tree(1 + t * 7, 1000, t);
+    }
+    if (verify_trees(small, 64)) {
+        return 1;
+    }
+    for (int t = 0; t < 64; t++) {
+        d2_free_local_tree(small[t]);
+    }
+    printf("all %d implementations match the plain loops\n\n", count);
+
+    LocalTreeStore** trees = malloc(ntrees * sizeof(LocalTreeStore*));
+    uint64_t** bitmaps = malloc(ntrees * sizeof(uint64_t*));
+    NetNode* netnodes = malloc((size_t)ntrees * nodes * sizeof(NetNode));
+    for (int t = 0; t < ntrees; t++) {
+        trees[t] = make_tree(nodes, 1000000, t + 1);
+        bitmaps[t] = malloc((nodes + 63) / 64 * sizeof(uint64_t));
+        for (int i = 0; i < nodes; i++) {
+            netnodes[(size_t)t * nodes + i].value = trees[t]->value[i];
+        }
+    }
+    double values = (double)ntrees * nodes;
+    volatile uint64_t sink = 0;
+    // About 10% of the values are in the range
+    uint32_t lo = 450000;
+    uint32_t hi = 549999;
+
+    printf("%d trees of %d nodes, Gvalues/s\n", ntrees, nodes);
+    printf("%-24s %12s %12s\n", "", "filter", "min/max/sum");
+    double start = now_s();
+    long matches = 0;
+    for (size_t i = 0; i < (size_t)ntrees * nodes; i++) {
+        matches += netnodes[i].value >= lo && netnodes[i].value <= hi;
+    }
+    double filter_s = now_s() - start;
+    start = now_s();
+    D2ScanStats stats = { 0, 0, UINT32_MAX, 0 };
+    for (size_t i = 0; i < (size_t)ntrees * nodes; i++) {
+        stats.sum += netnodes[i].value;
+        stats.min = netnodes[i].value < stats.min ? netnodes[i].value : stats.min;
+        stats.max = netnodes[i].value > stats.max ? netnodes[i].value : stats.max;
+    }
+    sink += matches + stats.sum + stats.min + stats.max;
+    printf("%-24s %12.2f %12.2f\n", "NetNode array, scalar", values / filter_s / 1e9, values / (now_s() - start) / 1e9);
+
+    for (int k = 0; k < count; k++) {
+        start = now_s();
+        for (int t = 0; t < ntrees; t++) {
+            sink += impls[k].filter(trees[t]->value, nodes, lo, hi - lo, bitmaps[t]);
+        }
+        filter_s = now_s() - start;
+        start = now_s();
+        for (int t = 0; t < ntrees; t++) {
+            impls[k].stats(trees[t]->value, nodes, &stats);
+            sink += stats.sum;
+        }
+        printf("%-24s %12.2f %12.2f\n", impls[k].name, values / filter_s / 1e9, values / (now_s() - start) / 1e9);
+    }
+
+    printf("\nd2_scan_trees_*, ms     %12s %12s %12s\n", "filter", "stats", "top-100");
+    D2ScanHit hits[100];
+    for (int w = 1; w <= 4; w *= 2) {
+        double t[3];
+        start = now_s();
+        sink += d2_scan_trees_filter((const LocalTreeStore* const*)trees, ntrees, lo, hi, w, bitmaps, NULL);
+        t[0] = now_s() - start;
+        start = now_s();
+        d2_scan_trees_stats((const LocalTreeStore* const*)trees, ntrees, w, NULL, &stats);
+        t[1] = now_s() - start;
+        start = now_s();
+        sink += d2_scan_trees_top_k((const LocalTreeStore* const*)trees, ntrees, 100, w, hits);
+        t[2] = now_s() - start;
+        printf("%d worker%-16s %12.2f %12.2f %12.2f\n", w, w > 1 ? "s" : "", t[0] * 1e3, t[1] * 1e3, t[2] * 1e3);
+    }
+    (void)sink;
+
+    for (int t = 0; t < ntrees; t++) {
+        d2_free_local_tree(trees[t]);
+        free(bitmaps[t]);
+    }
+    free(trees);
+    free(bitmaps);
+    free(netnodes);
+    return 0;
+}
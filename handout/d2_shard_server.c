@@ -0,0 +1,362 @@
+/* ======================================================================
+ * A D2 lookup server that scales with the number of cores.
+ *
+ * Every worker thread has its own D1Server socket bound to the same port
+ * with SO_REUSEPORT. The kernel hashes the client address to pick the
+ * socket, so a client always talks to the same worker, and the workers
+ * share nothing: no locks, no common queues, each one builds the trees
+ * in its own buffers.
+ *
+ * The trees are generated from the requested id with a small
+ * pseudo-random generator, so the same id always gets the same tree.
+ * They are not the trees of the prebuilt d2_server.
+ *
+ * Tagged requests (d2_lookup_mod.h) are answered with tagged packets. The
+ * lookups a worker has in flight are served round-robin, one packet each,
+ * so their response streams interleave and a large tree does not hold up
+ * the small ones behind it.
+ *
+ * Usage: d2_shard_server <port> [workers] [-p]
+ *   workers  number of worker threads, default: number of online CPUs
+ *   -p       pin worker i to CPU i % CPUs
+ * ====================================================================== */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "d1_server.h"
+#include "d2_lookup.h"
+
+#define TREE_MAX_NODES  300  /* the largest tree that is served */
+#define NODES_PER_PACKET 5
+
+/* A tagged lookup in flight.
+ */
+struct Lookup
+{
+    D1Peer*        peer;
+    uint16_t       tag;          /* in network byte order */
+    int            count;        /* nodes in the tree */
+    int            next;         /* next node to send, -1 before the size */
+    struct Lookup* next_lookup;
+    NetNode        nodes[TREE_MAX_NODES];
+};
+
+struct Worker
+{
+    pthread_t thread;
+    int       index;
+    uint16_t  port;
+    int       pin;
+    long      served;        /* completed lookups */
+};
+
+static volatile sig_atomic_t stop = 0;
+
+static void on_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+/* Builds the tree of the id into nodes, in depth first order, and returns its size.
+ * Every new node becomes the child of a node on the path from the root to the
+ * previous node, which keeps the ids in depth first order.
+ */
+static int make_tree(uint32_t id, NetNode* nodes) {
+    uint64_t state = id * 6364136223846793005ull + 1442695040888963407ull;
+    #define NEXT() (state = state * 6364136223846793005ull + 1442695040888963407ull, (uint32_t)(state >> 33))
+
+    int count = 1 + NEXT() % TREE_MAX_NODES;
+    int path[TREE_MAX_NODES];
+    int depth = 1;
+    path[0] = 0;
+
+    for (int i = 0; i < count; i++) {
+        nodes[i].id = i;
+        nodes[i].value = NEXT() % 1000000;
+        nodes[i].num_children = 0;
+        if (i == 0) {
+            continue;
+        }
+        // The previous node has no children yet, so this always ends on a node with room
+        int up = depth - 1 - NEXT() % depth;
+        while (nodes[path[up]].num_children == NODES_PER_PACKET) {
+            up++;
+        }
+        NetNode* parent = &nodes[path[up]];
+        parent->child_id[parent->num_children++] = i;
+        depth = up + 1;
+        path[depth++] = i;
+    }
+    #undef NEXT
+    return count;
+}
+
+/* Packs the abbreviated NetNodes [first, last) into packet, in network byte order:
+ * only the child ids that exist are sent. Returns the number of bytes.
+ */
+static int pack_nodes(NetNode* nodes, int first, int last, char* packet) {
+    int len = 0;
+    for (int i = first; i < last; i++) {
+        uint32_t fields[3 + NODES_PER_PACKET];
+        fields[0] = htonl(nodes[i].id);
+        fields[1] = htonl(nodes[i].value);
+        fields[2] = htonl(nodes[i].num_children);
+        for (uint32_t c = 0; c < nodes[i].num_children; c++) {
+            fields[3 + c] = htonl(nodes[i].child_id[c]);
+        }
+        int bytes = (3 + nodes[i].num_children) * sizeof(uint32_t);
+        memcpy(packet + len, fields, bytes);
+        len += bytes;
+    }
+    return len;
+}
+
+/* Answers one PacketRequest: the size, then the nodes, five per packet.
+ */
+static int serve_request(D1Server* server, D1Peer* peer, uint32_t id, NetNode* nodes) {
+    int count = make_tree(id, nodes);
+
+    PacketResponseSize size;
+    size.type = htons(TYPE_RESPONSE_SIZE);
+    size.size = htons(count);
+    if (d1_server_send(server, peer, (char*)&size, sizeof(size)) < 0) {
+        return -1;
+    }
+
+    char packet[PACKET_MAX];
+    for (int first = 0; first < count; first += NODES_PER_PACKET) {
+        int last = first + NODES_PER_PACKET < count ? first + NODES_PER_PACKET : count;
+        int len = sizeof(PacketResponse) + pack_nodes(nodes, first, last, packet + sizeof(PacketResponse));
+
+        PacketResponse header;
+        header.type = htons(last == count ? TYPE_LAST_RESPONSE : TYPE_RESPONSE);
+        header.payload_size = htons(len);
+        memcpy(packet, &header, sizeof(header));
+        if (d1_server_send(server, peer, packet, len) < 0) {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+/* Queues the tagged requests of one packet at the end of the worker's lookups. Ids that
+ * are too low get a tree of size 0, so the client is not left waiting.
+ * Returns the number of lookups queued.
+ */
+static int queue_tagged(struct Lookup** tail, D1Peer* peer, char* buffer, int len) {
+    int queued = 0;
+    for (int off = 0; off + (int)sizeof(PacketTaggedRequest) <= len; off += sizeof(PacketTaggedRequest)) {
+        PacketTaggedRequest request;
+        memcpy(&request, buffer + off, sizeof(request));
+        if (ntohs(request.type) != TYPE_REQUEST || request.tag == 0) {
+            continue;
+        }
+        struct Lookup* lookup = malloc(sizeof(struct Lookup));
+        if (lookup == NULL) {
+            break;
+        }
+        lookup->peer = peer;
+        lookup->tag = request.tag;
+        lookup->count = ntohl(request.id) > 1000 ? make_tree(ntohl(request.id), lookup->nodes) : 0;
+        lookup->next = -1;
+        lookup->next_lookup = NULL;
+        while (*tail != NULL) {
+            tail = &(*tail)->next_lookup;
+        }
+        *tail = lookup;
+        queued++;
+    }
+    return queued;
+}
+
+/* Sends the next packet of a tagged lookup.
+ * Returns 1 if the lookup is complete, 0 if more packets follow, -1 in case of error.
+ */
+static int serve_tagged(D1Server* server, struct Lookup* lookup) {
+    if (lookup->next == -1) {
+        PacketTaggedResponseSize size;
+        size.type = htons(TYPE_TAGGED | TYPE_RESPONSE_SIZE);
+        size.tag = lookup->tag;
+        size.size = htons(lookup->count);
+        if (d1_server_send(server, lookup->peer, (char*)&size, sizeof(size)) < 0) {
+            return -1;
+        }
+        lookup->next = 0;
+        return lookup->count == 0;
+    }
+
+    char packet[PACKET_MAX];
+    int first = lookup->next;
+    int last = first + NODES_PER_PACKET < lookup->count ? first + NODES_PER_PACKET : lookup->count;
+    int len = sizeof(PacketTaggedResponse) + pack_nodes(lookup->nodes, first, last, packet + sizeof(PacketTaggedResponse));
+
+    PacketTaggedResponse header;
+    header.type = htons(TYPE_TAGGED | (last == lookup->count ? TYPE_LAST_RESPONSE : TYPE_RESPONSE));
+    header.tag = lookup->tag;
+    header.payload_size = htons(len);
+    memcpy(packet, &header, sizeof(header));
+    if (d1_server_send(server, lookup->peer, packet, len) < 0) {
+        return -1;
+    }
+    lookup->next = last;
+    return last == lookup->count;
+}
+
+/* Removes the lookups of the peer (all of them if failed, else only this one) and forgets
+ * the peer once it has no lookups left.
+ */
+static void finish_tagged(D1Server* server, struct Lookup** list, struct Lookup* done, int failed) {
+    D1Peer* peer = done->peer;
+    int left = 0;
+    struct Lookup** link = list;
+    while (*link != NULL) {
+        struct Lookup* lookup = *link;
+        if (lookup == done || (failed && lookup->peer == peer)) {
+            *link = lookup->next_lookup;
+            free(lookup);
+        } else {
+            left += lookup->peer == peer;
+            link = &lookup->next_lookup;
+        }
+    }
+    if (left == 0) {
+        d1_server_forget(server, peer);
+    }
+}
+
+/* Sends one packet of every tagged lookup in flight. Returns the number served.
+ */
+static long serve_round(D1Server* server, struct Lookup** list) {
+    long served = 0;
+    struct Lookup* lookup = *list;
+    while (lookup != NULL) {
+        struct Lookup* next = lookup->next_lookup;
+        int res = serve_tagged(server, lookup);
+        if (res != 0) {
+            if (res < 0) {
+                // The lookups of the peer that come after this one are freed as well
+                while (next != NULL && next->peer == lookup->peer) {
+                    next = next->next_lookup;
+                }
+            }
+            served += res > 0;
+            finish_tagged(server, list, lookup, res < 0);
+        }
+        lookup = next;
+    }
+    return served;
+}
+
+static void* run_worker(void* arg) {
+    struct Worker* worker = (struct Worker*)arg;
+
+    if (worker->pin) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(worker->index % sysconf(_SC_NPROCESSORS_ONLN), &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            fprintf(stderr, "worker %d: could not pin to a CPU\n", worker->index);
+        }
+    }
+
+    D1Server* server = d1_create_server_reuseport(worker->port);
+    if (server == NULL) {
+        return NULL;
+    }
+    NetNode* nodes = malloc(TREE_MAX_NODES * sizeof(NetNode));
+
+    struct Lookup* lookups = NULL; // tagged lookups in flight
+    while (!stop && nodes != NULL) {
+        D1Peer* peer;
+        char buffer[PACKET_MAX];
+        // Don't wait for requests while there are responses to send
+        int len = d1_server_recv(server, &peer, buffer, sizeof(buffer), lookups ? 0 : 200);
+
+        if (peer != NULL) {
+            PacketTaggedRequest request;
+            memset(&request, 0, sizeof(request));
+            memcpy(&request, buffer, len < (int)sizeof(request) ? len : (int)sizeof(request));
+            if (len >= (int)sizeof(request) && ntohs(request.type) == TYPE_REQUEST && request.tag != 0) {
+                if (queue_tagged(&lookups, peer, buffer, len) == 0) {
+                    d1_server_forget(server, peer);
+                }
+            } else {
+                if (len >= (int)sizeof(request) && ntohs(request.type) == TYPE_REQUEST && ntohl(request.id) > 1000) {
+                    if (serve_request(server, peer, ntohl(request.id), nodes) > 0) {
+                        worker->served++;
+                    }
+                }
+                // One classic request per association, like the prebuilt server
+                d1_server_forget(server, peer);
+            }
+        }
+
+        worker->served += serve_round(server, &lookups);
+    }
+
+    while (lookups != NULL) {
+        struct Lookup* next = lookups->next_lookup;
+        free(lookups);
+        lookups = next;
+    }
+    free(nodes);
+    d1_server_delete(server);
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <port> [workers] [-p]\n", argv[0]);
+        return 1;
+    }
+    uint16_t port = atoi(argv[1]);
+    int workers = sysconf(_SC_NPROCESSORS_ONLN);
+    int pin = 0;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-p") == 0) {
+            pin = 1;
+        } else {
+            workers = atoi(argv[i]);
+        }
+    }
+    if (workers < 1) {
+        workers = 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    struct Worker* pool = calloc(workers, sizeof(struct Worker));
+    if (pool == NULL) {
+        return 1;
+    }
+    for (int i = 0; i < workers; i++) {
+        pool[i].index = i;
+        pool[i].port = port;
+        pool[i].pin = pin;
+        pthread_create(&pool[i].thread, NULL, run_worker, &pool[i]);
+    }
+    printf("d2_shard_server: port %d, %d workers%s\n", port, workers, pin ? ", pinned" : "");
+    fflush(stdout);
+
+    long total = 0;
+    for (int i = 0; i < workers; i++) {
+        pthread_join(pool[i].thread, NULL);
+        printf("worker %d served %ld lookups\n", i, pool[i].served);
+        total += pool[i].served;
+    }
+    printf("total %ld lookups\n", total);
+    free(pool);
+    return 0;
+}
@@ -0,0 +1,511 @@
+/* ======================================================================
+ * D2 tree snapshots: many LocalTreeStores in one file, written atomically
+ * and used in place through mmap.
+ * ====================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "d2_snapshot.h"
+
+
+#define SNAPSHOT_MAGIC "D2SNAP\0\0"
+#define BLOCK_ALIGN    64
+
+/* The node blocks are used in place, so they have to be in host byte order. */
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#define SNAPSHOT_UNSUPPORTED 1
+#endif
+
+/* All fields little-endian. */
+struct SnapshotHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t ntrees;
+    uint32_t directory_checksum;   /* FNV-1a of the directory */
+    uint64_t file_size;
+    uint64_t directory_offset;
+    uint8_t  reserved[24];
+};
+
+struct SnapshotEntry
+{
+    uint32_t id;
+    uint32_t nodes;
+    uint64_t offset;               /* of the node block, a multiple of BLOCK_ALIGN */
+    uint64_t bytes;
+    uint32_t checksum;             /* block_checksum of the node block */
+    uint32_t reserved;
+};
+
+_Static_assert(sizeof(struct SnapshotHeader) == 64, "the snapshot header is 64 bytes");
+_Static_assert(sizeof(struct SnapshotEntry) == 32, "a snapshot directory entry is 32 bytes");
+
+struct D2Snapshot
+{
+    char*           map;
+    size_t          size;
+    int             n;
+    uint32_t*       ids;
+    LocalTreeStore* trees;           /* pointing into map */
+};
+
+/* A tree to write, with its position in the arguments. */
+struct SnapshotItem
+{
+    uint32_t id;
+    int      index;
+};
+
+
+/*
+* START HELPER FUNCTIONS
+ */
+
+static uint32_t fnv1a(const void* data, size_t len) {
+    const uint8_t* p = (const uint8_t*)data;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * A checksum of a node block that takes 8 bytes per step, so that checking all blocks
+ * costs little next to mapping them. It finds bit flips and truncated files, it is not
+ * meant to resist attacks; the structure of every tree is checked as well.
+ */
+static uint32_t block_checksum(const void* data, uint64_t len) {
+    const uint8_t* p = (const uint8_t*)data;
+    uint64_t h = 0x9e3779b97f4a7c15ull;
+    uint64_t word;
+    for (; len >= 8; len -= 8, p += 8) {
+        memcpy(&word, p, 8);
+        h = (h ^ word) * 0x100000001b3ull;
+        h ^= h >> 29;
+    }
+    word = 0;
+    memcpy(&word, p, len);
+    h = (h ^ word ^ len << 56) * 0xff51afd7ed558ccdull;
+    h ^= h >> 32;
+    return (uint32_t)h;
+}
+
+/**
+ * Checks that a tree is a valid depth-first layout, so that the accessors, d2_query and
+ * d2_print_tree_fd stay inside its block: the root spans all nodes, every node has at
+ * most 5 children, and the subtrees of its children follow each other and end where its
+ * own subtree ends.
+ *
+ * @param tree The tree, pointing into the mapping.
+ * @param ends Scratch space for number_of_nodes entries.
+ * @param left Scratch space for number_of_nodes entries.
+ * @return 0 if the tree is valid, or -1.
+ */
+static int check_tree(const LocalTreeStore* tree, uint32_t* ends, uint8_t* left) {
+    const uint32_t* subtree_end = tree->subtree_end;
+    const uint8_t* num_children = tree->num_children;
+    uint32_t n = tree->number_of_nodes;
+    if (subtree_end[0] != n) {
+        return -1;
+    }
+    // The open ancestors: the end of their subtree and their children still to come
+    int depth = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t end = subtree_end[i];
+        uint32_t children = num_children[i];
+        if (end <= i || children > 5 || (children == 0) != (end == i + 1)) {
+            return -1;
+        }
+        if (i > 0) {
+            if (depth == 0 || left[depth - 1] == 0 || end > ends[depth - 1]) {
+                return -1;
+            }
+            left[depth - 1]--;
+        }
+        if (children > 0) {
+            ends[depth] = end;
+            left[depth] = children;
+            depth++;
+        }
+        while (depth > 0 && ends[depth - 1] == i + 1) {
+            if (left[depth - 1] != 0) {
+                return -1;
+            }
+            depth--;
+        }
+    }
+    return depth == 0 ? 0 : -1;
+}
+
+static uint64_t align_up(uint64_t offset) {
+    return (offset + BLOCK_ALIGN - 1) / BLOCK_ALIGN * BLOCK_ALIGN;
+}
+
+/* The size of the node block of a tree, the same as the block of d2_alloc_local_tree. */
+static uint64_t block_bytes(uint32_t nodes) {
+    return (uint64_t)nodes * (2 * sizeof(uint32_t) + sizeof(uint8_t));
+}
+
+static int compare_items(const void* a, const void* b) {
+    const struct SnapshotItem* x = (const struct SnapshotItem*)a;
+    const struct SnapshotItem* y = (const struct SnapshotItem*)b;
+    return x->id < y->id ? -1 : x->id > y->id;
+}
+
+/**
+ * Writes all bytes, or fails.
+ *
+ * @param f The file.
+ * @param data The bytes, or NULL for zeros.
+ * @param len The number of bytes.
+ * @return 0 on success, or -1 on failure.
+ */
+static int write_bytes(FILE* f, const void* data, uint64_t len) {
+    static const char zeros[BLOCK_ALIGN] = { 0 };
+    if (data != NULL) {
+        return len == 0 || fwrite(data, len, 1, f) == 1 ? 0 : -1;
+    }
+    while (len > 0) {
+        size_t chunk = len < sizeof(zeros) ? len : sizeof(zeros);
+        if (fwrite(zeros, chunk, 1, f) != 1) {
+            return -1;
+        }
+        len -= chunk;
+    }
+    return 0;
+}
+
+/**
+ * Syncs the directory of a path, so a rename in it is on disk.
+ *
+ * @param path The path of a file in the directory.
+ */
+static void sync_directory(const char* path) {
+    char* dir = strdup(path);
+    if (dir == NULL) {
+        return;
+    }
+    char* slash = strrchr(dir, '/');
+    const char* name = ".";
+    if (slash == dir) {
+        name = "/";
+    } else if (slash != NULL) {
+        *slash = '\0';
+        name = dir;
+    }
+    int fd = open(name, O_RDONLY);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+
+/**
+ * Writes the snapshot file: header, directory, node blocks.
+ *
+ * @param f The file, empty.
+ * @param items The trees to write, sorted by id.
+ * @param trees The trees, indexed by items[i].index.
+ * @param n The number of trees.
+ * @return 0 on success, or -1 on failure.
+ */
+static int write_snapshot(FILE* f, const struct SnapshotItem* items, const LocalTreeStore* const* trees, int n) {
+    struct SnapshotEntry* directory = calloc(n > 0 ? n : 1, sizeof(struct SnapshotEntry));
+    if (directory == NULL) {
+        return -1;
+    }
+    uint64_t offset = align_up(sizeof(struct SnapshotHeader) + (uint64_t)n * sizeof(struct SnapshotEntry));
+    for (int i = 0; i < n; i++) {
+        const LocalTreeStore* tree = trees[items[i].index];
+        directory[i].id = htole32(items[i].id);
+        directory[i].nodes = htole32(tree->number_of_nodes);
+        directory[i].offset = htole64(offset);
+        directory[i].bytes = htole64(block_bytes(tree->number_of_nodes));
+        directory[i].checksum = htole32(block_checksum(tree->value, block_bytes(tree->number_of_nodes)));
+        offset = align_up(offset + block_bytes(tree->number_of_nodes));
+    }
+
+    struct SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = htole32(D2_SNAPSHOT_VERSION);
+    header.header_size = htole32(sizeof(header));
+    header.ntrees = htole32(n);
+    header.directory_checksum = htole32(fnv1a(directory, (size_t)n * sizeof(struct SnapshotEntry)));
+    header.file_size = htole64(offset);
+    header.directory_offset = htole64(sizeof(header));
+
+    int res = write_bytes(f, &header, sizeof(header));
+    res |= write_bytes(f, directory, (uint64_t)n * sizeof(struct SnapshotEntry));
+    uint64_t written = sizeof(header) + (uint64_t)n * sizeof(struct SnapshotEntry);
+    for (int i = 0; i < n && res == 0; i++) {
+        const LocalTreeStore* tree = trees[items[i].index];
+        uint64_t at = le64toh(directory[i].offset);
+        res |= write_bytes(f, NULL, at - written);
+        // The three arrays are one block, starting at value
+        res |= write_bytes(f, tree->value, block_bytes(tree->number_of_nodes));
+        written = at + block_bytes(tree->number_of_nodes);
+    }
+    res |= write_bytes(f, NULL, offset - written);
+    free(directory);
+    return res == 0 ? 0 : -1;
+}
+
+/**
+ * Checks the header and directory of a mapped snapshot, and the checksum and structure of
+ * every node block, and sets up its trees.
+ *
+ * @param s The D2Snapshot, with map and size set.
+ * @return 0 on success, or -1 if the snapshot is not valid.
+ */
+static int load_directory(D2Snapshot* s) {
+    if (s->size < sizeof(struct SnapshotHeader)) {
+        return -1;
+    }
+    const struct SnapshotHeader* header = (const struct SnapshotHeader*)s->map;
+    uint64_t n = le32toh(header->ntrees);
+    uint64_t dir_offset = le64toh(header->directory_offset);
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+        le32toh(header->version) != D2_SNAPSHOT_VERSION ||
+        le32toh(header->header_size) != sizeof(struct SnapshotHeader) ||
+        le64toh(header->file_size) != s->size ||
+        dir_offset < sizeof(struct SnapshotHeader) || dir_offset % 8 != 0 ||
+        dir_offset + n * sizeof(struct SnapshotEntry) > s->size) {
+        return -1;
+    }
+    const struct SnapshotEntry* directory = (const struct SnapshotEntry*)(s->map + dir_offset);
+    if (fnv1a(directory, n * sizeof(struct SnapshotEntry)) != le32toh(header->directory_checksum)) {
+        return -1;
+    }
+
+    uint64_t max_nodes = 1;
+    for (uint64_t i = 0; i < n; i++) {
+        uint32_t nodes = le32toh(directory[i].nodes);
+        max_nodes = nodes > max_nodes && block_bytes(nodes) <= s->size ? nodes : max_nodes;
+    }
+
+    s->n = n;
+    s->ids = malloc((n > 0 ? n : 1) * sizeof(uint32_t));
+    s->trees = calloc(n > 0 ? n : 1, sizeof(LocalTreeStore));
+    uint32_t* ends = malloc(max_nodes * sizeof(uint32_t));
+    uint8_t* left = malloc(max_nodes);
+    int res = s->ids != NULL && s->trees != NULL && ends != NULL && left != NULL ? 0 : -1;
+    for (uint64_t i = 0; i < n && res == 0; i++) {
+        uint32_t nodes = le32toh(directory[i].nodes);
+        uint64_t offset = le64toh(directory[i].offset);
+        uint64_t bytes = le64toh(directory[i].bytes);
+        if (nodes == 0 || nodes > INT32_MAX || bytes != block_bytes(nodes) || offset % BLOCK_ALIGN != 0 ||
+            offset > s->size || bytes > s->size - offset ||
+            (i > 0 && le32toh(directory[i].id) < s->ids[i - 1]) ||
+            block_checksum(s->map + offset, bytes) != le32toh(directory[i].checksum)) {
+            res = -1;
+            break;
+        }
+        s->ids[i] = le32toh(directory[i].id);
+        LocalTreeStore* tree = &s->trees[i];
+        tree->number_of_nodes = nodes;
+        tree->filled = nodes;
+        tree->value = (uint32_t*)(s->map + offset);
+        tree->subtree_end = tree->value + nodes;
+        tree->num_children = (uint8_t*)(tree->subtree_end + nodes);
+        res = check_tree(tree, ends, left);
+    }
+    free(ends);
+    free(left);
+    return res;
+}
+
+/*
+* END HELPER FUNCTIONS
+ */
+
+/**
+ * Writes trees to a snapshot file, atomically: to a temporary file first, which is synced
+ * and then renamed over the path.
+ *
+ * @param path The snapshot file.
+ * @param ids The lookup ids of the trees.
+ * @param trees The trees, complete.
+ * @param n The number of trees.
+ * @return 0 on success, or -1 on failure.
+ */
+int d2_snapshot_write(const char* path, const uint32_t* ids, const LocalTreeStore* const* trees, int n) {
+#ifdef SNAPSHOT_UNSUPPORTED
+    (void)path; (void)ids; (void)trees; (void)n;
+    fprintf(stderr, "Snapshots need a little-endian host.\n");
+    return -1;
+#else
+    if (path == NULL || n < 0 || (n > 0 && (ids == NULL || trees == NULL))) {
+        fprintf(stderr, "Invalid input parameters.\n");
+        return -1;
+    }
+    struct SnapshotItem* items = malloc((n > 0 ? n : 1) * sizeof(struct SnapshotItem));
+    char* tmp = malloc(strlen(path) + 32);
+    if (items == NULL || tmp == NULL) {
+        free(items);
+        free(tmp);
+        check_error_d2(-1, "Failed to allocate memory for the snapshot", __LINE__, __FILE__);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (trees[i] == NULL || trees[i]->number_of_nodes <= 0 || trees[i]->filled != trees[i]->number_of_nodes) {
+            fprintf(stderr, "Only complete trees can go into a snapshot.\n");
+            free(items);
+            free(tmp);
+            return -1;
+        }
+        items[i].id = ids[i];
+        items[i].index = i;
+    }
+    qsort(items, n, sizeof(struct SnapshotItem), compare_items);
+
+    // A unique name from mkstemp, so concurrent writers (processes or threads) never share
+    // a temporary file. It is created 0600; the snapshot gets the usual 0644.
+    sprintf(tmp, "%s.XXXXXX", path);
+    int fd = mkstemp(tmp);
+    FILE* f = NULL;
+    if (fd != -1) {
+        fchmod(fd, 0644);
+        f = fdopen(fd, "wb");
+        if (f == NULL) {
+            close(fd);
+            unlink(tmp);
+        }
+    }
+    int res = -1;
+    if (f != NULL) {
+        res = write_snapshot(f, items, trees, n);
+        res |= fflush(f) == 0 ? 0 : -1;
+        res |= fsync(fileno(f)) == 0 ? 0 : -1;
+        res |= fclose(f) == 0 ? 0 : -1;
+        if (res == 0 && rename(tmp, path) == 0) {
+            sync_directory(path);
+        } else {
+            res = -1;
+            unlink(tmp);
+        }
+    }
+    check_error_d2(res, "Failed to write the snapshot", __LINE__, __FILE__);
+    free(items);
+    free(tmp);
+    return res;
+#endif
+}
+
+/**
+ * Maps a snapshot file and points a LocalTreeStore at each of its trees.
+ *
+ * @param path The snapshot file.
+ * @return The snapshot, or NULL on failure.
+ */
+D2Snapshot* d2_snapshot_open(const char* path) {
+#ifdef SNAPSHOT_UNSUPPORTED
+    (void)path;
+    fprintf(stderr, "Snapshots need a little-endian host.\n");
+    return NULL;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    D2Snapshot* s = calloc(1, sizeof(D2Snapshot));
+    if (s == NULL || fstat(fd, &st) == -1 || st.st_size == 0) {
+        free(s);
+        close(fd);
+        return NULL;
+    }
+    s->size = st.st_size;
+    s->map = mmap(NULL, s->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file
+    if (s->map == MAP_FAILED) {
+        free(s);
+        return NULL;
+    }
+    if (load_directory(s) == -1) {
+        fprintf(stderr, "%s is not a valid snapshot.\n", path);
+        return d2_snapshot_close(s);
+    }
+    print_line_d2(__LINE__, __FILE__, "Opened snapshot");
+    return s;
+#endif
+}
+
+/**
+ * Unmaps a snapshot.
+ *
+ * @param snapshot The D2Snapshot, may be NULL.
+ * @return Always NULL.
+ */
+D2Snapshot* d2_snapshot_close(D2Snapshot* snapshot) {
+    if (snapshot) {
+        munmap(snapshot->map, snapshot->size);
+        free(snapshot->ids);
+        free(snapshot->trees);
+        free(snapshot);
+    }
+    return NULL;
+}
+
+/**
+ * The number of trees in a snapshot.
+ *
+ * @param snapshot The D2Snapshot.
+ * @return The number of trees.
+ */
+int d2_snapshot_count(const D2Snapshot* snapshot) {
+    return snapshot ? snapshot->n : 0;
+}
+
+/**
+ * A tree of a snapshot by its position.
+ *
+ * @param snapshot The D2Snapshot.
+ * @param i The position in the directory.
+ * @param id Set to the lookup id of the tree, unless NULL.
+ * @return The tree, or NULL if i is out of range.
+ */
+const LocalTreeStore* d2_snapshot_tree(const D2Snapshot* snapshot, int i, uint32_t* id) {
+    if (snapshot == NULL || i < 0 || i >= snapshot->n) {
+        return NULL;
+    }
+    if (id) {
+        *id = snapshot->ids[i];
+    }
+    return &snapshot->trees[i];
+}
+
+/**
+ * A tree of a snapshot by its lookup id.
+ *
+ * @param snapshot The D2Snapshot.
+ * @param id The lookup id.
+ * @return The tree, or NULL if the snapshot does not have it.
+ */
+const LocalTreeStore* d2_snapshot_find(const D2Snapshot* snapshot, uint32_t id) {
+    if (snapshot == NULL) {
+        return NULL;
+    }
+    int lo = 0;
+    int hi = snapshot->n;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (snapshot->ids[mid] < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < snapshot->n && snapshot->ids[lo] == id ? &snapshot->trees[lo] : NULL;
+}
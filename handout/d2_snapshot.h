@@ -0,0 +1,65 @@
+#ifndef D2_SNAPSHOT_H
+#define D2_SNAPSHOT_H
+
+#include "d2_lookup.h"
+
+/* Snapshots: many trees in one file that is opened with mmap, so the trees can be used
+ * right away after a restart instead of being fetched again.
+ *
+ * The file is little-endian and laid out so that every tree's node block is exactly the
+ * block of a LocalTreeStore (value, subtree_end and num_children, see d2_lookup_mod.h).
+ * Opening a snapshot checks the header and the directory, and the checksum and the
+ * structure (subtree ends, at most 5 children per node) of every node block. It then
+ * points a LocalTreeStore at each block in the mapping; the nodes are not copied.
+ *
+ *   offset  size
+ *   0       64        header: magic "D2SNAP\0\0", version, header size, number of
+ *                     trees, file size, directory offset, checksum of the directory
+ *   64      32 * n    directory, sorted by lookup id: id, number of nodes, offset,
+ *                     size and checksum of the node block
+ *   ...               node blocks, each at a multiple of 64
+ *
+ * d2_snapshot_write writes a temporary file with a unique name (mkstemp) next to path,
+ * syncs it and renames it over path, so a reader sees either the old snapshot or the new
+ * one, also after a crash and with concurrent writers.
+ *
+ * The trees of an open snapshot are read-only: don't change them or give them to
+ * d2_free_local_tree. They stay valid until d2_snapshot_close. An open snapshot can be
+ * read from any number of threads.
+ */
+
+#define D2_SNAPSHOT_VERSION 2
+
+typedef struct D2Snapshot D2Snapshot;
+
+/* Write the n trees, trees[i] being the tree of ids[i], to path. The trees must be
+ * complete; the ids should be distinct.
+ * Returns 0, or -1 in case of failure (then path is unchanged).
+ */
+int d2_snapshot_write( const char* path, const uint32_t* ids, const LocalTreeStore* const* trees, int n );
+
+/* Map the snapshot at path.
+ * Returns NULL if it can't be read or is not a valid snapshot of this version.
+ */
+D2Snapshot* d2_snapshot_open( const char* path );
+
+/* Unmap the snapshot.
+ * Returns always NULL.
+ */
+D2Snapshot* d2_snapshot_close( D2Snapshot* snapshot );
+
+/* Returns the number of trees in the snapshot.
+ */
+int d2_snapshot_count( const D2Snapshot* snapshot );
+
+/* The tree at index i of the directory (ordered by id), and its id if id is not NULL.
+ * Returns NULL if i is out of range.
+ */
+const LocalTreeStore* d2_snapshot_tree( const D2Snapshot* snapshot, int i, uint32_t* id );
+
+/* The tree of a lookup id, found by binary search in the directory.
+ * Returns NULL if the snapshot does not have it.
+ */
+const LocalTreeStore* d2_snapshot_find( const D2Snapshot* snapshot, uint32_t id );
+
+#endif /* D2_SNAPSHOT_H */
@@ -0,0 +1,129 @@
+/* ======================================================================
+ * Cold start from a snapshot compared with fetching the trees again: looks
+ * up N trees with d2_lookup_many, writes them to a snapshot, and opens it
+ * with the file dropped from the page cache and again with it cached. Each
+ * start counts until every tree has been read once (the sum of its values).
+ * The trees from the snapshot are compared with the fetched ones.
+ *
+ * Usage: d2_snapshot_bench <server> <port> [trees] [file]
+ *   The server must answer several requests per association, e.g.
+ *   d2_shard_server.
+ * ====================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "d2_many.h"
+#include "d2_snapshot.h"
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Reads every node of every tree once. */
+static uint64_t touch(const D2Snapshot* snapshot) {
+    uint64_t sum = 0;
+    for (int i = 0; i < d2_snapshot_count(snapshot); i++) {
+        const LocalTreeStore* tree = d2_snapshot_tree(snapshot, i, NULL);
+        for (int k = 0; k < tree->number_of_nodes; k++) {
+            sum += tree->value[k];
+        }
+    }
+    return sum;
+}
+
+/* Asks the kernel to drop the file from the page cache, so the next open reads the disk. */
+static void drop_cache(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd != -1) {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <server> <port> [trees] [file]\n", argv[0]);
+        return 1;
+    }
+    int n = argc > 3 ? atoi(argv[3]) : 2000;
+    const char* path = argc > 4 ? argv[4] : "d2_snapshot_bench.snap";
+
+    uint32_t* ids = malloc(n * sizeof(uint32_t));
+    LocalTreeStore** trees = malloc(n * sizeof(LocalTreeStore*));
+    if (ids == NULL || trees == NULL) {
+        return 1;
+    }
+    for (int i = 0; i < n; i++) {
+        ids[i] = 1001 + (uint32_t)i * 7919 % 100000;
+    }
+
+    double start = now_s();
+    int received = d2_lookup_many(NULL, argv[1], atoi(argv[2]), ids, n, 8, trees);
+    double fetch_s = now_s() - start;
+    if (received != n) {
+        printf("only %d of %d trees received\n", received, n);
+        return 1;
+    }
+
+    start = now_s();
+    if (d2_snapshot_write(path, ids, (const LocalTreeStore* const*)trees, n) == -1) {
+        return 1;
+    }
+    double write_s = now_s() - start;
+
+    long nodes = 0;
+    uint64_t expect = 0;
+    for (int i = 0; i < n; i++) {
+        nodes += trees[i]->number_of_nodes;
+        for (int k = 0; k < trees[i]->number_of_nodes; k++) {
+            expect += trees[i]->value[k];
+        }
+    }
+
+    double open_s[2];
+    for (int warm = 0; warm < 2; warm++) {
+        if (!warm) {
+            drop_cache(path);
+        }
+        start = now_s();
+        D2Snapshot* snapshot = d2_snapshot_open(path);
+        uint64_t sum = snapshot ? touch(snapshot) : 0;
+        open_s[warm] = now_s() - start;
+        if (snapshot == NULL || d2_snapshot_count(snapshot) != n || sum != expect) {
+            printf("the snapshot does not hold the trees\n");
+            return 1;
+        }
+        // Every tree in place, the same bytes as the fetched one
+        for (int i = 0; i < n; i++) {
+            const LocalTreeStore* tree = d2_snapshot_find(snapshot, ids[i]);
+            if (tree == NULL || tree->number_of_nodes != trees[i]->number_of_nodes ||
+                memcmp(tree->value, trees[i]->value, d2_tree_bytes(tree) - sizeof(LocalTreeStore)) != 0) {
+                printf("tree %u differs in the snapshot\n", ids[i]);
+                return 1;
+            }
+        }
+        d2_snapshot_close(snapshot);
+    }
+
+    printf("%d trees, %ld nodes\n", n, nodes);
+    printf("%-34s %10.2f ms\n", "fetch with d2_lookup_many", fetch_s * 1e3);
+    printf("%-34s %10.2f ms\n", "write the snapshot", write_s * 1e3);
+    printf("%-34s %10.2f ms\n", "open the snapshot, not cached", open_s[0] * 1e3);
+    printf("%-34s %10.2f ms\n", "open the snapshot, cached", open_s[1] * 1e3);
+
+    unlink(path);
+    for (int i = 0; i < n; i++) {
+        d2_free_local_tree(trees[i]);
+    }
+    free(ids);
+    free(trees);
+    return 0;
+}
@@ -0,0 +1,1083 @@
+/* ======================================================================
+ * D2 tree store: a persistent tree cache in an append-only segment log
+ * with a hash index, compacted in the background.
+ * ====================================================================== */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "d2_store.h"
+#include "d2_mux.h"
+
+
+#define RECORD_MAGIC 0x43523244u  /* "D2RC" */
+#define INDEX_MAGIC  "D2STIDX\0"
+#define INDEX_SLOTS  1024         /* initial size of the hash table, a power of two */
+#define SEGMENTS     8            /* max_bytes is split into about this many segments */
+#define SEGMENT_MAX  (1u << 30)   /* offsets in the index are 32 bits */
+
+/* The node blocks are written and read as they are in memory. */
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#define STORE_UNSUPPORTED 1
+#endif
+
+/* A record in a segment: the header, the node block of the tree (value, subtree_end,
+ * num_children), and zeros up to a multiple of 8 bytes.
+ */
+struct RecordHeader
+{
+    uint32_t magic;
+    uint32_t id;
+    uint32_t nodes;
+    uint32_t checksum;   /* of id, nodes and the node block */
+};
+
+/* An entry of the hash table, in memory and in the index file. */
+struct StoreSlot
+{
+    uint32_t id;
+    uint32_t segment;    /* number of the segment, 0: empty slot */
+    uint32_t offset;     /* of the record in the segment */
+    uint32_t nodes;
+};
+
+/* The index file: this header, nsegments IndexSegments, nslots StoreSlots. */
+struct IndexHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t nsegments;
+    uint32_t nslots;
+    uint32_t nentries;
+    uint32_t checksum;   /* of the segments and the slots */
+    uint8_t  reserved[32];
+};
+
+struct IndexSegment
+{
+    uint32_t number;
+    uint32_t reserved;
+    uint64_t covered;    /* the records before this offset are in the index */
+};
+
+_Static_assert(sizeof(struct RecordHeader) == 16, "a record header is 16 bytes");
+_Static_assert(sizeof(struct StoreSlot) == 16, "an index slot is 16 bytes");
+_Static_assert(sizeof(struct IndexHeader) == 64, "the index header is 64 bytes");
+
+struct StoreSegment
+{
+    uint32_t number;
+    int      fd;
+    uint64_t bytes;      /* of valid records, the next record goes here */
+    uint64_t live;       /* bytes of the records the index points to */
+    uint64_t synced;     /* the records before this offset are on disk */
+};
+
+struct D2Store
+{
+    char*                dir;
+    uint64_t             max_bytes;
+    uint64_t             segment_bytes;
+    int                  lock_fd;        /* flock'ed, one process per directory */
+    int                  ready;          /* recovered, the index is written on close */
+
+    /* Gets take it for reading; puts, compaction steps and syncs for writing. */
+    pthread_rwlock_t     lock;
+    struct StoreSlot*    slots;
+    uint32_t             nslots;
+    uint32_t             nentries;
+    struct StoreSegment* segments;       /* oldest first, the last one is appended to */
+    int                  nsegments;
+    int                  segments_cap;
+    uint32_t             next_number;
+    uint64_t             bytes;
+
+    long                 hits;           /* atomic */
+    long                 misses;         /* atomic */
+    long                 puts;
+    long                 evictions;
+    long                 compactions;
+    long                 recovered;
+    uint64_t             truncated;
+
+    pthread_t            compactor;
+    int                  has_compactor;
+    pthread_mutex_t      wake_lock;
+    pthread_cond_t       wake;
+    int                  wanted;         /* a segment may be worth compacting */
+    int                  stop;
+};
+
+/*
+* START HELPER FUNCTIONS
+ */
+
+static uint32_t hash_id(uint32_t id) {
+    id ^= id >> 16;
+    id *= 0x85ebca6bu;
+    id ^= id >> 13;
+    id *= 0xc2b2ae35u;
+    return id ^ id >> 16;
+}
+
+static uint64_t payload_bytes(uint32_t nodes) {
+    return (uint64_t)nodes * (2 * sizeof(uint32_t) + sizeof(uint8_t));
+}
+
+static uint64_t record_bytes(uint32_t nodes) {
+    return sizeof(struct RecordHeader) + (payload_bytes(nodes) + 7) / 8 * 8;
+}
+
+/**
+ * @brief A 32-bit checksum that takes 8 bytes per step, for the records and the index.
+ * It finds torn writes and bit flips, it is not meant to resist attacks.
+ */
+static uint32_t checksum(uint64_t seed, const void* data, uint64_t len) {
+    const uint8_t* p = (const uint8_t*)data;
+    uint64_t h = seed ^ 0x9e3779b97f4a7c15ull;
+    uint64_t word;
+    for (; len >= 8; len -= 8, p += 8) {
+        memcpy(&word, p, 8);
+        h = (h ^ word) * 0x100000001b3ull;
+        h ^= h >> 29;
+    }
+    word = 0;
+    memcpy(&word, p, len);
+    h = (h ^ word ^ len << 56) * 0xff51afd7ed558ccdull;
+    h ^= h >> 32;
+    return (uint32_t)h;
+}
+
+static uint32_t record_checksum(uint32_t id, uint32_t nodes, const void* payload) {
+    return checksum((uint64_t)id << 32 | nodes, payload, payload_bytes(nodes));
+}
+
+static void segment_path(const D2Store* s, uint32_t number, char* path, size_t len) {
+    snprintf(path, len, "%s/%08u.seg", s->dir, number);
+}
+
+/**
+ * @brief Finds a segment by number, with a binary search.
+ *
+ * @return The segment, or NULL if it is gone.
+ */
+static struct StoreSegment* segment_find(D2Store* s, uint32_t number) {
+    int lo = 0;
+    int hi = s->nsegments - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (s->segments[mid].number == number) {
+            return &s->segments[mid];
+        }
+        if (s->segments[mid].number < number) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Adds a segment after the others, for an existing file or a new one.
+ *
+ * @param s The store.
+ * @param number The number of the segment.
+ * @param create 1 to create an empty file, 0 to open the existing one.
+ * @return The segment, or NULL on failure.
+ */
+static struct StoreSegment* segment_add(D2Store* s, uint32_t number, int create) {
+    if (s->nsegments == s->segments_cap) {
+        int cap = s->segments_cap ? s->segments_cap * 2 : 16;
+        struct StoreSegment* segments = realloc(s->segments, cap * sizeof(struct StoreSegment));
+        if (segments == NULL) {
+            return NULL;
+        }
+        s->segments = segments;
+        s->segments_cap = cap;
+    }
+    char path[4096];
+    segment_path(s, number, path, sizeof(path));
+    int fd = open(path, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0666);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct StoreSegment* seg = &s->segments[s->nsegments++];
+    memset(seg, 0, sizeof(*seg));
+    seg->number = number;
+    seg->fd = fd;
+    if (number >= s->next_number) {
+        s->next_number = number + 1;
+    }
+    return seg;
+}
+
+/**
+ * @brief Closes and deletes the segment at index i. The caller fixes the index.
+ */
+static void segment_drop(D2Store* s, int i) {
+    char path[4096];
+    segment_path(s, s->segments[i].number, path, sizeof(path));
+    close(s->segments[i].fd);
+    unlink(path);
+    s->bytes -= s->segments[i].bytes;
+    memmove(&s->segments[i], &s->segments[i + 1], (s->nsegments - i - 1) * sizeof(struct StoreSegment));
+    s->nsegments--;
+}
+
+/**
+ * @brief Syncs the records that are not on disk yet.
+ *
+ * @return 0 on success, or -1 if a sync failed.
+ */
+static int sync_segments(D2Store* s) {
+    int res = 0;
+    for (int i = 0; i < s->nsegments; i++) {
+        struct StoreSegment* seg = &s->segments[i];
+        if (seg->synced < seg->bytes) {
+            if (fdatasync(seg->fd) == 0) {
+                seg->synced = seg->bytes;
+            } else {
+                res = -1;
+            }
+        }
+    }
+    return res;
+}
+
+/**
+ * @brief Finds the slot of an id.
+ *
+ * @return Its index, or -1 if the id is not in the table.
+ */
+static int table_find(const D2Store* s, uint32_t id) {
+    uint32_t mask = s->nslots - 1;
+    for (uint32_t i = hash_id(id) & mask;; i = (i + 1) & mask) {
+        if (s->slots[i].segment == 0) {
+            return -1;
+        }
+        if (s->slots[i].id == id) {
+            return i;
+        }
+    }
+}
+
+/**
+ * @brief The slot for an id in a table: its slot, or the empty one where it goes.
+ */
+static struct StoreSlot* table_probe(struct StoreSlot* slots, uint32_t nslots, uint32_t id) {
+    uint32_t mask = nslots - 1;
+    uint32_t i = hash_id(id) & mask;
+    while (slots[i].segment != 0 && slots[i].id != id) {
+        i = (i + 1) & mask;
+    }
+    return &slots[i];
+}
+
+/**
+ * @brief Rebuilds the hash table with nslots slots. It keeps the entries whose record is
+ * within a segment that still exists, and recounts the live bytes of the segments. This
+ * is how the entries of dropped segments are removed, all at once.
+ *
+ * @return The number of entries dropped, or -1 if there is no memory (then the table
+ * stays as it is).
+ */
+static long table_rebuild(D2Store* s, uint32_t nslots) {
+    struct StoreSlot* slots = calloc(nslots, sizeof(struct StoreSlot));
+    if (slots == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < s->nsegments; i++) {
+        s->segments[i].live = 0;
+    }
+    long dropped = 0;
+    uint32_t nentries = 0;
+    for (uint32_t i = 0; i < s->nslots; i++) {
+        struct StoreSlot* old = &s->slots[i];
+        if (old->segment == 0) {
+            continue;
+        }
+        struct StoreSegment* seg = segment_find(s, old->segment);
+        if (seg == NULL || old->nodes == 0 || old->offset + record_bytes(old->nodes) > seg->bytes) {
+            dropped++;
+            continue;
+        }
+        struct StoreSlot* slot = table_probe(slots, nslots, old->id);
+        if (slot->segment != 0) {
+            continue; // a duplicate, only in a damaged index
+        }
+        *slot = *old;
+        seg->live += record_bytes(old->nodes);
+        nentries++;
+    }
+    free(s->slots);
+    s->slots = slots;
+    s->nslots = nslots;
+    s->nentries = nentries;
+    return dropped;
+}
+
+/**
+ * @brief Wakes the compactor if the segment holding a replaced record is sealed and now
+ * more than half garbage.
+ */
+static void maybe_wake_compactor(D2Store* s, struct StoreSegment* seg) {
+    if (seg != &s->segments[s->nsegments - 1] && seg->live * 2 < seg->bytes) {
+        pthread_mutex_lock(&s->wake_lock);
+        s->wanted = 1;
+        pthread_cond_signal(&s->wake);
+        pthread_mutex_unlock(&s->wake_lock);
+    }
+}
+
+/**
+ * @brief Points the id at a record, replacing the entry it had. Grows the table when it
+ * gets half full.
+ *
+ * @return 0 on success, or -1 if there is no memory.
+ */
+static int table_set(D2Store* s, uint32_t id, uint32_t segment, uint32_t offset, uint32_t nodes) {
+    if ((s->nentries + 1) * 2 > s->nslots && table_rebuild(s, s->nslots * 2) == -1) {
+        return -1;
+    }
+    struct StoreSlot* slot = table_probe(s->slots, s->nslots, id);
+    if (slot->segment != 0) {
+        struct StoreSegment* old = segment_find(s, slot->segment);
+        old->live -= record_bytes(slot->nodes);
+        maybe_wake_compactor(s, old);
+    } else {
+        s->nentries++;
+    }
+    slot->id = id;
+    slot->segment = segment;
+    slot->offset = offset;
+    slot->nodes = nodes;
+    segment_find(s, segment)->live += record_bytes(nodes);
+    return 0;
+}
+
+/**
+ * @brief Removes the entry of an id, if there is one, and moves the entries after it in
+ * the probe sequence back so that they can still be found.
+ */
+static void table_remove(D2Store* s, uint32_t id) {
+    int i = table_find(s, id);
+    if (i == -1) {
+        return;
+    }
+    segment_find(s, s->slots[i].segment)->live -= record_bytes(s->slots[i].nodes);
+    s->nentries--;
+    uint32_t mask = s->nslots - 1;
+    uint32_t hole = i;
+    for (uint32_t j = (hole + 1) & mask; s->slots[j].segment != 0; j = (j + 1) & mask) {
+        // The entry at j may move to the hole if its home slot is not between them
+        uint32_t home = hash_id(s->slots[j].id) & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            s->slots[hole] = s->slots[j];
+            hole = j;
+        }
+    }
+    s->slots[hole].segment = 0;
+}
+
+/**
+ * @brief Drops the oldest segments, and their trees, until the store fits into max_bytes.
+ * The newest segment stays.
+ */
+static void enforce_cap(D2Store* s) {
+    while (s->bytes > s->max_bytes && s->nsegments > 1) {
+        segment_drop(s, 0);
+        long dropped = table_rebuild(s, s->nslots);
+        if (dropped > 0) {
+            s->evictions += dropped;
+        }
+    }
+}
+
+/**
+ * @brief Appends a record to the newest segment, starting a new one when it is full, and
+ * points the index at it. The store must be locked for writing.
+ *
+ * @param s The store.
+ * @param header The record header, complete.
+ * @param payload The node block.
+ * @param cap 1 to drop old segments if the store is over max_bytes afterwards.
+ * @return 0 on success, or -1 on failure.
+ */
+static int store_append(D2Store* s, const struct RecordHeader* header, const void* payload, int cap) {
+    uint64_t bytes = record_bytes(header->nodes);
+    struct StoreSegment* seg = s->nsegments > 0 ? &s->segments[s->nsegments - 1] : NULL;
+    if (seg == NULL || (seg->bytes > 0 && seg->bytes + bytes > s->segment_bytes)) {
+        seg = segment_add(s, s->next_number, 1);
+        if (seg == NULL) {
+            return -1;
+        }
+        if (s->nsegments > 1) {
+            maybe_wake_compactor(s, &s->segments[s->nsegments - 2]);
+        }
+    }
+
+    static const char zeros[8] = { 0 };
+    struct iovec iov[3] = {
+        { (void*)header, sizeof(*header) },
+        { (void*)payload, payload_bytes(header->nodes) },
+        { (void*)zeros, bytes - sizeof(*header) - payload_bytes(header->nodes) },
+    };
+    // A failed write leaves garbage after the valid records, which the next one overwrites
+    if (pwritev(seg->fd, iov, 3, seg->bytes) != (ssize_t)bytes) {
+        return -1;
+    }
+    if (table_set(s, header->id, seg->number, seg->bytes, header->nodes) == -1) {
+        return -1;
+    }
+    seg->bytes += bytes;
+    s->bytes += bytes;
+    if (cap) {
+        enforce_cap(s);
+    }
+    return 0;
+}
+
+/**
+ * @brief Replays the records of a segment from an offset on, and cuts the segment at the
+ * first record that is torn or fails its check.
+ *
+ * @param s The store.
+ * @param seg The segment.
+ * @param from The offset up to which the loaded index already has the records.
+ * @return 0 on success, or -1 on failure.
+ */
+static int replay_segment(D2Store* s, struct StoreSegment* seg, uint64_t from) {
+    struct stat st;
+    if (fstat(seg->fd, &st) == -1) {
+        return -1;
+    }
+    uint64_t size = st.st_size;
+    uint64_t offset = from;
+    char* buf = NULL;
+    uint64_t buf_len = 0;
+    seg->bytes = from;
+    while (offset + sizeof(struct RecordHeader) <= size) {
+        struct RecordHeader header;
+        if (pread(seg->fd, &header, sizeof(header), offset) != sizeof(header) ||
+            header.magic != RECORD_MAGIC || header.nodes == 0 || header.nodes > INT32_MAX ||
+            record_bytes(header.nodes) > size - offset) {
+            break;
+        }
+        uint64_t len = payload_bytes(header.nodes);
+        if (len > buf_len) {
+            char* grown = realloc(buf, len);
+            if (grown == NULL) {
+                free(buf);
+                return -1;
+            }
+            buf = grown;
+            buf_len = len;
+        }
+        if (pread(seg->fd, buf, len, offset + sizeof(header)) != (ssize_t)len) {
+            break;
+        }
+        seg->bytes = offset + record_bytes(header.nodes);
+        s->bytes += record_bytes(header.nodes);
+        // A damaged node block is skipped, the intact header still leads to the next record.
+        // An older record of the id must not come back in its place.
+        if (record_checksum(header.id, header.nodes, buf) != header.checksum) {
+            table_remove(s, header.id);
+        } else if (table_set(s, header.id, seg->number, offset, header.nodes) == -1) {
+            free(buf);
+            return -1;
+        } else {
+            s->recovered++;
+        }
+        offset = seg->bytes;
+    }
+    free(buf);
+    if (offset < size) {
+        s->truncated += size - offset;
+        if (ftruncate(seg->fd, offset) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Loads the index file into the hash table. The segments found on disk must be
+ * open, with bytes set to their file size. On success, bytes is set to how far the index
+ * covers each segment (0 for those it does not know), and the table to the entries whose
+ * records are within that.
+ *
+ * @return 0 on success, or -1 if there is no usable index (then the table is empty).
+ */
+static int load_index(D2Store* s) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/index", s->dir);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    struct IndexHeader header;
+    if (fstat(fd, &st) == -1 || pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != D2_STORE_VERSION || header.header_size != sizeof(header) ||
+        header.nslots < INDEX_SLOTS || (header.nslots & (header.nslots - 1)) != 0 ||
+        header.nentries > header.nslots / 2 ||
+        (uint64_t)st.st_size != sizeof(header) + (uint64_t)header.nsegments * sizeof(struct IndexSegment) +
+                                (uint64_t)header.nslots * sizeof(struct StoreSlot)) {
+        close(fd);
+        return -1;
+    }
+    uint64_t len = st.st_size - sizeof(header);
+    char* body = malloc(len);
+    if (body == NULL || pread(fd, body, len, sizeof(header)) != (ssize_t)len ||
+        checksum(header.nslots, body, len) != header.checksum) {
+        free(body);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    // The segments the index knows must be at least as long as it says, the others are new
+    const struct IndexSegment* covered = (const struct IndexSegment*)body;
+    uint64_t* bytes = calloc(s->nsegments > 0 ? s->nsegments : 1, sizeof(uint64_t));
+    if (bytes == NULL) {
+        free(body);
+        return -1;
+    }
+    for (uint32_t i = 0; i < header.nsegments; i++) {
+        struct StoreSegment* seg = segment_find(s, covered[i].number);
+        if (covered[i].number >= s->next_number) {
+            s->next_number = covered[i].number + 1;
+        }
+        if (seg != NULL) {
+            if (covered[i].covered > seg->bytes) {
+                free(bytes);
+                free(body);
+                return -1;
+            }
+            bytes[seg - s->segments] = covered[i].covered;
+        }
+    }
+    for (int i = 0; i < s->nsegments; i++) {
+        s->segments[i].bytes = bytes[i];
+    }
+    free(bytes);
+
+    free(s->slots);
+    s->slots = malloc((uint64_t)header.nslots * sizeof(struct StoreSlot));
+    if (s->slots == NULL) {
+        free(body);
+        return -1;
+    }
+    memcpy(s->slots, body + (uint64_t)header.nsegments * sizeof(struct IndexSegment),
+           (uint64_t)header.nslots * sizeof(struct StoreSlot));
+    s->nslots = header.nslots;
+    free(body);
+    return table_rebuild(s, s->nslots) == -1 ? -1 : 0;
+}
+
+/**
+ * @brief Syncs the segments and writes the index file, atomically with a rename. The
+ * store must be locked for writing.
+ *
+ * @return 0 on success, or -1 on failure.
+ */
+static int write_index(D2Store* s) {
+    if (sync_segments(s) == -1) {
+        return -1;
+    }
+    uint64_t seg_len = (uint64_t)s->nsegments * sizeof(struct IndexSegment);
+    uint64_t len = seg_len + (uint64_t)s->nslots * sizeof(struct StoreSlot);
+    char* body = calloc(1, len);
+    if (body == NULL) {
+        return -1;
+    }
+    struct IndexSegment* covered = (struct IndexSegment*)body;
+    for (int i = 0; i < s->nsegments; i++) {
+        covered[i].number = s->segments[i].number;
+        covered[i].covered = s->segments[i].bytes;
+    }
+    memcpy(body + seg_len, s->slots, (uint64_t)s->nslots * sizeof(struct StoreSlot));
+
+    struct IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = D2_STORE_VERSION;
+    header.header_size = sizeof(header);
+    header.nsegments = s->nsegments;
+    header.nslots = s->nslots;
+    header.nentries = s->nentries;
+    header.checksum = checksum(header.nslots, body, len);
+
+    char tmp[4096];
+    char path[4096];
+    snprintf(tmp, sizeof(tmp), "%s/index.tmp", s->dir);
+    snprintf(path, sizeof(path), "%s/index", s->dir);
+    int res = -1;
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd != -1) {
+        struct iovec iov[2] = { { &header, sizeof(header) }, { body, len } };
+        res = pwritev(fd, iov, 2, 0) == (ssize_t)(sizeof(header) + len) ? 0 : -1;
+        res |= fsync(fd);
+        res |= close(fd);
+        if (res == 0 && rename(tmp, path) == 0) {
+            int dir_fd = open(s->dir, O_RDONLY);
+            if (dir_fd != -1) {
+                fsync(dir_fd);
+                close(dir_fd);
+            }
+        } else {
+            res = -1;
+            unlink(tmp);
+        }
+    }
+    free(body);
+    return res;
+}
+
+static int compare_numbers(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Opens the segment files of the directory in the order of their numbers, with
+ * bytes set to their file size.
+ *
+ * @return 0 on success, or -1 on failure.
+ */
+static int open_segments(D2Store* s) {
+    DIR* dir = opendir(s->dir);
+    if (dir == NULL) {
+        return -1;
+    }
+    uint32_t* numbers = NULL;
+    int n = 0;
+    int cap = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned number;
+        char rest;
+        if (strlen(entry->d_name) != 12 || sscanf(entry->d_name, "%8u.se%c", &number, &rest) != 2 ||
+            rest != 'g' || number == 0) {
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            uint32_t* grown = realloc(numbers, cap * sizeof(uint32_t));
+            if (grown == NULL) {
+                free(numbers);
+                closedir(dir);
+                return -1;
+            }
+            numbers = grown;
+        }
+        numbers[n++] = number;
+    }
+    closedir(dir);
+
+    if (n > 0) {
+        qsort(numbers, n, sizeof(uint32_t), compare_numbers);
+    }
+    for (int i = 0; i < n; i++) {
+        struct stat st;
+        struct StoreSegment* seg = segment_add(s, numbers[i], 0);
+        if (seg == NULL || fstat(seg->fd, &st) == -1) {
+            free(numbers);
+            return -1;
+        }
+        seg->bytes = st.st_size;
+    }
+    free(numbers);
+    return 0;
+}
+
+/**
+ * @brief Copies the live records of a sealed segment to the newest one and deletes it.
+ * A record is read with the store locked for reading and copied with it locked for
+ * writing, if the index still points to it, so gets and puts go on in between.
+ *
+ * @param s The store.
+ * @param number The number of the segment.
+ */
+static void compact_segment(D2Store* s, uint32_t number) {
+    char* buf = NULL;
+    uint64_t buf_len = 0;
+    uint64_t offset = 0;
+    for (;;) {
+        pthread_rwlock_rdlock(&s->lock);
+        struct StoreSegment* seg = segment_find(s, number);
+        struct RecordHeader header;
+        if (seg == NULL || offset >= seg->bytes ||
+            pread(seg->fd, &header, sizeof(header), offset) != sizeof(header)) {
+            pthread_rwlock_unlock(&s->lock);
+            break;
+        }
+        uint64_t len = payload_bytes(header.nodes);
+        if (len > buf_len) {
+            char* grown = realloc(buf, len);
+            if (grown == NULL) {
+                pthread_rwlock_unlock(&s->lock);
+                break;
+            }
+            buf = grown;
+            buf_len = len;
+        }
+        int i = table_find(s, header.id);
+        int live = i != -1 && s->slots[i].segment == number && s->slots[i].offset == offset;
+        if (live && pread(seg->fd, buf, len, offset + sizeof(header)) != (ssize_t)len) {
+            pthread_rwlock_unlock(&s->lock);
+            break;
+        }
+        pthread_rwlock_unlock(&s->lock);
+
+        if (live) {
+            pthread_rwlock_wrlock(&s->lock);
+            i = table_find(s, header.id);
+            if (i != -1 && s->slots[i].segment == number && s->slots[i].offset == offset) {
+                // Not over the cap: the segment goes away in a moment, and with it more than that
+                store_append(s, &header, buf, 0);
+            }
+            pthread_rwlock_unlock(&s->lock);
+        }
+        offset += record_bytes(header.nodes);
+    }
+    free(buf);
+
+    pthread_rwlock_wrlock(&s->lock);
+    struct StoreSegment* seg = segment_find(s, number);
+    // The copies must be on disk before the originals go
+    if (seg != NULL && seg->live == 0 && seg != &s->segments[s->nsegments - 1] && sync_segments(s) == 0) {
+        segment_drop(s, seg - s->segments);
+        s->compactions++;
+    }
+    enforce_cap(s);
+    pthread_rwlock_unlock(&s->lock);
+}
+
+/**
+ * @brief The sealed segment with the least live bytes, if it is more than half garbage.
+ *
+ * @return Its number, or 0 if no segment is worth compacting.
+ */
+static uint32_t pick_segment(D2Store* s) {
+    pthread_rwlock_rdlock(&s->lock);
+    uint32_t number = 0;
+    double best = 0.5;
+    for (int i = 0; i < s->nsegments - 1; i++) {
+        struct StoreSegment* seg = &s->segments[i];
+        double ratio = seg->bytes ? (double)seg->live / seg->bytes : 1;
+        if (ratio < best) {
+            best = ratio;
+            number = seg->number;
+        }
+    }
+    pthread_rwlock_unlock(&s->lock);
+    return number;
+}
+
+/**
+ * @brief The compaction thread: waits until a segment may be worth compacting, then
+ * compacts segments until none is.
+ */
+static void* run_compactor(void* arg) {
+    D2Store* s = (D2Store*)arg;
+    pthread_mutex_lock(&s->wake_lock);
+    while (!s->stop) {
+        if (!s->wanted) {
+            pthread_cond_wait(&s->wake, &s->wake_lock);
+            continue;
+        }
+        s->wanted = 0;
+        pthread_mutex_unlock(&s->wake_lock);
+
+        uint32_t last = 0;
+        uint32_t number;
+        // A segment that could not be deleted is not tried again until the next wake-up
+        while (!s->stop && (number = pick_segment(s)) != 0 && number != last) {
+            compact_segment(s, number);
+            last = number;
+        }
+        pthread_mutex_lock(&s->wake_lock);
+    }
+    pthread_mutex_unlock(&s->wake_lock);
+    return NULL;
+}
+
+/*
+* END HELPER FUNCTIONS
+ */
+
+/**
+ * @brief Opens a store: takes the directory's lock, opens the segments, loads the index,
+ * replays the records after it and starts the compactor.
+ *
+ * @param dir The directory of the store, created if it does not exist.
+ * @param max_bytes The most the segments may take together.
+ * @return The store, or NULL on failure.
+ */
+D2Store* d2_store_open(const char* dir, uint64_t max_bytes) {
+#ifdef STORE_UNSUPPORTED
+    (void)dir; (void)max_bytes;
+    fprintf(stderr, "The tree store needs a little-endian host.\n");
+    return NULL;
+#else
+    if (dir == NULL || max_bytes == 0) {
+        fprintf(stderr, "Invalid input parameters.\n");
+        return NULL;
+    }
+    D2Store* s = calloc(1, sizeof(D2Store));
+    if (s == NULL || (s->dir = strdup(dir)) == NULL) {
+        free(s);
+        check_error_d2(-1, "Failed to allocate memory for D2Store", __LINE__, __FILE__);
+        return NULL;
+    }
+    s->max_bytes = max_bytes;
+    // The cap drops a segment at a time, so about 1/SEGMENTS of the trees
+    s->segment_bytes = max_bytes / SEGMENTS;
+    s->segment_bytes = s->segment_bytes > SEGMENT_MAX ? SEGMENT_MAX : s->segment_bytes;
+    s->next_number = 1;
+    s->lock_fd = -1;
+
+    // Writers first, so a stream of gets does not hold off puts and compaction
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&s->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    pthread_mutex_init(&s->wake_lock, NULL);
+    pthread_cond_init(&s->wake, NULL);
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/lock", dir);
+    if (mkdir(dir, 0777) == -1 && errno != EEXIST) {
+        check_error_d2(-1, "Failed to create the store directory", __LINE__, __FILE__);
+        return d2_store_close(s);
+    }
+    s->lock_fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (s->lock_fd == -1 || flock(s->lock_fd, LOCK_EX | LOCK_NB) == -1) {
+        check_error_d2(-1, "The store is in use or can't be locked", __LINE__, __FILE__);
+        return d2_store_close(s);
+    }
+
+    // The index covers the segments up to where it was written; the rest is replayed
+    if (open_segments(s) == -1) {
+        check_error_d2(-1, "Failed to open the store segments", __LINE__, __FILE__);
+        return d2_store_close(s);
+    }
+    if (load_index(s) == -1) {
+        for (int i = 0; i < s->nsegments; i++) {
+            s->segments[i].bytes = 0;
+        }
+        free(s->slots);
+        s->slots = calloc(INDEX_SLOTS, sizeof(struct StoreSlot));
+        s->nslots = INDEX_SLOTS;
+        s->nentries = 0;
+    }
+    int res = s->slots != NULL ? 0 : -1;
+    for (int i = 0; i < s->nsegments && res == 0; i++) {
+        struct StoreSegment* seg = &s->segments[i];
+        seg->synced = seg->bytes;
+        s->bytes += seg->bytes;
+        res = replay_segment(s, seg, seg->bytes);
+    }
+    if (res == -1 || (s->nsegments == 0 && segment_add(s, s->next_number, 1) == NULL)) {
+        check_error_d2(-1, "Failed to recover the store", __LINE__, __FILE__);
+        return d2_store_close(s);
+    }
+    enforce_cap(s);
+    s->ready = 1;
+
+    s->wanted = 1; // segments may be half garbage from before
+    if (pthread_create(&s->compactor, NULL, run_compactor, s) == 0) {
+        s->has_compactor = 1;
+    }
+    return s;
+#endif
+}
+
+/**
+ * @brief Stops the compactor, writes the index and frees the store.
+ *
+ * @param store The store, can be NULL.
+ * @return Always NULL.
+ */
+D2Store* d2_store_close(D2Store* store) {
+    if (store == NULL) {
+        return NULL;
+    }
+    if (store->has_compactor) {
+        pthread_mutex_lock(&store->wake_lock);
+        store->stop = 1;
+        pthread_cond_signal(&store->wake);
+        pthread_mutex_unlock(&store->wake_lock);
+        pthread_join(store->compactor, NULL);
+    }
+    if (store->ready) {
+        check_error_d2(write_index(store), "Failed to write the store index", __LINE__, __FILE__);
+    }
+    for (int i = 0; i < store->nsegments; i++) {
+        close(store->segments[i].fd);
+    }
+    if (store->lock_fd != -1) {
+        close(store->lock_fd); // drops the flock
+    }
+    pthread_rwlock_destroy(&store->lock);
+    pthread_mutex_destroy(&store->wake_lock);
+    pthread_cond_destroy(&store->wake);
+    free(store->segments);
+    free(store->slots);
+    free(store->dir);
+    free(store);
+    return NULL;
+}
+
+/**
+ * @brief Reads a tree: finds its record in the index and reads header and node block with
+ * one preadv, straight into a new tree. The record is checked before the tree is
+ * returned.
+ *
+ * @param store The store.
+ * @param id The id.
+ * @return The tree, or NULL if it is not stored.
+ */
+LocalTreeStore* d2_store_get(D2Store* store, uint32_t id) {
+    pthread_rwlock_rdlock(&store->lock);
+    int i = table_find(store, id);
+    if (i == -1) {
+        pthread_rwlock_unlock(&store->lock);
+        __atomic_add_fetch(&store->misses, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    struct StoreSlot slot = store->slots[i];
+    LocalTreeStore* tree = d2_alloc_local_tree(slot.nodes);
+    struct RecordHeader header;
+    ssize_t expect = sizeof(header) + payload_bytes(slot.nodes);
+    ssize_t got = -1;
+    if (tree != NULL) {
+        struct iovec iov[2] = { { &header, sizeof(header) }, { tree->value, payload_bytes(slot.nodes) } };
+        got = preadv(segment_find(store, slot.segment)->fd, iov, 2, slot.offset);
+    }
+    pthread_rwlock_unlock(&store->lock);
+
+    if (got != expect || header.magic != RECORD_MAGIC || header.id != id || header.nodes != slot.nodes ||
+        record_checksum(id, slot.nodes, tree->value) != header.checksum) {
+        if (tree != NULL) {
+            fprintf(stderr, "The stored record of tree %u is damaged.\n", id);
+        }
+        d2_free_local_tree(tree);
+        __atomic_add_fetch(&store->misses, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    tree->filled = slot.nodes;
+    __atomic_add_fetch(&store->hits, 1, __ATOMIC_RELAXED);
+    return tree;
+}
+
+/**
+ * @brief Appends a copy of a tree to the log and points the index at it.
+ *
+ * @param store The store.
+ * @param id The id of the tree.
+ * @param tree The tree, complete. It stays the caller's.
+ * @return 0 on success, or -1 on failure.
+ */
+int d2_store_put(D2Store* store, uint32_t id, const LocalTreeStore* tree) {
+    if (tree == NULL || tree->number_of_nodes <= 0 || tree->filled != tree->number_of_nodes) {
+        fprintf(stderr, "Only complete trees can be stored.\n");
+        return -1;
+    }
+    if (record_bytes(tree->number_of_nodes) > store->max_bytes) {
+        return -1;
+    }
+    struct RecordHeader header = { RECORD_MAGIC, id, tree->number_of_nodes, 0 };
+    header.checksum = record_checksum(id, header.nodes, tree->value); // before taking the lock
+
+    pthread_rwlock_wrlock(&store->lock);
+    int res = store_append(store, &header, tree->value, 1);
+    store->puts += res == 0;
+    pthread_rwlock_unlock(&store->lock);
+    check_error_d2(res, "Failed to append to the store", __LINE__, __FILE__);
+    return res;
+}
+
+/**
+ * @brief Gets a tree from the store, or looks it up on a pooled session and stores it.
+ *
+ * @param store The store.
+ * @param pool The pool to take a session from on a miss.
+ * @param server_name The name of the server.
+ * @param server_port The port of the server.
+ * @param id The id.
+ * @return The tree, or NULL if it could not be looked up.
+ */
+LocalTreeStore* d2_store_fetch(D2Store* store, D2Pool* pool, const char* server_name,
+                               uint16_t server_port, uint32_t id) {
+    LocalTreeStore* tree = d2_store_get(store, id);
+    if (tree != NULL) {
+        return tree;
+    }
+
+    D2Client* client = d2_pool_checkout(pool, server_name, server_port);
+    if (client == NULL) {
+        return NULL;
+    }
+    d2_lookup_tagged(client, &id, 1, &tree);
+    d2_pool_return(pool, client);
+    if (tree != NULL) {
+        d2_store_put(store, id, tree); // the tree is still good if this fails
+    }
+    return tree;
+}
+
+/**
+ * @brief Syncs the segments and writes the index.
+ *
+ * @param store The store.
+ * @return 0 on success, or -1 on failure.
+ */
+int d2_store_sync(D2Store* store) {
+    pthread_rwlock_wrlock(&store->lock);
+    int res = write_index(store);
+    pthread_rwlock_unlock(&store->lock);
+    check_error_d2(res, "Failed to sync the store", __LINE__, __FILE__);
+    return res;
+}
+
+/**
+ * @brief Copies the counters and sizes of the store.
+ *
+ * @param store The store.
+ * @param stats Where to store them.
+ */
+void d2_store_stats(D2Store* store, D2StoreStats* stats) {
+    pthread_rwlock_rdlock(&store->lock);
+    stats->hits = __atomic_load_n(&store->hits, __ATOMIC_RELAXED);
+    stats->misses = __atomic_load_n(&store->misses, __ATOMIC_RELAXED);
+    stats->puts = store->puts;
+    stats->evictions = store->evictions;
+    stats->compactions = store->compactions;
+    stats->recovered = store->recovered;
+    stats->truncated = store->truncated;
+    stats->entries = store->nentries;
+    stats->segments = store->nsegments;
+    stats->bytes = store->bytes;
+    stats->live_bytes = 0;
+    for (int i = 0; i < store->nsegments; i++) {
+        stats->live_bytes += store->segments[i].live;
+    }
+    pthread_rwlock_unlock(&store->lock);
+}
@@ -0,0 +1,93 @@
+#ifndef D2_STORE_H
+#define D2_STORE_H
+
+#include "d2_pool.h"
+
+/* A persistent cache of decoded trees on disk, keyed by lookup id. Unlike d2_cache, it
+ * survives restarts and can hold far more trees than fit into memory.
+ *
+ * The store is a directory with an append-only log split into segment files
+ * (00000001.seg, ...) and a hash index. A put appends a record (a checksummed header and
+ * the node block of the LocalTreeStore, see d2_lookup_mod.h) to the newest segment; a
+ * get looks up the id in the index and reads the record with one pread into a new tree.
+ * Replacing a tree leaves its old record behind as garbage.
+ *
+ * The index is an open-addressing hash table of 16 bytes per tree (id, segment, offset,
+ * number of nodes). It is kept in memory and written to the file "index" by d2_store_sync
+ * and d2_store_close, together with how far each segment was covered.
+ *
+ * Size cap: when the segments together are larger than max_bytes, the oldest segment is
+ * dropped with its trees. A background thread compacts sealed segments that are more than
+ * half garbage: it copies their live records to the newest segment and deletes them.
+ *
+ * Recovery: d2_store_open loads the index and replays the records written after it,
+ * checking each one. The log is cut at the first torn or corrupt record, so a crash at
+ * any point loses at most the trees written since the last d2_store_sync, and never
+ * yields a wrong tree. Without a valid index, the whole log is replayed.
+ *
+ * Records are in host byte order, little-endian hosts only (like d2_snapshot.h). One
+ * process at a time can have a store directory open. All functions can be called from
+ * any number of threads.
+ */
+
+#define D2_STORE_VERSION 1
+
+typedef struct D2Store D2Store;
+
+struct D2StoreStats
+{
+    long     hits;
+    long     misses;      /* including records that failed their check */
+    long     puts;
+    long     evictions;   /* trees dropped with old segments to stay within max_bytes */
+    long     compactions; /* segments compacted and deleted */
+    long     recovered;   /* records replayed by d2_store_open */
+    uint64_t truncated;   /* bytes of torn records cut off by d2_store_open */
+    long     entries;
+    int      segments;
+    uint64_t bytes;       /* of all segments */
+    uint64_t live_bytes;  /* of the records the index points to */
+};
+
+typedef struct D2StoreStats D2StoreStats;
+
+/* Open the store in dir, creating the directory if needed, and recover it. The segments
+ * are kept below max_bytes together.
+ * Returns NULL in case of failure.
+ */
+D2Store* d2_store_open( const char* dir, uint64_t max_bytes );
+
+/* Stop compaction, write the index and close the store.
+ * Returns always NULL.
+ */
+D2Store* d2_store_close( D2Store* store );
+
+/* Read the tree of id into a new tree, which the caller frees with d2_free_local_tree.
+ * Returns NULL if the id is not stored.
+ */
+LocalTreeStore* d2_store_get( D2Store* store, uint32_t id );
+
+/* Append a copy of the tree of id, replacing an older one. The tree must be complete and
+ * stays the caller's. A tree larger than max_bytes is not stored.
+ * Returns 0, or -1 in case of failure.
+ */
+int d2_store_put( D2Store* store, uint32_t id, const LocalTreeStore* tree );
+
+/* Get the tree of id from the store, or look it up with a session from pool and store it.
+ * The network is only used on a miss.
+ * Returns the tree, to be freed with d2_free_local_tree, or NULL if the lookup failed.
+ */
+LocalTreeStore* d2_store_fetch( D2Store* store, D2Pool* pool, const char* server_name,
+                                uint16_t server_port, uint32_t id );
+
+/* Sync the segments and write the index, so everything put so far survives a crash.
+ * Blocks the other calls while it runs.
+ * Returns 0, or -1 in case of failure.
+ */
+int d2_store_sync( D2Store* store );
+
+/* Copy the counters of the store into stats.
+ */
+void d2_store_stats( D2Store* store, D2StoreStats* stats );
+
+#endif /* D2_STORE_H */
@@ -0,0 +1,249 @@
+/* ======================================================================
+ * Latency of the persistent tree store (d2_store.h): misses that go to
+ * the server, hits from the page cache and from disk, and the time to
+ * reopen the store with its index, without it, and after a torn write.
+ * Then compaction after the trees have been replaced, and the size cap.
+ * Every tree read from the store is compared with the one from the server.
+ *
+ * Usage: d2_store_bench <server> <port> [trees] [dir]
+ *   The server must answer several requests per association, e.g.
+ *   d2_shard_server. dir is created, and deleted at the end.
+ * ====================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include "d2_store.h"
+
+#define GETS 20000
+
+static char dir[1024];
+static char newest[2048];
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Prints the percentiles of n latencies in microseconds. */
+static void report(const char* label, double* us, int n) {
+    qsort(us, n, sizeof(double), compare_doubles);
+    printf("%-28s %8.1f %8.1f %8.1f %8.1f %8.1f\n", label, us[n / 2], us[n * 90 / 100], us[n * 99 / 100],
+           us[n * 999 / 1000], us[n - 1]);
+}
+
+/* Calls f for every file of the store directory. */
+static void for_each_file(void (*f)(const char* path)) {
+    DIR* d = opendir(dir);
+    struct dirent* entry;
+    while (d != NULL && (entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            char path[2048];
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+            f(path);
+        }
+    }
+    if (d != NULL) {
+        closedir(d);
+    }
+}
+
+/* The segment names are numbers with leading zeros, so the newest one sorts last. */
+static void find_newest(const char* path) {
+    size_t len = strlen(path);
+    if (len > 4 && strcmp(path + len - 4, ".seg") == 0 && strcmp(path, newest) > 0) {
+        snprintf(newest, sizeof(newest), "%s", path);
+    }
+}
+
+static void remove_file(const char* path) {
+    unlink(path);
+}
+
+/* Asks the kernel to drop the file from the page cache, so the next reads go to disk. */
+static void drop_cache(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd != -1) {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+static int same_tree(const LocalTreeStore* a, const LocalTreeStore* b) {
+    return a != NULL && b != NULL && a->number_of_nodes == b->number_of_nodes &&
+           memcmp(a->value, b->value, d2_tree_bytes(a) - sizeof(LocalTreeStore)) == 0;
+}
+
+/* Random gets of the stored trees, checked against the fetched ones. */
+static int timed_gets(D2Store* store, const uint32_t* ids, LocalTreeStore** trees, int n, double* us, int gets) {
+    unsigned seed = 1;
+    for (int i = 0; i < gets; i++) {
+        int k = rand_r(&seed) % n;
+        double start = now_us();
+        LocalTreeStore* tree = d2_store_get(store, ids[k]);
+        us[i] = now_us() - start;
+        if (!same_tree(tree, trees[k])) {
+            printf("tree %u differs in the store\n", ids[k]);
+            return -1;
+        }
+        d2_free_local_tree(tree);
+    }
+    return 0;
+}
+
+/* Reopens the store and prints what recovery found. */
+static D2Store* reopen(D2Store* store, const char* label, uint64_t max_bytes, long expect) {
+    d2_store_close(store);
+    double start = now_us();
+    store = d2_store_open(dir, max_bytes);
+    double took = now_us() - start;
+    D2StoreStats stats;
+    if (store == NULL) {
+        printf("%s: the store does not open\n", label);
+        return NULL;
+    }
+    d2_store_stats(store, &stats);
+    printf("%-28s %8.2f ms, %ld trees, %ld records replayed, %lu bytes cut off\n", label, took / 1e3,
+           stats.entries, stats.recovered, (unsigned long)stats.truncated);
+    if (stats.entries != expect) {
+        printf("expected %ld trees\n", expect);
+        return d2_store_close(store);
+    }
+    return store;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <server> <port> [trees] [dir]\n", argv[0]);
+        return 1;
+    }
+    int n = argc > 3 ? atoi(argv[3]) : 2000;
+    snprintf(dir, sizeof(dir), "%s", argc > 4 ? argv[4] : "d2_store_bench.d");
+    uint64_t max_bytes = 16 << 20; // segments of 2 MiB
+
+    uint32_t* ids = malloc(n * sizeof(uint32_t));
+    LocalTreeStore** trees = calloc(n, sizeof(LocalTreeStore*));
+    double* us = malloc((GETS > n ? GETS : n) * sizeof(double));
+    D2Pool* pool = d2_pool_create(4);
+    for_each_file(remove_file);
+    D2Store* store = d2_store_open(dir, max_bytes);
+    if (ids == NULL || trees == NULL || us == NULL || pool == NULL || store == NULL) {
+        return 1;
+    }
+
+    printf("%d trees, microseconds       %8s %8s %8s %8s %8s\n", n, "p50", "p90", "p99", "p99.9", "max");
+    for (int i = 0; i < n; i++) {
+        ids[i] = 1001 + (uint32_t)i * 7919 % 100000;
+        double start = now_us();
+        trees[i] = d2_store_fetch(store, pool, argv[1], atoi(argv[2]), ids[i]);
+        us[i] = now_us() - start;
+        if (trees[i] == NULL) {
+            printf("lookup of %u failed\n", ids[i]);
+            return 1;
+        }
+    }
+    report("miss, from the server", us, n);
+    d2_store_sync(store);
+
+    if (timed_gets(store, ids, trees, n, us, GETS) == -1) {
+        return 1;
+    }
+    report("hit, page cache", us, GETS);
+
+    // Cold: the segments are not in the page cache after the restart
+    store = reopen(store, "reopen with the index", max_bytes, n);
+    for_each_file(drop_cache);
+    if (store == NULL || timed_gets(store, ids, trees, n, us, n) == -1) {
+        return 1;
+    }
+    report("hit, from disk", us, n);
+
+    D2StoreStats stats;
+    d2_store_stats(store, &stats);
+    long hits = stats.hits;
+    for (int i = 0; i < n; i++) {
+        d2_free_local_tree(d2_store_fetch(store, pool, argv[1], atoi(argv[2]), ids[i]));
+    }
+    d2_store_stats(store, &stats);
+    printf("%-28s %ld of %d without the server\n", "d2_store_fetch again", stats.hits - hits, n);
+
+    // Crashes: no index, and a torn record at the end of the log
+    d2_store_close(store);
+    char path[2048];
+    snprintf(path, sizeof(path), "%s/index", dir);
+    unlink(path);
+    store = reopen(NULL, "reopen without the index", max_bytes, n);
+    d2_store_close(store);
+    newest[0] = '\0';
+    for_each_file(find_newest);
+    FILE* f = fopen(newest, "ab");
+    if (f != NULL) {
+        // A record header that promises more than was written
+        uint32_t torn[8] = { 0x43523244u, ids[1], 1000, 0, 1, 2, 3, 4 };
+        fwrite(torn, sizeof(torn), 1, f);
+        fclose(f);
+    }
+    store = reopen(NULL, "reopen after a torn write", max_bytes, n);
+    if (store == NULL || timed_gets(store, ids, trees, n, us, n) == -1) {
+        return 1;
+    }
+
+    // Compaction: every tree replaced twice leaves two thirds of the log as garbage
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < n; i++) {
+            d2_store_put(store, ids[i], trees[i]);
+        }
+    }
+    // Until the compactor has been idle for a while
+    long compactions = -1;
+    for (int wait = 0; wait < 100 && stats.compactions != compactions; wait++) {
+        compactions = stats.compactions;
+        usleep(50000);
+        d2_store_stats(store, &stats);
+    }
+    printf("%-28s %lu bytes on disk for %lu live, %ld segments compacted\n", "compaction, 3x written",
+           (unsigned long)stats.bytes, (unsigned long)stats.live_bytes, stats.compactions);
+    if (timed_gets(store, ids, trees, n, us, n) == -1) {
+        return 1;
+    }
+    d2_store_close(store);
+
+    // Size cap: a quarter of the trees' size
+    for_each_file(remove_file);
+    uint64_t cap = stats.live_bytes / 4;
+    store = d2_store_open(dir, cap);
+    if (store == NULL) {
+        return 1;
+    }
+    for (int i = 0; i < n; i++) {
+        d2_store_put(store, ids[i], trees[i]);
+    }
+    d2_store_stats(store, &stats);
+    printf("%-28s %lu of %lu bytes, %ld trees kept, %ld evicted\n", "cap of a quarter", (unsigned long)stats.bytes,
+           (unsigned long)cap, stats.entries, stats.evictions);
+    d2_store_close(store);
+
+    for_each_file(remove_file);
+    rmdir(dir);
+    for (int i = 0; i < n; i++) {
+        d2_free_local_tree(trees[i]);
+    }
+    d2_pool_delete(pool);
+    free(ids);
+    free(trees);
+    free(us);
+    return 0;
+}
@@ -0,0 +1,210 @@
+/* ======================================================================
+ * D2 streaming decode: NetNodes handed out as their packets arrive.
+ * ====================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "d2_stream.h"
+
+
+struct D2NodeStream
+{
+    D2Client* client;
+    int       size;       /* nodes announced by the server */
+    int       delivered;  /* nodes handed out */
+    int       last;       /* the TYPE_LAST_RESPONSE packet has been received */
+    char      packet[PACKET_MAX];
+    int       len;        /* bytes in packet */
+    int       pos;        /* next node in packet */
+    int*      pending;    /* per level: children of the node on that level still to come */
+    int       depth;      /* levels on the stack */
+    int       cap;
+};
+
+/*
+* START HELPER FUNCTIONS
+ */
+
+/**
+ * @brief Receives the next PacketResponse into the stream's packet.
+ *
+ * @param stream The stream.
+ * @return 1 on success, or -1 on failure.
+ */
+static int stream_fill(D2NodeStream* stream) {
+    int len = d2_recv_response(stream->client, stream->packet, sizeof(stream->packet));
+    if (len < (int)sizeof(PacketResponse)) {
+        return -1;
+    }
+    stream->len = len;
+    stream->pos = sizeof(PacketResponse);
+    stream->last = ntohs(((PacketResponse*)stream->packet)->type) == TYPE_LAST_RESPONSE;
+    return 1;
+}
+
+/**
+ * @brief Works out the depth of the next node and pushes its children on the stack.
+ *
+ * @param stream The stream.
+ * @param num_children The number of children of the node.
+ * @return The depth of the node, or -1 if there is no memory for the stack.
+ */
+static int stream_depth(D2NodeStream* stream, int num_children) {
+    // Levels whose children have all been seen are done
+    while (stream->depth > 0 && stream->pending[stream->depth - 1] == 0) {
+        stream->depth--;
+    }
+    int depth = stream->depth;
+    if (depth > 0) {
+        stream->pending[depth - 1]--;
+    }
+    if (num_children > 0) {
+        if (stream->depth == stream->cap) {
+            int cap = stream->cap ? stream->cap * 2 : 16;
+            int* pending = realloc(stream->pending, cap * sizeof(int));
+            if (pending == NULL) {
+                return -1;
+            }
+            stream->pending = pending;
+            stream->cap = cap;
+        }
+        stream->pending[stream->depth++] = num_children;
+    }
+    return depth;
+}
+
+/*
+* END HELPER FUNCTIONS
+ */
+
+/**
+ * @brief Starts streaming a response: receives the PacketResponseSize.
+ *
+ * @param client The D2Client the request was sent on.
+ * @return The stream, or NULL on failure.
+ */
+D2NodeStream* d2_stream_open(D2Client* client) {
+    int size = d2_recv_response_size(client);
+    if (size < 0) {
+        return NULL;
+    }
+    D2NodeStream* stream = calloc(1, sizeof(D2NodeStream));
+    if (stream == NULL) {
+        check_error_d2(-1, "Failed to allocate memory for D2NodeStream", __LINE__, __FILE__);
+        return NULL;
+    }
+    stream->client = client;
+    stream->size = size;
+    stream->last = size == 0; // no PacketResponse follows
+    return stream;
+}
+
+/**
+ * @brief The number of nodes the server announced.
+ */
+int d2_stream_size(D2NodeStream* stream) {
+    return stream->size;
+}
+
+/**
+ * @brief Decodes the next abbreviated NetNode, receiving a packet if needed.
+ *
+ * @param stream The stream.
+ * @param node Set to the node, in host byte order; unused child_id slots are 0.
+ * @param depth Set to the depth of the node, 0 for the root.
+ * @return 1 if there is a node, 0 at the end, or -1 on failure.
+ */
+int d2_stream_next(D2NodeStream* stream, NetNode* node, int* depth) {
+    const int base_size = sizeof(NetNode) - sizeof(uint32_t) * 5;
+
+    while (stream->pos + base_size > stream->len) {
+        if (stream->last) {
+            if (stream->delivered != stream->size) {
+                check_error_d2(-1, "Fewer nodes than announced", __LINE__, __FILE__);
+                return -1;
+            }
+            return 0;
+        }
+        if (stream_fill(stream) == -1) {
+            return -1;
+        }
+    }
+
+    uint32_t fields[3 + 5];
+    memcpy(fields, stream->packet + stream->pos, base_size);
+    uint32_t num_children = ntohl(fields[2]);
+    int bytes = base_size + num_children * sizeof(uint32_t);
+    if (num_children > 5 || stream->pos + bytes > stream->len || stream->delivered == stream->size) {
+        check_error_d2(-1, "Malformed NetNode in response", __LINE__, __FILE__);
+        return -1;
+    }
+    memcpy(fields + 3, stream->packet + stream->pos + base_size, num_children * sizeof(uint32_t));
+    stream->pos += bytes;
+
+    memset(node, 0, sizeof(*node));
+    node->id = ntohl(fields[0]);
+    node->value = ntohl(fields[1]);
+    node->num_children = num_children;
+    for (uint32_t i = 0; i < num_children; i++) {
+        node->child_id[i] = ntohl(fields[3 + i]);
+    }
+
+    *depth = stream_depth(stream, num_children);
+    if (*depth < 0) {
+        check_error_d2(-1, "Failed to allocate memory for the depth stack", __LINE__, __FILE__);
+        return -1;
+    }
+    stream->delivered++;
+    return 1;
+}
+
+/**
+ * @brief Frees a stream.
+ *
+ * @param stream The stream, can be NULL.
+ * @return Always NULL.
+ */
+D2NodeStream* d2_stream_close(D2NodeStream* stream) {
+    if (stream) {
+        free(stream->pending);
+        free(stream);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Sends a request and visits the nodes of the response as they arrive. After the
+ * visitor asked to stop, the remaining nodes are still received, so the association stays
+ * in step.
+ *
+ * @param client The D2Client.
+ * @param id The id to look up, in host byte order.
+ * @param visit The visitor.
+ * @param arg Passed to the visitor.
+ * @return The number of nodes received, or -1 on failure.
+ */
+int d2_stream_lookup(D2Client* client, uint32_t id, D2NodeVisitor visit, void* arg) {
+    if (d2_send_request(client, id) <= 0) {
+        return -1;
+    }
+    D2NodeStream* stream = d2_stream_open(client);
+    if (stream == NULL) {
+        return -1;
+    }
+
+    NetNode node;
+    int depth;
+    int visiting = 1;
+    int res;
+    while ((res = d2_stream_next(stream, &node, &depth)) == 1) {
+        if (visiting && visit(&node, depth, arg) != 0) {
+            visiting = 0;
+        }
+    }
+    int received = stream->delivered;
+    d2_stream_close(stream);
+    return res == 0 ? received : -1;
+}
@@ -0,0 +1,55 @@
+#ifndef D2_STREAM_H
+#define D2_STREAM_H
+
+#include "d2_lookup.h"
+
+/* Streaming decode of a lookup's response.
+ *
+ * Instead of collecting the whole tree in a LocalTreeStore, a D2NodeStream decodes the
+ * NetNodes of each PacketResponse as it arrives and hands them out one at a time, in the
+ * order the server sends them: depth first, the root first. With every node comes its
+ * depth (0 for the root), worked out from the num_children of the nodes before it.
+ *
+ * A stream holds one packet and a stack with one counter per level of the tree, so its
+ * memory does not grow with the number of nodes. Consumers that aggregate or forward
+ * nodes can start with the first packet and never need the whole tree.
+ *
+ * Streams work on the classic exchange of d2_lookup.h: one request, one
+ * PacketResponseSize, PacketResponses up to TYPE_LAST_RESPONSE.
+ */
+
+typedef struct D2NodeStream D2NodeStream;
+
+/* Called for every node in depth first order. Return 0 to go on; any other value stops
+ * the visits, the rest of the response is still received and dropped.
+ */
+typedef int (*D2NodeVisitor)( const NetNode* node, int depth, void* arg );
+
+/* Start streaming the response to a request that has been sent with d2_send_request.
+ * Receives the PacketResponseSize.
+ * Returns the stream, or NULL in case of failure.
+ */
+D2NodeStream* d2_stream_open( D2Client* client );
+
+/* The number of nodes the server announced.
+ */
+int d2_stream_size( D2NodeStream* stream );
+
+/* Get the next node, receiving the next PacketResponse when the current one is used up.
+ * Returns 1 with *node and *depth set, 0 after the last node, or -1 in case of error.
+ */
+int d2_stream_next( D2NodeStream* stream, NetNode* node, int* depth );
+
+/* Free the stream. Packets of the response that have not been read yet stay unread, so
+ * the client's association is only usable again after d2_stream_next returned 0.
+ * Returns always NULL.
+ */
+D2NodeStream* d2_stream_close( D2NodeStream* stream );
+
+/* Look up id and call visit for each node as it arrives. As with d2_send_request, a
+ * client that does not belong to a D2Pool has been deleted if sending the request fails.
+ * Returns the number of nodes received, or -1 in case of error.
+ */
+int d2_stream_lookup( D2Client* client, uint32_t id, D2NodeVisitor visit, void* arg );
+
+#endif /* D2_STREAM_H */